@@ -732,11 +732,14 @@ syntax-check: $(top_srcdir)/HACKING
 sc_po_check: \
 		$(srcdir)/daemon/remote_dispatch.h \
 		$(srcdir)/daemon/qemu_dispatch.h \
+		$(srcdir)/daemon/bulk_dispatch.h \
 		$(srcdir)/src/remote/remote_client_bodies.h
 $(srcdir)/daemon/remote_dispatch.h: $(srcdir)/src/remote/remote_protocol.x
 	$(MAKE) -C daemon remote_dispatch.h
 $(srcdir)/daemon/qemu_dispatch.h: $(srcdir)/src/remote/qemu_protocol.x
 	$(MAKE) -C daemon qemu_dispatch.h
+$(srcdir)/daemon/bulk_dispatch.h: $(srcdir)/src/remote/bulk_protocol.x
+	$(MAKE) -C daemon bulk_dispatch.h
 $(srcdir)/src/remote/remote_client_bodies.h: $(srcdir)/src/remote/remote_protocol.x
 	$(MAKE) -C src remote/remote_client_bodies.h
 
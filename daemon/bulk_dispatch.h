@@ -0,0 +1,75 @@
+/* Automatically generated by gendispatch.pl.
+ * Do not edit this file.  Any changes you make will be lost.
+ */
+static int bulkDispatchDomainListManagedRestore(
+    virNetServerPtr server,
+    virNetServerClientPtr client,
+    virNetMessagePtr msg,
+    virNetMessageErrorPtr rerr,
+    bulk_domain_list_managed_restore_args *args);
+static int bulkDispatchDomainListManagedRestoreHelper(
+    virNetServerPtr server,
+    virNetServerClientPtr client,
+    virNetMessagePtr msg,
+    virNetMessageErrorPtr rerr,
+    void *args,
+    void *ret ATTRIBUTE_UNUSED)
+{
+  VIR_DEBUG("server=%p client=%p msg=%p rerr=%p args=%p ret=%p", server, client, msg, rerr, args, ret);
+  return bulkDispatchDomainListManagedRestore(server, client, msg, rerr, args);
+}
+/* bulkDispatchDomainListManagedRestore body has to be implemented manually */
+
+
+
+static int bulkDispatchDomainListManagedSave(
+    virNetServerPtr server,
+    virNetServerClientPtr client,
+    virNetMessagePtr msg,
+    virNetMessageErrorPtr rerr,
+    bulk_domain_list_managed_save_args *args);
+static int bulkDispatchDomainListManagedSaveHelper(
+    virNetServerPtr server,
+    virNetServerClientPtr client,
+    virNetMessagePtr msg,
+    virNetMessageErrorPtr rerr,
+    void *args,
+    void *ret ATTRIBUTE_UNUSED)
+{
+  VIR_DEBUG("server=%p client=%p msg=%p rerr=%p args=%p ret=%p", server, client, msg, rerr, args, ret);
+  return bulkDispatchDomainListManagedSave(server, client, msg, rerr, args);
+}
+/* bulkDispatchDomainListManagedSave body has to be implemented manually */
+
+
+
+virNetServerProgramProc bulkProcs[] = {
+{ /* Unused 0 */
+   NULL,
+   0,
+   (xdrproc_t)xdr_void,
+   0,
+   (xdrproc_t)xdr_void,
+   true,
+   0
+},
+{ /* Method DomainListManagedSave => 1 */
+   bulkDispatchDomainListManagedSaveHelper,
+   sizeof(bulk_domain_list_managed_save_args),
+   (xdrproc_t)xdr_bulk_domain_list_managed_save_args,
+   0,
+   (xdrproc_t)xdr_void,
+   true,
+   0
+},
+{ /* Method DomainListManagedRestore => 2 */
+   bulkDispatchDomainListManagedRestoreHelper,
+   sizeof(bulk_domain_list_managed_restore_args),
+   (xdrproc_t)xdr_bulk_domain_list_managed_restore_args,
+   0,
+   (xdrproc_t)xdr_void,
+   true,
+   0
+},
+};
+size_t bulkNProcs = ARRAY_CARDINALITY(bulkProcs);
@@ -103,6 +103,7 @@ virNetSASLContextPtr saslCtxt = NULL;
 #endif
 virNetServerProgramPtr remoteProgram = NULL;
 virNetServerProgramPtr qemuProgram = NULL;
+virNetServerProgramPtr bulkProgram = NULL;
 
 enum {
     VIR_DAEMON_ERR_NONE = 0,
@@ -1141,6 +1142,18 @@ int main(int argc, char **argv) {
         goto cleanup;
     }
 
+    if (!(bulkProgram = virNetServerProgramNew(BULK_PROGRAM,
+                                               BULK_PROTOCOL_VERSION,
+                                               bulkProcs,
+                                               bulkNProcs))) {
+        ret = VIR_DAEMON_ERR_INIT;
+        goto cleanup;
+    }
+    if (virNetServerAddProgram(srv, bulkProgram) < 0) {
+        ret = VIR_DAEMON_ERR_INIT;
+        goto cleanup;
+    }
+
     if (timeout != -1) {
         VIR_DEBUG("Registering shutdown timeout %d", timeout);
         virNetServerAutoShutdown(srv,
@@ -1237,6 +1250,7 @@ cleanup:
     virNetlinkEventServiceStopAll();
     virObjectUnref(remoteProgram);
     virObjectUnref(qemuProgram);
+    virObjectUnref(bulkProgram);
     virNetServerClose(srv);
     virObjectUnref(srv);
     virNetlinkShutdown();
@@ -33,6 +33,7 @@
 # include <rpc/xdr.h>
 # include "remote_protocol.h"
 # include "qemu_protocol.h"
+# include "bulk_protocol.h"
 # include "logging.h"
 # include "threads.h"
 # if HAVE_SASL
@@ -71,5 +72,6 @@ extern virNetSASLContextPtr saslCtxt;
 # endif
 extern virNetServerProgramPtr remoteProgram;
 extern virNetServerProgramPtr qemuProgram;
+extern virNetServerProgramPtr bulkProgram;
 
 #endif
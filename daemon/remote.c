@@ -49,6 +49,7 @@
 #include "virprocess.h"
 #include "remote_protocol.h"
 #include "qemu_protocol.h"
+#include "bulk_protocol.h"
 
 
 #define VIR_FROM_THIS VIR_FROM_RPC
@@ -104,6 +105,7 @@ remoteSerializeDomainDiskErrors(virDomainDiskErrorPtr errors,
 
 #include "remote_dispatch.h"
 #include "qemu_dispatch.h"
+#include "bulk_dispatch.h"
 
 
 /* Prototypes */
@@ -4592,6 +4594,155 @@ cleanup:
     return rv;
 }
 
+static int
+remoteDispatchDomainGetJobStats(virNetServerPtr server ATTRIBUTE_UNUSED,
+                                virNetServerClientPtr client ATTRIBUTE_UNUSED,
+                                virNetMessagePtr msg ATTRIBUTE_UNUSED,
+                                virNetMessageErrorPtr rerr,
+                                remote_domain_get_job_stats_args *args,
+                                remote_domain_get_job_stats_ret *ret)
+{
+    virDomainPtr dom = NULL;
+    virTypedParameterPtr params = NULL;
+    int nparams = 0;
+    int type;
+    int rv = -1;
+    struct daemonClientPrivate *priv =
+        virNetServerClientGetPrivateData(client);
+
+    if (!priv->conn) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s", _("connection not open"));
+        goto cleanup;
+    }
+
+    if (!(dom = get_nonnull_domain(priv->conn, args->dom)))
+        goto cleanup;
+
+    if (virDomainGetJobStats(dom, &type, &params, &nparams, args->flags) < 0)
+        goto cleanup;
+
+    if (nparams > REMOTE_DOMAIN_JOB_STATS_MAX) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("Too many job stats '%d' for limit '%d'"),
+                       nparams, REMOTE_DOMAIN_JOB_STATS_MAX);
+        goto cleanup;
+    }
+
+    ret->type = type;
+
+    if (remoteSerializeTypedParameters(params, nparams,
+                                       &ret->params.params_val,
+                                       &ret->params.params_len,
+                                       0) < 0)
+        goto cleanup;
+
+    rv = 0;
+
+cleanup:
+    if (rv < 0)
+        virNetMessageSaveError(rerr);
+    if (dom)
+        virDomainFree(dom);
+    virTypedParameterArrayClear(params, nparams);
+    VIR_FREE(params);
+    return rv;
+}
+
+static int
+bulkDispatchDomainListManagedSaveRestore(virNetServerClientPtr client,
+                                         virNetMessageErrorPtr rerr,
+                                         remote_nonnull_domain *doms_val,
+                                         u_int doms_len,
+                                         remote_typed_param *params_val,
+                                         u_int params_len,
+                                         unsigned int flags,
+                                         bool restore)
+{
+    virDomainPtr *doms = NULL;
+    virTypedParameterPtr params = NULL;
+    int nparams = 0;
+    unsigned int i;
+    int rv = -1;
+    struct daemonClientPrivate *priv =
+        virNetServerClientGetPrivateData(client);
+
+    if (!priv->conn) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s", _("connection not open"));
+        goto cleanup;
+    }
+
+    if (doms_len > BULK_DOMAIN_LIST_MAX) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s", _("too many domains"));
+        goto cleanup;
+    }
+
+    if (VIR_ALLOC_N(doms, doms_len + 1) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+    for (i = 0 ; i < doms_len ; i++) {
+        if (!(doms[i] = get_nonnull_domain(priv->conn, doms_val[i])))
+            goto cleanup;
+    }
+
+    if ((params = remoteDeserializeTypedParameters(params_val, params_len,
+                                                   BULK_DOMAIN_PARAMETERS_MAX,
+                                                   &nparams)) == NULL)
+        goto cleanup;
+
+    if (restore) {
+        if (virDomainListManagedRestore(doms, params, nparams, flags) < 0)
+            goto cleanup;
+    } else {
+        if (virDomainListManagedSave(doms, params, nparams, flags) < 0)
+            goto cleanup;
+    }
+
+    rv = 0;
+
+cleanup:
+    if (rv < 0)
+        virNetMessageSaveError(rerr);
+    if (doms) {
+        for (i = 0 ; doms[i] ; i++)
+            virDomainFree(doms[i]);
+        VIR_FREE(doms);
+    }
+    virTypedParameterArrayClear(params, nparams);
+    VIR_FREE(params);
+    return rv;
+}
+
+static int
+bulkDispatchDomainListManagedSave(virNetServerPtr server ATTRIBUTE_UNUSED,
+                                  virNetServerClientPtr client,
+                                  virNetMessagePtr msg ATTRIBUTE_UNUSED,
+                                  virNetMessageErrorPtr rerr,
+                                  bulk_domain_list_managed_save_args *args)
+{
+    return bulkDispatchDomainListManagedSaveRestore(client, rerr,
+                                                    args->doms.doms_val,
+                                                    args->doms.doms_len,
+                                                    args->params.params_val,
+                                                    args->params.params_len,
+                                                    args->flags, false);
+}
+
+static int
+bulkDispatchDomainListManagedRestore(virNetServerPtr server ATTRIBUTE_UNUSED,
+                                     virNetServerClientPtr client,
+                                     virNetMessagePtr msg ATTRIBUTE_UNUSED,
+                                     virNetMessageErrorPtr rerr,
+                                     bulk_domain_list_managed_restore_args *args)
+{
+    return bulkDispatchDomainListManagedSaveRestore(client, rerr,
+                                                    args->doms.doms_val,
+                                                    args->doms.doms_len,
+                                                    args->params.params_val,
+                                                    args->params.params_len,
+                                                    args->flags, true);
+}
+
 /*----- Helpers. -----*/
 
 /* get_nonnull_domain and get_nonnull_network turn an on-wire
@@ -35,6 +35,9 @@ extern size_t remoteNProcs;
 extern virNetServerProgramProc qemuProcs[];
 extern size_t qemuNProcs;
 
+extern virNetServerProgramProc bulkProcs[];
+extern size_t bulkNProcs;
+
 void remoteClientFreeFunc(void *data);
 void *remoteClientInitHook(virNetServerClientPtr client,
                            void *opaque);
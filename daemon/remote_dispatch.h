@@ -2038,6 +2038,28 @@ cleanup:
 
 
 
+static int remoteDispatchDomainGetJobStats(
+    virNetServerPtr server,
+    virNetServerClientPtr client,
+    virNetMessagePtr msg,
+    virNetMessageErrorPtr rerr,
+    remote_domain_get_job_stats_args *args,
+    remote_domain_get_job_stats_ret *ret);
+static int remoteDispatchDomainGetJobStatsHelper(
+    virNetServerPtr server,
+    virNetServerClientPtr client,
+    virNetMessagePtr msg,
+    virNetMessageErrorPtr rerr,
+    void *args,
+    void *ret)
+{
+  VIR_DEBUG("server=%p client=%p msg=%p rerr=%p args=%p ret=%p", server, client, msg, rerr, args, ret);
+  return remoteDispatchDomainGetJobStats(server, client, msg, rerr, args, ret);
+}
+/* remoteDispatchDomainGetJobStats body has to be implemented manually */
+
+
+
 static int remoteDispatchDomainGetMaxMemory(
     virNetServerPtr server,
     virNetServerClientPtr client,
@@ -15992,5 +16014,59 @@ virNetServerProgramProc remoteProcs[] = {
    true,
    0
 },
+{ /* Unused 293 */
+   NULL,
+   0,
+   (xdrproc_t)xdr_void,
+   0,
+   (xdrproc_t)xdr_void,
+   true,
+   0
+},
+{ /* Unused 294 */
+   NULL,
+   0,
+   (xdrproc_t)xdr_void,
+   0,
+   (xdrproc_t)xdr_void,
+   true,
+   0
+},
+{ /* Unused 295 */
+   NULL,
+   0,
+   (xdrproc_t)xdr_void,
+   0,
+   (xdrproc_t)xdr_void,
+   true,
+   0
+},
+{ /* Unused 296 */
+   NULL,
+   0,
+   (xdrproc_t)xdr_void,
+   0,
+   (xdrproc_t)xdr_void,
+   true,
+   0
+},
+{ /* Unused 297 */
+   NULL,
+   0,
+   (xdrproc_t)xdr_void,
+   0,
+   (xdrproc_t)xdr_void,
+   true,
+   0
+},
+{ /* Method DomainGetJobStats => 298 */
+   remoteDispatchDomainGetJobStatsHelper,
+   sizeof(remote_domain_get_job_stats_args),
+   (xdrproc_t)xdr_remote_domain_get_job_stats_args,
+   sizeof(remote_domain_get_job_stats_ret),
+   (xdrproc_t)xdr_remote_domain_get_job_stats_ret,
+   true,
+   0
+},
 };
 size_t remoteNProcs = ARRAY_CARDINALITY(remoteProcs);
@@ -46,7 +46,7 @@ while (defined($line = <FILE>)) {
     next if $line =~ /^\s*#/;
     next if $line =~ /^\s*$/;
     next if $line =~ /^\s*(global|local):/;
-    if ($line =~ /^\s*LIBVIRT_(\d+\.\d+\.\d+)\s*{\s*$/) {
+    if ($line =~ /^\s*LIBVIRT_(?:[A-Z]+_)?(\d+\.\d+\.\d+)\s*{\s*$/) {
         if (defined $vers) {
             die "malformed syms file";
         }
@@ -57,7 +57,7 @@ while (defined($line = <FILE>)) {
         }
         $prevvers = $vers;
         $vers = undef;
-    } elsif ($line =~ /\s*}\s*LIBVIRT_(\d+\.\d+\.\d+)\s*;\s*$/) {
+    } elsif ($line =~ /\s*}\s*LIBVIRT_(?:[A-Z]+_)?(\d+\.\d+\.\d+)\s*;\s*$/) {
         if ($1 ne $prevvers) {
             die "malformed syms file $1 != $vers";
         }
@@ -6318,6 +6318,50 @@ cleanup:
     return ret;
 }
 
+static PyObject *
+libvirt_virDomainGetJobStats(PyObject *self ATTRIBUTE_UNUSED,
+                             PyObject *args)
+{
+    virDomainPtr domain;
+    PyObject *pyobj_domain;
+    PyObject *ret = NULL;
+    PyObject *val;
+    int i_retval;
+    int type = -1;
+    int nparams = 0;
+    unsigned int flags;
+    virTypedParameterPtr params = NULL;
+
+    if (!PyArg_ParseTuple(args, (char *)"Oi:virDomainGetJobStats",
+                          &pyobj_domain, &flags))
+        return NULL;
+    domain = (virDomainPtr) PyvirDomain_Get(pyobj_domain);
+
+    LIBVIRT_BEGIN_ALLOW_THREADS;
+    i_retval = virDomainGetJobStats(domain, &type, &params, &nparams, flags);
+    LIBVIRT_END_ALLOW_THREADS;
+
+    if (i_retval < 0)
+        return VIR_PY_NONE;
+
+    if (!(ret = getPyVirTypedParameter(params, nparams)))
+        goto cleanup;
+
+    if (!(val = libvirt_intWrap(type)) ||
+        PyDict_SetItemString(ret, "type", val) < 0) {
+        Py_XDECREF(val);
+        Py_DECREF(ret);
+        ret = NULL;
+        goto cleanup;
+    }
+    Py_DECREF(val);
+
+cleanup:
+    virTypedParameterArrayClear(params, nparams);
+    VIR_FREE(params);
+    return ret;
+}
+
 
 /************************************************************************
  *									*
@@ -6420,6 +6464,7 @@ static PyMethodDef libvirtMethods[] = {
     {(char *) "virConnectListAllInterfaces", libvirt_virConnectListAllInterfaces, METH_VARARGS, NULL},
     {(char *) "virConnectBaselineCPU", libvirt_virConnectBaselineCPU, METH_VARARGS, NULL},
     {(char *) "virDomainGetJobInfo", libvirt_virDomainGetJobInfo, METH_VARARGS, NULL},
+    {(char *) "virDomainGetJobStats", libvirt_virDomainGetJobStats, METH_VARARGS, NULL},
     {(char *) "virDomainSnapshotListNames", libvirt_virDomainSnapshotListNames, METH_VARARGS, NULL},
     {(char *) "virDomainListAllSnapshots", libvirt_virDomainListAllSnapshots, METH_VARARGS, NULL},
     {(char *) "virDomainSnapshotListChildrenNames", libvirt_virDomainSnapshotListChildrenNames, METH_VARARGS, NULL},
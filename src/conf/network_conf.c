@@ -44,6 +44,7 @@
 #include "buf.h"
 #include "c-ctype.h"
 #include "virfile.h"
+#include "virhash.h"
 
 #define MAX_BRIDGE_ID 256
 #define VIR_FROM_THIS VIR_FROM_NETWORK
@@ -164,6 +165,8 @@ static void virNetworkDNSDefFree(virNetworkDNSDefPtr def)
     }
 }
 
+static void virNetworkForwardIfPoolFree(virNetworkForwardIfPoolPtr pool);
+
 void virNetworkDefFree(virNetworkDefPtr def)
 {
     int ii;
@@ -184,6 +187,7 @@ void virNetworkDefFree(virNetworkDefPtr def)
         virNetworkForwardIfDefClear(&def->forwardIfs[ii]);
     }
     VIR_FREE(def->forwardIfs);
+    virNetworkForwardIfPoolFree(def->forwardIfPool);
 
     for (ii = 0 ; ii < def->nips && def->ips ; ii++) {
         virNetworkIpDefClear(&def->ips[ii]);
@@ -511,6 +515,315 @@ void virNetworkRemoveInactive(virNetworkObjListPtr nets,
     }
 }
 
+/*
+ * Index of the forward interfaces of a network, used to allocate them
+ * to guest interfaces without scanning the whole pool. It is built the
+ * first time it is needed and dropped whenever def->forwardIfs changes,
+ * so all changes of the connection counts must go through
+ * virNetworkDefForwardIfConnect/Disconnect to keep it ordered, and
+ * code replacing def->forwardIfs must call virNetworkDefForwardIfsChanged.
+ */
+struct _virNetworkForwardIfPool {
+    virNetworkForwardIfDefPtr ifs; /* forwardIfs the index was built for */
+    size_t nifs;
+    size_t *heap;   /* indexes of forwardIfs, least used first */
+    size_t *pos;    /* position of each of forwardIfs in heap */
+    virHashTablePtr devs; /* device key -> index + 1 */
+};
+
+static void
+virNetworkForwardIfPoolFree(virNetworkForwardIfPoolPtr pool)
+{
+    if (!pool)
+        return;
+
+    VIR_FREE(pool->heap);
+    VIR_FREE(pool->pos);
+    virHashFree(pool->devs);
+    VIR_FREE(pool);
+}
+
+static char *
+virNetworkForwardIfKey(int type, const char *dev, virDevicePCIAddressPtr addr)
+{
+    char *key = NULL;
+
+    if (type == VIR_NETWORK_FORWARD_HOSTDEV_DEVICE_PCI) {
+        ignore_value(virAsprintf(&key, "pci:%04x:%02x:%02x.%x",
+                                 addr->domain, addr->bus,
+                                 addr->slot, addr->function));
+    } else {
+        ignore_value(virAsprintf(&key, "dev:%s", dev));
+    }
+
+    return key;
+}
+
+/* Whether the index of @def still describes def->forwardIfs */
+static bool
+virNetworkForwardIfPoolValid(virNetworkDefPtr def)
+{
+    virNetworkForwardIfPoolPtr pool = def->forwardIfPool;
+
+    return pool && pool->ifs == def->forwardIfs &&
+        pool->nifs == def->nForwardIfs;
+}
+
+/**
+ * virNetworkDefForwardIfsChanged:
+ * @def: the network definition
+ *
+ * Drop the index of the forward interfaces of @def, to be called after
+ * replacing def->forwardIfs.
+ */
+void
+virNetworkDefForwardIfsChanged(virNetworkDefPtr def)
+{
+    virNetworkForwardIfPoolFree(def->forwardIfPool);
+    def->forwardIfPool = NULL;
+}
+
+/* devices are ordered by connections, then by their order in the pool */
+static bool
+virNetworkForwardIfPoolLess(virNetworkDefPtr def, size_t a, size_t b)
+{
+    if (def->forwardIfs[a].connections != def->forwardIfs[b].connections)
+        return def->forwardIfs[a].connections < def->forwardIfs[b].connections;
+    return a < b;
+}
+
+static void
+virNetworkForwardIfPoolSwap(virNetworkForwardIfPoolPtr pool, size_t i, size_t j)
+{
+    size_t tmp = pool->heap[i];
+
+    pool->heap[i] = pool->heap[j];
+    pool->heap[j] = tmp;
+    pool->pos[pool->heap[i]] = i;
+    pool->pos[pool->heap[j]] = j;
+}
+
+static void
+virNetworkForwardIfPoolSiftUp(virNetworkDefPtr def, size_t i)
+{
+    virNetworkForwardIfPoolPtr pool = def->forwardIfPool;
+
+    while (i > 0 &&
+           virNetworkForwardIfPoolLess(def, pool->heap[i],
+                                       pool->heap[(i - 1) / 2])) {
+        virNetworkForwardIfPoolSwap(pool, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void
+virNetworkForwardIfPoolSiftDown(virNetworkDefPtr def, size_t i)
+{
+    virNetworkForwardIfPoolPtr pool = def->forwardIfPool;
+
+    for (;;) {
+        size_t least = i;
+        size_t child = 2 * i + 1;
+
+        if (child < pool->nifs &&
+            virNetworkForwardIfPoolLess(def, pool->heap[child],
+                                        pool->heap[least]))
+            least = child;
+        child++;
+        if (child < pool->nifs &&
+            virNetworkForwardIfPoolLess(def, pool->heap[child],
+                                        pool->heap[least]))
+            least = child;
+
+        if (least == i)
+            break;
+
+        virNetworkForwardIfPoolSwap(pool, i, least);
+        i = least;
+    }
+}
+
+/*
+ * Return the index of the forward interfaces of @def, building it if
+ * necessary, or NULL if it could not be built.
+ */
+static virNetworkForwardIfPoolPtr
+virNetworkDefGetForwardIfPool(virNetworkDefPtr def)
+{
+    virNetworkForwardIfPoolPtr pool = def->forwardIfPool;
+    size_t ii;
+
+    if (virNetworkForwardIfPoolValid(def))
+        return pool;
+
+    virNetworkDefForwardIfsChanged(def);
+
+    if (VIR_ALLOC(pool) < 0 ||
+        VIR_ALLOC_N(pool->heap, def->nForwardIfs) < 0 ||
+        VIR_ALLOC_N(pool->pos, def->nForwardIfs) < 0 ||
+        !(pool->devs = virHashCreate(def->nForwardIfs, NULL)))
+        goto error;
+
+    for (ii = 0; ii < def->nForwardIfs; ii++) {
+        virNetworkForwardIfDefPtr dev = &def->forwardIfs[ii];
+        char *key = virNetworkForwardIfKey(dev->type, dev->device.dev,
+                                           &dev->device.pci);
+
+        if (!key)
+            goto error;
+
+        /* keep the first of duplicate devices, like a linear search */
+        if (!virHashLookup(pool->devs, key) &&
+            virHashAddEntry(pool->devs, key, (void *)(ii + 1)) < 0) {
+            VIR_FREE(key);
+            goto error;
+        }
+        VIR_FREE(key);
+
+        pool->heap[ii] = ii;
+        pool->pos[ii] = ii;
+    }
+    pool->ifs = def->forwardIfs;
+    pool->nifs = def->nForwardIfs;
+    def->forwardIfPool = pool;
+
+    for (ii = pool->nifs / 2; ii > 0; ii--)
+        virNetworkForwardIfPoolSiftDown(def, ii - 1);
+
+    return pool;
+
+error:
+    /* callers fall back to scanning forwardIfs */
+    virNetworkForwardIfPoolFree(pool);
+    virResetLastError();
+    return NULL;
+}
+
+/**
+ * virNetworkDefForwardIfLeastUsed:
+ * @def: the network definition
+ *
+ * Returns the forward interface of @def with the fewest connections,
+ * the first one in the pool among equally used ones, or NULL if @def
+ * has no forward interfaces.
+ */
+virNetworkForwardIfDefPtr
+virNetworkDefForwardIfLeastUsed(virNetworkDefPtr def)
+{
+    virNetworkForwardIfPoolPtr pool;
+    virNetworkForwardIfDefPtr dev;
+    size_t ii;
+
+    if (def->nForwardIfs == 0)
+        return NULL;
+
+    if ((pool = virNetworkDefGetForwardIfPool(def)))
+        return &def->forwardIfs[pool->heap[0]];
+
+    dev = &def->forwardIfs[0];
+    for (ii = 1; ii < def->nForwardIfs; ii++) {
+        if (def->forwardIfs[ii].connections < dev->connections)
+            dev = &def->forwardIfs[ii];
+    }
+    return dev;
+}
+
+static virNetworkForwardIfDefPtr
+virNetworkDefForwardIfFind(virNetworkDefPtr def, int type,
+                           const char *dev, virDevicePCIAddressPtr addr)
+{
+    virNetworkForwardIfPoolPtr pool;
+    char *key;
+    size_t ii;
+
+    if ((pool = virNetworkDefGetForwardIfPool(def)) &&
+        (key = virNetworkForwardIfKey(type, dev, addr))) {
+        void *entry = virHashLookup(pool->devs, key);
+
+        VIR_FREE(key);
+        ii = (size_t)entry;
+        return ii ? &def->forwardIfs[ii - 1] : NULL;
+    }
+
+    for (ii = 0; ii < def->nForwardIfs; ii++) {
+        if (def->forwardIfs[ii].type != type)
+            continue;
+        if (type == VIR_NETWORK_FORWARD_HOSTDEV_DEVICE_PCI
+            ? virDevicePCIAddressEqual(addr, &def->forwardIfs[ii].device.pci)
+            : STREQ(dev, def->forwardIfs[ii].device.dev))
+            return &def->forwardIfs[ii];
+    }
+    return NULL;
+}
+
+/**
+ * virNetworkDefForwardIfFindDev:
+ * @def: the network definition
+ * @dev: name of the device
+ *
+ * Returns the forward interface of @def for the network device @dev,
+ * or NULL if there is none.
+ */
+virNetworkForwardIfDefPtr
+virNetworkDefForwardIfFindDev(virNetworkDefPtr def, const char *dev)
+{
+    return virNetworkDefForwardIfFind(def,
+                                      VIR_NETWORK_FORWARD_HOSTDEV_DEVICE_NETDEV,
+                                      dev, NULL);
+}
+
+/**
+ * virNetworkDefForwardIfFindPCI:
+ * @def: the network definition
+ * @addr: PCI address of the device
+ *
+ * Returns the forward interface of @def for the PCI device at @addr,
+ * or NULL if there is none.
+ */
+virNetworkForwardIfDefPtr
+virNetworkDefForwardIfFindPCI(virNetworkDefPtr def, virDevicePCIAddressPtr addr)
+{
+    return virNetworkDefForwardIfFind(def,
+                                      VIR_NETWORK_FORWARD_HOSTDEV_DEVICE_PCI,
+                                      NULL, addr);
+}
+
+/**
+ * virNetworkDefForwardIfConnect:
+ * @def: the network definition
+ * @dev: one of the forward interfaces of @def
+ *
+ * Account for a new guest interface connected through @dev.
+ */
+void
+virNetworkDefForwardIfConnect(virNetworkDefPtr def,
+                              virNetworkForwardIfDefPtr dev)
+{
+    virNetworkForwardIfPoolPtr pool = def->forwardIfPool;
+
+    dev->connections++;
+    if (virNetworkForwardIfPoolValid(def))
+        virNetworkForwardIfPoolSiftDown(def, pool->pos[dev - def->forwardIfs]);
+}
+
+/**
+ * virNetworkDefForwardIfDisconnect:
+ * @def: the network definition
+ * @dev: one of the forward interfaces of @def
+ *
+ * Account for a guest interface no longer connected through @dev.
+ */
+void
+virNetworkDefForwardIfDisconnect(virNetworkDefPtr def,
+                                 virNetworkForwardIfDefPtr dev)
+{
+    virNetworkForwardIfPoolPtr pool = def->forwardIfPool;
+
+    dev->connections--;
+    if (virNetworkForwardIfPoolValid(def))
+        virNetworkForwardIfPoolSiftUp(def, pool->pos[dev - def->forwardIfs]);
+}
+
 /* return ips[index], or NULL if there aren't enough ips */
 virNetworkIpDefPtr
 virNetworkDefGetIpByIndex(const virNetworkDefPtr def,
@@ -2928,6 +3241,8 @@ virNetworkDefUpdateForwardInterface(virNetworkDefPtr def,
         }
         def->nForwardIfs++;
         memset(&iface, 0, sizeof(iface));
+        virNetworkForwardIfPoolFree(def->forwardIfPool);
+        def->forwardIfPool = NULL;
 
     } else if (command == VIR_NETWORK_UPDATE_COMMAND_DELETE) {
 
@@ -2956,6 +3271,8 @@ virNetworkDefUpdateForwardInterface(virNetworkDefPtr def,
                 sizeof(*def->forwardIfs) * (def->nForwardIfs - ii - 1));
         def->nForwardIfs--;
         ignore_value(VIR_REALLOC_N(def->forwardIfs, def->nForwardIfs));
+        virNetworkForwardIfPoolFree(def->forwardIfPool);
+        def->forwardIfPool = NULL;
     } else {
         virNetworkDefUpdateUnknownCommand(command);
         goto cleanup;
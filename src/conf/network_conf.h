@@ -153,6 +153,9 @@ struct _virNetworkForwardIfDef {
     int connections; /* how many guest interfaces are connected to this device? */
 };
 
+typedef struct _virNetworkForwardIfPool virNetworkForwardIfPool;
+typedef virNetworkForwardIfPool *virNetworkForwardIfPoolPtr;
+
 typedef struct _virNetworkForwardPfDef virNetworkForwardPfDef;
 typedef virNetworkForwardPfDef *virNetworkForwardPfDefPtr;
 struct _virNetworkForwardPfDef {
@@ -196,6 +199,7 @@ struct _virNetworkDef {
 
     size_t nForwardIfs;
     virNetworkForwardIfDefPtr forwardIfs;
+    virNetworkForwardIfPoolPtr forwardIfPool; /* index of forwardIfs */
 
     /* adresses for SNAT */
     virSocketAddr forwardAddrStart, forwardAddrEnd;
@@ -283,6 +287,19 @@ virNetworkDefForwardIf(const virNetworkDefPtr def, size_t n)
             ? def->forwardIfs[n].device.dev : NULL);
 }
 
+virNetworkForwardIfDefPtr
+virNetworkDefForwardIfLeastUsed(virNetworkDefPtr def);
+virNetworkForwardIfDefPtr
+virNetworkDefForwardIfFindDev(virNetworkDefPtr def, const char *dev);
+virNetworkForwardIfDefPtr
+virNetworkDefForwardIfFindPCI(virNetworkDefPtr def,
+                              virDevicePCIAddressPtr addr);
+void virNetworkDefForwardIfConnect(virNetworkDefPtr def,
+                                   virNetworkForwardIfDefPtr dev);
+void virNetworkDefForwardIfDisconnect(virNetworkDefPtr def,
+                                      virNetworkForwardIfDefPtr dev);
+void virNetworkDefForwardIfsChanged(virNetworkDefPtr def);
+
 virPortGroupDefPtr virPortGroupFindByName(virNetworkDefPtr net,
                                           const char *portgroup);
 
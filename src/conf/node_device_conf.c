@@ -38,6 +38,7 @@
 #include "uuid.h"
 #include "pci.h"
 #include "virrandom.h"
+#include "logging.h"
 
 #define VIR_FROM_THIS VIR_FROM_NODEDEV
 
@@ -91,34 +92,28 @@ virNodeDeviceObjPtr
 virNodeDeviceFindBySysfsPath(const virNodeDeviceObjListPtr devs,
                              const char *sysfs_path)
 {
-    unsigned int i;
+    virNodeDeviceObjPtr dev;
 
-    for (i = 0; i < devs->count; i++) {
-        virNodeDeviceObjLock(devs->objs[i]);
-        if ((devs->objs[i]->def->sysfs_path != NULL) &&
-            (STREQ(devs->objs[i]->def->sysfs_path, sysfs_path))) {
-            return devs->objs[i];
-        }
-        virNodeDeviceObjUnlock(devs->objs[i]);
-    }
+    if (!devs->bySysfsPath ||
+        !(dev = virHashLookup(devs->bySysfsPath, sysfs_path)))
+        return NULL;
 
-    return NULL;
+    virNodeDeviceObjLock(dev);
+    return dev;
 }
 
 
 virNodeDeviceObjPtr virNodeDeviceFindByName(const virNodeDeviceObjListPtr devs,
                                             const char *name)
 {
-    unsigned int i;
+    virNodeDeviceObjPtr dev;
 
-    for (i = 0; i < devs->count; i++) {
-        virNodeDeviceObjLock(devs->objs[i]);
-        if (STREQ(devs->objs[i]->def->name, name))
-            return devs->objs[i];
-        virNodeDeviceObjUnlock(devs->objs[i]);
-    }
+    if (!devs->byName ||
+        !(dev = virHashLookup(devs->byName, name)))
+        return NULL;
 
-    return NULL;
+    virNodeDeviceObjLock(dev);
+    return dev;
 }
 
 
@@ -166,6 +161,47 @@ void virNodeDeviceObjListFree(virNodeDeviceObjListPtr devs)
         virNodeDeviceObjFree(devs->objs[i]);
     VIR_FREE(devs->objs);
     devs->count = 0;
+    virHashFree(devs->byName);
+    devs->byName = NULL;
+    virHashFree(devs->bySysfsPath);
+    devs->bySysfsPath = NULL;
+}
+
+/*
+ * Devices are indexed by name and by sysfs path so that lookups from the
+ * udev event handler and the public API do not have to walk, and lock,
+ * every object on hosts with thousands of devices.
+ */
+static int
+virNodeDeviceObjListIndexInit(virNodeDeviceObjListPtr devs)
+{
+    if (!devs->byName &&
+        !(devs->byName = virHashCreate(64, NULL)))
+        return -1;
+    if (!devs->bySysfsPath &&
+        !(devs->bySysfsPath = virHashCreate(64, NULL)))
+        return -1;
+    return 0;
+}
+
+static int
+virNodeDeviceObjListIndexSysfsPath(virNodeDeviceObjListPtr devs,
+                                   virNodeDeviceObjPtr dev)
+{
+    if (!dev->def->sysfs_path)
+        return 0;
+    return virHashUpdateEntry(devs->bySysfsPath, dev->def->sysfs_path, dev);
+}
+
+static void
+virNodeDeviceObjListUnindexSysfsPath(virNodeDeviceObjListPtr devs,
+                                     virNodeDeviceObjPtr dev)
+{
+    if (!dev->def->sysfs_path || !devs->bySysfsPath)
+        return;
+    /* Only drop the entry if it still refers to this device */
+    if (virHashLookup(devs->bySysfsPath, dev->def->sysfs_path) == dev)
+        virHashRemoveEntry(devs->bySysfsPath, dev->def->sysfs_path);
 }
 
 virNodeDeviceObjPtr virNodeDeviceAssignDef(virNodeDeviceObjListPtr devs,
@@ -173,9 +209,15 @@ virNodeDeviceObjPtr virNodeDeviceAssignDef(virNodeDeviceObjListPtr devs,
 {
     virNodeDeviceObjPtr device;
 
+    if (virNodeDeviceObjListIndexInit(devs) < 0)
+        return NULL;
+
     if ((device = virNodeDeviceFindByName(devs, def->name))) {
+        virNodeDeviceObjListUnindexSysfsPath(devs, device);
         virNodeDeviceDefFree(device->def);
         device->def = def;
+        if (virNodeDeviceObjListIndexSysfsPath(devs, device) < 0)
+            VIR_WARN("Failed to index sysfs path of device %s", def->name);
         return device;
     }
 
@@ -200,6 +242,15 @@ virNodeDeviceObjPtr virNodeDeviceAssignDef(virNodeDeviceObjListPtr devs,
         virReportOOMError();
         return NULL;
     }
+
+    if (virHashAddEntry(devs->byName, def->name, device) < 0 ||
+        virNodeDeviceObjListIndexSysfsPath(devs, device) < 0) {
+        virHashRemoveEntry(devs->byName, def->name);
+        device->def = NULL;
+        virNodeDeviceObjUnlock(device);
+        virNodeDeviceObjFree(device);
+        return NULL;
+    }
     devs->objs[devs->count++] = device;
 
     return device;
@@ -214,9 +265,9 @@ void virNodeDeviceObjRemove(virNodeDeviceObjListPtr devs,
     virNodeDeviceObjUnlock(dev);
 
     for (i = 0; i < devs->count; i++) {
-        virNodeDeviceObjLock(dev);
         if (devs->objs[i] == dev) {
-            virNodeDeviceObjUnlock(dev);
+            virHashRemoveEntry(devs->byName, dev->def->name);
+            virNodeDeviceObjListUnindexSysfsPath(devs, dev);
             virNodeDeviceObjFree(devs->objs[i]);
 
             if (i < (devs->count - 1))
@@ -230,7 +281,6 @@ void virNodeDeviceObjRemove(virNodeDeviceObjListPtr devs,
 
             break;
         }
-        virNodeDeviceObjUnlock(dev);
     }
 }
 
@@ -28,6 +28,7 @@
 # include "internal.h"
 # include "util.h"
 # include "threads.h"
+# include "virhash.h"
 
 # include <libxml/tree.h>
 
@@ -201,6 +202,8 @@ typedef virNodeDeviceObjList *virNodeDeviceObjListPtr;
 struct _virNodeDeviceObjList {
     unsigned int count;
     virNodeDeviceObjPtr *objs;
+    virHashTablePtr byName;      /* name -> virNodeDeviceObjPtr */
+    virHashTablePtr bySysfsPath; /* sysfs_path -> virNodeDeviceObjPtr */
 };
 
 typedef struct _virDeviceMonitorState virDeviceMonitorState;
@@ -141,18 +141,74 @@ static const struct int_map chain_priorities[] = {
 };
 
 /*
- * only one filter update allowed
+ * only one filter update allowed; filters of different interfaces may
+ * be instantiated in parallel, but not while a filter is updated.
+ *
+ * Both kinds of holders may take the lock again recursively, the
+ * filter updater also as an instantiator. Instantiators do not wait
+ * for updaters that are merely waiting for the lock, since they
+ * recursively take it while instantiating.
+ *
+ * Hypervisor drivers take the lock for instantiating before they lock
+ * a domain; without the nwfilter driver there is nothing to lock.
  */
 static virMutex updateMutex;
+static virCond updateCond;
+static unsigned int updateReaders;
+static unsigned int updateWriterDepth;
+static virThread updateWriter;
 static bool initialized = false;
 
 void
 virNWFilterLockFilterUpdates(void) {
+    if (!initialized)
+        return;
+
     virMutexLock(&updateMutex);
+
+    if (!updateWriterDepth || !virThreadIsSelf(&updateWriter)) {
+        while (updateWriterDepth || updateReaders)
+            ignore_value(virCondWait(&updateCond, &updateMutex));
+        virThreadSelf(&updateWriter);
+    }
+    updateWriterDepth++;
+
+    virMutexUnlock(&updateMutex);
+}
+
+void
+virNWFilterReadLockFilterUpdates(void) {
+    if (!initialized)
+        return;
+
+    virMutexLock(&updateMutex);
+
+    if (updateWriterDepth && virThreadIsSelf(&updateWriter)) {
+        updateWriterDepth++;
+    } else {
+        while (updateWriterDepth)
+            ignore_value(virCondWait(&updateCond, &updateMutex));
+        updateReaders++;
+    }
+
+    virMutexUnlock(&updateMutex);
 }
 
 void
 virNWFilterUnlockFilterUpdates(void) {
+    if (!initialized)
+        return;
+
+    virMutexLock(&updateMutex);
+
+    /* while the updater holds the lock, nobody else does */
+    if (updateWriterDepth) {
+        if (--updateWriterDepth == 0)
+            virCondBroadcast(&updateCond);
+    } else if (--updateReaders == 0) {
+        virCondBroadcast(&updateCond);
+    }
+
     virMutexUnlock(&updateMutex);
 }
 
@@ -3507,10 +3563,15 @@ int virNWFilterConfLayerInit(virHashIterator domUpdateCB)
 {
     virNWFilterDomainFWUpdateCB = domUpdateCB;
 
-    initialized = true;
+    if (virMutexInit(&updateMutex) < 0)
+        return -1;
 
-    if (virMutexInitRecursive(&updateMutex) < 0)
+    if (virCondInit(&updateCond) < 0) {
+        virMutexDestroy(&updateMutex);
         return -1;
+    }
+
+    initialized = true;
 
     return 0;
 }
@@ -3521,6 +3582,7 @@ void virNWFilterConfLayerShutdown(void)
     if (!initialized)
         return;
 
+    ignore_value(virCondDestroy(&updateCond));
     virMutexDestroy(&updateMutex);
 
     initialized = false;
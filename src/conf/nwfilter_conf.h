@@ -622,6 +622,9 @@ typedef int (*virNWFilterRuleFreeInstanceData)(void * _inst);
 
 typedef int (*virNWFilterRuleDisplayInstanceData)(void *_inst);
 
+typedef int (*virNWFilterRuleFormatInstanceData)(virBufferPtr buf,
+                                                 void *_inst);
+
 typedef int (*virNWFilterCanApplyBasicRules)(void);
 
 typedef int (*virNWFilterApplyBasicRules)(const char *ifname,
@@ -655,6 +658,7 @@ struct _virNWFilterTechDriver {
     virNWFilterRuleAllTeardown allTeardown;
     virNWFilterRuleFreeInstanceData freeRuleInstance;
     virNWFilterRuleDisplayInstanceData displayRuleInstance;
+    virNWFilterRuleFormatInstanceData formatRuleInstance;
 
     virNWFilterCanApplyBasicRules canApplyBasicRules;
     virNWFilterApplyBasicRules applyBasicRules;
@@ -722,6 +726,7 @@ void virNWFilterObjLock(virNWFilterObjPtr obj);
 void virNWFilterObjUnlock(virNWFilterObjPtr obj);
 
 void virNWFilterLockFilterUpdates(void);
+void virNWFilterReadLockFilterUpdates(void);
 void virNWFilterUnlockFilterUpdates(void);
 
 int virNWFilterConfLayerInit(virHashIterator domUpdateCB);
@@ -591,6 +591,29 @@ typedef int
     (*virDrvDomainGetJobInfo)(virDomainPtr domain,
                               virDomainJobInfoPtr info);
 
+typedef int
+    (*virDrvDomainGetJobStats)(virDomainPtr domain,
+                               int *type,
+                               virTypedParameterPtr *params,
+                               int *nparams,
+                               unsigned int flags);
+
+typedef int
+    (*virDrvDomainListManagedSave)(virConnectPtr conn,
+                                   virDomainPtr *doms,
+                                   unsigned int ndoms,
+                                   virTypedParameterPtr params,
+                                   int nparams,
+                                   unsigned int flags);
+
+typedef int
+    (*virDrvDomainListManagedRestore)(virConnectPtr conn,
+                                      virDomainPtr *doms,
+                                      unsigned int ndoms,
+                                      virTypedParameterPtr params,
+                                      int nparams,
+                                      unsigned int flags);
+
 typedef int
     (*virDrvDomainAbortJob)(virDomainPtr domain);
 
@@ -1032,6 +1055,9 @@ struct _virDriver {
     virDrvCompareCPU                    cpuCompare;
     virDrvBaselineCPU                   cpuBaseline;
     virDrvDomainGetJobInfo              domainGetJobInfo;
+    virDrvDomainGetJobStats             domainGetJobStats;
+    virDrvDomainListManagedSave         domainListManagedSave;
+    virDrvDomainListManagedRestore      domainListManagedRestore;
     virDrvDomainAbortJob                domainAbortJob;
     virDrvDomainMigrateSetMaxDowntime   domainMigrateSetMaxDowntime;
     virDrvDomainMigrateGetMaxSpeed      domainMigrateGetMaxSpeed;
@@ -3009,6 +3009,13 @@ error:
  * or fail if it cannot do so for the given system; this can allow less
  * pressure on file system cache, but also risks slowing saves to NFS.
  *
+ * If @flags includes VIR_DUMP_MEMORY_ONLY, the file only holds the
+ * memory and CPU state of the guest, as an ELF core file.  Adding
+ * VIR_DUMP_PAGING further limits it to the memory mapped by the page
+ * tables of the guest, which makes it smaller but requires the guest to
+ * have usable page tables.  The progress of such a dump can be tracked
+ * with virDomainGetJobInfo() while it runs.
+ *
  * Returns 0 in case of success and -1 in case of failure.
  */
 int
@@ -17207,6 +17214,83 @@ error:
 }
 
 
+/**
+ * virDomainGetJobStats:
+ * @domain: a domain object
+ * @type: where to store the job type (one of virDomainJobType)
+ * @params: where to store job statistics
+ * @nparams: number of items in @params
+ * @flags: bitwise-OR of virDomainGetJobStatsFlags
+ *
+ * Extract information about progress of a background job on a domain.
+ * Will return an error if the domain is not active, unless @flags
+ * includes VIR_DOMAIN_JOB_STATS_COMPLETED. The function returns
+ * a superset of progress information provided by virDomainGetJobInfo,
+ * such as the transfer and dirty rates of a migration. Possible fields
+ * returned in @params are defined by VIR_DOMAIN_JOB_* macros and new
+ * fields will likely be introduced in the future so callers may receive
+ * fields that they do not understand in case they talk to a newer
+ * server. Which statistics are available depends on the type and
+ * progress of the job.
+ *
+ * The array stored in @params is allocated by the function; the caller
+ * must free the value of any VIR_TYPED_PARAM_STRING parameter and then
+ * the array itself.
+ *
+ * If @flags includes VIR_DOMAIN_JOB_STATS_COMPLETED, the statistics of
+ * the most recently completed job are returned instead, with @type set
+ * to VIR_DOMAIN_JOB_COMPLETED, or VIR_DOMAIN_JOB_NONE if there is no such
+ * job. They are the statistics the job reported when it finished; the
+ * domain does not need to be active, since the job (such as a migration
+ * or a save) may have stopped it. A restore from a saved state also
+ * counts as a job, which additionally reports the time it took to load
+ * the state and to get the domain running (VIR_DOMAIN_JOB_TIME_LOADED
+ * and VIR_DOMAIN_JOB_TIME_TO_RUN).
+ *
+ * Returns 0 in case of success and -1 in case of failure.
+ */
+int
+virDomainGetJobStats(virDomainPtr domain,
+                     int *type,
+                     virTypedParameterPtr *params,
+                     int *nparams,
+                     unsigned int flags)
+{
+    virConnectPtr conn;
+
+    VIR_DOMAIN_DEBUG(domain, "type=%p, params=%p, nparams=%p, flags=%x",
+                     type, params, nparams, flags);
+
+    virResetLastError();
+
+    if (!VIR_IS_CONNECTED_DOMAIN(domain)) {
+        virLibDomainError(VIR_ERR_INVALID_DOMAIN, __FUNCTION__);
+        virDispatchError(NULL);
+        return -1;
+    }
+    virCheckNonNullArgGoto(type, error);
+    virCheckNonNullArgGoto(params, error);
+    virCheckNonNullArgGoto(nparams, error);
+
+    conn = domain->conn;
+
+    if (conn->driver->domainGetJobStats) {
+        int ret;
+        ret = conn->driver->domainGetJobStats(domain, type, params,
+                                              nparams, flags);
+        if (ret < 0)
+            goto error;
+        return ret;
+    }
+
+    virLibConnError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
+
+error:
+    virDispatchError(domain->conn);
+    return -1;
+}
+
+
 /**
  * virDomainAbortJob:
  * @domain: a domain object
@@ -17676,6 +17760,191 @@ error:
     return -1;
 }
 
+/* Helper checking the NULL-terminated list of domains passed to the
+ * virDomainList* APIs, which must all belong to the same writable
+ * connection.  Returns that connection and stores the number of domains
+ * in @ndoms, or returns NULL after raising an error.  */
+static virConnectPtr
+virDomainListCheck(virDomainPtr *doms,
+                   unsigned int *ndoms)
+{
+    virConnectPtr conn;
+    unsigned int i;
+
+    if (!doms || !doms[0]) {
+        virLibConnError(VIR_ERR_INVALID_ARG, "%s",
+                        _("at least one domain is required"));
+        virDispatchError(NULL);
+        return NULL;
+    }
+
+    for (i = 0 ; doms[i] ; i++) {
+        if (!VIR_IS_CONNECTED_DOMAIN(doms[i])) {
+            virLibDomainError(VIR_ERR_INVALID_DOMAIN, __FUNCTION__);
+            virDispatchError(NULL);
+            return NULL;
+        }
+    }
+    *ndoms = i;
+
+    conn = doms[0]->conn;
+    for (i = 1 ; i < *ndoms ; i++) {
+        if (doms[i]->conn != conn) {
+            virLibConnError(VIR_ERR_INVALID_ARG, "%s",
+                            _("domains must belong to the same connection"));
+            goto error;
+        }
+    }
+
+    if (conn->flags & VIR_CONNECT_RO) {
+        virLibDomainError(VIR_ERR_OPERATION_DENIED, __FUNCTION__);
+        goto error;
+    }
+
+    return conn;
+
+error:
+    virDispatchError(conn);
+    return NULL;
+}
+
+/**
+ * virDomainListManagedSave:
+ * @doms: NULL-terminated array of domains
+ * @params: pointer to an array of typed parameters
+ * @nparams: number of parameters in @params
+ * @flags: bitwise-OR of virDomainSaveRestoreFlags
+ *
+ * Do a managed save of each domain in @doms, like virDomainManagedSave
+ * would, but let the hypervisor save several of them at the same time.
+ * This is meant for saving all guests before the host shuts down.  A
+ * domain of @doms which is not running cannot be saved, and counts as
+ * a failure.
+ *
+ * @params may contain VIR_DOMAIN_BULK_CONCURRENCY to set how many
+ * domains are saved at the same time, and VIR_DOMAIN_BULK_BANDWIDTH to
+ * limit the bandwidth all those saves may use together; otherwise the
+ * hypervisor picks a default concurrency and does not limit the
+ * bandwidth.  The order in which domains are saved is up to the
+ * hypervisor.  The progress of each save may be watched with
+ * virDomainGetJobInfo on that domain.
+ *
+ * A failure to save one domain does not stop the other saves. All
+ * domains in @doms have been processed once this function is done, and
+ * callers may check which ones have been saved with
+ * virDomainHasManagedSaveImage.
+ *
+ * Returns 0 if all domains were saved, -1 otherwise, with the error of
+ * the first domain which could not be saved.
+ */
+int
+virDomainListManagedSave(virDomainPtr *doms,
+                         virTypedParameterPtr params,
+                         int nparams,
+                         unsigned int flags)
+{
+    virConnectPtr conn;
+    unsigned int ndoms;
+
+    VIR_DEBUG("doms=%p, params=%p, nparams=%d, flags=%x",
+              doms, params, nparams, flags);
+
+    virResetLastError();
+
+    if (!(conn = virDomainListCheck(doms, &ndoms)))
+        return -1;
+
+    virCheckNonNegativeArgGoto(nparams, error);
+    if (virTypedParameterValidateSet(conn, params, nparams) < 0)
+        goto error;
+
+    if ((flags & VIR_DOMAIN_SAVE_RUNNING) && (flags & VIR_DOMAIN_SAVE_PAUSED)) {
+        virReportInvalidArg(flags, "%s",
+                            _("running and paused flags are mutually exclusive"));
+        goto error;
+    }
+
+    if (conn->driver->domainListManagedSave) {
+        int ret;
+
+        ret = conn->driver->domainListManagedSave(conn, doms, ndoms,
+                                                  params, nparams, flags);
+        if (ret < 0)
+            goto error;
+        return ret;
+    }
+
+    virLibConnError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
+
+error:
+    virDispatchError(conn);
+    return -1;
+}
+
+/**
+ * virDomainListManagedRestore:
+ * @doms: NULL-terminated array of domains
+ * @params: pointer to an array of typed parameters
+ * @nparams: number of parameters in @params
+ * @flags: bitwise-OR of VIR_DOMAIN_START_PAUSED and
+ *         VIR_DOMAIN_START_BYPASS_CACHE
+ *
+ * Start each domain in @doms, like virDomainCreateWithFlags would, but
+ * let the hypervisor start several of them at the same time.  Domains
+ * with a managed save image are restored from it, the others are
+ * booted.  This is meant for restarting all guests saved by
+ * virDomainListManagedSave once the host is back.  A domain of @doms
+ * which is already running counts as a failure.
+ *
+ * @params may contain VIR_DOMAIN_BULK_CONCURRENCY to set how many
+ * domains are started at the same time; otherwise the hypervisor picks
+ * a default.  The order in which domains are started is up to the
+ * hypervisor.
+ *
+ * A failure to start one domain does not stop the others. Callers may
+ * check which domains are running with virDomainIsActive.
+ *
+ * Returns 0 if all domains were started, -1 otherwise, with the error
+ * of the first domain which could not be started.
+ */
+int
+virDomainListManagedRestore(virDomainPtr *doms,
+                            virTypedParameterPtr params,
+                            int nparams,
+                            unsigned int flags)
+{
+    virConnectPtr conn;
+    unsigned int ndoms;
+
+    VIR_DEBUG("doms=%p, params=%p, nparams=%d, flags=%x",
+              doms, params, nparams, flags);
+
+    virResetLastError();
+
+    if (!(conn = virDomainListCheck(doms, &ndoms)))
+        return -1;
+
+    virCheckNonNegativeArgGoto(nparams, error);
+    if (virTypedParameterValidateSet(conn, params, nparams) < 0)
+        goto error;
+
+    if (conn->driver->domainListManagedRestore) {
+        int ret;
+
+        ret = conn->driver->domainListManagedRestore(conn, doms, ndoms,
+                                                     params, nparams, flags);
+        if (ret < 0)
+            goto error;
+        return ret;
+    }
+
+    virLibConnError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
+
+error:
+    virDispatchError(conn);
+    return -1;
+}
+
 /**
  * virDomainSnapshotGetName:
  * @snapshot: a snapshot object
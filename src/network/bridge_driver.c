@@ -65,6 +65,8 @@
 #include "virnetdevtap.h"
 #include "virnetdevvportprofile.h"
 #include "virdbus.h"
+#include "virtime.h"
+#include "virhash.h"
 
 #define NETWORK_PID_DIR LOCALSTATEDIR "/run/libvirt/network"
 #define NETWORK_STATE_DIR LOCALSTATEDIR "/lib/libvirt/network"
@@ -85,8 +87,15 @@ struct network_driver {
     char *networkAutostartDir;
     char *logDir;
     dnsmasqCapsPtr dnsmasqCaps;
+
+    /* networks whose dnsmasq is due to reread its host files */
+    virHashTablePtr dnsmasqPending;
+    int dnsmasqRefreshTimer;
 };
 
+/* window over which dnsmasq reloads are coalesced, in milliseconds */
+#define NETWORK_DNSMASQ_REFRESH_DELAY 100
+
 
 static void networkDriverLock(struct network_driver *driver)
 {
@@ -118,6 +127,8 @@ static int networkShutdownNetworkExternal(struct network_driver *driver,
                                         virNetworkObjPtr network);
 
 static void networkReloadIptablesRules(struct network_driver *driver);
+static void networkRemoveIptablesRules(struct network_driver *driver,
+                                       virNetworkObjPtr network);
 static void networkRefreshDaemons(struct network_driver *driver);
 
 static struct network_driver *driverState = NULL;
@@ -267,7 +278,9 @@ firewalld_dbus_filter_bridge(DBusConnection *connection ATTRIBUTE_UNUSED,
                                "Reloaded"))
     {
         VIR_DEBUG("Reload in bridge_driver because of firewalld.");
+        networkDriverLock(_driverState);
         networkReloadIptablesRules(_driverState);
+        networkDriverUnlock(_driverState);
     }
 
     return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
@@ -293,6 +306,7 @@ networkStartup(int privileged) {
         VIR_FREE(driverState);
         goto error;
     }
+    driverState->dnsmasqRefreshTimer = -1;
     networkDriverLock(driverState);
 
     if (privileged) {
@@ -337,6 +351,9 @@ networkStartup(int privileged) {
         goto out_of_memory;
     }
 
+    if (!(driverState->dnsmasqPending = virHashCreate(0, NULL)))
+        goto error;
+
     /* if this fails now, it will be retried later with dnsmasqCapsRefresh() */
     driverState->dnsmasqCaps = dnsmasqCapsNewFromBinary(DNSMASQ);
 
@@ -464,6 +481,10 @@ networkShutdown(void) {
     if (driverState->iptables)
         iptablesContextFree(driverState->iptables);
 
+    if (driverState->dnsmasqRefreshTimer >= 0)
+        virEventRemoveTimeout(driverState->dnsmasqRefreshTimer);
+    virHashFree(driverState->dnsmasqPending);
+
     virObjectUnref(driverState->dnsmasqCaps);
 
     networkDriverUnlock(driverState);
@@ -967,54 +988,156 @@ cleanup:
     return ret;
 }
 
+/* Look for first IPv4 address that has dhcp defined. */
+/* We support dhcp config on 1 IPv4 interface only. */
+static virNetworkIpDefPtr
+networkGetDhcpIpDef(virNetworkObjPtr network)
+{
+    virNetworkIpDefPtr ipdef;
+    int ii;
+
+    for (ii = 0;
+         (ipdef = virNetworkDefGetIpByIndex(network->def, AF_INET, ii));
+         ii++) {
+        if (ipdef->nranges || ipdef->nhosts)
+            return ipdef;
+    }
+    /* If no IPv4 addresses had dhcp info, pick the first (if there were any). */
+    return virNetworkDefGetIpByIndex(network->def, AF_INET, 0);
+}
+
+/* networkSaveDhcpHostsFiles:
+ *  Update the dnsmasq host files of @network for @ipdef.
+ *
+ *  Returns 1 if a file changed, 0 if none did, -1 on failure.
+ */
+static int
+networkSaveDhcpHostsFiles(virNetworkObjPtr network,
+                          virNetworkIpDefPtr ipdef)
+{
+    int ret = -1;
+    dnsmasqContext *dctx = NULL;
+
+    if (!(dctx = dnsmasqContextNew(network->def->name, DNSMASQ_STATE_DIR)))
+        goto cleanup;
+
+    if (networkBuildDnsmasqHostsfile(dctx, ipdef, network->def->dns) < 0)
+       goto cleanup;
+
+    ret = dnsmasqSave(dctx);
+cleanup:
+    dnsmasqContextFree(dctx);
+    return ret;
+}
+
 /* networkRefreshDhcpDaemon:
  *  Update dnsmasq config files, then send a SIGHUP so that it rereads
- *  them.
+ *  them. If @changedOnly, the SIGHUP is skipped if no file changed.
  *
  *  Returns 0 on success, -1 on failure.
  */
 static int
 networkRefreshDhcpDaemon(struct network_driver *driver,
-                         virNetworkObjPtr network)
+                         virNetworkObjPtr network,
+                         bool changedOnly)
 {
-    int ret = -1, ii;
+    int ret;
     virNetworkIpDefPtr ipdef;
-    dnsmasqContext *dctx = NULL;
 
     /* if there's no running dnsmasq, just start it */
     if (network->dnsmasqPid <= 0 || (kill(network->dnsmasqPid, 0) < 0))
         return networkStartDhcpDaemon(driver, network);
 
-    /* Look for first IPv4 address that has dhcp defined. */
-    /* We support dhcp config on 1 IPv4 interface only. */
-    for (ii = 0;
-         (ipdef = virNetworkDefGetIpByIndex(network->def, AF_INET, ii));
-         ii++) {
-        if (ipdef->nranges || ipdef->nhosts)
-            break;
+    if (!(ipdef = networkGetDhcpIpDef(network))) {
+        /* no <ip> elements, so nothing to do */
+        return 0;
     }
-    /* If no IPv4 addresses had dhcp info, pick the first (if there were any). */
-    if (!ipdef)
-        ipdef = virNetworkDefGetIpByIndex(network->def, AF_INET, 0);
 
-    if (!ipdef) {
-        /* no <ip> elements, so nothing to do */
+    if ((ret = networkSaveDhcpHostsFiles(network, ipdef)) < 0)
+        return -1;
+
+    if (ret == 0 && changedOnly) {
+        VIR_DEBUG("dnsmasq files of network '%s' are unchanged",
+                  network->def->name);
         return 0;
     }
 
-    if (!(dctx = dnsmasqContextNew(network->def->name, DNSMASQ_STATE_DIR)))
-        goto cleanup;
+    return kill(network->dnsmasqPid, SIGHUP);
+}
 
-    if (networkBuildDnsmasqHostsfile(dctx, ipdef, network->def->dns) < 0)
-       goto cleanup;
+static void
+networkReloadDhcpDaemonTimer(int timer ATTRIBUTE_UNUSED, void *opaque)
+{
+    struct network_driver *driver = opaque;
+    unsigned int i;
 
-    if ((ret = dnsmasqSave(dctx)) < 0)
-        goto cleanup;
+    networkDriverLock(driver);
 
-    ret = kill(network->dnsmasqPid, SIGHUP);
-cleanup:
-    dnsmasqContextFree(dctx);
-    return ret;
+    virEventRemoveTimeout(driver->dnsmasqRefreshTimer);
+    driver->dnsmasqRefreshTimer = -1;
+
+    for (i = 0 ; i < driver->networks.count &&
+                 virHashSize(driver->dnsmasqPending) > 0 ; i++) {
+        virNetworkObjPtr network = driver->networks.objs[i];
+
+        virNetworkObjLock(network);
+        if (virHashSteal(driver->dnsmasqPending, network->def->name) &&
+            virNetworkObjIsActive(network) &&
+            network->dnsmasqPid > 0 &&
+            kill(network->dnsmasqPid, SIGHUP) < 0) {
+            VIR_WARN("Failed to reload dnsmasq of network '%s'",
+                     network->def->name);
+        }
+        virNetworkObjUnlock(network);
+    }
+
+    /* drop the networks that went away meanwhile */
+    virHashRemoveAll(driver->dnsmasqPending);
+
+    networkDriverUnlock(driver);
+}
+
+/* networkRefreshDhcpHosts:
+ *  Update the dnsmasq host files of @network right away, but have
+ *  dnsmasq reread them shortly, so that a burst of host updates results
+ *  in a single SIGHUP. Falls back to sending it right away if that
+ *  cannot be scheduled. No SIGHUP is sent if no file changed.
+ *
+ *  Call this function with the driver lock held.
+ *
+ *  Returns 0 on success, -1 on failure.
+ */
+static int
+networkRefreshDhcpHosts(struct network_driver *driver,
+                        virNetworkObjPtr network)
+{
+    virNetworkIpDefPtr ipdef;
+    int rc;
+
+    /* if there's no running dnsmasq, just start it */
+    if (network->dnsmasqPid <= 0 || (kill(network->dnsmasqPid, 0) < 0))
+        return networkStartDhcpDaemon(driver, network);
+
+    if (!(ipdef = networkGetDhcpIpDef(network)))
+        return 0;
+
+    if ((rc = networkSaveDhcpHostsFiles(network, ipdef)) <= 0)
+        return rc;
+
+    if (driver->dnsmasqRefreshTimer < 0 &&
+        (driver->dnsmasqRefreshTimer =
+         virEventAddTimeout(NETWORK_DNSMASQ_REFRESH_DELAY,
+                            networkReloadDhcpDaemonTimer,
+                            driver, NULL)) < 0) {
+        VIR_DEBUG("Cannot defer dnsmasq reload, doing it now");
+        return kill(network->dnsmasqPid, SIGHUP);
+    }
+
+    if (virHashUpdateEntry(driver->dnsmasqPending,
+                           network->def->name, network) < 0)
+        return kill(network->dnsmasqPid, SIGHUP);
+
+    return 0;
 }
 
 /* networkRestartDhcpDaemon:
@@ -1300,7 +1423,7 @@ networkRefreshDaemons(struct network_driver *driver)
              * dnsmasq and/or radvd, or restart them if they've
              * disappeared.
              */
-            networkRefreshDhcpDaemon(driver, network);
+            networkRefreshDhcpDaemon(driver, network, false);
             networkRefreshRadvd(driver, network);
         }
         virNetworkObjUnlock(network);
@@ -1866,7 +1989,11 @@ networkRemoveIpSpecificIptablesRules(struct network_driver *driver,
     }
 }
 
-/* Add all rules for all ip addresses (and general rules) on a network */
+/* Add all rules for all ip addresses (and general rules) on a network.
+ * The rules are queued and applied with a single iptables-restore call
+ * per table; the removal of rules queued after their addition on an
+ * error path simply cancels them out.
+ */
 static int
 networkAddIptablesRules(struct network_driver *driver,
                         virNetworkObjPtr network)
@@ -1874,9 +2001,13 @@ networkAddIptablesRules(struct network_driver *driver,
     int ii;
     virNetworkIpDefPtr ipdef;
 
+    iptablesTransactionBegin(driver->iptables);
+
     /* Add "once per network" rules */
-    if (networkAddGeneralIptablesRules(driver, network) < 0)
+    if (networkAddGeneralIptablesRules(driver, network) < 0) {
+        ignore_value(iptablesTransactionCommit(driver->iptables));
         return -1;
+    }
 
     for (ii = 0;
          (ipdef = virNetworkDefGetIpByIndex(network->def, AF_UNSPEC, ii));
@@ -1886,6 +2017,12 @@ networkAddIptablesRules(struct network_driver *driver,
             goto err;
         }
     }
+
+    if (iptablesTransactionCommit(driver->iptables) < 0) {
+        /* do not leave the rules that could be added behind */
+        networkRemoveIptablesRules(driver, network);
+        return -1;
+    }
     return 0;
 
 err:
@@ -1898,6 +2035,7 @@ err:
         networkRemoveIpSpecificIptablesRules(driver, network, ipdef);
     }
     networkRemoveGeneralIptablesRules(driver, network);
+    ignore_value(iptablesTransactionCommit(driver->iptables));
     return -1;
 }
 
@@ -1909,21 +2047,28 @@ networkRemoveIptablesRules(struct network_driver *driver,
     int ii;
     virNetworkIpDefPtr ipdef;
 
+    iptablesTransactionBegin(driver->iptables);
+
     for (ii = 0;
          (ipdef = virNetworkDefGetIpByIndex(network->def, AF_UNSPEC, ii));
          ii++) {
         networkRemoveIpSpecificIptablesRules(driver, network, ipdef);
     }
     networkRemoveGeneralIptablesRules(driver, network);
+
+    ignore_value(iptablesTransactionCommit(driver->iptables));
 }
 
 static void
 networkReloadIptablesRules(struct network_driver *driver)
 {
     unsigned int i;
+    unsigned long long then = 0, now = 0;
 
     VIR_INFO("Reloading iptables rules");
 
+    ignore_value(virTimeMillisNow(&then));
+
     for (i = 0 ; i < driver->networks.count ; i++) {
         virNetworkObjPtr network = driver->networks.objs[i];
 
@@ -1942,6 +2087,10 @@ networkReloadIptablesRules(struct network_driver *driver)
         }
         virNetworkObjUnlock(network);
     }
+
+    ignore_value(virTimeMillisNow(&now));
+    VIR_INFO("Reloaded iptables rules of %u networks in %llums",
+             driver->networks.count, now - then);
 }
 
 /* Enable IP Forwarding. Return 0 for success, -1 for failure. */
@@ -2156,6 +2305,7 @@ networkStartNetworkVirtual(struct network_driver *driver,
     virErrorPtr save_err = NULL;
     virNetworkIpDefPtr ipdef;
     char *macTapIfName = NULL;
+    unsigned long long then = 0, now = 0;
 
     /* Check to see if any network IP collides with an existing route */
     if (networkCheckRouteCollision(network) < 0)
@@ -2206,8 +2356,12 @@ networkStartNetworkVirtual(struct network_driver *driver,
         goto err1;
 
     /* Add "once per network" rules */
+    ignore_value(virTimeMillisNow(&then));
     if (networkAddIptablesRules(driver, network) < 0)
         goto err1;
+    ignore_value(virTimeMillisNow(&now));
+    VIR_DEBUG("Added iptables rules of network '%s' in %llums",
+              network->def->name, now - then);
 
     for (ii = 0;
          (ipdef = virNetworkDefGetIpByIndex(network->def, AF_UNSPEC, ii));
@@ -3078,20 +3232,27 @@ networkUpdate(virNetworkPtr net,
                 }
             }
 
-            if ((newDhcpActive != oldDhcpActive &&
-                 networkRestartDhcpDaemon(driver, network) < 0) ||
-                networkRefreshDhcpDaemon(driver, network) < 0) {
+            if (newDhcpActive != oldDhcpActive) {
+                if (networkRestartDhcpDaemon(driver, network) < 0)
+                    goto cleanup;
+            } else if (networkRefreshDhcpHosts(driver, network) < 0) {
                 goto cleanup;
             }
 
-        } else if (section == VIR_NETWORK_SECTION_DNS_HOST ||
-                   section == VIR_NETWORK_SECTION_DNS_TXT ||
+        } else if (section == VIR_NETWORK_SECTION_DNS_HOST) {
+            /* host entries only live in the host files, so updates
+             * of many of them can share a single SIGHUP.
+             */
+            if (networkRefreshDhcpHosts(driver, network) < 0)
+                goto cleanup;
+
+        } else if (section == VIR_NETWORK_SECTION_DNS_TXT ||
                    section == VIR_NETWORK_SECTION_DNS_SRV) {
             /* these sections only change things in config files, so we
              * can just update the config files and send SIGHUP to
              * dnsmasq.
              */
-            if (networkRefreshDhcpDaemon(driver, network) < 0)
+            if (networkRefreshDhcpDaemon(driver, network, false) < 0)
                 goto cleanup;
 
         }
@@ -3424,6 +3585,7 @@ networkCreateInterfacePool(virNetworkDefPtr netdef) {
     }
 
     netdef->nForwardIfs = num_virt_fns;
+    virNetworkDefForwardIfsChanged(netdef);
 
     for (ii = 0; ii < netdef->nForwardIfs; ii++) {
         if ((netdef->forwardType == VIR_NETWORK_FORWARD_BRIDGE) ||
@@ -3487,7 +3649,6 @@ networkAllocateActualDevice(virDomainNetDefPtr iface)
     virNetDevVPortProfilePtr virtport = iface->virtPortProfile;
     virNetDevVlanPtr vlan = NULL;
     virNetworkForwardIfDefPtr dev = NULL;
-    int ii;
     int ret = -1;
 
     /* it's handy to have this initialized if we skip directly to validate */
@@ -3600,12 +3761,9 @@ networkAllocateActualDevice(virDomainNetDefPtr iface)
         }
 
         /* pick first dev with 0 connections */
-        for (ii = 0; ii < netdef->nForwardIfs; ii++) {
-            if (netdef->forwardIfs[ii].connections == 0) {
-                dev = &netdef->forwardIfs[ii];
-                break;
-            }
-        }
+        dev = virNetworkDefForwardIfLeastUsed(netdef);
+        if (dev && dev->connections > 0)
+            dev = NULL;
         if (!dev) {
             virReportError(VIR_ERR_INTERNAL_ERROR,
                            _("network '%s' requires exclusive access "
@@ -3732,19 +3890,12 @@ networkAllocateActualDevice(virDomainNetDefPtr iface)
                   == VIR_NETDEV_VPORT_PROFILE_8021QBH))) {
 
                 /* pick first dev with 0 connections */
-                for (ii = 0; ii < netdef->nForwardIfs; ii++) {
-                    if (netdef->forwardIfs[ii].connections == 0) {
-                        dev = &netdef->forwardIfs[ii];
-                        break;
-                    }
-                }
+                dev = virNetworkDefForwardIfLeastUsed(netdef);
+                if (dev && dev->connections > 0)
+                    dev = NULL;
             } else {
                 /* pick least used dev */
-                dev = &netdef->forwardIfs[0];
-                for (ii = 1; ii < netdef->nForwardIfs; ii++) {
-                    if (netdef->forwardIfs[ii].connections < dev->connections)
-                        dev = &netdef->forwardIfs[ii];
-                }
+                dev = virNetworkDefForwardIfLeastUsed(netdef);
             }
             /* dev points at the physical device we want to use */
             if (!dev) {
@@ -3810,7 +3961,7 @@ validate:
 
     if (dev) {
         /* we are now assured of success, so mark the allocation */
-        dev->connections++;
+        virNetworkDefForwardIfConnect(netdef, dev);
         if (actualType != VIR_DOMAIN_NET_TYPE_HOSTDEV) {
             VIR_DEBUG("Using physical device %s, %d connections",
                       dev->device.dev, dev->connections);
@@ -3860,7 +4011,7 @@ networkNotifyActualDevice(virDomainNetDefPtr iface)
     virNetworkObjPtr network;
     virNetworkDefPtr netdef;
     virNetworkForwardIfDefPtr dev = NULL;
-    int ii, ret = -1;
+    int ret = -1;
 
     if (iface->type != VIR_DOMAIN_NET_TYPE_NETWORK)
        return 0;
@@ -3907,14 +4058,7 @@ networkNotifyActualDevice(virDomainNetDefPtr iface)
         }
 
         /* find the matching interface and increment its connections */
-        for (ii = 0; ii < netdef->nForwardIfs; ii++) {
-            if (netdef->forwardIfs[ii].type
-                == VIR_NETWORK_FORWARD_HOSTDEV_DEVICE_NETDEV &&
-                STREQ(actualDev, netdef->forwardIfs[ii].device.dev)) {
-                dev = &netdef->forwardIfs[ii];
-                break;
-            }
-        }
+        dev = virNetworkDefForwardIfFindDev(netdef, actualDev);
         /* dev points at the physical device we want to use */
         if (!dev) {
             virReportError(VIR_ERR_INTERNAL_ERROR,
@@ -3942,7 +4086,7 @@ networkNotifyActualDevice(virDomainNetDefPtr iface)
         }
 
         /* we are now assured of success, so mark the allocation */
-        dev->connections++;
+        virNetworkDefForwardIfConnect(netdef, dev);
         VIR_DEBUG("Using physical device %s, connections %d",
                   dev->device.dev, dev->connections);
 
@@ -3958,15 +4102,8 @@ networkNotifyActualDevice(virDomainNetDefPtr iface)
         }
 
         /* find the matching interface and increment its connections */
-        for (ii = 0; ii < netdef->nForwardIfs; ii++) {
-            if (netdef->forwardIfs[ii].type
-                == VIR_NETWORK_FORWARD_HOSTDEV_DEVICE_PCI &&
-                virDevicePCIAddressEqual(&hostdev->source.subsys.u.pci,
-                                         &netdef->forwardIfs[ii].device.pci)) {
-                dev = &netdef->forwardIfs[ii];
-                break;
-            }
-        }
+        dev = virNetworkDefForwardIfFindPCI(netdef,
+                                            &hostdev->source.subsys.u.pci);
         /* dev points at the physical device we want to use */
         if (!dev) {
             virReportError(VIR_ERR_INTERNAL_ERROR,
@@ -3997,7 +4134,7 @@ networkNotifyActualDevice(virDomainNetDefPtr iface)
         }
 
         /* we are now assured of success, so mark the allocation */
-        dev->connections++;
+        virNetworkDefForwardIfConnect(netdef, dev);
         VIR_DEBUG("Using physical device %04x:%02x:%02x.%x, connections %d",
                   dev->device.pci.domain, dev->device.pci.bus,
                   dev->device.pci.slot, dev->device.pci.function,
@@ -4037,7 +4174,7 @@ networkReleaseActualDevice(virDomainNetDefPtr iface)
     virNetworkObjPtr network;
     virNetworkDefPtr netdef;
     virNetworkForwardIfDefPtr dev = NULL;
-    int ii, ret = -1;
+    int ret = -1;
 
     if (iface->type != VIR_DOMAIN_NET_TYPE_NETWORK)
        return 0;
@@ -4079,14 +4216,7 @@ networkReleaseActualDevice(virDomainNetDefPtr iface)
             goto error;
         }
 
-        for (ii = 0; ii < netdef->nForwardIfs; ii++) {
-            if (netdef->forwardIfs[ii].type
-                == VIR_NETWORK_FORWARD_HOSTDEV_DEVICE_NETDEV &&
-                STREQ(actualDev, netdef->forwardIfs[ii].device.dev)) {
-                dev = &netdef->forwardIfs[ii];
-                break;
-            }
-        }
+        dev = virNetworkDefForwardIfFindDev(netdef, actualDev);
 
         if (!dev) {
             virReportError(VIR_ERR_INTERNAL_ERROR,
@@ -4096,7 +4226,7 @@ networkReleaseActualDevice(virDomainNetDefPtr iface)
             goto error;
         }
 
-        dev->connections--;
+        virNetworkDefForwardIfDisconnect(netdef, dev);
         VIR_DEBUG("Releasing physical device %s, connections %d",
                   dev->device.dev, dev->connections);
 
@@ -4110,15 +4240,8 @@ networkReleaseActualDevice(virDomainNetDefPtr iface)
             goto error;
         }
 
-        for (ii = 0; ii < netdef->nForwardIfs; ii++) {
-            if (netdef->forwardIfs[ii].type
-                == VIR_NETWORK_FORWARD_HOSTDEV_DEVICE_PCI &&
-                virDevicePCIAddressEqual(&hostdev->source.subsys.u.pci,
-                                          &netdef->forwardIfs[ii].device.pci)) {
-                dev = &netdef->forwardIfs[ii];
-                break;
-            }
-        }
+        dev = virNetworkDefForwardIfFindPCI(netdef,
+                                            &hostdev->source.subsys.u.pci);
 
         if (!dev) {
             virReportError(VIR_ERR_INTERNAL_ERROR,
@@ -4132,7 +4255,7 @@ networkReleaseActualDevice(virDomainNetDefPtr iface)
                 goto error;
         }
 
-        dev->connections--;
+        virNetworkDefForwardIfDisconnect(netdef, dev);
         VIR_DEBUG("Releasing physical device %04x:%02x:%02x.%x, connections %d",
                   dev->device.pci.domain, dev->device.pci.bus,
                   dev->device.pci.slot, dev->device.pci.function,
@@ -471,18 +471,16 @@ static void dev_create(const char *udi)
 
     /* Some devices don't have a path in sysfs, so ignore failure */
     (void)get_str_prop(ctx, udi, "linux.sysfs_path", &devicePath);
+    def->sysfs_path = devicePath;
 
     dev = virNodeDeviceAssignDef(&driverState->devs,
                                  def);
 
-    if (!dev) {
-        VIR_FREE(devicePath);
+    if (!dev)
         goto failure;
-    }
 
     dev->privateData = privData;
     dev->privateFree = free_udi;
-    dev->def->sysfs_path = devicePath;
 
     virNodeDeviceObjUnlock(dev);
 
@@ -38,6 +38,7 @@
 #include "util.h"
 #include "buf.h"
 #include "pci.h"
+#include "virtime.h"
 
 #define VIR_FROM_THIS VIR_FROM_NODEDEV
 
@@ -1391,8 +1392,12 @@ static int udevEnumerateDevices(struct udev *udev)
 {
     struct udev_enumerate *udev_enumerate = NULL;
     struct udev_list_entry *list_entry = NULL;
+    unsigned long long then = 0, now = 0;
+    unsigned int seen = 0;
     int ret = 0;
 
+    ignore_value(virTimeMillisNow(&then));
+
     udev_enumerate = udev_enumerate_new(udev);
 
     ret = udev_enumerate_scan_devices(udev_enumerate);
@@ -1405,8 +1410,13 @@ static int udevEnumerateDevices(struct udev *udev)
                             udev_enumerate_get_list_entry(udev_enumerate)) {
 
         udevProcessDeviceListEntry(udev, list_entry);
+        seen++;
     }
 
+    ignore_value(virTimeMillisNow(&now));
+    VIR_DEBUG("Enumerated %u udev devices, %u node devices in %llu ms",
+              seen, driverState->devs.count, now - then);
+
 out:
     udev_enumerate_unref(udev_enumerate);
     return ret;
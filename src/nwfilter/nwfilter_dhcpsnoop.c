@@ -43,7 +43,9 @@
 #include <config.h>
 
 #ifdef HAVE_LIBPCAP
-# include <pcap.h>
+# include <netpacket/packet.h>
+# include <linux/if_ether.h>
+# include <linux/filter.h>
 #endif
 
 #include <fcntl.h>
@@ -68,6 +70,7 @@
 #include "threadpool.h"
 #include "configmake.h"
 #include "virtime.h"
+#include "intprops.h"
 
 #define VIR_FROM_THIS VIR_FROM_NWFILTER
 
@@ -76,18 +79,36 @@
 # define LEASEFILE LOCALSTATEDIR "/run/libvirt/network/nwfilter.leases"
 # define TMPLEASEFILE LOCALSTATEDIR "/run/libvirt/network/nwfilter.ltmp"
 
+/*
+ * number of threads decoding DHCP packets; packets of an interface are
+ * always decoded by the same thread so they are processed in order
+ */
+# define SNOOP_DECODE_WORKERS 4
+
 struct virNWFilterSnoopState {
     /* lease file */
     int                  leaseFD;
     int                  nLeases; /* number of active leases */
     int                  wLeases; /* number of written leases */
     int                  nThreads; /* number of running threads */
+    bool                 compacting; /* lease file is being compacted */
+    virBuffer            leaseTail; /* leases saved during compaction */
+    virMutex             leaseLock; /* protects the lease file fields */
+    virCond              leaseCond; /* signals the end of a compaction */
     /* thread management */
     virHashTablePtr      snoopReqs;
     virHashTablePtr      ifnameToKey;
     virMutex             snoopLock;  /* protects SnoopReqs and IfNameToKey */
     virHashTablePtr      active;
     virMutex             activeLock; /* protects Active */
+    /* snooping engine */
+    int                  engineFD;   /* packet socket seeing all interfaces */
+    int                  engineWakeFDs[2];
+    bool                 engineRunning;
+    bool                 engineQuit;
+    virHashTablePtr      engineIfaces; /* ifindex -> snooped interface */
+    virThreadPoolPtr     decoders[SNOOP_DECODE_WORKERS];
+    virMutex             engineLock; /* protects the engine fields */
 };
 
 # define virNWFilterSnoopLock() \
@@ -98,6 +119,14 @@ struct virNWFilterSnoopState {
     do { \
         virMutexUnlock(&virNWFilterSnoopState.snoopLock); \
     } while (0)
+# define virNWFilterSnoopLeaseLock() \
+    do { \
+        virMutexLock(&virNWFilterSnoopState.leaseLock); \
+    } while (0)
+# define virNWFilterSnoopLeaseUnlock() \
+    do { \
+        virMutexUnlock(&virNWFilterSnoopState.leaseLock); \
+    } while (0)
 # define virNWFilterSnoopActiveLock() \
     do { \
         virMutexLock(&virNWFilterSnoopState.activeLock); \
@@ -107,6 +136,15 @@ struct virNWFilterSnoopState {
         virMutexUnlock(&virNWFilterSnoopState.activeLock); \
     } while (0)
 
+# define virNWFilterSnoopEngineLock() \
+    do { \
+        virMutexLock(&virNWFilterSnoopState.engineLock); \
+    } while (0)
+# define virNWFilterSnoopEngineUnlock() \
+    do { \
+        virMutexUnlock(&virNWFilterSnoopState.engineLock); \
+    } while (0)
+
 # define VIR_IFKEY_LEN   ((VIR_UUID_STRING_BUFLEN) + (VIR_MAC_STRING_BUFLEN))
 
 typedef struct _virNWFilterSnoopReq virNWFilterSnoopReq;
@@ -115,11 +153,32 @@ typedef virNWFilterSnoopReq *virNWFilterSnoopReqPtr;
 typedef struct _virNWFilterSnoopIPLease virNWFilterSnoopIPLease;
 typedef virNWFilterSnoopIPLease *virNWFilterSnoopIPLeasePtr;
 
-typedef enum {
-    THREAD_STATUS_NONE,
-    THREAD_STATUS_OK,
-    THREAD_STATUS_FAIL,
-} virNWFilterSnoopThreadStatus;
+typedef struct _virNWFilterSnoopRateLimitConf virNWFilterSnoopRateLimitConf;
+typedef virNWFilterSnoopRateLimitConf *virNWFilterSnoopRateLimitConfPtr;
+
+struct _virNWFilterSnoopRateLimitConf {
+    time_t prev;
+    unsigned int pkt_ctr;
+    time_t burst;
+    unsigned int rate;
+    unsigned int burstRate;
+    unsigned int burstInterval;
+};
+
+typedef struct _virNWFilterSnoopDirConf virNWFilterSnoopDirConf;
+typedef virNWFilterSnoopDirConf *virNWFilterSnoopDirConfPtr;
+
+struct _virNWFilterSnoopDirConf {
+    virNWFilterSnoopRateLimitConf rateLimit; /* indep. rate limiters */
+    int qCtr; /* number of jobs in the worker's queue */
+    unsigned long long penaltyTimeoutAbs;
+    /* rate-limited warnings */
+    time_t last_displayed;
+    time_t last_displayed_queue;
+};
+
+# define SNOOP_DIR_FROM_VM 0
+# define SNOOP_DIR_TO_VM   1
 
 struct _virNWFilterSnoopReq {
     /*
@@ -144,11 +203,9 @@ struct _virNWFilterSnoopReq {
     virNWFilterSnoopIPLeasePtr           end;
     char                                *threadkey;
 
-    virNWFilterSnoopThreadStatus         threadStatus;
-    virCond                              threadStatusCond;
-
     int                                  jobCompletionStatus;
-    /* the number of submitted jobs in the worker's queue */
+    /* state of the traffic from and to the VM, used by the engine */
+    virNWFilterSnoopDirConf              dirConf[2];
     /*
      * protect those members that can change while the
      * req is on the public SnoopReq hash and
@@ -158,7 +215,6 @@ struct _virNWFilterSnoopReq {
      * - start
      * - end
      * - a lease while it is on the list
-     * - threadStatus
      * (for refctr, see above)
      */
     virMutex                             lock;
@@ -241,7 +297,7 @@ struct _virNWFilterDHCPDecodeJob {
     unsigned char packet[PCAP_PBUFSIZE];
     int caplen;
     bool fromVM;
-    int *qCtr;
+    virNWFilterSnoopReqPtr req;
 };
 
 # define DHCP_PKT_RATE          10 /* pkts/sec */
@@ -252,31 +308,6 @@ struct _virNWFilterDHCPDecodeJob {
 
 # define MAX_QUEUED_JOBS        (DHCP_PKT_BURST + 2 * DHCP_PKT_RATE)
 
-typedef struct _virNWFilterSnoopRateLimitConf virNWFilterSnoopRateLimitConf;
-typedef virNWFilterSnoopRateLimitConf *virNWFilterSnoopRateLimitConfPtr;
-
-struct _virNWFilterSnoopRateLimitConf {
-    time_t prev;
-    unsigned int pkt_ctr;
-    time_t burst;
-    const unsigned int rate;
-    const unsigned int burstRate;
-    const unsigned int burstInterval;
-};
-
-typedef struct _virNWFilterSnoopPcapConf virNWFilterSnoopPcapConf;
-typedef virNWFilterSnoopPcapConf *virNWFilterSnoopPcapConfPtr;
-
-struct _virNWFilterSnoopPcapConf {
-    pcap_t *handle;
-    const pcap_direction_t dir;
-    const char *filter;
-    virNWFilterSnoopRateLimitConf rateLimit; /* indep. rate limiters */
-    int qCtr; /* number of jobs in the worker's queue */
-    const unsigned int maxQSize;
-    unsigned long long penaltyTimeoutAbs;
-};
-
 /* local function prototypes */
 static int virNWFilterSnoopReqLeaseDel(virNWFilterSnoopReqPtr req,
                                        virSocketAddrPtr ipaddr,
@@ -292,6 +323,8 @@ static void virNWFilterSnoopLeaseFileSave(virNWFilterSnoopIPLeasePtr ipl);
 /* local variables */
 static struct virNWFilterSnoopState virNWFilterSnoopState = {
     .leaseFD = -1,
+    .engineFD = -1,
+    .engineWakeFDs = { -1, -1 },
 };
 
 static const unsigned char dhcp_magic[4] = { 99, 130, 83, 99 };
@@ -332,23 +365,6 @@ virNWFilterSnoopCancel(char **threadKey)
     virNWFilterSnoopActiveUnlock();
 }
 
-static bool
-virNWFilterSnoopIsActive(char *threadKey)
-{
-    void *entry;
-
-    if (threadKey == NULL)
-        return 0;
-
-    virNWFilterSnoopActiveLock();
-
-    entry = virHashLookup(virNWFilterSnoopState.active, threadKey);
-
-    virNWFilterSnoopActiveUnlock();
-
-    return entry != NULL;
-}
-
 /*
  * virNWFilterSnoopListAdd - add an IP lease to a list
  */
@@ -587,22 +603,14 @@ virNWFilterSnoopReqNew(const char *ifkey)
         return NULL;
     }
 
-    req->threadStatus = THREAD_STATUS_NONE;
-
     if (virStrcpyStatic(req->ifkey, ifkey) == NULL ||
         virMutexInitRecursive(&req->lock) < 0)
         goto err_free_req;
 
-    if (virCondInit(&req->threadStatusCond) < 0)
-        goto err_destroy_mutex;
-
     virNWFilterSnoopReqGet(req);
 
     return req;
 
-err_destroy_mutex:
-    virMutexDestroy(&req->lock);
-
 err_free_req:
     VIR_FREE(req);
 
@@ -636,7 +644,6 @@ virNWFilterSnoopReqFree(virNWFilterSnoopReqPtr req)
     virNWFilterHashTableFree(req->vars);
 
     virMutexDestroy(&req->lock);
-    ignore_value(virCondDestroy(&req->threadStatusCond));
 
     VIR_FREE(req);
 }
@@ -1072,104 +1079,89 @@ virNWFilterSnoopDHCPDecode(virNWFilterSnoopReqPtr req,
     return 0;
 }
 
-static pcap_t *
-virNWFilterSnoopDHCPOpen(const char *ifname, virMacAddr *mac,
-                         const char *filter, pcap_direction_t dir)
-{
-    pcap_t *handle = NULL;
-    struct bpf_program fp;
-    char pcap_errbuf[PCAP_ERRBUF_SIZE];
-    char *ext_filter = NULL;
-    char macaddr[VIR_MAC_STRING_BUFLEN];
-
-    virMacAddrFormat(mac, macaddr);
-
-    if (dir == PCAP_D_IN /* from VM */) {
-        /*
-         * don't want to hear about another VM's DHCP requests
-         *
-         * extend the filter with the macaddr of the VM; filter the
-         * more unlikely parameters first, then go for the MAC
-         */
-        if (virAsprintf(&ext_filter,
-                        "%s and ether src %s", filter, macaddr) < 0) {
-            virReportOOMError();
-            return NULL;
-        }
-    } else {
-        /*
-         * Some DHCP servers respond via MAC broadcast; we rely on later
-         * filtering of responses by comparing the MAC address inside the
-         * DHCP response against the one of the VM. Assuming that the
-         * bridge learns the VM's MAC address quickly this should not
-         * generate much more traffic than if we filtered by VM and
-         * braodcast MAC as well
-         */
-        if (virAsprintf(&ext_filter, "%s", filter) < 0) {
-            virReportOOMError();
-            return NULL;
-        }
-    }
-
-    handle = pcap_create(ifname, pcap_errbuf);
+/*
+ * Classic BPF program attached to the engine's packet socket. It only
+ * lets IPv4 UDP packets between the DHCP client and server ports pass,
+ * in either direction, truncated to PCAP_PBUFSIZE bytes.
+ */
+static struct sock_filter virNWFilterSnoopDHCPFilter[] = {
+    /* ethertype IPv4 */
+    BPF_STMT(BPF_LD + BPF_H + BPF_ABS, 12),
+    BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, ETH_P_IP, 0, 13),
+    /* protocol UDP */
+    BPF_STMT(BPF_LD + BPF_B + BPF_ABS, 23),
+    BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_UDP, 0, 11),
+    /* first fragment only */
+    BPF_STMT(BPF_LD + BPF_H + BPF_ABS, 20),
+    BPF_JUMP(BPF_JMP + BPF_JSET + BPF_K, 0x1fff, 9, 0),
+    /* X = IP header length */
+    BPF_STMT(BPF_LDX + BPF_B + BPF_MSH, 14),
+    /* source port 67 and dest. port 68, or vice versa */
+    BPF_STMT(BPF_LD + BPF_H + BPF_IND, 14),
+    BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, 67, 1, 0),
+    BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, 68, 2, 5),
+    BPF_STMT(BPF_LD + BPF_H + BPF_IND, 16),
+    BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, 68, 2, 3),
+    BPF_STMT(BPF_LD + BPF_H + BPF_IND, 16),
+    BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, 67, 0, 1),
+    BPF_STMT(BPF_RET + BPF_K, PCAP_PBUFSIZE),
+    BPF_STMT(BPF_RET + BPF_K, 0),
+};
 
-    if (handle == NULL) {
-        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                       _("pcap_create failed"));
-        goto cleanup_nohandle;
-    }
+/*
+ * Open a packet socket that sees the DHCP traffic of all interfaces,
+ * including the packets the host sends out on them.
+ */
+static int
+virNWFilterSnoopDHCPOpen(void)
+{
+    struct sock_fprog fprog = {
+        .len = ARRAY_CARDINALITY(virNWFilterSnoopDHCPFilter),
+        .filter = virNWFilterSnoopDHCPFilter,
+    };
+    int rcvbuf = PCAP_BUFFERSIZE * SNOOP_DECODE_WORKERS;
+    int fd;
 
-    if (pcap_set_snaplen(handle, PCAP_PBUFSIZE) < 0 ||
-        pcap_set_buffer_size(handle, PCAP_BUFFERSIZE) < 0 ||
-        pcap_activate(handle) < 0) {
-        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                       _("setup of pcap handle failed"));
-        goto cleanup;
+    if ((fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("cannot open packet socket"));
+        return -1;
     }
 
-    if (pcap_compile(handle, &fp, ext_filter, 1, PCAP_NETMASK_UNKNOWN) != 0) {
-        virReportError(VIR_ERR_INTERNAL_ERROR,
-                       _("pcap_compile: %s"), pcap_geterr(handle));
-        goto cleanup;
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER,
+                   &fprog, sizeof(fprog)) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("cannot attach DHCP filter to packet socket"));
+        goto error;
     }
 
-    if (pcap_setfilter(handle, &fp) != 0) {
-        virReportError(VIR_ERR_INTERNAL_ERROR,
-                       _("pcap_setfilter: %s"), pcap_geterr(handle));
-        goto cleanup_freecode;
-    }
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0)
+        VIR_WARN("Could not set receive buffer of DHCP snooping socket");
 
-    if (pcap_setdirection(handle, dir) < 0) {
-        virReportError(VIR_ERR_INTERNAL_ERROR,
-                       _("pcap_setdirection: %s"),
-                       pcap_geterr(handle));
-        goto cleanup_freecode;
+    if (virSetNonBlock(fd) < 0 || virSetCloseExec(fd) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("cannot set up packet socket"));
+        goto error;
     }
 
-    pcap_freecode(&fp);
-    VIR_FREE(ext_filter);
-
-    return handle;
+    return fd;
 
-cleanup_freecode:
-    pcap_freecode(&fp);
-cleanup:
-    pcap_close(handle);
-cleanup_nohandle:
-    VIR_FREE(ext_filter);
-
-    return NULL;
+error:
+    VIR_FORCE_CLOSE(fd);
+    return -1;
 }
 
 /*
  * Worker function to decode the DHCP message and with that
  * also do the time-consuming work of instantiating the filters
  */
-static void virNWFilterDHCPDecodeWorker(void *jobdata, void *opaque)
+static void virNWFilterDHCPDecodeWorker(void *jobdata,
+                                        void *opaque ATTRIBUTE_UNUSED)
 {
-    virNWFilterSnoopReqPtr req = opaque;
     virNWFilterDHCPDecodeJobPtr job = jobdata;
+    virNWFilterSnoopReqPtr req = job->req;
     virNWFilterSnoopEthHdrPtr packet = (virNWFilterSnoopEthHdrPtr)job->packet;
+    int dir = job->fromVM ? SNOOP_DIR_FROM_VM : SNOOP_DIR_TO_VM;
 
     if (virNWFilterSnoopDHCPDecode(req, packet,
                                    job->caplen, job->fromVM) == -1) {
@@ -1179,7 +1171,8 @@ static void virNWFilterDHCPDecodeWorker(void *jobdata, void *opaque)
                        _("Instantiation of rules failed on "
                          "interface '%s'"), req->ifname);
     }
-    virAtomicIntDecAndTest(job->qCtr);
+    virAtomicIntDecAndTest(&req->dirConf[dir].qCtr);
+    virNWFilterSnoopReqPut(req);
     VIR_FREE(job);
 }
 
@@ -1188,11 +1181,12 @@ static void virNWFilterDHCPDecodeWorker(void *jobdata, void *opaque)
  */
 static int
 virNWFilterSnoopDHCPDecodeJobSubmit(virThreadPoolPtr pool,
+                                    virNWFilterSnoopReqPtr req,
                                     virNWFilterSnoopEthHdrPtr pep,
-                                    int len, pcap_direction_t dir,
-                                    int *qCtr)
+                                    int len, bool fromVM)
 {
     virNWFilterDHCPDecodeJobPtr job;
+    int dir = fromVM ? SNOOP_DIR_FROM_VM : SNOOP_DIR_TO_VM;
     int ret;
 
     if (len <= MIN_VALID_DHCP_PKT_SIZE || len > sizeof(job->packet))
@@ -1205,15 +1199,20 @@ virNWFilterSnoopDHCPDecodeJobSubmit(virThreadPoolPtr pool,
 
     memcpy(job->packet, pep, len);
     job->caplen = len;
-    job->fromVM = (dir == PCAP_D_IN);
-    job->qCtr = qCtr;
+    job->fromVM = fromVM;
+    job->req = req;
+
+    /* the job holds a reference to req */
+    virNWFilterSnoopReqGet(req);
+    virAtomicIntInc(&req->dirConf[dir].qCtr);
 
     ret = virThreadPoolSendJob(pool, 0, job);
 
-    if (ret == 0)
-        virAtomicIntInc(qCtr);
-    else
+    if (ret < 0) {
+        virAtomicIntDecAndTest(&req->dirConf[dir].qCtr);
+        virNWFilterSnoopReqPut(req);
         VIR_FREE(job);
+    }
 
     return ret;
 }
@@ -1267,315 +1266,525 @@ virNWFilterSnoopRateLimit(virNWFilterSnoopRateLimitConfPtr rl)
 /*
  * virNWFilterSnoopRatePenalty
  *
- * @pc: pointer to the virNWFilterSnoopPcapConf
+ * @dc: pointer to the virNWFilterSnoopDirConf
  * @diff: the amount of pkts beyond the rate, i.e., if the rate is 10
  *        and 13 pkts have been received now in one seconds, then
  *        this should be 3.
  *
- * Adjusts the timeout the virNWFilterSnooPcapConf will be penalized for
+ * Adjusts the timeout the virNWFilterSnoopDirConf will be penalized for
  * sending too many packets.
  */
 static void
-virNWFilterSnoopRatePenalty(virNWFilterSnoopPcapConfPtr pc,
+virNWFilterSnoopRatePenalty(virNWFilterSnoopDirConfPtr dc,
                             unsigned int diff, unsigned int limit)
 {
     if (diff > limit) {
         unsigned long long now;
 
         if (virTimeMillisNowRaw(&now) < 0) {
-            usleep(PCAP_FLOOD_TIMEOUT_MS); /* 1 ms */
-            pc->penaltyTimeoutAbs = 0;
+            dc->penaltyTimeoutAbs = 0;
         } else {
-            /* don't listen to the fd for 1 ms */
-            pc->penaltyTimeoutAbs = now + PCAP_FLOOD_TIMEOUT_MS;
+            /* drop the packets of this direction for some time */
+            dc->penaltyTimeoutAbs = now + PCAP_FLOOD_TIMEOUT_MS;
         }
     }
 }
 
-static int
-virNWFilterSnoopAdjustPoll(virNWFilterSnoopPcapConfPtr pc,
-                           size_t nPc, struct pollfd *pfd,
-                           int *pollTo)
+static void
+virNWFilterSnoopDirConfInit(virNWFilterSnoopDirConfPtr dc)
 {
-    int ret = 0;
-    size_t i;
-    int tmp;
-    unsigned long long now = 0;
-
-    *pollTo = -1;
+    memset(dc, 0, sizeof(*dc));
+    dc->rateLimit.prev = time(0);
+    dc->rateLimit.rate = DHCP_PKT_RATE;
+    dc->rateLimit.burstRate = DHCP_PKT_BURST;
+    dc->rateLimit.burstInterval = DHCP_BURST_INTERVAL_S;
+}
 
-    for (i = 0; i < nPc; i++) {
-        if (pc[i].penaltyTimeoutAbs != 0) {
-            if (now == 0) {
-                if (virTimeMillisNow(&now) < 0) {
-                    ret = -1;
-                    break;
-                }
-            }
+/*
+ * An interface the snooping engine listens on. The engine holds a
+ * reference to the req.
+ */
+typedef struct _virNWFilterSnoopIface virNWFilterSnoopIface;
+typedef virNWFilterSnoopIface *virNWFilterSnoopIfacePtr;
 
-            if (now < pc[i].penaltyTimeoutAbs) {
-                /* don't listen to incoming data on the fd for some time */
-                pfd[i].events &= ~POLLIN;
-                /*
-                 * calc the max. time to spend in poll() until adjustments
-                 * to the pollfd array are needed again.
-                 */
-                tmp = pc[i].penaltyTimeoutAbs - now;
-                if (*pollTo == -1 || tmp < *pollTo)
-                    *pollTo = tmp;
-            } else {
-                /* listen again to the fd */
-                pfd[i].events |= POLLIN;
-
-                pc[i].penaltyTimeoutAbs = 0;
-            }
-        }
-    }
+struct _virNWFilterSnoopIface {
+    int ifindex;
+    virNWFilterSnoopReqPtr req;
+};
 
-    return ret;
+static void
+virNWFilterSnoopIfaceKeyFMT(char *key, size_t keylen, int ifindex)
+{
+    snprintf(key, keylen, "%d", ifindex);
 }
 
 /*
- * The DHCP snooping thread. It spends most of its time in the pcap
- * library and if it gets suitable packets, it submits them to the worker
- * thread for processing.
+ * Stop listening on an interface removed from the engine. If the
+ * interface still is the one of the req, the req loses its association
+ * with the interface, just as when snooping was stopped on it.
+ * Call this function without holding the engine lock.
  */
 static void
-virNWFilterDHCPSnoopThread(void *req0)
+virNWFilterSnoopIfaceDetach(virNWFilterSnoopIfacePtr iface)
 {
-    virNWFilterSnoopReqPtr req = req0;
-    struct pcap_pkthdr *hdr;
-    virNWFilterSnoopEthHdrPtr packet;
-    int ifindex = 0;
-    int errcount = 0;
-    int tmp = -1, i, rv, n, pollTo;
-    char *threadkey = NULL;
-    virThreadPoolPtr worker = NULL;
-    time_t last_displayed = 0, last_displayed_queue = 0;
-    virNWFilterSnoopPcapConf pcapConf[] = {
-        {
-            .dir = PCAP_D_IN, /* from VM */
-            .filter = "dst port 67 and src port 68",
-            .rateLimit = {
-                .prev = time(0),
-                .rate = DHCP_PKT_RATE,
-                .burstRate = DHCP_PKT_BURST,
-                .burstInterval = DHCP_BURST_INTERVAL_S,
-            },
-            .maxQSize = MAX_QUEUED_JOBS,
-        }, {
-            .dir = PCAP_D_OUT, /* to VM */
-            .filter = "src port 67 and dst port 68",
-            .rateLimit = {
-                .prev = time(0),
-                .rate = DHCP_PKT_RATE,
-                .burstRate = DHCP_PKT_BURST,
-                .burstInterval = DHCP_BURST_INTERVAL_S,
-            },
-            .maxQSize = MAX_QUEUED_JOBS,
-        },
-    };
-    struct pollfd fds[] = {
-        {
-            /* get a POLLERR if interface goes down or disappears */
-            .events = POLLIN | POLLERR,
-        }, {
-            .events = POLLIN | POLLERR,
-        },
-    };
-    bool error = false;
+    virNWFilterSnoopReqPtr req = iface->req;
+    const char *ifkey;
 
-    /* whoever started us increased the reference counter for the req for us */
+    /* protect IfNameToKey */
+    virNWFilterSnoopLock();
 
     /* protect req->ifname & req->threadkey */
     virNWFilterSnoopReqLock(req);
 
-    if (req->ifname && req->threadkey) {
-        for (i = 0; i < ARRAY_CARDINALITY(pcapConf); i++) {
-            pcapConf[i].handle =
-                virNWFilterSnoopDHCPOpen(req->ifname, &req->macaddr,
-                                         pcapConf[i].filter,
-                                         pcapConf[i].dir);
-            if (!pcapConf[i].handle) {
-                error = true;
-                break;
-            }
-            fds[i].fd = pcap_fileno(pcapConf[i].handle);
+    if (req->ifindex == iface->ifindex) {
+        virNWFilterSnoopCancel(&req->threadkey);
+
+        if (req->ifname) {
+            ifkey = virHashLookup(virNWFilterSnoopState.ifnameToKey,
+                                  req->ifname);
+            if (ifkey && STREQ(ifkey, req->ifkey))
+                ignore_value(virHashRemoveEntry(
+                                 virNWFilterSnoopState.ifnameToKey,
+                                 req->ifname));
+
+            VIR_FREE(req->ifname);
         }
-        tmp = virNetDevGetIndex(req->ifname, &ifindex);
-        threadkey = strdup(req->threadkey);
-        worker = virThreadPoolNew(1, 1, 0,
-                                  virNWFilterDHCPDecodeWorker,
-                                  req);
     }
 
-    /* let creator know how well we initialized */
-    if (error == true || !threadkey || tmp < 0 || !worker ||
-        ifindex != req->ifindex)
-        req->threadStatus = THREAD_STATUS_FAIL;
-    else
-        req->threadStatus = THREAD_STATUS_OK;
+    virNWFilterSnoopReqUnlock(req);
+    virNWFilterSnoopUnlock();
 
-    virCondSignal(&req->threadStatusCond);
+    virNWFilterSnoopReqPut(req);
+    VIR_FREE(iface);
+}
 
-    virNWFilterSnoopReqUnlock(req);
+/*
+ * Look up the req snooping on the given interface and get a reference
+ * to it.
+ */
+static virNWFilterSnoopReqPtr
+virNWFilterSnoopEngineLookup(int ifindex)
+{
+    virNWFilterSnoopIfacePtr iface;
+    virNWFilterSnoopReqPtr req = NULL;
+    char key[INT_BUFSIZE_BOUND(int)];
 
-    if (req->threadStatus != THREAD_STATUS_OK)
-        goto exit;
+    virNWFilterSnoopIfaceKeyFMT(key, sizeof(key), ifindex);
 
-    while (!error) {
-        if (virNWFilterSnoopAdjustPoll(pcapConf,
-                                       ARRAY_CARDINALITY(pcapConf),
-                                       fds, &pollTo) < 0) {
-            break;
+    virNWFilterSnoopEngineLock();
+
+    if ((iface = virHashLookup(virNWFilterSnoopState.engineIfaces, key))) {
+        req = iface->req;
+        virNWFilterSnoopReqGet(req);
+    }
+
+    virNWFilterSnoopEngineUnlock();
+
+    return req;
+}
+
+/*
+ * Check whether the DHCP packet is travelling in the direction its
+ * ports indicate; the BPF filter accepts either.
+ */
+static bool
+virNWFilterSnoopDHCPPortsMatch(virNWFilterSnoopEthHdrPtr pep, int len,
+                               bool fromVM)
+{
+    struct iphdr *pip = (struct iphdr *) pep->eh_data;
+    struct udphdr *pup;
+
+    if (len < offsetof(virNWFilterSnoopEthHdr, eh_data) + sizeof(*pip) ||
+        len < offsetof(virNWFilterSnoopEthHdr, eh_data) + (pip->ihl << 2) +
+              sizeof(*pup))
+        return false;
+
+    pup = (struct udphdr *) ((char *) pip + (pip->ihl << 2));
+
+    if (fromVM)
+        return ntohs(pup->source) == 68 && ntohs(pup->dest) == 67;
+
+    return ntohs(pup->source) == 67 && ntohs(pup->dest) == 68;
+}
+
+/*
+ * Handle a packet received by the engine: find the interface it was
+ * seen on and submit it to that interface's decoding thread, subject
+ * to the per-direction queue length and rate limits.
+ */
+static void
+virNWFilterSnoopEngineHandlePacket(virNWFilterSnoopEthHdrPtr pep, int len,
+                                   const struct sockaddr_ll *sll)
+{
+    virNWFilterSnoopReqPtr req;
+    virNWFilterSnoopDirConfPtr dc;
+    bool fromVM = (sll->sll_pkttype != PACKET_OUTGOING);
+    unsigned long long now;
+    unsigned int diff;
+
+    if (!virNWFilterSnoopDHCPPortsMatch(pep, len, fromVM))
+        return;
+
+    if (!(req = virNWFilterSnoopEngineLookup(sll->sll_ifindex)))
+        return;
+
+    /* don't want to hear about another VM's DHCP requests */
+    if (fromVM && virMacAddrCmp(&pep->eh_src, &req->macaddr) != 0)
+        goto cleanup;
+
+    dc = &req->dirConf[fromVM ? SNOOP_DIR_FROM_VM : SNOOP_DIR_TO_VM];
+
+    if (dc->penaltyTimeoutAbs != 0) {
+        if (virTimeMillisNowRaw(&now) == 0 && now < dc->penaltyTimeoutAbs)
+            goto cleanup;
+        dc->penaltyTimeoutAbs = 0;
+    }
+
+    if (virAtomicIntGet(&dc->qCtr) > MAX_QUEUED_JOBS) {
+        if (time(0) - dc->last_displayed_queue > 10) {
+            dc->last_displayed_queue = time(0);
+            VIR_WARN("Worker thread for interface %d has a "
+                     "job queue that is too long", req->ifindex);
+        }
+        goto cleanup;
+    }
+
+    diff = virNWFilterSnoopRateLimit(&dc->rateLimit);
+    if (diff > 0) {
+        virNWFilterSnoopRatePenalty(dc, diff, DHCP_PKT_RATE);
+        if (time(0) - dc->last_displayed > 10) {
+            dc->last_displayed = time(0);
+            VIR_WARN("Too many DHCP packets on interface %d",
+                     req->ifindex);
         }
+        goto cleanup;
+    }
+
+    if (virNWFilterSnoopDHCPDecodeJobSubmit(
+            virNWFilterSnoopState.decoders[req->ifindex %
+                                           SNOOP_DECODE_WORKERS],
+            req, pep, len, fromVM) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("Job submission failed on "
+                         "interface %d"), req->ifindex);
+        req->jobCompletionStatus = -1;
+    }
+
+cleanup:
+    virNWFilterSnoopReqPut(req);
+}
+
+/*
+ * Run the lease timers of all interfaces and stop listening on those
+ * whose snooping was cancelled, whose req moved to another interface,
+ * or where the instantiation of rules failed.
+ */
+static void
+virNWFilterSnoopEngineTimerRun(void)
+{
+    virHashKeyValuePairPtr items;
+    virNWFilterSnoopIfacePtr ifaces = NULL, iface;
+    virNWFilterSnoopReqPtr req;
+    char key[INT_BUFSIZE_BOUND(int)];
+    size_t i, n = 0;
+    bool stale;
 
-        n = poll(fds, ARRAY_CARDINALITY(fds), pollTo);
+    virNWFilterSnoopEngineLock();
 
-        if (n < 0) {
-            if (errno != EAGAIN && errno != EINTR)
-                error = true;
+    /* work on a copy; the entries may change once the lock is dropped */
+    if ((items = virHashGetItems(virNWFilterSnoopState.engineIfaces, NULL))) {
+        n = virHashSize(virNWFilterSnoopState.engineIfaces);
+        if (VIR_ALLOC_N(ifaces, n) < 0) {
+            virReportOOMError();
+            n = 0;
+        }
+        for (i = 0; i < n; i++) {
+            ifaces[i] = *(virNWFilterSnoopIfacePtr)items[i].value;
+            virNWFilterSnoopReqGet(ifaces[i].req);
         }
+        VIR_FREE(items);
+    }
+
+    virNWFilterSnoopEngineUnlock();
+
+    for (i = 0; i < n; i++) {
+        req = ifaces[i].req;
 
         virNWFilterSnoopReqLeaseTimerRun(req);
 
-        /*
-         * Check whether we were cancelled or whether
-         * a previously submitted job failed.
-         */
-        if (!virNWFilterSnoopIsActive(threadkey) ||
-            req->jobCompletionStatus != 0)
-            goto exit;
-
-        for (i = 0; n > 0 && i < ARRAY_CARDINALITY(fds); i++) {
-            if (!fds[i].revents)
-                continue;
-
-            fds[i].revents = 0;
-            n--;
-
-            rv = pcap_next_ex(pcapConf[i].handle, &hdr,
-                              (const u_char **)&packet);
-
-            if (rv < 0) {
-                /* error reading from socket */
-                tmp = -1;
-
-                /* protect req->ifname */
-                virNWFilterSnoopReqLock(req);
-
-                if (req->ifname)
-                    tmp = virNetDevValidateConfig(req->ifname, NULL, ifindex);
-
-                virNWFilterSnoopReqUnlock(req);
-
-                if (tmp <= 0) {
-                    error = true;
-                    break;
-                }
-
-                if (++errcount > PCAP_READ_MAXERRS) {
-                    pcap_close(pcapConf[i].handle);
-                    pcapConf[i].handle = NULL;
-
-                    /* protect req->ifname */
-                    virNWFilterSnoopReqLock(req);
-
-                    virReportError(VIR_ERR_INTERNAL_ERROR,
-                                   _("interface '%s' failing; "
-                                     "reopening"),
-                                   req->ifname);
-                    if (req->ifname)
-                        pcapConf[i].handle =
-                            virNWFilterSnoopDHCPOpen(req->ifname, &req->macaddr,
-                                                     pcapConf[i].filter,
-                                                     pcapConf[i].dir);
-
-                    virNWFilterSnoopReqUnlock(req);
-
-                    if (!pcapConf[i].handle) {
-                        error = true;
-                        break;
-                    }
-                }
-                continue;
+        /* protect req->threadkey */
+        virNWFilterSnoopReqLock(req);
+        stale = !req->threadkey || req->ifindex != ifaces[i].ifindex ||
+                req->jobCompletionStatus != 0;
+        virNWFilterSnoopReqUnlock(req);
+
+        if (stale) {
+            virNWFilterSnoopIfaceKeyFMT(key, sizeof(key), ifaces[i].ifindex);
+
+            virNWFilterSnoopEngineLock();
+            iface = virHashLookup(virNWFilterSnoopState.engineIfaces, key);
+            if (iface && iface->req == req)
+                ignore_value(virHashSteal(virNWFilterSnoopState.engineIfaces,
+                                          key));
+            else
+                iface = NULL;
+            virNWFilterSnoopEngineUnlock();
+
+            if (iface) {
+                VIR_DEBUG("Stopped DHCP snooping on interface %d",
+                          iface->ifindex);
+                virNWFilterSnoopIfaceDetach(iface);
             }
+        }
 
-            errcount = 0;
+        virNWFilterSnoopReqPut(req);
+    }
 
-            if (rv) {
-                unsigned int diff;
+    virResetLastError();
+    VIR_FREE(ifaces);
+}
 
-                /* submit packet to worker thread */
-                if (virAtomicIntGet(&pcapConf[i].qCtr) >
-                    pcapConf[i].maxQSize) {
-                    if (last_displayed_queue - time(0) > 10) {
-                        last_displayed_queue = time(0);
-                        VIR_WARN("Worker thread for interface '%s' has a "
-                                 "job queue that is too long\n",
-                                 req->ifname);
-                    }
-                    continue;
-                }
-
-                diff = virNWFilterSnoopRateLimit(&pcapConf[i].rateLimit);
-                if (diff > 0) {
-                    virNWFilterSnoopRatePenalty(&pcapConf[i], diff,
-                                                DHCP_PKT_RATE);
-                    /* rate-limited warnings */
-                    if (time(0) - last_displayed > 10) {
-                         last_displayed = time(0);
-                         VIR_WARN("Too many DHCP packets on interface '%s'",
-                                  req->ifname);
-                    }
+/*
+ * The DHCP snooping engine. A single thread receives the DHCP traffic
+ * of all snooped interfaces through one packet socket and submits
+ * suitable packets to the decoding threads for processing.
+ */
+static void
+virNWFilterDHCPSnoopEngine(void *opaque ATTRIBUTE_UNUSED)
+{
+    unsigned char packet[PCAP_PBUFSIZE];
+    struct sockaddr_ll sll;
+    socklen_t slen;
+    struct pollfd fds[2];
+    time_t last_timer_run = 0;
+    ssize_t len;
+    int n, i;
+    bool quit = false;
+    char c;
+
+    fds[0].fd = virNWFilterSnoopState.engineFD;
+    fds[0].events = POLLIN;
+    fds[1].fd = virNWFilterSnoopState.engineWakeFDs[0];
+    fds[1].events = POLLIN;
+
+    while (!quit) {
+        fds[0].revents = fds[1].revents = 0;
+
+        /* wake up at least once per second to run the lease timers */
+        n = poll(fds, ARRAY_CARDINALITY(fds), 1000);
+
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            virReportSystemError(errno, "%s",
+                                 _("DHCP snooping engine failed to poll"));
+            break;
+        }
+
+        if (n > 0 && fds[1].revents) {
+            while (saferead(fds[1].fd, &c, sizeof(c)) > 0)
+                ;
+        }
+
+        /* bound the time spent on a flood before timers run again */
+        for (i = 0; n > 0 && fds[0].revents && i < DHCP_PKT_BURST; i++) {
+            slen = sizeof(sll);
+            len = recvfrom(fds[0].fd, packet, sizeof(packet), 0,
+                           (struct sockaddr *)&sll, &slen);
+            if (len < 0) {
+                if (errno == EINTR)
                     continue;
-                }
-
-                if (virNWFilterSnoopDHCPDecodeJobSubmit(worker, packet,
-                                                      hdr->caplen,
-                                                      pcapConf[i].dir,
-                                                      &pcapConf[i].qCtr) < 0) {
-                    virReportError(VIR_ERR_INTERNAL_ERROR,
-                                   _("Job submission failed on "
-                                     "interface '%s'"), req->ifname);
-                    error = true;
-                    break;
-                }
+                break;
             }
-        } /* for all fds */
-    } /* while (!error) */
 
-    /* protect IfNameToKey */
-    virNWFilterSnoopLock();
+            virNWFilterSnoopEngineHandlePacket(
+                (virNWFilterSnoopEthHdrPtr)packet, len, &sll);
+        }
 
-    /* protect req->ifname & req->threadkey */
-    virNWFilterSnoopReqLock(req);
+        if (time(0) != last_timer_run) {
+            last_timer_run = time(0);
+            virNWFilterSnoopEngineTimerRun();
+        }
 
-    virNWFilterSnoopCancel(&req->threadkey);
+        virNWFilterSnoopEngineLock();
+        quit = virNWFilterSnoopState.engineQuit;
+        virNWFilterSnoopEngineUnlock();
+    }
 
-    ignore_value(virHashRemoveEntry(virNWFilterSnoopState.ifnameToKey,
-                                    req->ifname));
+    virNWFilterSnoopEngineLock();
+    virNWFilterSnoopState.engineRunning = false;
+    virNWFilterSnoopEngineUnlock();
 
-    VIR_FREE(req->ifname);
+    virAtomicIntDecAndTest(&virNWFilterSnoopState.nThreads);
+}
 
-    virNWFilterSnoopReqUnlock(req);
-    virNWFilterSnoopUnlock();
+static void
+virNWFilterSnoopEngineFreeIface(void *payload, const void *name ATTRIBUTE_UNUSED)
+{
+    virNWFilterSnoopIfaceDetach(payload);
+}
 
-exit:
-    virThreadPoolFree(worker);
+/*
+ * Set up the engine's socket and decoding threads and start it.
+ * Call this function with the engine lock held.
+ */
+static int
+virNWFilterSnoopEngineStart(void)
+{
+    virThread thread;
+    size_t i;
 
-    virNWFilterSnoopReqPut(req);
+    if (virNWFilterSnoopState.engineRunning)
+        return 0;
+
+    if (virNWFilterSnoopState.engineFD < 0 &&
+        (virNWFilterSnoopState.engineFD = virNWFilterSnoopDHCPOpen()) < 0)
+        return -1;
 
-    VIR_FREE(threadkey);
+    if (virNWFilterSnoopState.engineWakeFDs[0] < 0) {
+        if (pipe2(virNWFilterSnoopState.engineWakeFDs,
+                  O_CLOEXEC | O_NONBLOCK) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("cannot create pipe"));
+            return -1;
+        }
+    }
 
-    for (i = 0; i < ARRAY_CARDINALITY(pcapConf); i++) {
-        if (pcapConf[i].handle)
-            pcap_close(pcapConf[i].handle);
+    for (i = 0; i < SNOOP_DECODE_WORKERS; i++) {
+        if (virNWFilterSnoopState.decoders[i])
+            continue;
+        virNWFilterSnoopState.decoders[i] =
+            virThreadPoolNew(0, 1, 0, virNWFilterDHCPDecodeWorker, NULL);
+        if (!virNWFilterSnoopState.decoders[i])
+            return -1;
     }
 
-    virAtomicIntDecAndTest(&virNWFilterSnoopState.nThreads);
+    virNWFilterSnoopState.engineQuit = false;
 
-    return;
+    if (virThreadCreate(&thread, false, virNWFilterDHCPSnoopEngine,
+                        NULL) != 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("could not start DHCP snooping engine"));
+        return -1;
+    }
+
+    virAtomicIntInc(&virNWFilterSnoopState.nThreads);
+    virNWFilterSnoopState.engineRunning = true;
+
+    return 0;
+}
+
+/*
+ * Tell the engine to terminate; virNWFilterSnoopJoinThreads waits
+ * for it.
+ */
+static void
+virNWFilterSnoopEngineStop(void)
+{
+    char c = 0;
+
+    virNWFilterSnoopEngineLock();
+
+    if (virNWFilterSnoopState.engineRunning) {
+        virNWFilterSnoopState.engineQuit = true;
+        ignore_value(safewrite(virNWFilterSnoopState.engineWakeFDs[1],
+                               &c, sizeof(c)));
+    }
+
+    virNWFilterSnoopEngineUnlock();
+}
+
+/*
+ * Release the engine's resources once it has terminated.
+ */
+static void
+virNWFilterSnoopEngineFree(void)
+{
+    virHashTablePtr ifaces;
+    size_t i;
+
+    virNWFilterSnoopEngineLock();
+
+    ifaces = virNWFilterSnoopState.engineIfaces;
+    virNWFilterSnoopState.engineIfaces = NULL;
+
+    for (i = 0; i < SNOOP_DECODE_WORKERS; i++) {
+        virThreadPoolFree(virNWFilterSnoopState.decoders[i]);
+        virNWFilterSnoopState.decoders[i] = NULL;
+    }
+
+    VIR_FORCE_CLOSE(virNWFilterSnoopState.engineFD);
+    VIR_FORCE_CLOSE(virNWFilterSnoopState.engineWakeFDs[0]);
+    VIR_FORCE_CLOSE(virNWFilterSnoopState.engineWakeFDs[1]);
+
+    virNWFilterSnoopEngineUnlock();
+
+    /* detaching takes the snoop lock, which nests outside the engine lock */
+    virHashFree(ifaces);
+}
+
+/*
+ * Have the engine listen for DHCP traffic on the interface of req,
+ * starting the engine if necessary.
+ * Call this function with the req lock held.
+ */
+static int
+virNWFilterSnoopEngineAttach(virNWFilterSnoopReqPtr req)
+{
+    virNWFilterSnoopIfacePtr iface = NULL, old = NULL;
+    char key[INT_BUFSIZE_BOUND(int)];
+    int ret = -1;
+
+    virNWFilterSnoopIfaceKeyFMT(key, sizeof(key), req->ifindex);
+
+    req->jobCompletionStatus = 0;
+    virNWFilterSnoopDirConfInit(&req->dirConf[SNOOP_DIR_FROM_VM]);
+    virNWFilterSnoopDirConfInit(&req->dirConf[SNOOP_DIR_TO_VM]);
+
+    virNWFilterSnoopEngineLock();
+
+    if (virNWFilterSnoopEngineStart() < 0)
+        goto cleanup;
+
+    old = virHashLookup(virNWFilterSnoopState.engineIfaces, key);
+    if (old && old->req == req) {
+        /* snooping was restarted before the engine noticed */
+        old = NULL;
+        ret = 0;
+        goto cleanup;
+    }
+
+    if (VIR_ALLOC(iface) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    iface->ifindex = req->ifindex;
+    iface->req = req;
+
+    if (old)
+        ignore_value(virHashSteal(virNWFilterSnoopState.engineIfaces, key));
+
+    if (virHashAddEntry(virNWFilterSnoopState.engineIfaces, key, iface) < 0) {
+        VIR_FREE(iface);
+        goto cleanup;
+    }
+
+    virNWFilterSnoopReqGet(req);
+
+    VIR_DEBUG("Started DHCP snooping on interface %s (%d); "
+              "snooping on %zd interfaces with %d threads",
+              req->ifname, req->ifindex,
+              virHashSize(virNWFilterSnoopState.engineIfaces),
+              1 + SNOOP_DECODE_WORKERS);
+
+    ret = 0;
+
+cleanup:
+    virNWFilterSnoopEngineUnlock();
+
+    if (old)
+        virNWFilterSnoopIfaceDetach(old);
+
+    return ret;
 }
 
 static void
@@ -1602,7 +1811,6 @@ virNWFilterDHCPSnoopReq(virNWFilterTechDriverPtr techdriver,
     bool isnewreq;
     char ifkey[VIR_IFKEY_LEN];
     int tmp;
-    virThread thread;
     virNWFilterVarValuePtr dhcpsrvrs;
 
     virNWFilterSnoopIFKeyFMT(ifkey, vmuuid, macaddr);
@@ -1686,19 +1894,9 @@ virNWFilterDHCPSnoopReq(virNWFilterTechDriverPtr techdriver,
         goto exit_rem_ifnametokey;
     }
 
-    /* prevent thread from holding req */
+    /* prevent the engine from using req */
     virNWFilterSnoopReqLock(req);
 
-    if (virThreadCreate(&thread, false, virNWFilterDHCPSnoopThread,
-                        req) != 0) {
-        virReportError(VIR_ERR_INTERNAL_ERROR,
-                       _("virNWFilterDHCPSnoopReq virThreadCreate "
-                         "failed on interface '%s'"), ifname);
-        goto exit_snoopreq_unlock;
-    }
-
-    virAtomicIntInc(&virNWFilterSnoopState.nThreads);
-
     req->threadkey = virNWFilterSnoopActivate(req);
     if (!req->threadkey) {
         virReportError(VIR_ERR_INTERNAL_ERROR,
@@ -1714,16 +1912,19 @@ virNWFilterDHCPSnoopReq(virNWFilterTechDriverPtr techdriver,
         goto exit_snoop_cancel;
     }
 
-    /* sync with thread */
-    if (virCondWait(&req->threadStatusCond, &req->lock) < 0 ||
-        req->threadStatus != THREAD_STATUS_OK)
+    if (virNWFilterSnoopEngineAttach(req) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("DHCP snooping failed to start on "
+                         "interface '%s'"), req->ifname);
         goto exit_snoop_cancel;
+    }
 
     virNWFilterSnoopReqUnlock(req);
 
     virNWFilterSnoopUnlock();
 
-    /* do not 'put' the req -- the thread will do this */
+    /* the engine holds its own reference to req */
+    virNWFilterSnoopReqPut(req);
 
     return 0;
 
@@ -1747,6 +1948,9 @@ virNWFilterSnoopLeaseFileClose(void)
     VIR_FORCE_CLOSE(virNWFilterSnoopState.leaseFD);
 }
 
+/*
+ * Call this function with the LeaseLock held.
+ */
 static void
 virNWFilterSnoopLeaseFileOpen(void)
 {
@@ -1757,78 +1961,113 @@ virNWFilterSnoopLeaseFileOpen(void)
 }
 
 /*
- * Write a single lease to the given file.
- *
+ * Format a single lease record. A timeout of 0 records the removal
+ * of the lease.
  */
 static int
-virNWFilterSnoopLeaseFileWrite(int lfd, const char *ifkey,
-                               virNWFilterSnoopIPLeasePtr ipl)
+virNWFilterSnoopLeaseFormat(virBufferPtr buf, const char *ifkey,
+                            virNWFilterSnoopIPLeasePtr ipl,
+                            unsigned int timeout)
 {
-    char *lbuf = NULL;
     char *ipstr, *dhcpstr;
-    int len;
-    int ret = 0;
+    int ret = -1;
 
     ipstr = virSocketAddrFormat(&ipl->ipAddress);
     dhcpstr = virSocketAddrFormat(&ipl->ipServer);
 
-    if (!dhcpstr || !ipstr) {
-        ret = -1;
+    if (!dhcpstr || !ipstr)
         goto cleanup;
-    }
 
     /* time intf ip dhcpserver */
-    len = virAsprintf(&lbuf, "%u %s %s %s\n", ipl->timeout,
-                      ifkey, ipstr, dhcpstr);
+    virBufferAsprintf(buf, "%u %s %s %s\n", timeout, ifkey, ipstr, dhcpstr);
+    ret = 0;
+
+cleanup:
+    VIR_FREE(dhcpstr);
+    VIR_FREE(ipstr);
+
+    return ret;
+}
+
+/*
+ * Write the content of a buffer to the given file.
+ */
+static int
+virNWFilterSnoopLeaseFileWrite(int lfd, virBufferPtr buf)
+{
+    const char *content;
+    size_t len;
 
-    if (len < 0) {
+    if (virBufferError(buf)) {
         virReportOOMError();
-        ret = -1;
-        goto cleanup;
+        return -1;
     }
 
-    if (safewrite(lfd, lbuf, len) != len) {
+    content = virBufferCurrentContent(buf);
+    len = virBufferUse(buf);
+
+    if (len && safewrite(lfd, content, len) != len) {
         virReportSystemError(errno, "%s", _("lease file write failed"));
-        ret = -1;
-        goto cleanup;
+        return -1;
     }
 
-    ignore_value(fsync(lfd));
-
-cleanup:
-    VIR_FREE(lbuf);
-    VIR_FREE(dhcpstr);
-    VIR_FREE(ipstr);
-
-    return ret;
+    return 0;
 }
 
+static void virNWFilterSnoopLeaseFileCompactThread(void *opaque);
+
 /*
- * Append a single lease to the end of the lease file.
- * To keep a limited number of dead leases, re-read the lease
- * file if the threshold of active leases versus written ones
- * exceeds a threshold.
+ * Append a record of a single lease to the end of the lease file.
+ * The file is a journal of lease changes where the last record of a
+ * lease wins; to keep a limited number of dead records, have the file
+ * compacted in the background once the number of written records
+ * exceeds the number of active leases by a threshold.
  */
 static void
 virNWFilterSnoopLeaseFileSave(virNWFilterSnoopIPLeasePtr ipl)
 {
     virNWFilterSnoopReqPtr req = ipl->snoopReq;
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    virThread thread;
 
-    virNWFilterSnoopLock();
+    if (virNWFilterSnoopLeaseFormat(&buf, req->ifkey, ipl, ipl->timeout) < 0)
+        goto cleanup;
+
+    virNWFilterSnoopLeaseLock();
 
     if (virNWFilterSnoopState.leaseFD < 0)
         virNWFilterSnoopLeaseFileOpen();
     if (virNWFilterSnoopLeaseFileWrite(virNWFilterSnoopState.leaseFD,
-                                       req->ifkey, ipl) < 0)
+                                       &buf) < 0)
         goto err_exit;
 
+    ignore_value(fsync(virNWFilterSnoopState.leaseFD));
+
+    /* records written during a compaction go into the new file as well */
+    if (virNWFilterSnoopState.compacting)
+        virBufferAdd(&virNWFilterSnoopState.leaseTail,
+                     virBufferCurrentContent(&buf), virBufferUse(&buf));
+
     /* keep dead leases at < ~95% of file size */
     if (virAtomicIntInc(&virNWFilterSnoopState.wLeases) >=
-        virAtomicIntGet(&virNWFilterSnoopState.nLeases) * 20)
-        virNWFilterSnoopLeaseFileLoad();   /* load & refresh lease file */
+        virAtomicIntGet(&virNWFilterSnoopState.nLeases) * 20 &&
+        !virNWFilterSnoopState.compacting) {
+        virNWFilterSnoopState.compacting = true;
+        if (virThreadCreate(&thread, false,
+                            virNWFilterSnoopLeaseFileCompactThread,
+                            NULL) < 0) {
+            virNWFilterSnoopState.compacting = false;
+            VIR_WARN("Could not start compaction of the DHCP lease file");
+        } else {
+            virAtomicIntInc(&virNWFilterSnoopState.nThreads);
+        }
+    }
 
 err_exit:
-    virNWFilterSnoopUnlock();
+    virNWFilterSnoopLeaseUnlock();
+
+cleanup:
+    virBufferFreeAndReset(&buf);
 }
 
 /*
@@ -1863,7 +2102,7 @@ virNWFilterSnoopPruneIter(const void *payload,
 }
 
 /*
- * Iterator to write all leases of a single request to a file.
+ * Iterator to format all leases of a single request.
  * Call this function with the SnoopLock held.
  */
 static void
@@ -1872,14 +2111,15 @@ virNWFilterSnoopSaveIter(void *payload,
                          void *data)
 {
     virNWFilterSnoopReqPtr req = payload;
-    int tfd = *(int *)data;
+    virBufferPtr buf = data;
     virNWFilterSnoopIPLeasePtr ipl;
 
     /* protect req->start */
     virNWFilterSnoopReqLock(req);
 
     for (ipl = req->start; ipl; ipl = ipl->next)
-        ignore_value(virNWFilterSnoopLeaseFileWrite(tfd, req->ifkey, ipl));
+        ignore_value(virNWFilterSnoopLeaseFormat(buf, req->ifkey, ipl,
+                                                 ipl->timeout));
 
     virNWFilterSnoopReqUnlock(req);
 }
@@ -1887,63 +2127,191 @@ virNWFilterSnoopSaveIter(void *payload,
 /*
  * Write all valid leases into a temporary file and then
  * rename the file to the final file.
- * Call this function with the SnoopLock held.
+ *
+ * The leases are collected in memory with the SnoopLock held only
+ * for that; records saved while the temporary file is written are
+ * appended to it before it replaces the lease file, so the snooping
+ * does not have to wait for the file I/O.
+ *
+ * The caller must have set the compacting flag; it is cleared here.
+ * Call this function without holding the SnoopLock or the LeaseLock.
  */
 static void
-virNWFilterSnoopLeaseFileRefresh(void)
+virNWFilterSnoopLeaseFileCompact(void)
 {
-    int tfd;
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    int tfd = -1;
+    bool ok = false;
+
+    virNWFilterSnoopLock();
+
+    if (virNWFilterSnoopState.snoopReqs) {
+        /* clean up the requests */
+        virHashRemoveSet(virNWFilterSnoopState.snoopReqs,
+                         virNWFilterSnoopPruneIter, NULL);
+        /* now collect them */
+        virHashForEach(virNWFilterSnoopState.snoopReqs,
+                       virNWFilterSnoopSaveIter, &buf);
+    }
+
+    virNWFilterSnoopUnlock();
 
     if (unlink(TMPLEASEFILE) < 0 && errno != ENOENT)
         virReportSystemError(errno, _("unlink(\"%s\")"), TMPLEASEFILE);
 
-    /* lease file loaded, delete old one */
     tfd = open(TMPLEASEFILE, O_CREAT|O_RDWR|O_TRUNC|O_EXCL, 0644);
     if (tfd < 0) {
         virReportSystemError(errno, _("open(\"%s\")"), TMPLEASEFILE);
-        return;
+    } else if (virNWFilterSnoopLeaseFileWrite(tfd, &buf) == 0) {
+        ok = true;
     }
 
-    if (virNWFilterSnoopState.snoopReqs) {
-        /* clean up the requests */
-        virHashRemoveSet(virNWFilterSnoopState.snoopReqs,
-                         virNWFilterSnoopPruneIter, NULL);
-        /* now save them */
-        virHashForEach(virNWFilterSnoopState.snoopReqs,
-                       virNWFilterSnoopSaveIter, (void *)&tfd);
-    }
+    virNWFilterSnoopLeaseLock();
 
-    if (VIR_CLOSE(tfd) < 0) {
+    if (ok &&
+        virNWFilterSnoopLeaseFileWrite(tfd,
+                                       &virNWFilterSnoopState.leaseTail) < 0)
+        ok = false;
+
+    if (tfd >= 0 && VIR_CLOSE(tfd) < 0) {
         virReportSystemError(errno, _("unable to close %s"), TMPLEASEFILE);
-        /* assuming the old lease file is still better, skip the renaming */
-        goto skip_rename;
+        ok = false;
     }
 
-    if (rename(TMPLEASEFILE, LEASEFILE) < 0) {
-        virReportSystemError(errno, _("rename(\"%s\", \"%s\")"),
-                             TMPLEASEFILE, LEASEFILE);
+    /* if anything failed, assume the old lease file is still better */
+    if (ok) {
+        if (rename(TMPLEASEFILE, LEASEFILE) < 0) {
+            virReportSystemError(errno, _("rename(\"%s\", \"%s\")"),
+                                 TMPLEASEFILE, LEASEFILE);
+            ignore_value(unlink(TMPLEASEFILE));
+        }
+        virAtomicIntSet(&virNWFilterSnoopState.wLeases, 0);
+    } else {
         ignore_value(unlink(TMPLEASEFILE));
     }
-    virAtomicIntSet(&virNWFilterSnoopState.wLeases, 0);
 
-skip_rename:
     virNWFilterSnoopLeaseFileOpen();
+
+    virBufferFreeAndReset(&virNWFilterSnoopState.leaseTail);
+    virNWFilterSnoopState.compacting = false;
+    virCondBroadcast(&virNWFilterSnoopState.leaseCond);
+
+    virNWFilterSnoopLeaseUnlock();
+
+    VIR_FORCE_CLOSE(tfd);
+    virBufferFreeAndReset(&buf);
 }
 
+static void
+virNWFilterSnoopLeaseFileCompactThread(void *opaque ATTRIBUTE_UNUSED)
+{
+    virNWFilterSnoopLeaseFileCompact();
 
+    virAtomicIntDecAndTest(&virNWFilterSnoopState.nThreads);
+}
+
+/*
+ * Wait for a running compaction to end and prevent new ones from
+ * starting until virNWFilterSnoopLeaseFileCompact is called.
+ */
 static void
-virNWFilterSnoopLeaseFileLoad(void)
+virNWFilterSnoopLeaseFileBeginCompact(void)
 {
-    char line[256], ifkey[VIR_IFKEY_LEN];
-    char ipstr[INET_ADDRSTRLEN], srvstr[INET_ADDRSTRLEN];
+    virNWFilterSnoopLeaseLock();
+
+    while (virNWFilterSnoopState.compacting)
+        ignore_value(virCondWait(&virNWFilterSnoopState.leaseCond,
+                                 &virNWFilterSnoopState.leaseLock));
+
+    virNWFilterSnoopState.compacting = true;
+
+    virNWFilterSnoopLeaseUnlock();
+}
+
+
+/*
+ * The last record of a lease found in the lease file.
+ */
+typedef struct _virNWFilterSnoopLeaseRecord virNWFilterSnoopLeaseRecord;
+typedef virNWFilterSnoopLeaseRecord *virNWFilterSnoopLeaseRecordPtr;
+
+struct _virNWFilterSnoopLeaseRecord {
+    char ifkey[VIR_IFKEY_LEN];
     virNWFilterSnoopIPLease ipl;
+};
+
+static void
+virNWFilterSnoopLeaseRecordFree(void *payload,
+                                const void *name ATTRIBUTE_UNUSED)
+{
+    VIR_FREE(payload);
+}
+
+/*
+ * Add the lease of a record to its request.
+ * Call this function with the SnoopLock held.
+ */
+static void
+virNWFilterSnoopLeaseRecordRestore(void *payload,
+                                   const void *name ATTRIBUTE_UNUSED,
+                                   void *data)
+{
+    virNWFilterSnoopLeaseRecordPtr rec = payload;
+    time_t now = *(time_t *)data;
     virNWFilterSnoopReqPtr req;
+
+    /* removed or expired */
+    if (rec->ipl.timeout == 0 || rec->ipl.timeout < now)
+        return;
+
+    req = virNWFilterSnoopReqGetByIFKey(rec->ifkey);
+    if (!req) {
+        req = virNWFilterSnoopReqNew(rec->ifkey);
+        if (!req)
+            return;
+
+        if (virHashAddEntry(virNWFilterSnoopState.snoopReqs,
+                            rec->ifkey, req) < 0) {
+            virNWFilterSnoopReqPut(req);
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("virNWFilterSnoopLeaseFileLoad req add"
+                             " failed on interface \"%s\""), rec->ifkey);
+            return;
+        }
+    }
+
+    rec->ipl.snoopReq = req;
+    virNWFilterSnoopReqLeaseAdd(req, &rec->ipl, false);
+
+    virNWFilterSnoopReqPut(req);
+}
+
+/*
+ * Load the leases from the lease file and compact the file.
+ *
+ * The file is first indexed by interface key and IP address so that
+ * only the last record of each lease is applied, rather than
+ * replaying its whole history.
+ * Call this function without holding the SnoopLock or the LeaseLock.
+ */
+static void
+virNWFilterSnoopLeaseFileLoad(void)
+{
+    char line[256], key[VIR_IFKEY_LEN + INET_ADDRSTRLEN + 1];
+    char ipstr[INET_ADDRSTRLEN], srvstr[INET_ADDRSTRLEN];
+    virNWFilterSnoopLeaseRecordPtr rec = NULL;
+    virHashTablePtr records;
     time_t now;
     FILE *fp;
-    int ln = 0, tmp;
+    int ln = 0;
 
-    /* protect the lease file */
-    virNWFilterSnoopLock();
+    /* keep compactions from replacing the file while it is read */
+    virNWFilterSnoopLeaseFileBeginCompact();
+
+    if (!(records = virHashCreate(0, virNWFilterSnoopLeaseRecordFree))) {
+        virResetLastError();
+        goto compact;
+    }
 
     fp = fopen(LEASEFILE, "r");
     time(&now);
@@ -1955,56 +2323,55 @@ virNWFilterSnoopLeaseFileLoad(void)
             break;
         }
         ln++;
+
+        if (!rec && VIR_ALLOC(rec) < 0) {
+            virReportOOMError();
+            break;
+        }
+
         /* key len 55 = "VMUUID"+'-'+"MAC" */
-        if (sscanf(line, "%u %55s %16s %16s", &ipl.timeout,
-                   ifkey, ipstr, srvstr) < 4) {
+        if (sscanf(line, "%u %55s %16s %16s", &rec->ipl.timeout,
+                   rec->ifkey, ipstr, srvstr) < 4) {
             virReportError(VIR_ERR_INTERNAL_ERROR,
                            _("virNWFilterSnoopLeaseFileLoad lease file "
                              "line %d corrupt"), ln);
             break;
         }
-        if (ipl.timeout && ipl.timeout < now)
-            continue;
-        req = virNWFilterSnoopReqGetByIFKey(ifkey);
-        if (!req) {
-            req = virNWFilterSnoopReqNew(ifkey);
-            if (!req)
-               break;
-
-            tmp = virHashAddEntry(virNWFilterSnoopState.snoopReqs, ifkey, req);
-
-            if (tmp < 0) {
-                virNWFilterSnoopReqPut(req);
-                virReportError(VIR_ERR_INTERNAL_ERROR,
-                               _("virNWFilterSnoopLeaseFileLoad req add"
-                                 " failed on interface \"%s\""), ifkey);
-                continue;
-            }
-        }
 
-        if (virSocketAddrParseIPv4(&ipl.ipAddress, ipstr) < 0) {
+        if (virSocketAddrParseIPv4(&rec->ipl.ipAddress, ipstr) < 0) {
             virReportError(VIR_ERR_INTERNAL_ERROR,
                            _("line %d corrupt ipaddr \"%s\""),
                            ln, ipstr);
-            virNWFilterSnoopReqPut(req);
             continue;
         }
-        ignore_value(virSocketAddrParseIPv4(&ipl.ipServer, srvstr));
-        ipl.snoopReq = req;
+        ignore_value(virSocketAddrParseIPv4(&rec->ipl.ipServer, srvstr));
 
-        if (ipl.timeout)
-            virNWFilterSnoopReqLeaseAdd(req, &ipl, false);
-        else
-            virNWFilterSnoopReqLeaseDel(req, &ipl.ipAddress, false, false);
+        /* the last record of a lease wins */
+        if (snprintf(key, sizeof(key), "%s %s",
+                     rec->ifkey, ipstr) >= sizeof(key))
+            continue;
 
-        virNWFilterSnoopReqPut(req);
+        if (virHashUpdateEntry(records, key, rec) < 0) {
+            virResetLastError();
+            continue;
+        }
+        rec = NULL;
     }
 
     VIR_FORCE_FCLOSE(fp);
+    VIR_FREE(rec);
 
-    virNWFilterSnoopLeaseFileRefresh();
+    VIR_DEBUG("Read %d lease records, %zd distinct leases",
+              ln, virHashSize(records));
 
+    virNWFilterSnoopLock();
+    virHashForEach(records, virNWFilterSnoopLeaseRecordRestore, &now);
     virNWFilterSnoopUnlock();
+
+    virHashFree(records);
+
+compact:
+    virNWFilterSnoopLeaseFileCompact();
 }
 
 /*
@@ -2080,23 +2447,33 @@ virNWFilterDHCPSnoopInit(void)
     VIR_DEBUG("Initializing DHCP snooping");
 
     if (virMutexInitRecursive(&virNWFilterSnoopState.snoopLock) < 0 ||
-        virMutexInit(&virNWFilterSnoopState.activeLock) < 0)
+        virMutexInit(&virNWFilterSnoopState.activeLock) < 0 ||
+        virMutexInit(&virNWFilterSnoopState.engineLock) < 0 ||
+        virMutexInit(&virNWFilterSnoopState.leaseLock) < 0)
         return -1;
 
+    if (virCondInit(&virNWFilterSnoopState.leaseCond) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("cannot initialize lease file condition"));
+        return -1;
+    }
+
     virNWFilterSnoopState.ifnameToKey = virHashCreate(0, NULL);
     virNWFilterSnoopState.active = virHashCreate(0, NULL);
     virNWFilterSnoopState.snoopReqs =
         virHashCreate(0, virNWFilterSnoopReqRelease);
+    virNWFilterSnoopState.engineIfaces =
+        virHashCreate(0, virNWFilterSnoopEngineFreeIface);
 
     if (!virNWFilterSnoopState.ifnameToKey ||
         !virNWFilterSnoopState.snoopReqs ||
-        !virNWFilterSnoopState.active) {
+        !virNWFilterSnoopState.active ||
+        !virNWFilterSnoopState.engineIfaces) {
         virReportOOMError();
         goto err_exit;
     }
 
     virNWFilterSnoopLeaseFileLoad();
-    virNWFilterSnoopLeaseFileOpen();
 
     return 0;
 
@@ -2110,6 +2487,9 @@ err_exit:
     virHashFree(virNWFilterSnoopState.active);
     virNWFilterSnoopState.active = NULL;
 
+    virHashFree(virNWFilterSnoopState.engineIfaces);
+    virNWFilterSnoopState.engineIfaces = NULL;
+
     return -1;
 }
 
@@ -2117,6 +2497,7 @@ void
 virNWFilterDHCPSnoopEnd(const char *ifname)
 {
     char *ifkey = NULL;
+    bool reload = false;
 
     virNWFilterSnoopLock();
 
@@ -2158,29 +2539,41 @@ virNWFilterDHCPSnoopEnd(const char *ifname)
 
         virNWFilterSnoopReqPut(req);
     } else {                      /* free all of them */
+        virNWFilterSnoopLeaseLock();
         virNWFilterSnoopLeaseFileClose();
+        virNWFilterSnoopLeaseUnlock();
 
         virHashRemoveAll(virNWFilterSnoopState.ifnameToKey);
 
         /* tell the threads to terminate */
         virNWFilterSnoopEndThreads();
 
-        virNWFilterSnoopLeaseFileLoad();
+        /* a compaction in progress needs the snoop lock to finish */
+        reload = true;
     }
 
 cleanup:
     virNWFilterSnoopUnlock();
+
+    if (reload)
+        virNWFilterSnoopLeaseFileLoad();
 }
 
 void
 virNWFilterDHCPSnoopShutdown(void)
 {
     virNWFilterSnoopEndThreads();
+    virNWFilterSnoopEngineStop();
     virNWFilterSnoopJoinThreads();
+    virNWFilterSnoopEngineFree();
+
+    virNWFilterSnoopLeaseLock();
+    virNWFilterSnoopLeaseFileClose();
+    virBufferFreeAndReset(&virNWFilterSnoopState.leaseTail);
+    virNWFilterSnoopLeaseUnlock();
 
     virNWFilterSnoopLock();
 
-    virNWFilterSnoopLeaseFileClose();
     virHashFree(virNWFilterSnoopState.ifnameToKey);
     virHashFree(virNWFilterSnoopState.snoopReqs);
 
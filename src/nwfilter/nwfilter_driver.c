@@ -35,6 +35,7 @@
 #include "virterror_internal.h"
 #include "datatypes.h"
 #include "memory.h"
+#include "virtime.h"
 #include "domain_conf.h"
 #include "domain_nwfilter.h"
 #include "nwfilter_conf.h"
@@ -281,6 +282,7 @@ err_free_driverstate:
 static int
 nwfilterDriverReload(void) {
     virConnectPtr conn;
+    unsigned long long then = 0, now = 0;
 
     if (!driverState) {
         return -1;
@@ -303,7 +305,15 @@ nwfilterDriverReload(void) {
         virNWFilterCallbackDriversUnlock();
         nwfilterDriverUnlock(driverState);
 
+        ignore_value(virTimeMillisNow(&then));
+
+        virNWFilterInstBatchBegin();
         virNWFilterInstFiltersOnAllVMs(conn);
+        virNWFilterInstBatchEnd();
+
+        if (virTimeMillisNow(&now) == 0)
+            VIR_INFO("Re-instantiated filters of all domains in %llu ms",
+                     now - then);
 
         virConnectClose(conn);
     }
@@ -43,6 +43,7 @@
 #include "command.h"
 #include "configmake.h"
 #include "intprops.h"
+#include "virtime.h"
 
 
 #define VIR_FROM_THIS VIR_FROM_NWFILTER
@@ -83,6 +84,8 @@
 static char *ebtables_cmd_path;
 static char *iptables_cmd_path;
 static char *ip6tables_cmd_path;
+static char *iptables_restore_cmd_path;
+static char *ip6tables_restore_cmd_path;
 static char *grep_cmd_path;
 
 #define PRINT_ROOT_CHAIN(buf, prefix, ifname) \
@@ -768,6 +771,59 @@ iptablesLinkTmpRootChains(virBufferPtr buf,
 }
 
 
+/*
+ * iptablesRestoreTmpRootChain:
+ * @buf: buffer to append to
+ * @basechain: the chain to link the root chain from
+ * @prefix: prefix of the root chain
+ * @incoming: whether this is the root chain of the incoming traffic
+ * @ifname: name of the interface
+ * @declare: whether to declare the chain or to link it
+ *
+ * iptables-restore counterpart of iptablesCreateTmpRootChain and
+ * iptablesLinkTmpRootChain.
+ */
+static void
+iptablesRestoreTmpRootChain(virBufferPtr buf,
+                            const char *basechain,
+                            char prefix,
+                            int incoming, const char *ifname,
+                            bool declare)
+{
+    char chain[MAX_CHAINNAME_LENGTH];
+    char chainPrefix[2] = {
+        prefix,
+        (incoming) ? CHAINPREFIX_HOST_IN_TEMP
+                   : CHAINPREFIX_HOST_OUT_TEMP
+    };
+    const char *match = (incoming) ? MATCH_PHYSDEV_IN
+                                   : MATCH_PHYSDEV_OUT;
+
+    PRINT_IPT_ROOT_CHAIN(chain, chainPrefix, ifname);
+
+    if (declare)
+        virBufferAsprintf(buf, ":%s - [0:0]\n", chain);
+    else
+        virBufferAsprintf(buf, "-A %s %s %s -g %s\n",
+                          basechain, match, ifname, chain);
+}
+
+
+static void
+iptablesRestoreTmpRootChains(virBufferPtr buf,
+                             const char *ifname)
+{
+    /* chains have to be declared before anything refers to them */
+    iptablesRestoreTmpRootChain(buf, VIRT_OUT_CHAIN, 'F', 0, ifname, true);
+    iptablesRestoreTmpRootChain(buf, VIRT_IN_CHAIN , 'F', 1, ifname, true);
+    iptablesRestoreTmpRootChain(buf, HOST_IN_CHAIN , 'H', 1, ifname, true);
+
+    iptablesRestoreTmpRootChain(buf, VIRT_OUT_CHAIN, 'F', 0, ifname, false);
+    iptablesRestoreTmpRootChain(buf, VIRT_IN_CHAIN , 'F', 1, ifname, false);
+    iptablesRestoreTmpRootChain(buf, HOST_IN_CHAIN , 'H', 1, ifname, false);
+}
+
+
 static int
 iptablesSetupVirtInPost(virBufferPtr buf,
                         const char *ifname)
@@ -933,6 +989,93 @@ iptablesInstCommand(virBufferPtr buf,
 }
 
 
+/*
+ * iptablesRestoreRule:
+ * @buf: buffer to append to
+ * @templ: command template of an iptables rule, as created by
+ *         _iptablesCreateRuleInstance
+ *
+ * Append the rule described by @templ to @buf as a line of
+ * iptables-restore input. The template is a shell fragment that
+ * optionally defines the comment variable before defining the
+ * command itself.
+ *
+ * Returns 0 on success, -1 if the rule cannot be expressed in
+ * iptables-restore syntax, in which case @buf is left untouched and
+ * the caller has to run the rule through the shell instead.
+ */
+static int
+iptablesRestoreRule(virBufferPtr buf, const char *templ)
+{
+    virBuffer comment = VIR_BUFFER_INITIALIZER;
+    virBuffer rule = VIR_BUFFER_INITIALIZER;
+    const char *commentref = "\"$" COMMENT_VARNAME "\"";
+    bool haveComment = false;
+    const char *args, *end, *p;
+    char *content;
+
+    if ((p = STRSKIP(templ, COMMENT_VARNAME "='"))) {
+        /* undo the quoting applied by printCommentVar */
+        while (*p && !(p[0] == '\'' && p[1] == '\n')) {
+            char c = *p++;
+
+            if (c == '\'' && STRPREFIX(p, "\\''")) {
+                p += 3;
+            } else if (c == '\'') {
+                goto unsupported;
+            }
+            if (c == '"' || c == '\\' || c == '\n')
+                goto unsupported;
+            virBufferAddChar(&comment, c);
+        }
+        if (!*p)
+            goto unsupported;
+        templ = p + 2;
+        haveComment = true;
+    }
+
+    if (!(args = STRSKIP(templ, CMD_DEF_PRE "$IPT -%c ")) ||
+        !(end = strchr(args, '\'')))
+        goto unsupported;
+
+    virBufferAddLit(&rule, "-A ");
+    for (p = args; p < end; p++) {
+        if (STRPREFIX(p, "%s")) {
+            /* no position: append */
+            p++;
+        } else if (STRPREFIX(p, commentref)) {
+            if (!haveComment)
+                goto unsupported;
+            content = virBufferContentAndReset(&comment);
+            virBufferAsprintf(&rule, "\"%s\"", content ? content : "");
+            VIR_FREE(content);
+            p += strlen(commentref) - 1;
+        } else if (strchr("$`\\'\"%\n", *p)) {
+            goto unsupported;
+        } else {
+            virBufferAddChar(&rule, *p);
+        }
+    }
+    virBufferAddChar(&rule, '\n');
+
+    if (virBufferError(&rule) || virBufferError(&comment)) {
+        virReportOOMError();
+        goto unsupported;
+    }
+
+    content = virBufferContentAndReset(&rule);
+    virBufferAdd(buf, content, -1);
+    VIR_FREE(content);
+    virBufferFreeAndReset(&comment);
+    return 0;
+
+unsupported:
+    virBufferFreeAndReset(&comment);
+    virBufferFreeAndReset(&rule);
+    return -1;
+}
+
+
 static int
 iptablesHandleSrcMacAddr(virBufferPtr buf,
                          virNWFilterVarCombIterPtr vars,
@@ -2749,6 +2892,22 @@ ebiptablesDisplayRuleInstance(void *_inst)
 }
 
 
+static int
+ebiptablesFormatRuleInstance(virBufferPtr buf, void *_inst)
+{
+    ebiptablesRuleInstPtr inst = (ebiptablesRuleInstPtr)_inst;
+
+    virBufferAsprintf(buf, "%d %c %d %d %s\n%s\n",
+                      inst->ruleType,
+                      inst->chainprefix,
+                      inst->chainPriority,
+                      inst->priority,
+                      NULLSTR(inst->neededProtocolChain),
+                      inst->commandTemplate);
+    return 0;
+}
+
+
 /**
  * ebiptablesExecCLI:
  * @buf : pointer to virBuffer containing the string with the commands to
@@ -2801,6 +2960,134 @@ ebiptablesExecCLI(virBufferPtr buf,
 }
 
 
+/**
+ * ebiptablesExecRestore:
+ * @restore_cmd_path : path of iptables-restore or ip6tables-restore
+ * @buf : pointer to virBuffer containing the input for the tool
+ * @outbuf : optional pointer to a string that will hold the output
+ *           of the tool in case of failure
+ *
+ * Apply a batch of rules in a single invocation of an iptables-restore
+ * style tool, without flushing the tables it touches. The batch is
+ * committed atomically by the tool.
+ *
+ * Returns 0 in case of success, < 0 in case of an error, including
+ * the tool exiting with a non-zero status.
+ */
+static int
+ebiptablesExecRestore(const char *restore_cmd_path,
+                      virBufferPtr buf,
+                      char **outbuf)
+{
+    int rc = -1;
+    int status;
+    char *input = NULL;
+    virCommandPtr cmd;
+
+    if (virBufferError(buf)) {
+        virReportOOMError();
+        virBufferFreeAndReset(buf);
+        return -1;
+    }
+
+    input = virBufferContentAndReset(buf);
+
+    if (outbuf)
+        VIR_FREE(*outbuf);
+
+    cmd = virCommandNewArgList(restore_cmd_path, "--noflush", NULL);
+    virCommandSetInputBuffer(cmd, input);
+    if (outbuf)
+        virCommandSetErrorBuffer(cmd, outbuf);
+
+    virMutexLock(&execCLIMutex);
+
+    if (virCommandRun(cmd, &status) == 0) {
+        if (status == 0)
+            rc = 0;
+        else
+            virReportError(VIR_ERR_BUILD_FIREWALL,
+                           _("%s exited with status %d"),
+                           restore_cmd_path, status);
+    }
+
+    virMutexUnlock(&execCLIMutex);
+
+    virCommandFree(cmd);
+    VIR_FREE(input);
+
+    return rc;
+}
+
+
+/*
+ * iptablesInstRules:
+ * @ifname : name of the interface
+ * @nruleInstances : the number of rules in @inst
+ * @inst : the sorted rules of an interface
+ * @isIPv6 : whether to instantiate the ip6tables or the iptables rules
+ * @errmsg : pointer to a string that will hold an error message, if any
+ *
+ * Create the temporary root chains of @ifname, link them from the
+ * base chains and append all iptables (or ip6tables) rules in @inst
+ * to their chains. If the matching restore tool is usable all of this
+ * is done with a single transaction on the filter table, rather than
+ * with one process for each chain, link and rule. The base chains
+ * must already exist.
+ */
+static int
+iptablesInstRules(const char *ifname,
+                  int nruleInstances,
+                  ebiptablesRuleInstPtr *inst,
+                  bool isIPv6,
+                  char **errmsg)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    enum RuleType ruleType = isIPv6 ? RT_IP6TABLES : RT_IPTABLES;
+    const char *restore_cmd_path = isIPv6 ? ip6tables_restore_cmd_path
+                                          : iptables_restore_cmd_path;
+    int i;
+
+    if (restore_cmd_path) {
+        virBufferAddLit(&buf, "*filter\n");
+        iptablesRestoreTmpRootChains(&buf, ifname);
+        for (i = 0; i < nruleInstances; i++) {
+            if (inst[i]->ruleType != ruleType)
+                continue;
+            if (iptablesRestoreRule(&buf, inst[i]->commandTemplate) < 0) {
+                VIR_DEBUG("Cannot batch rule '%s'",
+                          inst[i]->commandTemplate);
+                virBufferFreeAndReset(&buf);
+                break;
+            }
+        }
+
+        if (i == nruleInstances) {
+            virBufferAddLit(&buf, "COMMIT\n");
+            return ebiptablesExecRestore(restore_cmd_path, &buf, errmsg);
+        }
+    }
+
+    if (isIPv6) {
+        NWFILTER_SET_IP6TABLES_SHELLVAR(&buf);
+    } else {
+        NWFILTER_SET_IPTABLES_SHELLVAR(&buf);
+    }
+
+    iptablesCreateTmpRootChains(&buf, ifname);
+    iptablesLinkTmpRootChains(&buf, ifname);
+
+    for (i = 0; i < nruleInstances; i++) {
+        if (inst[i]->ruleType == ruleType)
+            iptablesInstCommand(&buf,
+                                inst[i]->commandTemplate,
+                                'A', -1, 1);
+    }
+
+    return ebiptablesExecCLI(&buf, NULL, errmsg);
+}
+
+
 static int
 ebtablesCreateTmpRootChain(virBufferPtr buf,
                            int incoming, const char *ifname,
@@ -3671,10 +3958,13 @@ ebiptablesApplyNewRules(const char *ifname,
     ebiptablesRuleInstPtr ebtChains = NULL;
     int nEbtChains = 0;
     char *errmsg = NULL;
+    unsigned long long then = 0, now = 0;
 
     if (inst == NULL)
         nruleInstances = 0;
 
+    ignore_value(virTimeMillisNow(&then));
+
     if (!chains_in_set || !chains_out_set) {
         virReportOOMError();
         goto exit_free_sets;
@@ -3780,35 +4070,14 @@ ebiptablesApplyNewRules(const char *ifname,
         iptablesRemoveTmpRootChains(&buf, ifname);
 
         iptablesCreateBaseChains(&buf);
+        iptablesSetupVirtInPost(&buf, ifname);
 
         if (ebiptablesExecCLI(&buf, NULL, &errmsg) < 0)
             goto tear_down_tmpebchains;
 
-        NWFILTER_SET_IPTABLES_SHELLVAR(&buf);
-
-        iptablesCreateTmpRootChains(&buf, ifname);
-
-        if (ebiptablesExecCLI(&buf, NULL, &errmsg) < 0)
-           goto tear_down_tmpiptchains;
-
-        NWFILTER_SET_IPTABLES_SHELLVAR(&buf);
-
-        iptablesLinkTmpRootChains(&buf, ifname);
-        iptablesSetupVirtInPost(&buf, ifname);
-        if (ebiptablesExecCLI(&buf, NULL, &errmsg) < 0)
-           goto tear_down_tmpiptchains;
-
-        NWFILTER_SET_IPTABLES_SHELLVAR(&buf);
-
-        for (i = 0; i < nruleInstances; i++) {
-            sa_assert (inst);
-            if (inst[i]->ruleType == RT_IPTABLES)
-                iptablesInstCommand(&buf,
-                                    inst[i]->commandTemplate,
-                                    'A', -1, 1);
-        }
-
-        if (ebiptablesExecCLI(&buf, NULL, &errmsg) < 0)
+        sa_assert (inst);
+        if (iptablesInstRules(ifname, nruleInstances, inst,
+                              false, &errmsg) < 0)
            goto tear_down_tmpiptchains;
 
         iptablesCheckBridgeNFCallEnabled(false);
@@ -3821,34 +4090,13 @@ ebiptablesApplyNewRules(const char *ifname,
         iptablesRemoveTmpRootChains(&buf, ifname);
 
         iptablesCreateBaseChains(&buf);
+        iptablesSetupVirtInPost(&buf, ifname);
 
         if (ebiptablesExecCLI(&buf, NULL, &errmsg) < 0)
             goto tear_down_tmpiptchains;
 
-        NWFILTER_SET_IP6TABLES_SHELLVAR(&buf);
-
-        iptablesCreateTmpRootChains(&buf, ifname);
-
-        if (ebiptablesExecCLI(&buf, NULL, &errmsg) < 0)
-           goto tear_down_tmpip6tchains;
-
-        NWFILTER_SET_IP6TABLES_SHELLVAR(&buf);
-
-        iptablesLinkTmpRootChains(&buf, ifname);
-        iptablesSetupVirtInPost(&buf, ifname);
-        if (ebiptablesExecCLI(&buf, NULL, &errmsg) < 0)
-           goto tear_down_tmpip6tchains;
-
-        NWFILTER_SET_IP6TABLES_SHELLVAR(&buf);
-
-        for (i = 0; i < nruleInstances; i++) {
-            if (inst[i]->ruleType == RT_IP6TABLES)
-                iptablesInstCommand(&buf,
-                                    inst[i]->commandTemplate,
-                                    'A', -1, 1);
-        }
-
-        if (ebiptablesExecCLI(&buf, NULL, &errmsg) < 0)
+        if (iptablesInstRules(ifname, nruleInstances, inst,
+                              true, &errmsg) < 0)
            goto tear_down_tmpip6tchains;
 
         iptablesCheckBridgeNFCallEnabled(true);
@@ -3864,6 +4112,10 @@ ebiptablesApplyNewRules(const char *ifname,
     if (ebiptablesExecCLI(&buf, NULL, &errmsg) < 0)
         goto tear_down_ebsubchains_and_unlink;
 
+    if (virTimeMillisNow(&now) == 0)
+        VIR_DEBUG("Instantiated %d rules on interface %s in %llu ms",
+                  nruleInstances, ifname, now - then);
+
     virHashFree(chains_in_set);
     virHashFree(chains_out_set);
 
@@ -4123,6 +4375,7 @@ virNWFilterTechDriver ebiptables_driver = {
     .removeRules         = ebiptablesRemoveRules,
     .freeRuleInstance    = ebiptablesFreeRuleInstance,
     .displayRuleInstance = ebiptablesDisplayRuleInstance,
+    .formatRuleInstance  = ebiptablesFormatRuleInstance,
 
     .canApplyBasicRules  = ebiptablesCanApplyBasicRules,
     .applyBasicRules     = ebtablesApplyBasicRules,
@@ -4210,6 +4463,12 @@ ebiptablesDriverInitCLITools(void)
     if (!ip6tables_cmd_path)
         VIR_WARN("Could not find 'ip6tables' executable");
 
+    /* optional; rules are applied one by one if these are missing */
+    if (iptables_cmd_path)
+        iptables_restore_cmd_path = virFindFileInPath("iptables-restore");
+    if (ip6tables_cmd_path)
+        ip6tables_restore_cmd_path = virFindFileInPath("ip6tables-restore");
+
     return 0;
 }
 
@@ -4277,6 +4536,26 @@ ebiptablesDriverTestCLITools(void)
         }
     }
 
+    if (iptables_restore_cmd_path) {
+        virBufferAddLit(&buf, "*filter\nCOMMIT\n");
+        if (ebiptablesExecRestore(iptables_restore_cmd_path,
+                                  &buf, &errmsg) < 0) {
+            VIR_FREE(iptables_restore_cmd_path);
+            VIR_WARN("Testing of iptables-restore command failed: %s",
+                     NULLSTR(errmsg));
+        }
+    }
+
+    if (ip6tables_restore_cmd_path) {
+        virBufferAddLit(&buf, "*filter\nCOMMIT\n");
+        if (ebiptablesExecRestore(ip6tables_restore_cmd_path,
+                                  &buf, &errmsg) < 0) {
+            VIR_FREE(ip6tables_restore_cmd_path);
+            VIR_WARN("Testing of ip6tables-restore command failed: %s",
+                     NULLSTR(errmsg));
+        }
+    }
+
     VIR_FREE(errmsg);
 
     return ret;
@@ -4311,6 +4590,8 @@ ebiptablesDriverInit(bool privileged)
                   "firewalls could not be located"));
         VIR_FREE(iptables_cmd_path);
         VIR_FREE(ip6tables_cmd_path);
+        VIR_FREE(iptables_restore_cmd_path);
+        VIR_FREE(ip6tables_restore_cmd_path);
     }
 
     if (!ebtables_cmd_path && !iptables_cmd_path && !ip6tables_cmd_path) {
@@ -4332,5 +4613,7 @@ ebiptablesDriverShutdown(void)
     VIR_FREE(ebtables_cmd_path);
     VIR_FREE(iptables_cmd_path);
     VIR_FREE(ip6tables_cmd_path);
+    VIR_FREE(iptables_restore_cmd_path);
+    VIR_FREE(ip6tables_restore_cmd_path);
     ebiptables_driver.flags = 0;
 }
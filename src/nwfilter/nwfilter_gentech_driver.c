@@ -37,6 +37,9 @@
 #include "nwfilter_learnipaddr.h"
 #include "virnetdev.h"
 #include "datatypes.h"
+#include "threads.h"
+#include "threadpool.h"
+#include "md5.h"
 
 #define VIR_FROM_THIS VIR_FROM_NWFILTER
 
@@ -46,6 +49,9 @@
 
 #define NWFILTER_DFLT_LEARN  "any"
 
+/* upper bound of threads instantiating filters of all domains at once */
+#define NWFILTER_INST_MAX_WORKERS 4
+
 static int _virNWFilterTeardownFilter(const char *ifname);
 
 
@@ -55,8 +61,182 @@ static virNWFilterTechDriverPtr filter_tech_drivers[] = {
 };
 
 
+/*
+ * Digests of the expanded rules that are active on each interface,
+ * indexed by interface name. When a filter is redefined, interfaces
+ * whose rules expand to the same digest as before are left alone.
+ * A digest computed while an update is in progress only becomes the
+ * active one once the old rules of the interface have been torn down.
+ */
+typedef struct _virNWFilterIfaceRules virNWFilterIfaceRules;
+typedef virNWFilterIfaceRules *virNWFilterIfaceRulesPtr;
+struct _virNWFilterIfaceRules {
+    bool haveCurrent;
+    bool havePending;
+    unsigned char current[MD5_DIGEST_SIZE];
+    unsigned char pending[MD5_DIGEST_SIZE];
+};
+
+static virHashTablePtr ifaceRules;
+static virMutex ifaceRulesLock;
+
+
+static void
+virNWFilterIfaceRulesFree(void *payload, const void *name ATTRIBUTE_UNUSED)
+{
+    VIR_FREE(payload);
+}
+
+
+/*
+ * Compute the digest of the instantiated rules of an interface.
+ *
+ * Returns 0 on success, -1 if the tech driver cannot format its rule
+ * instances or on failure.
+ */
+static int
+virNWFilterRuleInstancesDigest(virNWFilterTechDriverPtr techdriver,
+                               int nEntries,
+                               virNWFilterRuleInstPtr *insts,
+                               unsigned char *digest)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    char *content;
+    int i, j;
+
+    if (!techdriver->formatRuleInstance)
+        return -1;
+
+    for (j = 0; j < nEntries; j++)
+        for (i = 0; i < insts[j]->ndata; i++)
+            if (techdriver->formatRuleInstance(&buf, insts[j]->data[i]) < 0)
+                goto error;
+
+    if (virBufferError(&buf))
+        goto error;
+
+    content = virBufferContentAndReset(&buf);
+    md5_buffer(content ? content : "", content ? strlen(content) : 0, digest);
+    VIR_FREE(content);
+
+    return 0;
+
+error:
+    virBufferFreeAndReset(&buf);
+    return -1;
+}
+
+
+/*
+ * Check whether the rules active on @ifname match @digest.
+ */
+static bool
+virNWFilterIfaceRulesUnchanged(const char *ifname,
+                               const unsigned char *digest)
+{
+    virNWFilterIfaceRulesPtr entry;
+    bool ret = false;
+
+    if (!ifaceRules)
+        return false;
+
+    virMutexLock(&ifaceRulesLock);
+    if ((entry = virHashLookup(ifaceRules, ifname)) &&
+        entry->haveCurrent &&
+        memcmp(entry->current, digest, MD5_DIGEST_SIZE) == 0)
+        ret = true;
+    virMutexUnlock(&ifaceRulesLock);
+
+    return ret;
+}
+
+
+/*
+ * Record @digest as the rules of @ifname; if @pending, they only become
+ * active with virNWFilterIfaceRulesCommit.
+ */
+static void
+virNWFilterIfaceRulesSet(const char *ifname,
+                         const unsigned char *digest,
+                         bool pending)
+{
+    virNWFilterIfaceRulesPtr entry;
+
+    if (!ifaceRules)
+        return;
+
+    virMutexLock(&ifaceRulesLock);
+
+    if (!(entry = virHashLookup(ifaceRules, ifname))) {
+        if (VIR_ALLOC(entry) < 0 ||
+            virHashAddEntry(ifaceRules, ifname, entry) < 0) {
+            /* not fatal; the interface will always be updated */
+            VIR_FREE(entry);
+            virResetLastError();
+            goto cleanup;
+        }
+    }
+
+    if (pending) {
+        memcpy(entry->pending, digest, MD5_DIGEST_SIZE);
+        entry->havePending = true;
+    } else {
+        memcpy(entry->current, digest, MD5_DIGEST_SIZE);
+        entry->haveCurrent = true;
+        entry->havePending = false;
+    }
+
+cleanup:
+    virMutexUnlock(&ifaceRulesLock);
+}
+
+
+/*
+ * Make the pending rules of @ifname the active ones (@commit) or drop
+ * them in case the update is rolled back.
+ */
+static void
+virNWFilterIfaceRulesCommit(const char *ifname, bool commit)
+{
+    virNWFilterIfaceRulesPtr entry;
+
+    if (!ifaceRules)
+        return;
+
+    virMutexLock(&ifaceRulesLock);
+    if ((entry = virHashLookup(ifaceRules, ifname)) && entry->havePending) {
+        if (commit) {
+            memcpy(entry->current, entry->pending, MD5_DIGEST_SIZE);
+            entry->haveCurrent = true;
+        }
+        entry->havePending = false;
+    }
+    virMutexUnlock(&ifaceRulesLock);
+}
+
+
+static void
+virNWFilterIfaceRulesForget(const char *ifname)
+{
+    if (!ifaceRules)
+        return;
+
+    virMutexLock(&ifaceRulesLock);
+    virHashRemoveEntry(ifaceRules, ifname);
+    virMutexUnlock(&ifaceRulesLock);
+}
+
+
 void virNWFilterTechDriversInit(bool privileged) {
     int i = 0;
+
+    if (!ifaceRules && virMutexInit(&ifaceRulesLock) == 0) {
+        if (!(ifaceRules = virHashCreate(0, virNWFilterIfaceRulesFree))) {
+            virResetLastError();
+            virMutexDestroy(&ifaceRulesLock);
+        }
+    }
+
     VIR_DEBUG("Initializing NWFilter technology drivers");
     while (filter_tech_drivers[i]) {
         if (!(filter_tech_drivers[i]->flags & TECHDRV_FLAG_INITIALIZED))
@@ -73,6 +253,12 @@ void virNWFilterTechDriversShutdown(void) {
             filter_tech_drivers[i]->shutdown();
         i++;
     }
+
+    if (ifaceRules) {
+        virHashFree(ifaceRules);
+        ifaceRules = NULL;
+        virMutexDestroy(&ifaceRulesLock);
+    }
 }
 
 
@@ -670,6 +856,8 @@ virNWFilterInstantiate(const unsigned char *vmuuid ATTRIBUTE_UNUSED,
     virNWFilterVarValuePtr lv;
     const char *learning;
     bool reportIP = false;
+    unsigned char digest[MD5_DIGEST_SIZE];
+    bool haveDigest = false;
 
     virNWFilterHashTablePtr missing_vars = virNWFilterHashTableCreate(0);
     if (!missing_vars) {
@@ -756,6 +944,20 @@ virNWFilterInstantiate(const unsigned char *vmuuid ATTRIBUTE_UNUSED,
     break;
     }
 
+    if (instantiate) {
+        haveDigest = virNWFilterRuleInstancesDigest(techdriver,
+                                                    nEntries, insts,
+                                                    digest) == 0;
+
+        /* a referenced filter changed, but not the rules it expands to */
+        if (useNewFilter == INSTANTIATE_FOLLOW_NEWFILTER && haveDigest &&
+            virNWFilterIfaceRulesUnchanged(ifname, digest)) {
+            VIR_DEBUG("Rules of interface %s are unchanged", ifname);
+            *foundNewFilter = false;
+            instantiate = 0;
+        }
+    }
+
     if (instantiate) {
 
         rc = virNWFilterRuleInstancesToArray(nEntries, insts,
@@ -766,6 +968,15 @@ virNWFilterInstantiate(const unsigned char *vmuuid ATTRIBUTE_UNUSED,
         if (virNWFilterLockIface(ifname) < 0)
             goto err_exit;
 
+        /* the interface may have been replaced by another one of the
+           same name since we looked it up; its filter is instantiated
+           for the new interface, not by us */
+        if (virNetDevValidateConfig(ifname, NULL, ifindex) <= 0) {
+            virResetLastError();
+            virNWFilterUnlockIface(ifname);
+            goto err_exit;
+        }
+
         rc = techdriver->applyNewRules(ifname, nptrs, ptrs);
 
         if (teardownOld && rc == 0)
@@ -778,6 +989,11 @@ virNWFilterInstantiate(const unsigned char *vmuuid ATTRIBUTE_UNUSED,
             rc = -1;
         }
 
+        if (rc == 0 && haveDigest)
+            virNWFilterIfaceRulesSet(ifname, digest, !teardownOld);
+        else
+            virNWFilterIfaceRulesForget(ifname);
+
         virNWFilterUnlockIface(ifname);
     }
 
@@ -905,6 +1121,11 @@ __virNWFilterInstantiateFilter(const unsigned char *vmuuid,
     break;
     }
 
+    /* the filter update lock keeps the definitions from being replaced
+       or removed; don't serialize interfaces sharing this filter */
+    virNWFilterObjUnlock(obj);
+    obj = NULL;
+
     rc = virNWFilterInstantiate(vmuuid,
                                 techdriver,
                                 nettype,
@@ -925,7 +1146,8 @@ err_exit_vars1:
     virNWFilterHashTableFree(vars1);
 
 err_exit:
-    virNWFilterObjUnlock(obj);
+    if (obj)
+        virNWFilterObjUnlock(obj);
 
     VIR_FREE(str_ipaddr);
     VIR_FREE(str_macaddr);
@@ -934,6 +1156,51 @@ err_exit:
 }
 
 
+/*
+ * Call this function while holding the NWFilter filter update lock
+ */
+static int
+virNWFilterInstantiateFilterIface(virNWFilterDriverStatePtr driver,
+                                  const unsigned char *vmuuid,
+                                  const char *ifname,
+                                  const char *linkdev,
+                                  enum virDomainNetType nettype,
+                                  const virMacAddrPtr macaddr,
+                                  const char *filtername,
+                                  virNWFilterHashTablePtr filterparams,
+                                  bool teardownOld,
+                                  enum instCase useNewFilter,
+                                  bool *foundNewFilter)
+{
+    int ifindex;
+
+    /* after grabbing the filter update lock check for the interface; if
+       it's not there anymore its filters will be or are being removed
+       (while holding the lock) and we don't want to build new ones */
+    if (virNetDevExists(ifname) != 1 ||
+        virNetDevGetIndex(ifname, &ifindex) < 0) {
+        /* interfaces / VMs can disappear during filter instantiation;
+           don't mark it as an error */
+        virResetLastError();
+        return 0;
+    }
+
+    return __virNWFilterInstantiateFilter(vmuuid,
+                                          teardownOld,
+                                          ifname,
+                                          ifindex,
+                                          linkdev,
+                                          nettype,
+                                          macaddr,
+                                          filtername,
+                                          filterparams,
+                                          useNewFilter,
+                                          driver,
+                                          false,
+                                          foundNewFilter);
+}
+
+
 static int
 _virNWFilterInstantiateFilter(virConnectPtr conn,
                               const unsigned char *vmuuid,
@@ -945,41 +1212,270 @@ _virNWFilterInstantiateFilter(virConnectPtr conn,
     const char *linkdev = (net->type == VIR_DOMAIN_NET_TYPE_DIRECT)
                           ? net->data.direct.linkdev
                           : NULL;
-    int ifindex;
     int rc;
 
-    virNWFilterLockFilterUpdates();
+    virNWFilterReadLockFilterUpdates();
 
-    /* after grabbing the filter update lock check for the interface; if
-       it's not there anymore its filters will be or are being removed
-       (while holding the lock) and we don't want to build new ones */
-    if (virNetDevExists(net->ifname) != 1 ||
-        virNetDevGetIndex(net->ifname, &ifindex) < 0) {
+    rc = virNWFilterInstantiateFilterIface(conn->nwfilterPrivateData,
+                                           vmuuid,
+                                           net->ifname,
+                                           linkdev,
+                                           net->type,
+                                           &net->mac,
+                                           net->filter,
+                                           net->filterparams,
+                                           teardownOld,
+                                           useNewFilter,
+                                           foundNewFilter);
+
+    virNWFilterUnlockFilterUpdates();
+
+    return rc;
+}
+
+
+/*
+ * A batch of interfaces whose current filters are instantiated by a
+ * pool of worker threads. The interfaces are collected while their
+ * domains are locked; the workers then only take the filter update
+ * lock, like any other instantiation of a filter.
+ */
+typedef struct _virNWFilterInstBatch virNWFilterInstBatch;
+typedef virNWFilterInstBatch *virNWFilterInstBatchPtr;
+struct _virNWFilterInstBatch {
+    virThreadPoolPtr pool;
+    virMutex lock;
+    virCond cond;
+    size_t pending;
+    size_t njobs;
+};
+
+typedef struct _virNWFilterInstJob virNWFilterInstJob;
+typedef virNWFilterInstJob *virNWFilterInstJobPtr;
+struct _virNWFilterInstJob {
+    virNWFilterInstBatchPtr batch;
+    virNWFilterDriverStatePtr driver;
+    unsigned char vmuuid[VIR_UUID_BUFLEN];
+    char *vmname;
+    char *ifname;
+    int ifindex;
+    char *linkdev;
+    enum virDomainNetType nettype;
+    virMacAddr mac;
+    char *filtername;
+    virNWFilterHashTablePtr filterparams;
+};
+
+/* only accessed by the thread reloading the driver */
+static virNWFilterInstBatchPtr instBatch;
+
+
+static void
+virNWFilterInstJobFree(virNWFilterInstJobPtr job)
+{
+    if (!job)
+        return;
+
+    VIR_FREE(job->vmname);
+    VIR_FREE(job->ifname);
+    VIR_FREE(job->linkdev);
+    VIR_FREE(job->filtername);
+    virNWFilterHashTableFree(job->filterparams);
+    VIR_FREE(job);
+}
+
+
+/*
+ * The domain may have been stopped since the job was queued and its
+ * interface name handed to another domain. The new interface has a
+ * different index, so instantiating for the queued index leaves it
+ * alone.
+ */
+static void
+virNWFilterInstJobRun(void *jobdata, void *opaque ATTRIBUTE_UNUSED)
+{
+    virNWFilterInstJobPtr job = jobdata;
+    virNWFilterInstBatchPtr batch = job->batch;
+    bool foundNewFilter = false;
+
+    virNWFilterReadLockFilterUpdates();
+
+    if (__virNWFilterInstantiateFilter(job->vmuuid,
+                                       true,
+                                       job->ifname,
+                                       job->ifindex,
+                                       job->linkdev,
+                                       job->nettype,
+                                       &job->mac,
+                                       job->filtername,
+                                       job->filterparams,
+                                       INSTANTIATE_ALWAYS,
+                                       job->driver,
+                                       false,
+                                       &foundNewFilter) < 0)
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("Failure while applying current filter on "
+                         "VM %s"), job->vmname);
+
+    virNWFilterUnlockFilterUpdates();
+
+    virNWFilterInstJobFree(job);
+
+    virMutexLock(&batch->lock);
+    if (--batch->pending == 0)
+        virCondBroadcast(&batch->cond);
+    virMutexUnlock(&batch->lock);
+}
+
+
+/*
+ * Hand the instantiation of the current filter of @net over to the
+ * workers of the open batch. Call this function while holding the
+ * lock of the domain @vm.
+ *
+ * Returns 0 if the job was queued or the interface does not exist
+ * anymore, -1 if the caller has to instantiate the filter itself.
+ */
+static int
+virNWFilterInstBatchQueue(virConnectPtr conn,
+                          virDomainDefPtr vm,
+                          virDomainNetDefPtr net)
+{
+    virNWFilterInstBatchPtr batch = instBatch;
+    virNWFilterInstJobPtr job = NULL;
+
+    if (!batch)
+        return -1;
+
+    if (VIR_ALLOC(job) < 0)
+        goto no_memory;
+
+    if (virNetDevGetIndex(net->ifname, &job->ifindex) < 0) {
         /* interfaces / VMs can disappear during filter instantiation;
            don't mark it as an error */
+        virNWFilterInstJobFree(job);
         virResetLastError();
-        rc = 0;
-        goto cleanup;
+        return 0;
     }
 
-    rc = __virNWFilterInstantiateFilter(vmuuid,
-                                        teardownOld,
-                                        net->ifname,
-                                        ifindex,
-                                        linkdev,
-                                        net->type,
-                                        &net->mac,
-                                        net->filter,
-                                        net->filterparams,
-                                        useNewFilter,
-                                        conn->nwfilterPrivateData,
-                                        false,
-                                        foundNewFilter);
+    job->batch = batch;
+    job->driver = conn->nwfilterPrivateData;
+    memcpy(job->vmuuid, vm->uuid, VIR_UUID_BUFLEN);
+    job->nettype = net->type;
+    virMacAddrSet(&job->mac, &net->mac);
+
+    if (!(job->vmname = strdup(vm->name)) ||
+        !(job->ifname = strdup(net->ifname)) ||
+        !(job->filtername = strdup(net->filter)))
+        goto no_memory;
+
+    if (net->type == VIR_DOMAIN_NET_TYPE_DIRECT &&
+        net->data.direct.linkdev &&
+        !(job->linkdev = strdup(net->data.direct.linkdev)))
+        goto no_memory;
+
+    if (!(job->filterparams = virNWFilterHashTableCreate(0)))
+        goto no_memory;
+    if (net->filterparams &&
+        virNWFilterHashTablePutAll(net->filterparams,
+                                   job->filterparams) < 0)
+        goto error;
+
+    virMutexLock(&batch->lock);
+    batch->pending++;
+    virMutexUnlock(&batch->lock);
+
+    if (virThreadPoolSendJob(batch->pool, 0, job) < 0) {
+        virMutexLock(&batch->lock);
+        batch->pending--;
+        virMutexUnlock(&batch->lock);
+        goto error;
+    }
 
-cleanup:
-    virNWFilterUnlockFilterUpdates();
+    batch->njobs++;
 
-    return rc;
+    return 0;
+
+no_memory:
+    virReportOOMError();
+error:
+    virNWFilterInstJobFree(job);
+    virResetLastError();
+    return -1;
+}
+
+
+/**
+ * virNWFilterInstBatchBegin:
+ *
+ * Start instantiating the current filters of the interfaces visited
+ * by virNWFilterDomainFWUpdateCB in parallel. Rule expansion and the
+ * checks of the interfaces then overlap with the execution of the
+ * firewall tools for other interfaces; the firewall tools themselves
+ * are still run one at a time by the tech driver.
+ *
+ * Must be called without holding the filter update lock and be
+ * matched by a call to virNWFilterInstBatchEnd.
+ */
+void
+virNWFilterInstBatchBegin(void)
+{
+    virNWFilterInstBatchPtr batch;
+
+    if (instBatch || VIR_ALLOC(batch) < 0)
+        return;
+
+    if (virMutexInit(&batch->lock) < 0) {
+        VIR_FREE(batch);
+        return;
+    }
+
+    if (virCondInit(&batch->cond) < 0) {
+        virMutexDestroy(&batch->lock);
+        VIR_FREE(batch);
+        return;
+    }
+
+    if (!(batch->pool = virThreadPoolNew(0, NWFILTER_INST_MAX_WORKERS, 0,
+                                         virNWFilterInstJobRun, NULL))) {
+        /* fall back to instantiating the filters serially */
+        virResetLastError();
+        ignore_value(virCondDestroy(&batch->cond));
+        virMutexDestroy(&batch->lock);
+        VIR_FREE(batch);
+        return;
+    }
+
+    instBatch = batch;
+}
+
+
+/**
+ * virNWFilterInstBatchEnd:
+ *
+ * Wait for all jobs queued since virNWFilterInstBatchBegin to finish.
+ */
+void
+virNWFilterInstBatchEnd(void)
+{
+    virNWFilterInstBatchPtr batch = instBatch;
+
+    if (!batch)
+        return;
+
+    virMutexLock(&batch->lock);
+    while (batch->pending > 0)
+        ignore_value(virCondWait(&batch->cond, &batch->lock));
+    virMutexUnlock(&batch->lock);
+
+    VIR_DEBUG("Instantiated filters of %zu interfaces in parallel",
+              batch->njobs);
+
+    instBatch = NULL;
+    virThreadPoolFree(batch->pool);
+    ignore_value(virCondDestroy(&batch->cond));
+    virMutexDestroy(&batch->lock);
+    VIR_FREE(batch);
 }
 
 
@@ -997,7 +1493,7 @@ virNWFilterInstantiateFilterLate(const unsigned char *vmuuid,
     int rc;
     bool foundNewFilter = false;
 
-    virNWFilterLockFilterUpdates();
+    virNWFilterReadLockFilterUpdates();
 
     rc = __virNWFilterInstantiateFilter(vmuuid,
                                         true,
@@ -1081,6 +1577,8 @@ virNWFilterRollbackUpdateFilter(const virDomainNetDefPtr net)
     else if (virNWFilterLookupLearnReq(ifindex) != NULL)
         return 0;
 
+    virNWFilterIfaceRulesCommit(net->ifname, false);
+
     return techdriver->tearNewRules(net->ifname);
 }
 
@@ -1107,6 +1605,8 @@ virNWFilterTearOldFilter(virDomainNetDefPtr net)
     else if (virNWFilterLookupLearnReq(ifindex) != NULL)
         return 0;
 
+    virNWFilterIfaceRulesCommit(net->ifname, true);
+
     return techdriver->tearOldRules(net->ifname);
 }
 
@@ -1135,6 +1635,8 @@ _virNWFilterTeardownFilter(const char *ifname)
 
     techdriver->allTeardown(ifname);
 
+    virNWFilterIfaceRulesForget(ifname);
+
     virNWFilterIPAddrMapDelIPAddr(ifname, NULL);
 
     virNWFilterUnlockIface(ifname);
@@ -1194,6 +1696,8 @@ virNWFilterDomainFWUpdateCB(void *payload,
                     break;
 
                 case STEP_APPLY_CURRENT:
+                    if (virNWFilterInstBatchQueue(cb->conn, vm, net) == 0)
+                        break;
                     err = virNWFilterInstantiateFilter(cb->conn,
                                                        vm->uuid,
                                                        net);
@@ -60,6 +60,9 @@ int virNWFilterTeardownFilter(const virDomainNetDefPtr net);
 virNWFilterHashTablePtr virNWFilterCreateVarHashmap(char *macaddr,
                                        const virNWFilterVarValuePtr);
 
+void virNWFilterInstBatchBegin(void);
+void virNWFilterInstBatchEnd(void);
+
 void virNWFilterDomainFWUpdateCB(void *payload,
                                  const void *name,
                                  void *data);
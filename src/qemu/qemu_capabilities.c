@@ -200,6 +200,7 @@ VIR_ENUM_IMPL(qemuCaps, QEMU_CAPS_LAST,
               "ipv6-migration",
               "vnc-share-policy",
               "mlock",
+              "nbd-server",
     );
 
 struct _qemuCaps {
@@ -1928,6 +1929,8 @@ qemuCapsProbeQMPCommands(qemuCapsPtr caps,
             qemuCapsSet(caps, QEMU_CAPS_DRIVE_MIRROR);
         else if (STREQ(name, "blockdev-snapshot-sync"))
             qemuCapsSet(caps, QEMU_CAPS_DISK_SNAPSHOT);
+        else if (STREQ(name, "nbd-server-start"))
+            qemuCapsSet(caps, QEMU_CAPS_NBD_SERVER);
         VIR_FREE(name);
     }
     VIR_FREE(commands);
@@ -57,6 +57,12 @@
 
 #define VIR_FROM_THIS VIR_FROM_QEMU
 
+VIR_ENUM_IMPL(qemuMigrationConverge, QEMU_MIGRATION_CONVERGE_LAST,
+              "none",
+              "downtime",
+              "throttle",
+              "auto")
+
 struct _qemuDriverCloseDef {
     virConnectPtr conn;
     qemuDriverCloseCallback cb;
@@ -131,6 +137,11 @@ int qemudLoadDriverConfig(struct qemud_driver *driver,
     driver->keepAliveCount = 5;
     driver->seccompSandbox = -1;
 
+    driver->migrationConvergePolicy = QEMU_MIGRATION_CONVERGE_NONE;
+    driver->migrationConvergeIterations = 3;
+    driver->migrationConvergeMaxDowntime = 1000;
+    driver->migrationConvergeMaxThrottle = 50;
+
     /* Just check the file is readable before opening it, otherwise
      * libvirt emits an error.
      */
@@ -463,6 +474,10 @@ int qemudLoadDriverConfig(struct qemud_driver *driver,
         }
     }
 
+    p = virConfGetValue(conf, "save_image_threads");
+    CHECK_TYPE("save_image_threads", VIR_CONF_LONG);
+    if (p) driver->saveImageThreads = p->l;
+
     p = virConfGetValue (conf, "auto_dump_path");
     CHECK_TYPE ("auto_dump_path", VIR_CONF_STRING);
     if (p && p->str) {
@@ -575,6 +590,67 @@ int qemudLoadDriverConfig(struct qemud_driver *driver,
     CHECK_TYPE("seccomp_sandbox", VIR_CONF_LONG);
     if (p) driver->seccompSandbox = p->l;
 
+    p = virConfGetValue(conf, "migration_converge_policy");
+    CHECK_TYPE("migration_converge_policy", VIR_CONF_STRING);
+    if (p && p->str) {
+        int policy = qemuMigrationConvergeTypeFromString(p->str);
+        if (policy < 0) {
+            virReportError(VIR_ERR_CONF_SYNTAX,
+                           _("%s: unknown migration_converge_policy '%s'"),
+                           filename, p->str);
+            virConfFree(conf);
+            return -1;
+        }
+        driver->migrationConvergePolicy = policy;
+    }
+
+    p = virConfGetValue(conf, "migration_converge_iterations");
+    CHECK_TYPE("migration_converge_iterations", VIR_CONF_LONG);
+    if (p) driver->migrationConvergeIterations = p->l;
+
+    p = virConfGetValue(conf, "migration_converge_max_downtime");
+    CHECK_TYPE("migration_converge_max_downtime", VIR_CONF_LONG);
+    if (p) driver->migrationConvergeMaxDowntime = p->l;
+
+    p = virConfGetValue(conf, "migration_converge_max_throttle");
+    CHECK_TYPE("migration_converge_max_throttle", VIR_CONF_LONG);
+    if (p) {
+        if (p->l < 0 || p->l > 99) {
+            virReportError(VIR_ERR_CONF_SYNTAX,
+                           _("%s: migration_converge_max_throttle must be "
+                             "between 0 and 99"), filename);
+            virConfFree(conf);
+            return -1;
+        }
+        driver->migrationConvergeMaxThrottle = p->l;
+    }
+
+    p = virConfGetValue(conf, "migration_max_concurrent");
+    CHECK_TYPE("migration_max_concurrent", VIR_CONF_LONG);
+    if (p) {
+        if (p->l < 0) {
+            virReportError(VIR_ERR_CONF_SYNTAX,
+                           _("%s: migration_max_concurrent must not be "
+                             "negative"), filename);
+            virConfFree(conf);
+            return -1;
+        }
+        driver->migrationMaxConcurrent = p->l;
+    }
+
+    p = virConfGetValue(conf, "migration_bandwidth");
+    CHECK_TYPE("migration_bandwidth", VIR_CONF_LONG);
+    if (p) {
+        if (p->l < 0) {
+            virReportError(VIR_ERR_CONF_SYNTAX,
+                           _("%s: migration_bandwidth must not be "
+                             "negative"), filename);
+            virConfFree(conf);
+            return -1;
+        }
+        driver->migrationBandwidth = p->l;
+    }
+
     virConfFree (conf);
     return 0;
 }
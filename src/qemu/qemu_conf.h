@@ -50,6 +50,18 @@
 typedef struct _qemuDriverCloseDef qemuDriverCloseDef;
 typedef qemuDriverCloseDef *qemuDriverCloseDefPtr;
 
+/* What to do when a live migration does not converge */
+enum qemuMigrationConvergePolicy {
+    QEMU_MIGRATION_CONVERGE_NONE = 0,   /* Only use settings from the user */
+    QEMU_MIGRATION_CONVERGE_DOWNTIME,   /* Raise maximum downtime */
+    QEMU_MIGRATION_CONVERGE_THROTTLE,   /* Throttle guest vCPUs */
+    QEMU_MIGRATION_CONVERGE_AUTO,       /* Pick whichever works best */
+
+    QEMU_MIGRATION_CONVERGE_LAST
+};
+
+VIR_ENUM_DECL(qemuMigrationConverge)
+
 /* Main driver state */
 struct qemud_driver {
     virMutex lock;
@@ -128,6 +140,7 @@ struct qemud_driver {
 
     char *saveImageFormat;
     char *dumpImageFormat;
+    unsigned int saveImageThreads;
 
     char *autoDumpPath;
     bool autoDumpBypassCache;
@@ -143,6 +156,7 @@ struct qemud_driver {
     virHashTablePtr sharedDisks;
 
     virBitmapPtr reservedRemotePorts;
+    virBitmapPtr reservedNBDPorts;
 
     virSysinfoDefPtr hostsysinfo;
 
@@ -158,6 +172,21 @@ struct qemud_driver {
     int keepAliveInterval;
     unsigned int keepAliveCount;
     int seccompSandbox;
+
+    int migrationConvergePolicy;
+    unsigned int migrationConvergeIterations;
+    unsigned long long migrationConvergeMaxDowntime;
+    unsigned int migrationConvergeMaxThrottle;
+
+    unsigned int migrationMaxConcurrent;
+    unsigned long migrationBandwidth;
+    /* Outgoing migrations sharing the limits above, protected by the
+     * driver lock: those running and those waiting for their turn */
+    virCond migrationCond;
+    virDomainObjPtr *migrations;
+    size_t nmigrations;
+    virDomainObjPtr *migrationsQueued;
+    size_t nmigrationsQueued;
 };
 
 typedef struct _qemuDomainCmdlineDef qemuDomainCmdlineDef;
@@ -175,6 +204,11 @@ struct _qemuDomainCmdlineDef {
 # define QEMUD_MIGRATION_FIRST_PORT 49152
 # define QEMUD_MIGRATION_NUM_PORTS 64
 
+/* Port numbers used by NBD servers exporting disks of incoming migrations */
+# define QEMUD_MIGRATION_NBD_FIRST_PORT \
+    (QEMUD_MIGRATION_FIRST_PORT + QEMUD_MIGRATION_NUM_PORTS)
+# define QEMUD_MIGRATION_NBD_NUM_PORTS 64
+
 
 void qemuDriverLock(struct qemud_driver *driver);
 void qemuDriverUnlock(struct qemud_driver *driver);
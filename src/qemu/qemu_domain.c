@@ -37,6 +37,7 @@
 #include "domain_event.h"
 #include "virtime.h"
 #include "storage_file.h"
+#include "virtypedparam.h"
 
 #include <sys/time.h>
 #include <fcntl.h>
@@ -137,6 +138,12 @@ qemuDomainObjInitJob(qemuDomainObjPrivatePtr priv)
         return -1;
     }
 
+    if (virCondInit(&priv->job.progressCond) < 0) {
+        ignore_value(virCondDestroy(&priv->job.cond));
+        ignore_value(virCondDestroy(&priv->job.asyncCond));
+        return -1;
+    }
+
     return 0;
 }
 
@@ -153,6 +160,7 @@ static void
 qemuDomainObjResetAsyncJob(qemuDomainObjPrivatePtr priv)
 {
     struct qemuDomainJobObj *job = &priv->job;
+    size_t i;
 
     job->asyncJob = QEMU_ASYNC_JOB_NONE;
     job->asyncOwner = 0;
@@ -160,8 +168,21 @@ qemuDomainObjResetAsyncJob(qemuDomainObjPrivatePtr priv)
     job->mask = DEFAULT_JOB_MASK;
     job->start = 0;
     job->dump_memory_only = false;
+    job->dump = NULL;
     job->asyncAbort = false;
     memset(&job->info, 0, sizeof(job->info));
+    memset(&job->progress, 0, sizeof(job->progress));
+    memset(&job->converge, 0, sizeof(job->converge));
+    memset(&job->phases, 0, sizeof(job->phases));
+    for (i = 0 ; i < job->nmirrors ; i++) {
+        VIR_FREE(job->mirrors[i].disk);
+        VIR_FREE(job->mirrors[i].device);
+    }
+    VIR_FREE(job->mirrors);
+    job->nmirrors = 0;
+    job->mirrorStart = 0;
+    job->mirrorEnd = 0;
+    memset(&job->slot, 0, sizeof(job->slot));
 }
 
 void
@@ -196,6 +217,8 @@ qemuDomainObjFreeJob(qemuDomainObjPrivatePtr priv)
 {
     ignore_value(virCondDestroy(&priv->job.cond));
     ignore_value(virCondDestroy(&priv->job.asyncCond));
+    ignore_value(virCondDestroy(&priv->job.progressCond));
+    qemuDomainObjResetAsyncJob(priv);
 }
 
 static bool
@@ -239,6 +262,8 @@ static void qemuDomainObjPrivateFree(void *data)
     VIR_FREE(priv->vcpupids);
     VIR_FREE(priv->lockState);
     VIR_FREE(priv->origname);
+    virTypedParameterArrayClear(priv->completed, priv->ncompleted);
+    VIR_FREE(priv->completed);
 
     virConsoleFree(priv->cons);
 
@@ -326,6 +351,16 @@ static int qemuDomainObjPrivateXMLFormat(virBufferPtr buf, void *data)
     if (priv->fakeReboot)
         virBufferAsprintf(buf, "  <fakereboot/>\n");
 
+    if (priv->migMaxDowntime || priv->migThrottle) {
+        virBufferAddLit(buf, "  <migration");
+        if (priv->migMaxDowntime)
+            virBufferAsprintf(buf, " maxDowntime='%llu'",
+                              priv->migMaxDowntime);
+        if (priv->migThrottle)
+            virBufferAsprintf(buf, " throttle='%u'", priv->migThrottle);
+        virBufferAddLit(buf, "/>\n");
+    }
+
     return 0;
 }
 
@@ -471,6 +506,19 @@ static int qemuDomainObjPrivateXMLParse(xmlXPathContextPtr ctxt, void *data)
 
     priv->fakeReboot = virXPathBoolean("boolean(./fakereboot)", ctxt) == 1;
 
+    if (virXPathULongLong("string(./migration[1]/@maxDowntime)", ctxt,
+                          &priv->migMaxDowntime) == -2) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("invalid migration maximum downtime"));
+        goto error;
+    }
+    if (virXPathUInt("string(./migration[1]/@throttle)", ctxt,
+                     &priv->migThrottle) == -2) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("invalid migration vCPU throttle"));
+        goto error;
+    }
+
     return 0;
 
 error:
@@ -738,6 +786,281 @@ qemuDomainObjReleaseAsyncJob(virDomainObjPtr obj)
     priv->job.asyncOwner = 0;
 }
 
+/*
+ * obj must be locked before calling
+ *
+ * Wakes up the thread waiting for an async job to progress so that it
+ * checks the job status right away instead of at its next poll.
+ */
+void
+qemuDomainObjSignalJobProgress(virDomainObjPtr obj)
+{
+    qemuDomainObjPrivatePtr priv = obj->privateData;
+
+    if (!priv->job.asyncJob)
+        return;
+
+    priv->job.progressEvents++;
+    virCondBroadcast(&priv->job.progressCond);
+}
+
+/*
+ * Derives transfer and dirtying rates from a new sample of migration
+ * status taken @now ms after the job started.
+ *
+ * QEMU recomputes the remaining amount of memory from the dirty bitmap
+ * only when it starts a new pass over guest memory; within a pass the
+ * remaining amount just shrinks as memory is sent.  A remaining amount
+ * larger than in the previous sample therefore means a new pass started,
+ * and whatever was not sent during the pass it ended, but is remaining
+ * now, was dirtied by the guest during that pass.  The dirtying rate is
+ * computed over the whole pass rather than over the last interval
+ * between two samples.
+ */
+void
+qemuDomainJobProgressUpdate(qemuDomainJobProgressPtr progress,
+                            unsigned long long now,
+                            unsigned long long processed,
+                            unsigned long long remaining)
+{
+    if (!progress->iteration) {
+        progress->iteration = 1;
+        progress->passStart = now;
+        progress->passProcessed = processed;
+        progress->passRemaining = remaining;
+    } else if (now > progress->sampled &&
+               processed >= progress->processed) {
+        unsigned long long bps;
+
+        bps = (processed - progress->processed) * 1000 /
+              (now - progress->sampled);
+
+        /* Smooth out the noise coming from short sampling intervals */
+        progress->bps = progress->bps ? (progress->bps + bps) / 2 : bps;
+
+        if (remaining > progress->remaining &&
+            now > progress->passStart &&
+            processed >= progress->passProcessed) {
+            unsigned long long sent = processed - progress->passProcessed;
+            unsigned long long left = 0;
+            unsigned long long dirtied = 0;
+
+            if (progress->passRemaining > sent)
+                left = progress->passRemaining - sent;
+            if (remaining > left)
+                dirtied = remaining - left;
+
+            progress->dirtyRate = dirtied * 1000 /
+                                  (now - progress->passStart);
+            progress->iteration++;
+            progress->passStart = now;
+            progress->passProcessed = processed;
+            progress->passRemaining = remaining;
+        }
+    }
+
+    if (progress->bps) {
+        progress->downtime = remaining * 1000 / progress->bps;
+        if (progress->bps > progress->dirtyRate)
+            progress->timeRemaining = remaining * 1000 /
+                (progress->bps - progress->dirtyRate);
+        else
+            progress->timeRemaining = 0;
+    }
+
+    progress->sampled = now;
+    progress->processed = processed;
+    progress->remaining = remaining;
+}
+
+/* Fill the progress of a memory-only dump into @info */
+void
+qemuDomainDumpJobInfo(qemuDomainObjPrivatePtr priv, virDomainJobInfoPtr info)
+{
+    virMutexLock(&priv->job.dump->lock);
+    info->dataProcessed = priv->job.dump->processed;
+    virMutexUnlock(&priv->job.dump->lock);
+
+    if (info->dataTotal > info->dataProcessed)
+        info->dataRemaining = info->dataTotal - info->dataProcessed;
+    else
+        info->dataRemaining = 0;
+}
+
+/* Stats reported by qemuDomainJobStatsCollect besides those of the
+ * disks copied by a migration */
+#define QEMU_NB_JOB_STATS 26
+/* Copied disks whose own progress is reported by virDomainGetJobStats */
+#define QEMU_NB_JOB_DISK_STATS 16
+
+/*
+ * Collects the statistics virDomainGetJobStats reports for the async job
+ * of @priv into a new array stored in @params.
+ */
+int
+qemuDomainJobStatsCollect(qemuDomainObjPrivatePtr priv,
+                          int *type,
+                          virTypedParameterPtr *params,
+                          int *nparams)
+{
+    virDomainJobInfo info;
+    qemuDomainJobProgress progress;
+    qemuDomainJobConverge converge;
+    virTypedParameterPtr stats = NULL;
+    int nstats = 0;
+    int ret = -1;
+
+    if (VIR_ALLOC_N(stats, QEMU_NB_JOB_STATS +
+                    2 * QEMU_NB_JOB_DISK_STATS) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+
+#define ADD_STAT(name, value)                                           \
+    do {                                                                \
+        if (virTypedParameterAssign(&stats[nstats++], name,             \
+                                    VIR_TYPED_PARAM_ULLONG, value) < 0) \
+            goto cleanup;                                               \
+    } while (0)
+
+    memcpy(&info, &priv->job.info, sizeof(info));
+    if (priv->job.dump)
+        qemuDomainDumpJobInfo(priv, &info);
+    memcpy(&progress, &priv->job.progress, sizeof(progress));
+    memcpy(&converge, &priv->job.converge, sizeof(converge));
+
+    /* See qemuDomainGetJobInfo */
+    if (virTimeMillisNow(&info.timeElapsed) < 0)
+        goto cleanup;
+    info.timeElapsed -= priv->job.start;
+
+    ADD_STAT(VIR_DOMAIN_JOB_TIME_ELAPSED, info.timeElapsed);
+    if (progress.bps) {
+        if (progress.timeRemaining)
+            ADD_STAT(VIR_DOMAIN_JOB_TIME_REMAINING, progress.timeRemaining);
+        ADD_STAT(VIR_DOMAIN_JOB_DOWNTIME, progress.downtime);
+    }
+
+    if (info.dataTotal || info.dataRemaining || info.dataProcessed) {
+        ADD_STAT(VIR_DOMAIN_JOB_DATA_TOTAL, info.dataTotal);
+        ADD_STAT(VIR_DOMAIN_JOB_DATA_PROCESSED, info.dataProcessed);
+        ADD_STAT(VIR_DOMAIN_JOB_DATA_REMAINING, info.dataRemaining);
+    }
+
+    if (info.memTotal || info.memRemaining || info.memProcessed) {
+        ADD_STAT(VIR_DOMAIN_JOB_MEMORY_TOTAL, info.memTotal);
+        ADD_STAT(VIR_DOMAIN_JOB_MEMORY_PROCESSED, info.memProcessed);
+        ADD_STAT(VIR_DOMAIN_JOB_MEMORY_REMAINING, info.memRemaining);
+    }
+
+    if (progress.iteration) {
+        ADD_STAT(VIR_DOMAIN_JOB_MEMORY_BPS, progress.bps);
+        ADD_STAT(VIR_DOMAIN_JOB_MEMORY_DIRTY_BPS, progress.dirtyRate);
+        ADD_STAT(VIR_DOMAIN_JOB_MEMORY_ITERATION, progress.iteration);
+    }
+
+    if (converge.actions) {
+        ADD_STAT(VIR_DOMAIN_JOB_CONVERGE_DOWNTIME, converge.downtime);
+        ADD_STAT(VIR_DOMAIN_JOB_CONVERGE_THROTTLE, converge.throttle);
+        ADD_STAT(VIR_DOMAIN_JOB_CONVERGE_ACTIONS, converge.actions);
+    }
+
+    if (priv->job.nmirrors) {
+        unsigned long long copyTime;
+        char field[VIR_TYPED_PARAM_FIELD_LENGTH];
+        size_t j;
+
+        if (priv->job.mirrorEnd)
+            copyTime = priv->job.mirrorEnd - priv->job.mirrorStart;
+        else
+            copyTime = info.timeElapsed + priv->job.start -
+                priv->job.mirrorStart;
+
+        ADD_STAT(VIR_DOMAIN_JOB_DISK_TOTAL, info.fileTotal);
+        ADD_STAT(VIR_DOMAIN_JOB_DISK_PROCESSED, info.fileProcessed);
+        ADD_STAT(VIR_DOMAIN_JOB_DISK_REMAINING, info.fileRemaining);
+        if (copyTime)
+            ADD_STAT(VIR_DOMAIN_JOB_DISK_BPS,
+                     info.fileProcessed * 1000 / copyTime);
+        ADD_STAT(VIR_DOMAIN_JOB_TIME_DISK_COPY, copyTime);
+
+        for (j = 0; j < priv->job.nmirrors && j < QEMU_NB_JOB_DISK_STATS; j++) {
+            qemuDomainMirrorProgressPtr mirror = &priv->job.mirrors[j];
+
+            /* Skip disks whose name does not fit in a field name */
+            if (strlen(VIR_DOMAIN_JOB_DISK_PREFIX) + strlen(mirror->disk) +
+                strlen(".processed") >= sizeof(field))
+                continue;
+
+            snprintf(field, sizeof(field), "%s%s.total",
+                     VIR_DOMAIN_JOB_DISK_PREFIX, mirror->disk);
+            ADD_STAT(field, mirror->total);
+            snprintf(field, sizeof(field), "%s%s.processed",
+                     VIR_DOMAIN_JOB_DISK_PREFIX, mirror->disk);
+            ADD_STAT(field, mirror->processed);
+        }
+    }
+
+    if (priv->job.slot.active)
+        ADD_STAT(VIR_DOMAIN_JOB_BANDWIDTH, priv->job.slot.applied);
+    if (priv->job.slot.queued)
+        ADD_STAT(VIR_DOMAIN_JOB_TIME_QUEUED, priv->job.slot.queued);
+
+    if (priv->job.phases.begin)
+        ADD_STAT(VIR_DOMAIN_JOB_TIME_BEGIN, priv->job.phases.begin);
+    if (priv->job.phases.prepare)
+        ADD_STAT(VIR_DOMAIN_JOB_TIME_PREPARE, priv->job.phases.prepare);
+    if (priv->job.phases.perform)
+        ADD_STAT(VIR_DOMAIN_JOB_TIME_PERFORM, priv->job.phases.perform);
+    if (priv->job.phases.finish)
+        ADD_STAT(VIR_DOMAIN_JOB_TIME_FINISH, priv->job.phases.finish);
+
+
+#undef ADD_STAT
+
+    *type = info.type;
+    *params = stats;
+    *nparams = nstats;
+    stats = NULL;
+    ret = 0;
+
+cleanup:
+    VIR_FREE(stats);
+    return ret;
+}
+
+/* Remember @params, which the caller no longer owns, as the statistics
+ * of the most recently completed job of @priv's domain */
+void
+qemuDomainJobStatsSetCompleted(qemuDomainObjPrivatePtr priv,
+                               virTypedParameterPtr params,
+                               int nparams)
+{
+    virTypedParameterArrayClear(priv->completed, priv->ncompleted);
+    VIR_FREE(priv->completed);
+    priv->completed = params;
+    priv->ncompleted = nparams;
+}
+
+/* Keeps the statistics of the async job of @obj, which has just
+ * completed successfully, until another job of the domain completes */
+void
+qemuDomainObjJobCompleted(virDomainObjPtr obj)
+{
+    qemuDomainObjPrivatePtr priv = obj->privateData;
+    virTypedParameterPtr params;
+    int nparams;
+    int type;
+
+    if (qemuDomainJobStatsCollect(priv, &type, &params, &nparams) < 0) {
+        VIR_WARN("Unable to record statistics of the job completed by %s",
+                 obj->def->name);
+        return;
+    }
+
+    qemuDomainJobStatsSetCompleted(priv, params, nparams);
+}
+
 static bool
 qemuDomainNestedJobAllowed(qemuDomainObjPrivatePtr priv, enum qemuDomainJob job)
 {
@@ -970,6 +1293,7 @@ qemuDomainObjAbortAsyncJob(virDomainObjPtr obj)
               qemuDomainAsyncJobTypeToString(priv->job.asyncJob));
 
     priv->job.asyncAbort = true;
+    qemuDomainObjSignalJobProgress(obj);
 }
 
 static int
@@ -98,6 +98,78 @@ enum qemuDomainAsyncJob {
 };
 VIR_ENUM_DECL(qemuDomainAsyncJob)
 
+/* Transfer statistics derived from consecutive samples of an async job */
+typedef struct _qemuDomainJobProgress qemuDomainJobProgress;
+typedef qemuDomainJobProgress *qemuDomainJobProgressPtr;
+struct _qemuDomainJobProgress {
+    unsigned long long sampled;         /* Job time of the last sample (ms) */
+    unsigned long long processed;       /* Memory processed at that time */
+    unsigned long long remaining;       /* Memory remaining at that time */
+    unsigned long long passStart;       /* Job time the current pass began */
+    unsigned long long passProcessed;   /* Memory processed at that time */
+    unsigned long long passRemaining;   /* Memory remaining at that time */
+    unsigned long long bps;             /* Transfer rate (bytes/s) */
+    unsigned long long dirtyRate;       /* Memory dirtying rate (bytes/s) */
+    unsigned long long iteration;       /* Passes over guest memory */
+    unsigned long long downtime;        /* Expected downtime (ms) */
+    unsigned long long timeRemaining;   /* Expected time to converge (ms) */
+};
+
+/* State of the policy making a migration converge */
+typedef struct _qemuDomainJobConverge qemuDomainJobConverge;
+typedef qemuDomainJobConverge *qemuDomainJobConvergePtr;
+struct _qemuDomainJobConverge {
+    unsigned long long iteration;       /* Last pass the policy looked at */
+    unsigned long long downtime;        /* Max downtime set by the policy */
+    unsigned int throttle;              /* vCPU time withheld (percent) */
+    unsigned int actions;               /* Number of policy decisions */
+    bool noThrottle;                    /* vCPUs cannot be throttled */
+};
+
+/* Duration (ms) of the phases of a migration, including those run by
+ * the other side as told by its migration cookies */
+typedef struct _qemuDomainMigrationTimes qemuDomainMigrationTimes;
+typedef qemuDomainMigrationTimes *qemuDomainMigrationTimesPtr;
+struct _qemuDomainMigrationTimes {
+    unsigned long long begin;
+    unsigned long long prepare;
+    unsigned long long perform;
+    unsigned long long finish;
+};
+
+/* Share of the host-wide outgoing migration bandwidth; all but @applied
+ * and @queued are protected by the driver lock */
+typedef struct _qemuDomainMigrationSlot qemuDomainMigrationSlot;
+typedef qemuDomainMigrationSlot *qemuDomainMigrationSlotPtr;
+struct _qemuDomainMigrationSlot {
+    bool active;                        /* Counted by the driver */
+    unsigned long maxBandwidth;         /* Domain limit when last seen */
+    unsigned long requested;            /* Bandwidth asked for (MiB/s) */
+    unsigned long speed;                /* Share assigned by the driver */
+    bool capped;                        /* @speed is all it asked for */
+    unsigned long applied;              /* Bandwidth last set in QEMU */
+    unsigned long long queued;          /* Time waited for a slot (ms) */
+};
+
+/* Copy of a disk to the destination of a migration by a drive-mirror job */
+typedef struct _qemuDomainMirrorProgress qemuDomainMirrorProgress;
+typedef qemuDomainMirrorProgress *qemuDomainMirrorProgressPtr;
+struct _qemuDomainMirrorProgress {
+    char *disk;                         /* Target name of the disk */
+    char *device;                       /* Block device known to QEMU */
+    unsigned long long total;           /* Size of the disk */
+    unsigned long long processed;       /* Data copied so far */
+    bool ready;                         /* Copy caught up with the guest */
+};
+
+/* Progress of a memory-only dump, updated by the thread writing it */
+typedef struct _qemuDomainDumpProgress qemuDomainDumpProgress;
+typedef qemuDomainDumpProgress *qemuDomainDumpProgressPtr;
+struct _qemuDomainDumpProgress {
+    virMutex lock;
+    unsigned long long processed;       /* Bytes received from QEMU */
+};
+
 struct qemuDomainJobObj {
     virCond cond;                       /* Use to coordinate jobs */
     enum qemuDomainJob active;          /* Currently running job */
@@ -110,7 +182,19 @@ struct qemuDomainJobObj {
     unsigned long long mask;            /* Jobs allowed during async job */
     unsigned long long start;           /* When the async job started */
     bool dump_memory_only;              /* use dump-guest-memory to do dump */
+    qemuDomainDumpProgressPtr dump;     /* Memory-only dump progress */
     virDomainJobInfo info;              /* Async job progress data */
+    qemuDomainJobProgress progress;     /* Async job transfer statistics */
+    qemuDomainJobConverge converge;     /* Migration convergence policy */
+    qemuDomainMigrationTimes phases;    /* Migration phase durations */
+    qemuDomainMirrorProgressPtr mirrors; /* Disks copied by a migration */
+    size_t nmirrors;
+    unsigned long long mirrorStart;     /* When disks started being copied */
+    unsigned long long mirrorEnd;       /* When all of them were ready */
+    qemuDomainMigrationSlot slot;       /* Outgoing migration bandwidth */
+    virCond progressCond;               /* Signalled on events which may
+                                           change async job progress */
+    unsigned int progressEvents;        /* Number of such events */
     bool asyncAbort;                    /* abort of async job requested */
 };
 
@@ -153,10 +237,19 @@ struct _qemuDomainObjPrivate {
     int jobs_queued;
 
     unsigned long migMaxBandwidth;
+    unsigned long long migMaxDowntime;  /* Set by the user in QEMU, 0 if not */
+    unsigned int migThrottle;           /* vCPU time withheld from the domain
+                                           by a migration (percent) */
     char *origname;
 
     virConsolesPtr cons;
 
+    virTypedParameterPtr completed;     /* Stats of the most recently
+                                           completed job */
+    int ncompleted;
+    unsigned int nbdPort;               /* NBD server exporting the disks
+                                           of an incoming migration */
+
     qemuDomainCleanupCallback *cleanupCallbacks;
     size_t ncleanupCallbacks;
     size_t ncleanupCallbacks_max;
@@ -224,6 +317,27 @@ void qemuDomainObjTransferJob(virDomainObjPtr obj);
 void qemuDomainObjDiscardAsyncJob(struct qemud_driver *driver,
                                   virDomainObjPtr obj);
 void qemuDomainObjReleaseAsyncJob(virDomainObjPtr obj);
+void qemuDomainObjSignalJobProgress(virDomainObjPtr obj);
+void qemuDomainJobProgressUpdate(qemuDomainJobProgressPtr progress,
+                                 unsigned long long now,
+                                 unsigned long long processed,
+                                 unsigned long long remaining)
+    ATTRIBUTE_NONNULL(1);
+void qemuDomainDumpJobInfo(qemuDomainObjPrivatePtr priv,
+                           virDomainJobInfoPtr info)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
+int qemuDomainJobStatsCollect(qemuDomainObjPrivatePtr priv,
+                              int *type,
+                              virTypedParameterPtr *params,
+                              int *nparams)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(3)
+    ATTRIBUTE_NONNULL(4);
+void qemuDomainJobStatsSetCompleted(qemuDomainObjPrivatePtr priv,
+                                    virTypedParameterPtr params,
+                                    int nparams)
+    ATTRIBUTE_NONNULL(1);
+void qemuDomainObjJobCompleted(virDomainObjPtr obj)
+    ATTRIBUTE_NONNULL(1);
 
 void qemuDomainObjEnterMonitor(struct qemud_driver *driver,
                                virDomainObjPtr obj)
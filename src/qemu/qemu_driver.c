@@ -93,6 +93,8 @@
 #include "virtime.h"
 #include "virtypedparam.h"
 #include "bitmap.h"
+#include "intprops.h"
+#include "virchunkstream.h"
 
 #define VIR_FROM_THIS VIR_FROM_QEMU
 
@@ -107,6 +109,8 @@
 #define QEMU_NB_TOTAL_CPU_STAT_PARAM 3
 #define QEMU_NB_PER_CPU_STAT_PARAM 2
 
+#define QEMU_NB_RESTORE_STATS 6
+
 #define QEMU_SCHED_MIN_PERIOD              1000LL
 #define QEMU_SCHED_MAX_PERIOD           1000000LL
 #define QEMU_SCHED_MIN_QUOTA               1000LL
@@ -632,6 +636,12 @@ qemudStartup(int privileged) {
         VIR_FREE(qemu_driver);
         return -1;
     }
+    if (virCondInit(&qemu_driver->migrationCond) < 0) {
+        VIR_ERROR(_("cannot initialize condition"));
+        virMutexDestroy(&qemu_driver->lock);
+        VIR_FREE(qemu_driver);
+        return -1;
+    }
     qemuDriverLock(qemu_driver);
 
     qemu_driver->privileged = privileged;
@@ -766,6 +776,11 @@ qemudStartup(int privileged) {
          virBitmapNew(qemu_driver->remotePortMax - qemu_driver->remotePortMin)) == NULL)
         goto out_of_memory;
 
+    /* Ports of NBD servers exporting disks of incoming migrations */
+    if ((qemu_driver->reservedNBDPorts =
+         virBitmapNew(QEMUD_MIGRATION_NBD_NUM_PORTS)) == NULL)
+        goto out_of_memory;
+
     /* We should always at least have the 'nop' manager, so
      * NULLs here are a fatal error
      */
@@ -1009,6 +1024,7 @@ qemudShutdown(void) {
 
     virDomainObjListDeinit(&qemu_driver->domains);
     virBitmapFree(qemu_driver->reservedRemotePorts);
+    virBitmapFree(qemu_driver->reservedNBDPorts);
 
     virSysinfoDefFree(qemu_driver->hostsysinfo);
 
@@ -1053,7 +1069,11 @@ qemudShutdown(void) {
 
     virLockManagerPluginUnref(qemu_driver->lockManager);
 
+    VIR_FREE(qemu_driver->migrations);
+    VIR_FREE(qemu_driver->migrationsQueued);
+
     qemuDriverUnlock(qemu_driver);
+    ignore_value(virCondDestroy(&qemu_driver->migrationCond));
     virMutexDestroy(&qemu_driver->lock);
     virThreadPoolFree(qemu_driver->workerPool);
     VIR_FREE(qemu_driver);
@@ -2608,7 +2628,11 @@ cleanup:
 
 #define QEMUD_SAVE_MAGIC   "LibvirtQemudSave"
 #define QEMUD_SAVE_PARTIAL "LibvirtQemudPart"
-#define QEMUD_SAVE_VERSION 2
+#define QEMUD_SAVE_VERSION 3
+
+/* Images in the formats known before version 3 was introduced keep being
+ * written as version 2, so that older libvirt can still restore them */
+#define QEMUD_SAVE_VERSION_COMPAT 2
 
 verify(sizeof(QEMUD_SAVE_MAGIC) == sizeof(QEMUD_SAVE_PARTIAL));
 
@@ -2622,6 +2646,7 @@ enum qemud_save_formats {
      */
     QEMUD_SAVE_FORMAT_XZ = 3,
     QEMUD_SAVE_FORMAT_LZOP = 4,
+    QEMUD_SAVE_FORMAT_CHUNKED = 5,
     /* Note: add new members only at the end.
        These values are used in the on-disk format.
        Do not change or re-use numbers. */
@@ -2635,7 +2660,8 @@ VIR_ENUM_IMPL(qemudSaveCompression, QEMUD_SAVE_FORMAT_LAST,
               "gzip",
               "bzip2",
               "xz",
-              "lzop")
+              "lzop",
+              "chunked")
 
 struct qemud_save_header {
     char magic[sizeof(QEMUD_SAVE_MAGIC)-1];
@@ -2680,17 +2706,43 @@ endjob:
     return ret;
 }
 
-/* Given a enum qemud_save_formats compression level, return the name
- * of the program to run, or NULL if no program is needed.  */
-static const char *
-qemuCompressProgramName(int compress)
+#define QEMU_IOHELPER LIBEXECDIR "/libvirt_iohelper"
+
+typedef struct _qemuCompressProgram qemuCompressProgram;
+struct _qemuCompressProgram {
+    const char *args[4];
+    char threads[INT_BUFSIZE_BOUND(unsigned int)];
+};
+
+/* Given a enum qemud_save_formats compression level, fill @prog with
+ * the command line of the program to run and return it, or return NULL
+ * if no program is needed.  */
+static const char *const *
+qemuCompressProgramArgs(struct qemud_driver *driver,
+                        int compress,
+                        qemuCompressProgram *prog)
 {
-    return (compress == QEMUD_SAVE_FORMAT_RAW ? NULL :
-            qemudSaveCompressionTypeToString(compress));
+    if (compress == QEMUD_SAVE_FORMAT_RAW)
+        return NULL;
+
+    memset(prog, 0, sizeof(*prog));
+    if (compress == QEMUD_SAVE_FORMAT_CHUNKED) {
+        snprintf(prog->threads, sizeof(prog->threads), "%u",
+                 driver->saveImageThreads);
+        prog->args[0] = QEMU_IOHELPER;
+        prog->args[1] = "--chunk-compress";
+        prog->args[2] = prog->threads;
+    } else {
+        prog->args[0] = qemudSaveCompressionTypeToString(compress);
+        prog->args[1] = "-c";
+    }
+
+    return prog->args;
 }
 
 static virCommandPtr
-qemuCompressGetCommand(enum qemud_save_formats compression)
+qemuCompressGetCommand(struct qemud_driver *driver,
+                       enum qemud_save_formats compression)
 {
     virCommandPtr ret = NULL;
     const char *prog = qemudSaveCompressionTypeToString(compression);
@@ -2702,6 +2754,12 @@ qemuCompressGetCommand(enum qemud_save_formats compression)
         return NULL;
     }
 
+    if (compression == QEMUD_SAVE_FORMAT_CHUNKED) {
+        ret = virCommandNewArgList(QEMU_IOHELPER, "--chunk-decompress", NULL);
+        virCommandAddArgFormat(ret, "%u", driver->saveImageThreads);
+        return ret;
+    }
+
     ret = virCommandNew(prog);
     virCommandAddArg(ret, "-dc");
 
@@ -2842,6 +2900,7 @@ qemuDomainSaveMemory(struct qemud_driver *driver,
                      int compressed,
                      bool was_running,
                      unsigned int flags,
+                     unsigned long bandwidth,
                      enum qemuDomainAsyncJob asyncJob)
 {
     struct qemud_save_header header;
@@ -2856,10 +2915,14 @@ qemuDomainSaveMemory(struct qemud_driver *driver,
     unsigned long long offset;
     size_t len;
     char *xml = NULL;
+    qemuCompressProgram prog;
 
     memset(&header, 0, sizeof(header));
     memcpy(header.magic, QEMUD_SAVE_PARTIAL, sizeof(header.magic));
-    header.version = QEMUD_SAVE_VERSION;
+    if (compressed == QEMUD_SAVE_FORMAT_CHUNKED)
+        header.version = QEMUD_SAVE_VERSION;
+    else
+        header.version = QEMUD_SAVE_VERSION_COMPAT;
     header.was_running = was_running ? 1 : 0;
 
     header.compressed = compressed;
@@ -2911,8 +2974,8 @@ qemuDomainSaveMemory(struct qemud_driver *driver,
 
     /* Perform the migration */
     if (qemuMigrationToFile(driver, vm, fd, offset, path,
-                            qemuCompressProgramName(compressed),
-                            bypassSecurityDriver,
+                            qemuCompressProgramArgs(driver, compressed, &prog),
+                            bandwidth, bypassSecurityDriver,
                             asyncJob) < 0)
         goto cleanup;
 
@@ -2969,7 +3032,8 @@ cleanup:
 static int
 qemuDomainSaveInternal(struct qemud_driver *driver, virDomainPtr dom,
                        virDomainObjPtr vm, const char *path,
-                       int compressed, const char *xmlin, unsigned int flags)
+                       int compressed, const char *xmlin, unsigned int flags,
+                       unsigned long bandwidth)
 {
     char *xml = NULL;
     bool was_running = false;
@@ -3043,7 +3107,8 @@ qemuDomainSaveInternal(struct qemud_driver *driver, virDomainPtr dom,
     }
 
     ret = qemuDomainSaveMemory(driver, vm, path, xml, compressed,
-                               was_running, flags, QEMU_ASYNC_JOB_SAVE);
+                               was_running, flags, bandwidth,
+                               QEMU_ASYNC_JOB_SAVE);
     if (ret < 0)
         goto endjob;
 
@@ -3095,6 +3160,8 @@ static bool qemudCompressProgramAvailable(enum qemud_save_formats compress)
 
     if (compress == QEMUD_SAVE_FORMAT_RAW)
         return true;
+    if (compress == QEMUD_SAVE_FORMAT_CHUNKED)
+        return virFileIsExecutable(QEMU_IOHELPER);
     prog = qemudSaveCompressionTypeToString(compress);
     c = virFindFileInPath(prog);
     if (!c)
@@ -3152,7 +3219,7 @@ qemuDomainSaveFlags(virDomainPtr dom, const char *path, const char *dxml,
     }
 
     ret = qemuDomainSaveInternal(driver, dom, vm, path, compressed,
-                                 dxml, flags);
+                                 dxml, flags, 0);
     vm = NULL;
 
 cleanup:
@@ -3181,8 +3248,11 @@ qemuDomainManagedSavePath(struct qemud_driver *driver, virDomainObjPtr vm) {
     return ret;
 }
 
+/* Save @dom to its managed save image, letting QEMU write at most
+ * @bandwidth MiB/s, or as fast as it can if @bandwidth is 0.  */
 static int
-qemuDomainManagedSave(virDomainPtr dom, unsigned int flags)
+qemuDomainManagedSaveInternal(virDomainPtr dom, unsigned int flags,
+                              unsigned long bandwidth)
 {
     struct qemud_driver *driver = dom->conn->privateData;
     virDomainObjPtr vm = NULL;
@@ -3190,10 +3260,6 @@ qemuDomainManagedSave(virDomainPtr dom, unsigned int flags)
     int ret = -1;
     int compressed;
 
-    virCheckFlags(VIR_DOMAIN_SAVE_BYPASS_CACHE |
-                  VIR_DOMAIN_SAVE_RUNNING |
-                  VIR_DOMAIN_SAVE_PAUSED, -1);
-
     qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
     if (!vm) {
@@ -3223,7 +3289,7 @@ qemuDomainManagedSave(virDomainPtr dom, unsigned int flags)
 
     compressed = QEMUD_SAVE_FORMAT_RAW;
     if ((ret = qemuDomainSaveInternal(driver, dom, vm, name, compressed,
-                                      NULL, flags)) == 0)
+                                      NULL, flags, bandwidth)) == 0)
         vm->hasManagedSave = true;
 
     vm = NULL;
@@ -3237,6 +3303,16 @@ cleanup:
     return ret;
 }
 
+static int
+qemuDomainManagedSave(virDomainPtr dom, unsigned int flags)
+{
+    virCheckFlags(VIR_DOMAIN_SAVE_BYPASS_CACHE |
+                  VIR_DOMAIN_SAVE_RUNNING |
+                  VIR_DOMAIN_SAVE_PAUSED, -1);
+
+    return qemuDomainManagedSaveInternal(dom, flags, 0);
+}
+
 static void
 qemuDomainManagedSaveLoad(void *payload,
                           const void *n ATTRIBUTE_UNUSED,
@@ -3321,30 +3397,203 @@ cleanup:
     return ret;
 }
 
+/* Memory-only dumps are written by QEMU to a pipe, and from there to the
+ * dump file by a thread of ours which also compresses them */
+typedef struct _qemuDumpWriter qemuDumpWriter;
+typedef qemuDumpWriter *qemuDumpWriterPtr;
+struct _qemuDumpWriter {
+    int fdin;                           /* Pipe QEMU writes the dump to */
+    int fdout;                          /* Dump file or compression program */
+    const char *const *compress;        /* Compression program run on
+                                           chunks in parallel, if any */
+    unsigned int nthreads;
+    qemuDomainDumpProgress progress;
+    virErrorPtr err;
+};
+
+#define QEMU_DUMP_BUFLEN (1024 * 1024)
+
+static void
+qemuDumpWriterProgress(unsigned long long nbytes, void *opaque)
+{
+    qemuDumpWriterPtr writer = opaque;
+
+    virMutexLock(&writer->progress.lock);
+    writer->progress.processed = nbytes;
+    virMutexUnlock(&writer->progress.lock);
+}
+
+static int
+qemuDumpWriterCopy(qemuDumpWriterPtr writer)
+{
+    char *buf = NULL;
+    unsigned long long total = 0;
+    ssize_t got;
+    int ret = -1;
+
+    if (VIR_ALLOC_N(buf, QEMU_DUMP_BUFLEN) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+
+    while ((got = saferead(writer->fdin, buf, QEMU_DUMP_BUFLEN)) > 0) {
+        if (safewrite(writer->fdout, buf, got) < 0) {
+            virReportSystemError(errno, "%s", _("unable to write dump"));
+            goto cleanup;
+        }
+        total += got;
+        qemuDumpWriterProgress(total, writer);
+    }
+    if (got < 0) {
+        virReportSystemError(errno, "%s", _("unable to read dump"));
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(buf);
+    return ret;
+}
+
+static void
+qemuDumpWriterThread(void *opaque)
+{
+    qemuDumpWriterPtr writer = opaque;
+    int rc;
+
+    if (writer->compress)
+        rc = virChunkStreamCompressWith(writer->fdin, writer->fdout,
+                                        writer->nthreads, writer->compress,
+                                        qemuDumpWriterProgress, writer);
+    else
+        rc = qemuDumpWriterCopy(writer);
+
+    if (rc < 0)
+        writer->err = virSaveLastError();
+
+    /* Make QEMU fail rather than block if we stopped reading early */
+    VIR_FORCE_CLOSE(writer->fdin);
+}
+
 static int qemuDumpToFd(struct qemud_driver *driver, virDomainObjPtr vm,
-                        int fd, enum qemuDomainAsyncJob asyncJob)
+                        int fd, enum qemud_save_formats compress,
+                        bool paging, enum qemuDomainAsyncJob asyncJob)
 {
     qemuDomainObjPrivatePtr priv = vm->privateData;
+    qemuDumpWriter writer;
+    qemuCompressProgram prog;
+    const char *const *args;
+    virCommandPtr cmd = NULL;
+    virThread thread;
+    bool haveLock = false;
+    bool haveThread = false;
+    int pipefd[2] = { -1, -1 };
+    int cmdfd[2] = { -1, -1 };
     int ret = -1;
 
+    memset(&writer, 0, sizeof(writer));
+    writer.fdin = -1;
+    writer.fdout = fd;
+
     if (!qemuCapsGet(priv->caps, QEMU_CAPS_DUMP_GUEST_MEMORY)) {
         virReportError(VIR_ERR_NO_SUPPORT, "%s",
                        _("dump-guest-memory is not supported"));
         return -1;
     }
 
-    if (virSecurityManagerSetImageFDLabel(driver->securityManager, vm->def,
-                                          fd) < 0)
+    if (virMutexInit(&writer.progress.lock) < 0) {
+        virReportSystemError(errno, "%s", _("unable to initialize mutex"));
         return -1;
+    }
+    haveLock = true;
+
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        virReportSystemError(errno, "%s", _("unable to create pipe"));
+        goto cleanup;
+    }
+    writer.fdin = pipefd[0];
+    pipefd[0] = -1;
+
+    /* Chunks compressed separately form a single gzip, bzip2 or xz
+     * stream, but lzop may not read them back, so it compresses the
+     * whole dump by itself */
+    args = qemuCompressProgramArgs(driver, compress, &prog);
+    if (compress == QEMUD_SAVE_FORMAT_LZOP) {
+        if (pipe2(cmdfd, O_CLOEXEC) < 0) {
+            virReportSystemError(errno, "%s", _("unable to create pipe"));
+            goto cleanup;
+        }
+        cmd = virCommandNewArgs(args);
+        virCommandSetInputFD(cmd, cmdfd[0]);
+        virCommandSetOutputFD(cmd, &fd);
+        if (virCommandRunAsync(cmd, NULL) < 0)
+            goto cleanup;
+        VIR_FORCE_CLOSE(cmdfd[0]);
+        writer.fdout = cmdfd[1];
+    } else {
+        writer.compress = args;
+        writer.nthreads = driver->saveImageThreads;
+    }
+
+    if (virSecurityManagerSetImageFDLabel(driver->securityManager, vm->def,
+                                          pipefd[1]) < 0)
+        goto cleanup;
 
+    if (virThreadCreate(&thread, true, qemuDumpWriterThread, &writer) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create dump writer thread"));
+        goto cleanup;
+    }
+    haveThread = true;
+
+    /* Without paging QEMU dumps the whole guest RAM, plus a few headers */
     priv->job.dump_memory_only = true;
+    priv->job.dump = &writer.progress;
+    if (!paging)
+        priv->job.info.dataTotal = vm->def->mem.max_balloon * 1024ull;
 
     if (qemuDomainObjEnterMonitorAsync(driver, vm, asyncJob) < 0)
-        return -1;
+        goto cleanup;
 
-    ret = qemuMonitorDumpToFd(priv->mon, fd);
+    ret = qemuMonitorDumpToFd(priv->mon, pipefd[1], paging);
     qemuDomainObjExitMonitorWithDriver(driver, vm);
 
+cleanup:
+    /* The writer sees the end of the dump once QEMU closed its end too */
+    VIR_FORCE_CLOSE(pipefd[1]);
+    if (haveThread) {
+        /* Compressing the rest of the dump may take a while; the async
+         * job keeps the domain around while we wait without the locks */
+        virDomainObjUnlock(vm);
+        qemuDriverUnlock(driver);
+        virThreadJoin(&thread);
+        /* lzop sees the end of its input once the writer is done */
+        VIR_FORCE_CLOSE(cmdfd[1]);
+        if (cmd && ret == 0 && !writer.err && virCommandWait(cmd, NULL) < 0)
+            ret = -1;
+        qemuDriverLock(driver);
+        virDomainObjLock(vm);
+
+        if (writer.err) {
+            virSetError(writer.err);
+            virFreeError(writer.err);
+            ret = -1;
+        }
+        if (ret == 0)
+            qemuDomainObjJobCompleted(vm);
+        priv->job.dump = NULL;
+    }
+    VIR_FORCE_CLOSE(writer.fdin);
+    VIR_FORCE_CLOSE(cmdfd[0]);
+    VIR_FORCE_CLOSE(cmdfd[1]);
+    if (cmd) {
+        virCommandAbort(cmd);
+        virCommandFree(cmd);
+    }
+    if (haveLock)
+        virMutexDestroy(&writer.progress.lock);
+
     return ret;
 }
 
@@ -3360,6 +3609,7 @@ doCoreDump(struct qemud_driver *driver,
     virFileWrapperFdPtr wrapperFd = NULL;
     int directFlag = 0;
     unsigned int flags = VIR_FILE_WRAPPER_NON_BLOCKING;
+    qemuCompressProgram prog;
 
     /* Create an empty file with appropriate ownership.  */
     if (dump_flags & VIR_DUMP_BYPASS_CACHE) {
@@ -3383,11 +3633,14 @@ doCoreDump(struct qemud_driver *driver,
         goto cleanup;
 
     if (dump_flags & VIR_DUMP_MEMORY_ONLY) {
-        ret = qemuDumpToFd(driver, vm, fd, QEMU_ASYNC_JOB_DUMP);
+        ret = qemuDumpToFd(driver, vm, fd, compress,
+                           !!(dump_flags & VIR_DUMP_PAGING),
+                           QEMU_ASYNC_JOB_DUMP);
     } else {
         ret = qemuMigrationToFile(driver, vm, fd, 0, path,
-                                  qemuCompressProgramName(compress), false,
-                                  QEMU_ASYNC_JOB_DUMP);
+                                  qemuCompressProgramArgs(driver, compress,
+                                                          &prog),
+                                  0, false, QEMU_ASYNC_JOB_DUMP);
     }
 
     if (ret < 0)
@@ -3434,6 +3687,12 @@ getCompressionType(struct qemud_driver *driver)
                              "configuration file, using raw"));
             return QEMUD_SAVE_FORMAT_RAW;
         }
+        /* Tools analyzing core dumps would not be able to read it */
+        if (compress == QEMUD_SAVE_FORMAT_CHUNKED) {
+            VIR_WARN("%s", _("Dump image format 'chunked' is only "
+                             "supported for save images, using raw"));
+            return QEMUD_SAVE_FORMAT_RAW;
+        }
         if (!qemudCompressProgramAvailable(compress)) {
             VIR_WARN("%s", _("Compression program for dump image format "
                              "in configuration file isn't available, "
@@ -3457,7 +3716,13 @@ static int qemudDomainCoreDump(virDomainPtr dom,
 
     virCheckFlags(VIR_DUMP_LIVE | VIR_DUMP_CRASH |
                   VIR_DUMP_BYPASS_CACHE | VIR_DUMP_RESET |
-                  VIR_DUMP_MEMORY_ONLY, -1);
+                  VIR_DUMP_MEMORY_ONLY | VIR_DUMP_PAGING, -1);
+
+    if ((flags & VIR_DUMP_PAGING) && !(flags & VIR_DUMP_MEMORY_ONLY)) {
+        virReportError(VIR_ERR_INVALID_ARG, "%s",
+                       _("paging is only supported for memory-only dumps"));
+        return -1;
+    }
 
     qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
@@ -5221,6 +5486,29 @@ cleanup:
     return ret;
 }
 
+/* How much of a save image is read ahead of QEMU when restoring it */
+#define QEMU_SAVE_IMAGE_PREFETCH (128 * 1024 * 1024)
+
+/* Ask the kernel to start reading the memory state while the domain is
+ * being set up, so that QEMU does not have to wait for the first
+ * chunks of it.  Not used when bypassing the cache, as the
+ * libvirt_iohelper then reads ahead by itself.  */
+static void
+qemuDomainSaveImagePrefetch(int fd ATTRIBUTE_UNUSED)
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+    off_t offset;
+
+    if ((offset = lseek(fd, 0, SEEK_CUR)) < 0)
+        return;
+
+    if (posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL) != 0 ||
+        posix_fadvise(fd, offset, QEMU_SAVE_IMAGE_PREFETCH,
+                      POSIX_FADV_WILLNEED) != 0)
+        VIR_DEBUG("Unable to prefetch save image");
+#endif
+}
+
 /* Return -1 on most failures after raising error, -2 if edit was specified
  * but xmlin and state (-1 for no change, 0 for paused, 1 for running) do
  * not represent any changes (no error raised), -3 if corrupt image was
@@ -5356,6 +5644,9 @@ qemuDomainSaveImageOpen(struct qemud_driver *driver,
 
     VIR_FREE(xml);
 
+    if (!bypass_cache && !edit)
+        qemuDomainSaveImagePrefetch(fd);
+
     *ret_def = def;
     *ret_header = header;
 
@@ -5369,6 +5660,53 @@ error:
     return -1;
 }
 
+/* Remember the timings of a restore as the statistics of the most
+ * recently completed job of the domain; @running is 0 if the restore
+ * left the domain paused */
+static void
+qemuDomainSaveImageRecordStats(virDomainObjPtr vm,
+                               unsigned long long start,
+                               unsigned long long loaded,
+                               unsigned long long running,
+                               unsigned long long size)
+{
+    virTypedParameterPtr stats = NULL;
+    int nstats = 0;
+
+    if (VIR_ALLOC_N(stats, QEMU_NB_RESTORE_STATS) < 0) {
+        virReportOOMError();
+        goto error;
+    }
+
+#define ADD_STAT(name, value)                                           \
+    do {                                                                \
+        if (virTypedParameterAssign(&stats[nstats++], name,             \
+                                    VIR_TYPED_PARAM_ULLONG, value) < 0) \
+            goto error;                                                 \
+    } while (0)
+
+    ADD_STAT(VIR_DOMAIN_JOB_TIME_ELAPSED,
+             (running ? running : loaded) - start);
+    if (size) {
+        ADD_STAT(VIR_DOMAIN_JOB_DATA_TOTAL, size);
+        ADD_STAT(VIR_DOMAIN_JOB_DATA_PROCESSED, size);
+        ADD_STAT(VIR_DOMAIN_JOB_DATA_REMAINING, 0);
+    }
+    ADD_STAT(VIR_DOMAIN_JOB_TIME_LOADED, loaded - start);
+    if (running)
+        ADD_STAT(VIR_DOMAIN_JOB_TIME_TO_RUN, running - start);
+
+#undef ADD_STAT
+
+    qemuDomainJobStatsSetCompleted(vm->privateData, stats, nstats);
+    return;
+
+error:
+    VIR_WARN("Unable to record statistics of the restore of %s",
+             vm->def->name);
+    VIR_FREE(stats);
+}
+
 static int ATTRIBUTE_NONNULL(4) ATTRIBUTE_NONNULL(5) ATTRIBUTE_NONNULL(6)
 qemuDomainSaveImageStartVM(virConnectPtr conn,
                            struct qemud_driver *driver,
@@ -5382,10 +5720,18 @@ qemuDomainSaveImageStartVM(virConnectPtr conn,
     virDomainEventPtr event;
     int intermediatefd = -1;
     virCommandPtr cmd = NULL;
+    unsigned long long start;
+    unsigned long long loaded;
+    unsigned long long running = 0;
+    unsigned long long size = 0;
+    struct stat sb;
+
+    if (virTimeMillisNow(&start) < 0)
+        goto out;
 
-    if ((header->version == 2) &&
+    if ((header->version >= 2) &&
         (header->compressed != QEMUD_SAVE_FORMAT_RAW)) {
-        if (!(cmd = qemuCompressGetCommand(header->compressed)))
+        if (!(cmd = qemuCompressGetCommand(driver, header->compressed)))
             goto out;
 
         intermediatefd = *fd;
@@ -5432,6 +5778,11 @@ qemuDomainSaveImageStartVM(virConnectPtr conn,
         goto out;
     }
 
+    if (virTimeMillisNow(&loaded) < 0)
+        loaded = start;
+    if (stat(path, &sb) == 0)
+        size = sb.st_size;
+
     event = virDomainEventNewFromObj(vm,
                                      VIR_DOMAIN_EVENT_STARTED,
                                      VIR_DOMAIN_EVENT_STARTED_RESTORED);
@@ -5450,6 +5801,8 @@ qemuDomainSaveImageStartVM(virConnectPtr conn,
                                "%s", _("failed to resume domain"));
             goto out;
         }
+        if (virTimeMillisNow(&running) < 0)
+            running = loaded;
         if (virDomainSaveStatus(driver->caps, driver->stateDir, vm) < 0) {
             VIR_WARN("Failed to save status on vm %s", vm->def->name);
             goto out;
@@ -5464,6 +5817,7 @@ qemuDomainSaveImageStartVM(virConnectPtr conn,
             qemuDomainEventQueue(driver, event);
     }
 
+    qemuDomainSaveImageRecordStats(vm, start, loaded, running, size);
     ret = 0;
 
 out:
@@ -6096,6 +6450,272 @@ qemuDomainStart(virDomainPtr dom)
     return qemuDomainStartWithFlags(dom, 0);
 }
 
+
+/* Number of domains saved or restored at the same time by
+ * virDomainListManagedSave and virDomainListManagedRestore, unless
+ * the caller asks otherwise */
+#define QEMU_BULK_CONCURRENCY 4
+
+typedef struct _qemuBulkDomain qemuBulkDomain;
+struct _qemuBulkDomain {
+    virDomainPtr dom;
+    unsigned long long memory;
+};
+
+typedef struct _qemuBulkJob qemuBulkJob;
+typedef qemuBulkJob *qemuBulkJobPtr;
+struct _qemuBulkJob {
+    virMutex lock;
+    qemuBulkDomain *doms;       /* In the order they are processed */
+    size_t ndoms;
+    size_t next;                /* Next domain to process */
+
+    bool restore;
+    unsigned int flags;
+    unsigned long bandwidth;    /* Limit for each save (MiB/s) */
+
+    size_t nfailed;
+    virErrorPtr err;            /* Error of the first failed domain */
+};
+
+static int
+qemuBulkDomainCompareMemory(const void *a, const void *b)
+{
+    const qemuBulkDomain *da = a;
+    const qemuBulkDomain *db = b;
+
+    if (da->memory < db->memory)
+        return -1;
+    return da->memory > db->memory;
+}
+
+static void
+qemuBulkWorker(void *opaque)
+{
+    qemuBulkJobPtr job = opaque;
+
+    while (1) {
+        virDomainPtr dom = NULL;
+        virErrorPtr err;
+        int rc;
+
+        virMutexLock(&job->lock);
+        if (job->next < job->ndoms)
+            dom = job->doms[job->next++].dom;
+        virMutexUnlock(&job->lock);
+
+        if (!dom)
+            break;
+
+        VIR_DEBUG("%s domain %s", job->restore ? "Restoring" : "Saving",
+                  dom->name);
+        if (job->restore)
+            rc = qemuDomainStartWithFlags(dom, job->flags);
+        else
+            rc = qemuDomainManagedSaveInternal(dom, job->flags,
+                                               job->bandwidth);
+        if (rc == 0)
+            continue;
+
+        err = virSaveLastError();
+        VIR_WARN("Unable to %s domain %s: %s",
+                 job->restore ? "restore" : "save", dom->name,
+                 err && err->message ? err->message : "unknown error");
+
+        virMutexLock(&job->lock);
+        job->nfailed++;
+        if (!job->err)
+            job->err = err;
+        else
+            virFreeError(err);
+        virMutexUnlock(&job->lock);
+    }
+}
+
+/* Save or restore @doms using up to @concurrency threads.  Saves go
+ * from the largest domain to the smallest one so that the longest
+ * saves do not end up running alone at the end, while restores start
+ * with the smallest domains to get as many of them running as soon as
+ * possible.  @bandwidth (MiB/s) is shared among the saves running at
+ * the same time.  */
+static int
+qemuBulkRun(struct qemud_driver *driver,
+            virDomainPtr *doms,
+            unsigned int ndoms,
+            unsigned int concurrency,
+            unsigned long long bandwidth,
+            bool restore,
+            unsigned int flags)
+{
+    qemuBulkJob job;
+    virThreadPtr threads = NULL;
+    size_t nthreads = 0;
+    size_t i;
+    int ret = -1;
+
+    memset(&job, 0, sizeof(job));
+    job.restore = restore;
+    job.flags = flags;
+
+    if (virMutexInit(&job.lock) < 0) {
+        virReportSystemError(errno, "%s", _("Unable to initialize mutex"));
+        return -1;
+    }
+
+    if (VIR_ALLOC_N(job.doms, ndoms) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    qemuDriverLock(driver);
+    for (i = 0 ; i < ndoms ; i++) {
+        virDomainObjPtr vm;
+
+        job.doms[i].dom = doms[i];
+        if ((vm = virDomainFindByUUID(&driver->domains, doms[i]->uuid))) {
+            job.doms[i].memory = vm->def->mem.cur_balloon;
+            virDomainObjUnlock(vm);
+        }
+    }
+    qemuDriverUnlock(driver);
+    job.ndoms = ndoms;
+
+    qsort(job.doms, job.ndoms, sizeof(*job.doms),
+          qemuBulkDomainCompareMemory);
+    if (!restore) {
+        for (i = 0 ; i < job.ndoms / 2 ; i++) {
+            qemuBulkDomain tmp = job.doms[i];
+            job.doms[i] = job.doms[job.ndoms - i - 1];
+            job.doms[job.ndoms - i - 1] = tmp;
+        }
+    }
+
+    if (concurrency > ndoms)
+        concurrency = ndoms;
+
+    if (bandwidth) {
+        bandwidth /= concurrency;
+        if (bandwidth == 0)
+            bandwidth = 1;
+        if (bandwidth > QEMU_DOMAIN_MIG_BANDWIDTH_MAX)
+            bandwidth = QEMU_DOMAIN_MIG_BANDWIDTH_MAX;
+        job.bandwidth = bandwidth;
+    }
+
+    if (VIR_ALLOC_N(threads, concurrency) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    for (nthreads = 0 ; nthreads < concurrency ; nthreads++) {
+        if (virThreadCreate(&threads[nthreads], true,
+                            qemuBulkWorker, &job) < 0) {
+            virReportSystemError(errno, "%s", _("Unable to create thread"));
+            break;
+        }
+    }
+
+    /* Whatever threads were started get the job done */
+    if (nthreads == 0)
+        goto cleanup;
+    for (i = 0 ; i < nthreads ; i++)
+        virThreadJoin(&threads[i]);
+
+    if (job.err) {
+        virSetError(job.err);
+        if (job.nfailed > 1)
+            VIR_WARN("%zu of %zu domains could not be %s",
+                     job.nfailed, job.ndoms, restore ? "restored" : "saved");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virFreeError(job.err);
+    VIR_FREE(threads);
+    VIR_FREE(job.doms);
+    virMutexDestroy(&job.lock);
+    return ret;
+}
+
+static int
+qemuDomainListManagedSave(virConnectPtr conn,
+                          virDomainPtr *doms,
+                          unsigned int ndoms,
+                          virTypedParameterPtr params,
+                          int nparams,
+                          unsigned int flags)
+{
+    struct qemud_driver *driver = conn->privateData;
+    unsigned int concurrency = QEMU_BULK_CONCURRENCY;
+    unsigned long long bandwidth = 0;
+    int i;
+
+    virCheckFlags(VIR_DOMAIN_SAVE_BYPASS_CACHE |
+                  VIR_DOMAIN_SAVE_RUNNING |
+                  VIR_DOMAIN_SAVE_PAUSED, -1);
+
+    if (virTypedParameterArrayValidate(params, nparams,
+                                       VIR_DOMAIN_BULK_CONCURRENCY,
+                                       VIR_TYPED_PARAM_UINT,
+                                       VIR_DOMAIN_BULK_BANDWIDTH,
+                                       VIR_TYPED_PARAM_ULLONG,
+                                       NULL) < 0)
+        return -1;
+
+    for (i = 0; i < nparams; i++) {
+        if (STREQ(params[i].field, VIR_DOMAIN_BULK_CONCURRENCY))
+            concurrency = params[i].value.ui;
+        else if (STREQ(params[i].field, VIR_DOMAIN_BULK_BANDWIDTH))
+            bandwidth = params[i].value.ul;
+    }
+
+    if (concurrency == 0) {
+        virReportError(VIR_ERR_INVALID_ARG, "%s",
+                       _("concurrency must be at least 1"));
+        return -1;
+    }
+
+    return qemuBulkRun(driver, doms, ndoms, concurrency, bandwidth,
+                       false, flags);
+}
+
+static int
+qemuDomainListManagedRestore(virConnectPtr conn,
+                             virDomainPtr *doms,
+                             unsigned int ndoms,
+                             virTypedParameterPtr params,
+                             int nparams,
+                             unsigned int flags)
+{
+    struct qemud_driver *driver = conn->privateData;
+    unsigned int concurrency = QEMU_BULK_CONCURRENCY;
+    int i;
+
+    virCheckFlags(VIR_DOMAIN_START_PAUSED |
+                  VIR_DOMAIN_START_BYPASS_CACHE, -1);
+
+    if (virTypedParameterArrayValidate(params, nparams,
+                                       VIR_DOMAIN_BULK_CONCURRENCY,
+                                       VIR_TYPED_PARAM_UINT,
+                                       NULL) < 0)
+        return -1;
+
+    for (i = 0; i < nparams; i++) {
+        if (STREQ(params[i].field, VIR_DOMAIN_BULK_CONCURRENCY))
+            concurrency = params[i].value.ui;
+    }
+
+    if (concurrency == 0) {
+        virReportError(VIR_ERR_INVALID_ARG, "%s",
+                       _("concurrency must be at least 1"));
+        return -1;
+    }
+
+    return qemuBulkRun(driver, doms, ndoms, concurrency, 0, true, flags);
+}
+
 static virDomainPtr qemudDomainDefine(virConnectPtr conn, const char *xml) {
     struct qemud_driver *driver = conn->privateData;
     virDomainDefPtr def;
@@ -10801,8 +11421,11 @@ static int qemuDomainGetJobInfo(virDomainPtr dom,
     priv = vm->privateData;
 
     if (virDomainObjIsActive(vm)) {
-        if (priv->job.asyncJob && !priv->job.dump_memory_only) {
+        if (priv->job.asyncJob &&
+            (!priv->job.dump_memory_only || priv->job.dump)) {
             memcpy(info, &priv->job.info, sizeof(*info));
+            if (priv->job.dump)
+                qemuDomainDumpJobInfo(priv, info);
 
             /* Refresh elapsed time again just to ensure it
              * is fully updated. This is primarily for benefit
@@ -10831,6 +11454,90 @@ cleanup:
 }
 
 
+static int
+qemuDomainGetJobStats(virDomainPtr dom,
+                      int *type,
+                      virTypedParameterPtr *params,
+                      int *nparams,
+                      unsigned int flags)
+{
+    struct qemud_driver *driver = dom->conn->privateData;
+    virDomainObjPtr vm;
+    qemuDomainObjPrivatePtr priv;
+    virTypedParameterPtr stats = NULL;
+    int nstats = 0;
+    int ret = -1;
+
+    virCheckFlags(VIR_DOMAIN_JOB_STATS_COMPLETED, -1);
+
+    qemuDriverLock(driver);
+    vm = virDomainFindByUUID(&driver->domains, dom->uuid);
+    qemuDriverUnlock(driver);
+    if (!vm) {
+        char uuidstr[VIR_UUID_STRING_BUFLEN];
+        virUUIDFormat(dom->uuid, uuidstr);
+        virReportError(VIR_ERR_NO_DOMAIN,
+                       _("no domain with matching uuid '%s'"), uuidstr);
+        goto cleanup;
+    }
+
+    /* The last completed job may have stopped the domain */
+    if (!(flags & VIR_DOMAIN_JOB_STATS_COMPLETED) &&
+        !virDomainObjIsActive(vm)) {
+        virReportError(VIR_ERR_OPERATION_INVALID,
+                       "%s", _("domain is not running"));
+        goto cleanup;
+    }
+
+    priv = vm->privateData;
+
+    if (flags & VIR_DOMAIN_JOB_STATS_COMPLETED) {
+        if (!priv->ncompleted) {
+            *type = VIR_DOMAIN_JOB_NONE;
+            *params = NULL;
+            *nparams = 0;
+            ret = 0;
+            goto cleanup;
+        }
+
+        /* All the stats are numbers, none has a string to duplicate */
+        if (VIR_ALLOC_N(stats, priv->ncompleted) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+        memcpy(stats, priv->completed, priv->ncompleted * sizeof(*stats));
+        nstats = priv->ncompleted;
+
+        *type = VIR_DOMAIN_JOB_COMPLETED;
+        goto done;
+    }
+
+    if (!priv->job.asyncJob ||
+        (priv->job.dump_memory_only && !priv->job.dump)) {
+        *type = VIR_DOMAIN_JOB_NONE;
+        *params = NULL;
+        *nparams = 0;
+        ret = 0;
+        goto cleanup;
+    }
+
+    if (qemuDomainJobStatsCollect(priv, type, &stats, &nstats) < 0)
+        goto cleanup;
+
+done:
+    *params = stats;
+    *nparams = nstats;
+    stats = NULL;
+    ret = 0;
+
+cleanup:
+    VIR_FREE(stats);
+    if (vm)
+        virDomainObjUnlock(vm);
+    return ret;
+}
+
+
 static int qemuDomainAbortJob(virDomainPtr dom) {
     struct qemud_driver *driver = dom->conn->privateData;
     virDomainObjPtr vm;
@@ -10933,6 +11640,12 @@ qemuDomainMigrateSetMaxDowntime(virDomainPtr dom,
     ret = qemuMonitorSetMigrationDowntime(priv->mon, downtime);
     qemuDomainObjExitMonitor(driver, vm);
 
+    /* The convergence policy only ever raises the downtime from here */
+    if (ret == 0) {
+        priv->migMaxDowntime = downtime;
+        priv->job.converge.downtime = 0;
+    }
+
 endjob:
     if (qemuDomainObjEndJob(driver, vm) == 0)
         vm = NULL;
@@ -11842,7 +12555,7 @@ qemuDomainSnapshotCreateActiveExternal(virConnectPtr conn,
 
         if ((ret = qemuDomainSaveMemory(driver, vm, snap->def->file,
                                         xml, QEMUD_SAVE_FORMAT_RAW,
-                                        resume, 0,
+                                        resume, 0, 0,
                                         QEMU_ASYNC_JOB_SNAPSHOT)) < 0)
             goto endjob;
 
@@ -15402,6 +16115,9 @@ static virDriver qemuDriver = {
     .cpuCompare = qemuCPUCompare, /* 0.7.5 */
     .cpuBaseline = qemuCPUBaseline, /* 0.7.7 */
     .domainGetJobInfo = qemuDomainGetJobInfo, /* 0.7.7 */
+    .domainGetJobStats = qemuDomainGetJobStats, /* 1.0.3 */
+    .domainListManagedSave = qemuDomainListManagedSave, /* 1.0.0 */
+    .domainListManagedRestore = qemuDomainListManagedRestore, /* 1.0.0 */
     .domainAbortJob = qemuDomainAbortJob, /* 0.7.7 */
     .domainMigrateSetMaxDowntime = qemuDomainMigrateSetMaxDowntime, /* 0.8.0 */
     .domainMigrateSetMaxSpeed = qemuDomainMigrateSetMaxSpeed, /* 0.9.0 */
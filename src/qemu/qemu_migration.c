@@ -30,6 +30,7 @@
 #include <poll.h>
 
 #include "qemu_migration.h"
+#include "qemu_migration_policy.h"
 #include "qemu_monitor.h"
 #include "qemu_domain.h"
 #include "qemu_process.h"
@@ -51,6 +52,8 @@
 #include "storage_file.h"
 #include "viruri.h"
 #include "hooks.h"
+#include "virchunkstream.h"
+#include "md5.h"
 
 
 #define VIR_FROM_THIS VIR_FROM_QEMU
@@ -72,6 +75,7 @@ enum qemuMigrationCookieFlags {
     QEMU_MIGRATION_COOKIE_FLAG_GRAPHICS,
     QEMU_MIGRATION_COOKIE_FLAG_LOCKSTATE,
     QEMU_MIGRATION_COOKIE_FLAG_PERSISTENT,
+    QEMU_MIGRATION_COOKIE_FLAG_NBD,
 
     QEMU_MIGRATION_COOKIE_FLAG_LAST
 };
@@ -79,12 +83,13 @@ enum qemuMigrationCookieFlags {
 VIR_ENUM_DECL(qemuMigrationCookieFlag);
 VIR_ENUM_IMPL(qemuMigrationCookieFlag,
               QEMU_MIGRATION_COOKIE_FLAG_LAST,
-              "graphics", "lockstate", "persistent");
+              "graphics", "lockstate", "persistent", "nbd");
 
 enum qemuMigrationCookieFeatures {
     QEMU_MIGRATION_COOKIE_GRAPHICS  = (1 << QEMU_MIGRATION_COOKIE_FLAG_GRAPHICS),
     QEMU_MIGRATION_COOKIE_LOCKSTATE = (1 << QEMU_MIGRATION_COOKIE_FLAG_LOCKSTATE),
     QEMU_MIGRATION_COOKIE_PERSISTENT = (1 << QEMU_MIGRATION_COOKIE_FLAG_PERSISTENT),
+    QEMU_MIGRATION_COOKIE_NBD = (1 << QEMU_MIGRATION_COOKIE_FLAG_NBD),
 };
 
 typedef struct _qemuMigrationCookieGraphics qemuMigrationCookieGraphics;
@@ -97,6 +102,13 @@ struct _qemuMigrationCookieGraphics {
     char *tlsSubject;
 };
 
+typedef struct _qemuMigrationCookieNBD qemuMigrationCookieNBD;
+typedef qemuMigrationCookieNBD *qemuMigrationCookieNBDPtr;
+struct _qemuMigrationCookieNBD {
+    int port; /* Port of the NBD server on the destination, 0 when the
+                 source only says it can copy disks over NBD */
+};
+
 typedef struct _qemuMigrationCookie qemuMigrationCookie;
 typedef qemuMigrationCookie *qemuMigrationCookiePtr;
 struct _qemuMigrationCookie {
@@ -120,10 +132,29 @@ struct _qemuMigrationCookie {
     /* If (flags & QEMU_MIGRATION_COOKIE_GRAPHICS) */
     qemuMigrationCookieGraphicsPtr graphics;
 
+    /* If (flags & QEMU_MIGRATION_COOKIE_NBD) */
+    qemuMigrationCookieNBDPtr nbd;
+
     /* If (flags & QEMU_MIGRATION_COOKIE_PERSISTENT) */
     virDomainDefPtr persistent;
+    /* Set instead of persistent when the destination already has it */
+    char *persistentFingerprint;
+
+    /* What the peer accepts, from the <transfer> element of its cookie */
+    bool peerCompress;          /* Compressed cookies */
+    char *peerPersistent;       /* Fingerprint of the persistent definition
+                                   the peer already has */
+
+    /* Fingerprint of our persistent definition, sent to the peer */
+    char *knownPersistent;
+
+    /* Phase durations known to the side which sent or sends the cookie */
+    qemuDomainMigrationTimes times;
 };
 
+/* Largest cookie accepted once decompressed */
+#define QEMU_MIGRATION_COOKIE_MAX (16 * 1024 * 1024)
+
 static void qemuMigrationCookieGraphicsFree(qemuMigrationCookieGraphicsPtr grap)
 {
     if (!grap)
@@ -147,6 +178,10 @@ static void qemuMigrationCookieFree(qemuMigrationCookiePtr mig)
     VIR_FREE(mig->name);
     VIR_FREE(mig->lockState);
     VIR_FREE(mig->lockDriver);
+    VIR_FREE(mig->persistentFingerprint);
+    VIR_FREE(mig->peerPersistent);
+    VIR_FREE(mig->knownPersistent);
+    VIR_FREE(mig->nbd);
     VIR_FREE(mig);
 }
 
@@ -375,6 +410,126 @@ qemuMigrationCookieAddPersistent(qemuMigrationCookiePtr mig,
 }
 
 
+static int
+qemuMigrationCookieAddNBD(qemuMigrationCookiePtr mig,
+                          virDomainObjPtr dom)
+{
+    qemuDomainObjPrivatePtr priv = dom->privateData;
+
+    if (!mig->nbd && VIR_ALLOC(mig->nbd) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+
+    mig->nbd->port = priv->nbdPort;
+    mig->flags |= QEMU_MIGRATION_COOKIE_NBD;
+    return 0;
+}
+
+
+/* Format a persistent definition the way it is put in cookies */
+static char *
+qemuMigrationCookiePersistentXML(struct qemud_driver *driver,
+                                 virDomainDefPtr def)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+
+    virBufferAdjustIndent(&buf, 2);
+    if (qemuDomainDefFormatBuf(driver, def,
+                               VIR_DOMAIN_XML_INACTIVE |
+                               VIR_DOMAIN_XML_SECURE |
+                               VIR_DOMAIN_XML_MIGRATABLE,
+                               &buf) < 0) {
+        virBufferFreeAndReset(&buf);
+        return NULL;
+    }
+    virBufferAdjustIndent(&buf, -2);
+
+    if (virBufferError(&buf)) {
+        virReportOOMError();
+        virBufferFreeAndReset(&buf);
+        return NULL;
+    }
+
+    return virBufferContentAndReset(&buf);
+}
+
+
+static char *
+qemuMigrationCookieFingerprint(const char *xml)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char digest[MD5_DIGEST_SIZE];
+    char *ret;
+    int i;
+
+    if (VIR_ALLOC_N(ret, MD5_DIGEST_SIZE * 2 + 1) < 0) {
+        virReportOOMError();
+        return NULL;
+    }
+
+    md5_buffer(xml, strlen(xml), digest);
+    for (i = 0 ; i < MD5_DIGEST_SIZE ; i++) {
+        ret[i * 2] = hex[digest[i] >> 4];
+        ret[i * 2 + 1] = hex[digest[i] & 0xf];
+    }
+
+    return ret;
+}
+
+
+static char *
+qemuMigrationCookieDefFingerprint(struct qemud_driver *driver,
+                                  virDomainDefPtr def)
+{
+    char *xml;
+    char *ret;
+
+    if (!(xml = qemuMigrationCookiePersistentXML(driver, def)))
+        return NULL;
+    ret = qemuMigrationCookieFingerprint(xml);
+    VIR_FREE(xml);
+    return ret;
+}
+
+
+/* Let the source skip sending the persistent definition of the domain
+ * and us parsing it if it is the same as the one we already have */
+static int
+qemuMigrationCookieAddKnownPersistent(qemuMigrationCookiePtr mig,
+                                      struct qemud_driver *driver,
+                                      virDomainObjPtr dom)
+{
+    if (!dom->newDef || !mig->peerCompress)
+        return 0;
+
+    if (!(mig->knownPersistent =
+          qemuMigrationCookieDefFingerprint(driver, dom->newDef)))
+        return -1;
+
+    return 0;
+}
+
+
+/* Remember the durations of the phases run by the peer */
+static void
+qemuMigrationCookieGetTimes(qemuMigrationCookiePtr mig,
+                            virDomainObjPtr dom)
+{
+    qemuDomainObjPrivatePtr priv = dom->privateData;
+    qemuDomainMigrationTimesPtr phases = &priv->job.phases;
+
+    if (!phases->begin)
+        phases->begin = mig->times.begin;
+    if (!phases->prepare)
+        phases->prepare = mig->times.prepare;
+    if (!phases->perform)
+        phases->perform = mig->times.perform;
+    if (!phases->finish)
+        phases->finish = mig->times.finish;
+}
+
+
 
 static void qemuMigrationCookieGraphicsXMLFormat(virBufferPtr buf,
                                                  qemuMigrationCookieGraphicsPtr grap)
@@ -433,15 +588,54 @@ qemuMigrationCookieXMLFormat(struct qemud_driver *driver,
 
     if ((mig->flags & QEMU_MIGRATION_COOKIE_PERSISTENT) &&
         mig->persistent) {
-        virBufferAdjustIndent(buf, 2);
-        if (qemuDomainDefFormatBuf(driver,
-                                   mig->persistent,
-                                   VIR_DOMAIN_XML_INACTIVE |
-                                   VIR_DOMAIN_XML_SECURE |
-                                   VIR_DOMAIN_XML_MIGRATABLE,
-                                   buf) < 0)
+        char *xml;
+        char *fingerprint = NULL;
+
+        if (!(xml = qemuMigrationCookiePersistentXML(driver,
+                                                     mig->persistent)))
+            return -1;
+        if (mig->peerPersistent &&
+            !(fingerprint = qemuMigrationCookieFingerprint(xml))) {
+            VIR_FREE(xml);
             return -1;
-        virBufferAdjustIndent(buf, -2);
+        }
+
+        if (fingerprint && STREQ(fingerprint, mig->peerPersistent)) {
+            VIR_DEBUG("Destination already has persistent definition %s",
+                      fingerprint);
+            virBufferAsprintf(buf, "  <persistent fingerprint='%s'/>\n",
+                              fingerprint);
+        } else {
+            virBufferAdd(buf, xml, -1);
+        }
+        VIR_FREE(fingerprint);
+        VIR_FREE(xml);
+    }
+
+    if ((mig->flags & QEMU_MIGRATION_COOKIE_NBD) && mig->nbd) {
+        virBufferAddLit(buf, "  <nbd");
+        if (mig->nbd->port)
+            virBufferAsprintf(buf, " port='%d'", mig->nbd->port);
+        virBufferAddLit(buf, "/>\n");
+    }
+
+    virBufferAddLit(buf, "  <transfer compression='chunked'");
+    if (mig->knownPersistent)
+        virBufferAsprintf(buf, " persistent='%s'", mig->knownPersistent);
+    virBufferAddLit(buf, "/>\n");
+
+    if (mig->times.begin || mig->times.prepare ||
+        mig->times.perform || mig->times.finish) {
+        virBufferAddLit(buf, "  <timing");
+        if (mig->times.begin)
+            virBufferAsprintf(buf, " begin='%llu'", mig->times.begin);
+        if (mig->times.prepare)
+            virBufferAsprintf(buf, " prepare='%llu'", mig->times.prepare);
+        if (mig->times.perform)
+            virBufferAsprintf(buf, " perform='%llu'", mig->times.perform);
+        if (mig->times.finish)
+            virBufferAsprintf(buf, " finish='%llu'", mig->times.finish);
+        virBufferAddLit(buf, "/>\n");
     }
 
     virBufferAddLit(buf, "</qemu-migration>\n");
@@ -650,6 +844,10 @@ qemuMigrationCookieXMLParse(qemuMigrationCookiePtr mig,
     }
 
     if ((flags & QEMU_MIGRATION_COOKIE_PERSISTENT) &&
+        (mig->persistentFingerprint =
+         virXPathString("string(./persistent/@fingerprint)", ctxt))) {
+        /* Checked against our own persistent definition by the caller */
+    } else if ((flags & QEMU_MIGRATION_COOKIE_PERSISTENT) &&
         virXPathBoolean("count(./domain) > 0", ctxt)) {
         if ((n = virXPathNodeSet("./domain", ctxt, &nodes)) > 1) {
             virReportError(VIR_ERR_INTERNAL_ERROR,
@@ -668,6 +866,36 @@ qemuMigrationCookieXMLParse(qemuMigrationCookiePtr mig,
         VIR_FREE(nodes);
     }
 
+    if ((flags & QEMU_MIGRATION_COOKIE_NBD) &&
+        virXPathBoolean("count(./nbd) > 0", ctxt)) {
+        if (VIR_ALLOC(mig->nbd) < 0) {
+            virReportOOMError();
+            goto error;
+        }
+        if (virXPathInt("string(./nbd/@port)", ctxt, &mig->nbd->port) == -2) {
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("malformed nbd port in migration data"));
+            goto error;
+        }
+    }
+
+    /* Older peers send neither of these */
+    if ((tmp = virXPathString("string(./transfer/@compression)", ctxt))) {
+        mig->peerCompress = STREQ(tmp, "chunked");
+        VIR_FREE(tmp);
+    }
+    mig->peerPersistent = virXPathString("string(./transfer/@persistent)",
+                                         ctxt);
+
+    ignore_value(virXPathULongLong("string(./timing/@begin)", ctxt,
+                                   &mig->times.begin));
+    ignore_value(virXPathULongLong("string(./timing/@prepare)", ctxt,
+                                   &mig->times.prepare));
+    ignore_value(virXPathULongLong("string(./timing/@perform)", ctxt,
+                                   &mig->times.perform));
+    ignore_value(virXPathULongLong("string(./timing/@finish)", ctxt,
+                                   &mig->times.finish));
+
     return 0;
 
 error:
@@ -710,6 +938,10 @@ qemuMigrationBakeCookie(qemuMigrationCookiePtr mig,
                         int *cookieoutlen,
                         unsigned int flags)
 {
+    qemuDomainObjPrivatePtr priv = dom->privateData;
+    char *compressed = NULL;
+    size_t compressedlen;
+
     if (!cookieout || !cookieoutlen)
         return 0;
 
@@ -727,6 +959,19 @@ qemuMigrationBakeCookie(qemuMigrationCookiePtr mig,
         qemuMigrationCookieAddPersistent(mig, dom) < 0)
         return -1;
 
+    if (flags & QEMU_MIGRATION_COOKIE_NBD &&
+        qemuMigrationCookieAddNBD(mig, dom) < 0)
+        return -1;
+
+    if (priv->job.phases.begin)
+        mig->times.begin = priv->job.phases.begin;
+    if (priv->job.phases.prepare)
+        mig->times.prepare = priv->job.phases.prepare;
+    if (priv->job.phases.perform)
+        mig->times.perform = priv->job.phases.perform;
+    if (priv->job.phases.finish)
+        mig->times.finish = priv->job.phases.finish;
+
     if (!(*cookieout = qemuMigrationCookieXMLFormatStr(driver, mig)))
         return -1;
 
@@ -734,6 +979,23 @@ qemuMigrationBakeCookie(qemuMigrationCookiePtr mig,
 
     VIR_DEBUG("cookielen=%d cookie=%s", *cookieoutlen, *cookieout);
 
+    /* Cookies carrying the persistent definition of large domains take
+     * a good part of the migration setup when sent verbatim */
+    if (mig->peerCompress) {
+        if (virChunkStreamCompressBuffer(*cookieout, *cookieoutlen,
+                                         &compressed, &compressedlen) < 0)
+            return -1;
+
+        if (compressedlen < *cookieoutlen) {
+            VIR_DEBUG("compressed cookie to %zu bytes", compressedlen);
+            VIR_FREE(*cookieout);
+            *cookieout = compressed;
+            *cookieoutlen = compressedlen;
+        } else {
+            VIR_FREE(compressed);
+        }
+    }
+
     return 0;
 }
 
@@ -746,6 +1008,22 @@ qemuMigrationEatCookie(struct qemud_driver *driver,
                        unsigned int flags)
 {
     qemuMigrationCookiePtr mig = NULL;
+    char *decompressed = NULL;
+    size_t decompressedlen;
+    char *fingerprint = NULL;
+
+    if (cookiein && cookieinlen > 0 &&
+        virChunkStreamIsChunked(cookiein, cookieinlen)) {
+        if (virChunkStreamDecompressBuffer(cookiein, cookieinlen,
+                                           QEMU_MIGRATION_COOKIE_MAX,
+                                           &decompressed,
+                                           &decompressedlen) < 0)
+            goto error;
+        VIR_DEBUG("decompressed cookie from %d to %zu bytes",
+                  cookieinlen, decompressedlen);
+        cookiein = decompressed;
+        cookieinlen = decompressedlen;
+    }
 
     /* Parse & validate incoming cookie (if any) */
     if (cookiein && cookieinlen &&
@@ -758,7 +1036,7 @@ qemuMigrationEatCookie(struct qemud_driver *driver,
     VIR_DEBUG("cookielen=%d cookie='%s'", cookieinlen, NULLSTR(cookiein));
 
     if (!(mig = qemuMigrationCookieNew(dom)))
-        return NULL;
+        goto error;
 
     if (cookiein && cookieinlen &&
         qemuMigrationCookieXMLParseStr(mig,
@@ -785,9 +1063,27 @@ qemuMigrationEatCookie(struct qemud_driver *driver,
         }
     }
 
+    if (mig->persistentFingerprint) {
+        if (dom->newDef &&
+            !(fingerprint = qemuMigrationCookieDefFingerprint(driver,
+                                                              dom->newDef)))
+            goto error;
+
+        if (!fingerprint || STRNEQ(fingerprint, mig->persistentFingerprint)) {
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("No persistent definition with fingerprint %s"),
+                           mig->persistentFingerprint);
+            goto error;
+        }
+        VIR_FREE(fingerprint);
+    }
+
+    VIR_FREE(decompressed);
     return mig;
 
 error:
+    VIR_FREE(decompressed);
+    VIR_FREE(fingerprint);
     qemuMigrationCookieFree(mig);
     return NULL;
 }
@@ -978,6 +1274,57 @@ qemuMigrationWaitForSpice(struct qemud_driver *driver,
     return 0;
 }
 
+/* Bounds of the interval between two queries of migration status (ms) */
+#define QEMU_MIGRATION_POLL_MIN 10
+#define QEMU_MIGRATION_POLL_MAX 500
+#define QEMU_MIGRATION_POLL_DEFAULT 50
+
+/* Query migration status often enough to notice completion soon after
+ * it happens, but not more than needed while a lot of memory is left.  */
+static unsigned long long
+qemuMigrationProgressInterval(qemuDomainObjPrivatePtr priv)
+{
+    unsigned long long interval;
+
+    if (!priv->job.progress.bps)
+        return QEMU_MIGRATION_POLL_DEFAULT;
+
+    interval = priv->job.progress.downtime / 4;
+    if (interval < QEMU_MIGRATION_POLL_MIN)
+        interval = QEMU_MIGRATION_POLL_MIN;
+    if (interval > QEMU_MIGRATION_POLL_MAX)
+        interval = QEMU_MIGRATION_POLL_MAX;
+
+    return interval;
+}
+
+/* Wait for the next status query to be due or for an event which may
+ * have changed the status.  Called with both driver and vm locked.  */
+static void
+qemuMigrationWaitForProgress(struct qemud_driver *driver,
+                             virDomainObjPtr vm)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    unsigned int events = priv->job.progressEvents;
+    unsigned long long interval = qemuMigrationProgressInterval(priv);
+    unsigned long long now;
+
+    virDomainObjUnlock(vm);
+    qemuDriverUnlock(driver);
+    virDomainObjLock(vm);
+
+    if (priv->job.progressEvents == events &&
+        virTimeMillisNow(&now) == 0 &&
+        virCondWaitUntil(&priv->job.progressCond, &vm->lock,
+                         now + interval) < 0 &&
+        errno != ETIMEDOUT)
+        VIR_WARN("Unable to wait for job progress on %s", vm->def->name);
+
+    virDomainObjUnlock(vm);
+    qemuDriverLock(driver);
+    virDomainObjLock(vm);
+}
+
 static int
 qemuMigrationUpdateJobStatus(struct qemud_driver *driver,
                              virDomainObjPtr vm,
@@ -1028,6 +1375,9 @@ qemuMigrationUpdateJobStatus(struct qemud_driver *driver,
         priv->job.info.memRemaining = memRemaining;
         priv->job.info.memProcessed = memProcessed;
 
+        qemuDomainJobProgressUpdate(&priv->job.progress,
+                                    priv->job.info.timeElapsed,
+                                    memProcessed, memRemaining);
         ret = 0;
         break;
 
@@ -1079,9 +1429,6 @@ qemuMigrationWaitForCompletion(struct qemud_driver *driver, virDomainObjPtr vm,
     priv->job.info.type = VIR_DOMAIN_JOB_UNBOUNDED;
 
     while (priv->job.info.type == VIR_DOMAIN_JOB_UNBOUNDED) {
-        /* Poll every 50ms for progress & to allow cancellation */
-        struct timespec ts = { .tv_sec = 0, .tv_nsec = 50 * 1000 * 1000ull };
-
         /* cancel migration if disk I/O error is emitted while migrating */
         if (abort_on_error &&
             virDomainObjGetState(vm, &pauseReason) == VIR_DOMAIN_PAUSED &&
@@ -1091,22 +1438,23 @@ qemuMigrationWaitForCompletion(struct qemud_driver *driver, virDomainObjPtr vm,
         if (qemuMigrationUpdateJobStatus(driver, vm, job, asyncJob) < 0)
             goto cleanup;
 
+        if (priv->job.info.type == VIR_DOMAIN_JOB_UNBOUNDED &&
+            qemuMigrationPolicyApply(driver, vm, asyncJob) < 0)
+            goto cleanup;
+
+        qemuMigrationQueueUpdate(driver, vm, asyncJob);
+
         if (dconn && virConnectIsAlive(dconn) <= 0) {
             virReportError(VIR_ERR_OPERATION_FAILED, "%s",
                            _("Lost connection to destination host"));
             goto cleanup;
         }
 
-        virDomainObjUnlock(vm);
-        qemuDriverUnlock(driver);
-
-        nanosleep(&ts, NULL);
-
-        qemuDriverLock(driver);
-        virDomainObjLock(vm);
+        qemuMigrationWaitForProgress(driver, vm);
     }
 
 cleanup:
+    qemuMigrationPolicyReset(driver, vm, asyncJob);
     if (priv->job.info.type == VIR_DOMAIN_JOB_COMPLETED)
         return 0;
     else
@@ -1124,6 +1472,7 @@ cancel:
     priv->job.info.type = VIR_DOMAIN_JOB_FAILED;
     virReportError(VIR_ERR_OPERATION_FAILED,
                    _("%s: %s"), job, _("failed due to I/O error"));
+    qemuMigrationPolicyReset(driver, vm, asyncJob);
     return -1;
 }
 
@@ -1248,6 +1597,11 @@ char *qemuMigrationBegin(struct qemud_driver *driver,
     virDomainDefPtr def = NULL;
     qemuDomainObjPrivatePtr priv = vm->privateData;
     bool abort_on_error = !!(flags & VIR_MIGRATE_ABORT_ON_ERROR);
+    unsigned int cookie_flags = QEMU_MIGRATION_COOKIE_LOCKSTATE;
+    unsigned long long start = 0;
+    unsigned long long now;
+
+    ignore_value(virTimeMillisNow(&start));
 
     VIR_DEBUG("driver=%p, vm=%p, xmlin=%s, dname=%s,"
               " cookieout=%p, cookieoutlen=%p, flags=%lx",
@@ -1270,11 +1624,6 @@ char *qemuMigrationBegin(struct qemud_driver *driver,
     if (!(mig = qemuMigrationEatCookie(driver, vm, NULL, 0, 0)))
         goto cleanup;
 
-    if (qemuMigrationBakeCookie(mig, driver, vm,
-                                cookieout, cookieoutlen,
-                                QEMU_MIGRATION_COOKIE_LOCKSTATE) < 0)
-        goto cleanup;
-
     if (xmlin) {
         if (!(def = virDomainDefParseString(driver->caps, xmlin,
                                             QEMU_EXPECTED_VIRT_TYPES,
@@ -1295,6 +1644,23 @@ char *qemuMigrationBegin(struct qemud_driver *driver,
         rv = qemuDomainDefFormatLive(driver, vm->def, false, true);
     }
 
+    if (!rv)
+        goto cleanup;
+
+    if (start && virTimeMillisNow(&now) == 0)
+        priv->job.phases.begin = now - start;
+
+    /* Offer to copy non-shared disks with drive-mirror to an NBD server
+     * started by the destination instead of inside the migration stream */
+    if (flags & (VIR_MIGRATE_NON_SHARED_DISK | VIR_MIGRATE_NON_SHARED_INC) &&
+        qemuCapsGet(priv->caps, QEMU_CAPS_DRIVE_MIRROR))
+        cookie_flags |= QEMU_MIGRATION_COOKIE_NBD;
+
+    if (qemuMigrationBakeCookie(mig, driver, vm,
+                                cookieout, cookieoutlen,
+                                cookie_flags) < 0)
+        VIR_FREE(rv);
+
 cleanup:
     qemuMigrationCookieFree(mig);
     virDomainDefFree(def);
@@ -1302,6 +1668,104 @@ cleanup:
 }
 
 
+/* Disks which need to be copied when migrating without shared storage */
+static bool
+qemuMigrationDiskIsCopied(virDomainDiskDefPtr disk)
+{
+    return disk->src && !disk->shared && !disk->readonly &&
+           disk->type != VIR_DOMAIN_DISK_TYPE_NETWORK;
+}
+
+
+/* Export the disks of an incoming domain through an NBD server of its
+ * QEMU process, so that the source can copy them with drive-mirror while
+ * the domain keeps running there.  */
+static int
+qemuMigrationStartNBDServer(struct qemud_driver *driver,
+                            virDomainObjPtr vm,
+                            const char *listenAddr)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    int this_port;
+    int ret = -1;
+    int i;
+    char *diskAlias = NULL;
+
+    if ((this_port = qemuProcessNextFreeNBDPort(driver)) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("Unable to find an unused port for NBD server"));
+        return -1;
+    }
+
+    /* The NBD server wants a bare IPv6 address */
+    if (STREQ(listenAddr, "[::]"))
+        listenAddr = "::";
+
+    if (qemuDomainObjEnterMonitorAsync(driver, vm,
+                                       QEMU_ASYNC_JOB_MIGRATION_IN) < 0) {
+        qemuProcessReturnNBDPort(driver, this_port);
+        return -1;
+    }
+
+    if (qemuMonitorNBDServerStart(priv->mon, listenAddr, this_port) < 0)
+        goto cleanup;
+
+    for (i = 0 ; i < vm->def->ndisks ; i++) {
+        virDomainDiskDefPtr disk = vm->def->disks[i];
+
+        if (!qemuMigrationDiskIsCopied(disk))
+            continue;
+
+        VIR_FREE(diskAlias);
+        if (virAsprintf(&diskAlias, "drive-%s", disk->info.alias) < 0) {
+            virReportOOMError();
+            goto stop;
+        }
+
+        if (qemuMonitorNBDServerAdd(priv->mon, diskAlias, true) < 0)
+            goto stop;
+    }
+
+    VIR_DEBUG("Exporting disks of %s on NBD port %d",
+              vm->def->name, this_port);
+    priv->nbdPort = this_port;
+    ret = 0;
+
+cleanup:
+    qemuDomainObjExitMonitorWithDriver(driver, vm);
+    if (ret < 0)
+        qemuProcessReturnNBDPort(driver, this_port);
+    VIR_FREE(diskAlias);
+    return ret;
+
+stop:
+    ignore_value(qemuMonitorNBDServerStop(priv->mon));
+    goto cleanup;
+}
+
+
+static void
+qemuMigrationStopNBDServer(struct qemud_driver *driver,
+                           virDomainObjPtr vm)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+
+    if (!priv->nbdPort)
+        return;
+
+    if (qemuDomainObjEnterMonitorAsync(driver, vm,
+                                       QEMU_ASYNC_JOB_MIGRATION_IN) < 0)
+        return;
+
+    if (qemuMonitorNBDServerStop(priv->mon) < 0)
+        VIR_WARN("Unable to stop NBD server of %s", vm->def->name);
+    qemuDomainObjExitMonitorWithDriver(driver, vm);
+
+    qemuProcessReturnNBDPort(driver, priv->nbdPort);
+    priv->nbdPort = 0;
+}
+
+
 /* Prepare is the first step, and it runs on the destination host.
  */
 
@@ -1341,12 +1805,14 @@ qemuMigrationPrepareAny(struct qemud_driver *driver,
     int dataFD[2] = { -1, -1 };
     qemuDomainObjPrivatePtr priv = NULL;
     unsigned long long now;
+    unsigned long long end;
     qemuMigrationCookiePtr mig = NULL;
     bool tunnel = !!st;
     char *origname = NULL;
     char *xmlout = NULL;
     const char *listenAddr = NULL;
     char *migrateFrom = NULL;
+    unsigned int cookie_flags = QEMU_MIGRATION_COOKIE_GRAPHICS;
 
     if (virTimeMillisNow(&now) < 0)
         return -1;
@@ -1380,14 +1846,16 @@ qemuMigrationPrepareAny(struct qemud_driver *driver,
         hookret = virHookCall(VIR_HOOK_DRIVER_QEMU, def->name,
                               VIR_HOOK_QEMU_OP_MIGRATE, VIR_HOOK_SUBOP_BEGIN,
                               NULL, xml, &xmlout);
-        VIR_FREE(xml);
 
         if (hookret < 0) {
+            VIR_FREE(xml);
             goto cleanup;
         } else if (hookret == 0) {
             if (!*xmlout) {
                 VIR_DEBUG("Migrate hook filter returned nothing; using the"
                           " original XML");
+            } else if (STREQ(xmlout, xml)) {
+                VIR_DEBUG("Migrate hook filter did not change the XML");
             } else {
                 virDomainDefPtr newdef;
 
@@ -1395,11 +1863,14 @@ qemuMigrationPrepareAny(struct qemud_driver *driver,
                 newdef = virDomainDefParseString(driver->caps, xmlout,
                                                  QEMU_EXPECTED_VIRT_TYPES,
                                                  VIR_DOMAIN_XML_INACTIVE);
-                if (!newdef)
+                if (!newdef) {
+                    VIR_FREE(xml);
                     goto cleanup;
+                }
 
                 if (!virDomainDefCheckABIStability(def, newdef)) {
                     virDomainDefFree(newdef);
+                    VIR_FREE(xml);
                     goto cleanup;
                 }
 
@@ -1407,6 +1878,7 @@ qemuMigrationPrepareAny(struct qemud_driver *driver,
                 def = newdef;
             }
         }
+        VIR_FREE(xml);
     }
 
     if (tunnel) {
@@ -1463,12 +1935,14 @@ qemuMigrationPrepareAny(struct qemud_driver *driver,
     origname = NULL;
 
     if (!(mig = qemuMigrationEatCookie(driver, vm, cookiein, cookieinlen,
-                                       QEMU_MIGRATION_COOKIE_LOCKSTATE)))
+                                       QEMU_MIGRATION_COOKIE_LOCKSTATE |
+                                       QEMU_MIGRATION_COOKIE_NBD)))
         goto cleanup;
 
     if (qemuMigrationJobStart(driver, vm, QEMU_ASYNC_JOB_MIGRATION_IN) < 0)
         goto cleanup;
     qemuMigrationJobSetPhase(driver, vm, QEMU_MIGRATION_PHASE_PREPARE);
+    qemuMigrationCookieGetTimes(mig, vm);
 
     /* Domain starts inactive, even if the domain XML had an id field. */
     vm->def->id = -1;
@@ -1505,6 +1979,18 @@ qemuMigrationPrepareAny(struct qemud_driver *driver,
         dataFD[1] = -1; /* 'st' owns the FD now & will close it */
     }
 
+    /* Tunnelled migrations keep copying disks inside the migration stream;
+     * so do sources which did not offer to copy them over NBD */
+    if (mig->nbd && !tunnel &&
+        qemuCapsGet(priv->caps, QEMU_CAPS_NBD_SERVER)) {
+        if (qemuMigrationStartNBDServer(driver, vm, listenAddr) < 0) {
+            virDomainAuditStart(vm, "migrated", false);
+            qemuProcessStop(driver, vm, VIR_DOMAIN_SHUTOFF_FAILED, 0);
+            goto endjob;
+        }
+        cookie_flags |= QEMU_MIGRATION_COOKIE_NBD;
+    }
+
     if (mig->lockState) {
         VIR_DEBUG("Received lockstate %s", mig->lockState);
         VIR_FREE(priv->lockState);
@@ -1514,8 +2000,14 @@ qemuMigrationPrepareAny(struct qemud_driver *driver,
         VIR_DEBUG("Received no lockstate");
     }
 
+    if (qemuMigrationCookieAddKnownPersistent(mig, driver, vm) < 0)
+        VIR_WARN("Unable to fingerprint persistent domain definition");
+
+    if (virTimeMillisNow(&end) == 0)
+        priv->job.phases.prepare = end - now;
+
     if (qemuMigrationBakeCookie(mig, driver, vm, cookieout, cookieoutlen,
-                                QEMU_MIGRATION_COOKIE_GRAPHICS) < 0) {
+                                cookie_flags) < 0) {
         /* We could tear down the whole guest here, but
          * cookie data is (so far) non-critical, so that
          * seems a little harsh. We'll just warn for now.
@@ -1587,9 +2079,9 @@ qemuMigrationPrepareTunnel(struct qemud_driver *driver,
 {
     int ret;
 
-    VIR_DEBUG("driver=%p, dconn=%p, cookiein=%s, cookieinlen=%d, "
+    VIR_DEBUG("driver=%p, dconn=%p, cookiein=%p, cookieinlen=%d, "
               "cookieout=%p, cookieoutlen=%p, st=%p, dname=%s, dom_xml=%s",
-              driver, dconn, NULLSTR(cookiein), cookieinlen,
+              driver, dconn, cookiein, cookieinlen,
               cookieout, cookieoutlen, st, NULLSTR(dname), dom_xml);
 
     ret = qemuMigrationPrepareAny(driver, dconn, cookiein, cookieinlen,
@@ -1619,10 +2111,10 @@ qemuMigrationPrepareDirect(struct qemud_driver *driver,
     int ret = -1;
     virURIPtr uri = NULL;
 
-    VIR_DEBUG("driver=%p, dconn=%p, cookiein=%s, cookieinlen=%d, "
+    VIR_DEBUG("driver=%p, dconn=%p, cookiein=%p, cookieinlen=%d, "
               "cookieout=%p, cookieoutlen=%p, uri_in=%s, uri_out=%p, "
               "dname=%s, dom_xml=%s",
-              driver, dconn, NULLSTR(cookiein), cookieinlen,
+              driver, dconn, cookiein, cookieinlen,
               cookieout, cookieoutlen, NULLSTR(uri_in), uri_out,
               NULLSTR(dname), dom_xml);
 
@@ -1767,35 +2259,122 @@ struct _qemuMigrationSpec {
     } fwd;
 };
 
-#define TUNNEL_SEND_BUF_SIZE 65536
+/* Largest stream packet payload accepted by every libvirtd version */
+#define TUNNEL_SEND_BUF_SIZE 262120
+
+/* Number of buffers which may be filled by qemu while one is being sent */
+#define TUNNEL_SEND_QUEUE_LEN 8
 
 typedef struct _qemuMigrationIOThread qemuMigrationIOThread;
 typedef qemuMigrationIOThread *qemuMigrationIOThreadPtr;
 struct _qemuMigrationIOThread {
-    virThread thread;
+    virThread thread;       /* reads migration data from qemu */
+    virThread sendThread;   /* forwards it to the stream */
     virStreamPtr st;
     int sock;
     virError err;
     int wakeupRecvFD;
     int wakeupSendFD;
+
+    /* Ring of buffers passed from the reading to the sending thread */
+    virMutex lock;
+    virCond cond;
+    char *bufs[TUNNEL_SEND_QUEUE_LEN];
+    size_t lens[TUNNEL_SEND_QUEUE_LEN];
+    size_t head;            /* first filled buffer */
+    size_t count;           /* number of filled buffers */
+    bool eof;               /* no more data will be queued */
+    bool abort;             /* the stream has to be aborted */
+    bool failed;            /* sending data failed */
+    unsigned long long sent;
 };
 
+
+/* Record the current error, unless an earlier one was already recorded.
+ * Must be called with data->lock held. */
+static void
+qemuMigrationIOSaveError(qemuMigrationIOThreadPtr data)
+{
+    if (data->err.code == VIR_ERR_OK)
+        virCopyLastError(&data->err);
+    virResetLastError();
+}
+
+
+static void qemuMigrationIOSendFunc(void *arg)
+{
+    qemuMigrationIOThreadPtr data = arg;
+    unsigned long long start = 0, end = 0;
+
+    ignore_value(virTimeMillisNow(&start));
+
+    for (;;) {
+        size_t slot;
+
+        virMutexLock(&data->lock);
+        while (data->count == 0 && !data->eof && !data->abort)
+            ignore_value(virCondWait(&data->cond, &data->lock));
+
+        if (data->abort) {
+            virMutexUnlock(&data->lock);
+            goto abrt;
+        }
+        if (data->count == 0) {
+            virMutexUnlock(&data->lock);
+            break;
+        }
+        slot = data->head;
+        virMutexUnlock(&data->lock);
+
+        if (virStreamSend(data->st, data->bufs[slot], data->lens[slot]) < 0)
+            goto error;
+
+        virMutexLock(&data->lock);
+        data->sent += data->lens[slot];
+        data->head = (data->head + 1) % TUNNEL_SEND_QUEUE_LEN;
+        data->count--;
+        virCondBroadcast(&data->cond);
+        virMutexUnlock(&data->lock);
+    }
+
+    if (virStreamFinish(data->st) < 0)
+        goto error;
+
+    ignore_value(virTimeMillisNow(&end));
+    VIR_DEBUG("Migration tunnel forwarded %llu bytes in %llu ms",
+              data->sent, end - start);
+    return;
+
+abrt:
+    virStreamAbort(data->st);
+    virMutexLock(&data->lock);
+    if (virGetLastError())
+        qemuMigrationIOSaveError(data);
+    virMutexUnlock(&data->lock);
+    return;
+
+error:
+    virMutexLock(&data->lock);
+    data->failed = true;
+    qemuMigrationIOSaveError(data);
+    virCondBroadcast(&data->cond);
+    virMutexUnlock(&data->lock);
+}
+
+
+/*
+ * Reads data from qemu into the ring of buffers, so that qemu is not
+ * stalled while the previous chunk is being sent to the destination.
+ */
 static void qemuMigrationIOFunc(void *arg)
 {
     qemuMigrationIOThreadPtr data = arg;
-    char *buffer = NULL;
     struct pollfd fds[2];
     int timeout = -1;
-    virErrorPtr err = NULL;
 
     VIR_DEBUG("Running migration tunnel; stream=%p, sock=%d",
               data->st, data->sock);
 
-    if (VIR_ALLOC_N(buffer, TUNNEL_SEND_BUF_SIZE) < 0) {
-        virReportOOMError();
-        goto abrt;
-    }
-
     fds[0].fd = data->sock;
     fds[1].fd = data->wakeupRecvFD;
 
@@ -1844,11 +2423,28 @@ static void qemuMigrationIOFunc(void *arg)
 
         if (fds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
             int nbytes;
+            size_t slot;
+
+            virMutexLock(&data->lock);
+            while (data->count == TUNNEL_SEND_QUEUE_LEN &&
+                   !data->failed && !data->abort)
+                ignore_value(virCondWait(&data->cond, &data->lock));
+            if (data->failed || data->abort) {
+                /* the sending thread has already dealt with the stream */
+                virMutexUnlock(&data->lock);
+                return;
+            }
+            slot = (data->head + data->count) % TUNNEL_SEND_QUEUE_LEN;
+            virMutexUnlock(&data->lock);
 
-            nbytes = saferead(data->sock, buffer, TUNNEL_SEND_BUF_SIZE);
+            nbytes = saferead(data->sock, data->bufs[slot],
+                              TUNNEL_SEND_BUF_SIZE);
             if (nbytes > 0) {
-                if (virStreamSend(data->st, buffer, nbytes) < 0)
-                    goto error;
+                virMutexLock(&data->lock);
+                data->lens[slot] = nbytes;
+                data->count++;
+                virCondBroadcast(&data->cond);
+                virMutexUnlock(&data->lock);
             } else if (nbytes < 0) {
                 virReportSystemError(errno, "%s",
                         _("tunnelled migration failed to read from qemu"));
@@ -1860,29 +2456,37 @@ static void qemuMigrationIOFunc(void *arg)
         }
     }
 
-    if (virStreamFinish(data->st) < 0)
-        goto error;
-
-    VIR_FREE(buffer);
-
+    virMutexLock(&data->lock);
+    data->eof = true;
+    virCondBroadcast(&data->cond);
+    virMutexUnlock(&data->lock);
     return;
 
 abrt:
-    err = virSaveLastError();
-    if (err && err->code == VIR_ERR_OK) {
-        virFreeError(err);
-        err = NULL;
-    }
-    virStreamAbort(data->st);
-    if (err) {
-        virSetError(err);
-        virFreeError(err);
-    }
+    virMutexLock(&data->lock);
+    if (virGetLastError())
+        qemuMigrationIOSaveError(data);
+    data->abort = true;
+    virCondBroadcast(&data->cond);
+    virMutexUnlock(&data->lock);
+}
 
-error:
-    virCopyLastError(&data->err);
-    virResetLastError();
-    VIR_FREE(buffer);
+
+static void
+qemuMigrationIOThreadFree(qemuMigrationIOThreadPtr io)
+{
+    size_t i;
+
+    if (!io)
+        return;
+
+    for (i = 0 ; i < TUNNEL_SEND_QUEUE_LEN ; i++)
+        VIR_FREE(io->bufs[i]);
+    VIR_FORCE_CLOSE(io->wakeupSendFD);
+    VIR_FORCE_CLOSE(io->wakeupRecvFD);
+    ignore_value(virCondDestroy(&io->cond));
+    virMutexDestroy(&io->lock);
+    VIR_FREE(io);
 }
 
 
@@ -1892,6 +2496,7 @@ qemuMigrationStartTunnel(virStreamPtr st,
 {
     qemuMigrationIOThreadPtr io = NULL;
     int wakeupFD[2] = { -1, -1 };
+    size_t i;
 
     if (pipe2(wakeupFD, O_CLOEXEC) < 0) {
         virReportSystemError(errno, "%s",
@@ -1902,16 +2507,49 @@ qemuMigrationStartTunnel(virStreamPtr st,
     if (VIR_ALLOC(io) < 0)
         goto no_memory;
 
+    if (virMutexInit(&io->lock) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("Unable to initialize mutex"));
+        VIR_FREE(io);
+        goto error;
+    }
+    if (virCondInit(&io->cond) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to initialize condition"));
+        virMutexDestroy(&io->lock);
+        VIR_FREE(io);
+        goto error;
+    }
+
     io->st = st;
     io->sock = sock;
     io->wakeupRecvFD = wakeupFD[0];
     io->wakeupSendFD = wakeupFD[1];
+    wakeupFD[0] = wakeupFD[1] = -1;
+
+    for (i = 0 ; i < TUNNEL_SEND_QUEUE_LEN ; i++) {
+        if (VIR_ALLOC_N(io->bufs[i], TUNNEL_SEND_BUF_SIZE) < 0)
+            goto no_memory;
+    }
+
+    if (virThreadCreate(&io->sendThread, true,
+                        qemuMigrationIOSendFunc,
+                        io) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to create migration thread"));
+        goto error;
+    }
 
     if (virThreadCreate(&io->thread, true,
                         qemuMigrationIOFunc,
                         io) < 0) {
         virReportSystemError(errno, "%s",
                              _("Unable to create migration thread"));
+        virMutexLock(&io->lock);
+        io->abort = true;
+        virCondBroadcast(&io->cond);
+        virMutexUnlock(&io->lock);
+        virThreadJoin(&io->sendThread);
         goto error;
     }
 
@@ -1922,7 +2560,7 @@ no_memory:
 error:
     VIR_FORCE_CLOSE(wakeupFD[0]);
     VIR_FORCE_CLOSE(wakeupFD[1]);
-    VIR_FREE(io);
+    qemuMigrationIOThreadFree(io);
     return NULL;
 }
 
@@ -1939,7 +2577,16 @@ qemuMigrationStopTunnel(qemuMigrationIOThreadPtr io, bool error)
         goto cleanup;
     }
 
+    if (error) {
+        /* do not wait for queued data to be sent */
+        virMutexLock(&io->lock);
+        io->abort = true;
+        virCondBroadcast(&io->cond);
+        virMutexUnlock(&io->lock);
+    }
+
     virThreadJoin(&io->thread);
+    virThreadJoin(&io->sendThread);
 
     /* Forward error from the IO thread, to this thread */
     if (io->err.code != VIR_ERR_OK) {
@@ -1954,9 +2601,7 @@ qemuMigrationStopTunnel(qemuMigrationIOThreadPtr io, bool error)
     rv = 0;
 
 cleanup:
-    VIR_FORCE_CLOSE(io->wakeupSendFD);
-    VIR_FORCE_CLOSE(io->wakeupRecvFD);
-    VIR_FREE(io);
+    qemuMigrationIOThreadFree(io);
     return rv;
 }
 
@@ -1998,6 +2643,269 @@ cleanup:
     return ret;
 }
 
+/* Refresh the progress of the drive-mirror jobs copying disks to the
+ * destination.  Returns 1 once all of them caught up with the guest,
+ * 0 if some are still copying and -1 on error.  */
+static int
+qemuMigrationUpdateDriveMirror(struct qemud_driver *driver,
+                               virDomainObjPtr vm)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    struct qemuDomainJobObj *job = &priv->job;
+    unsigned long long total = 0;
+    unsigned long long processed = 0;
+    bool ready = true;
+    size_t i;
+
+    for (i = 0 ; i < job->nmirrors ; i++) {
+        qemuDomainMirrorProgressPtr mirror = &job->mirrors[i];
+        virDomainBlockJobInfo info;
+        int rv;
+
+        if (qemuDomainObjEnterMonitorAsync(driver, vm,
+                                           QEMU_ASYNC_JOB_MIGRATION_OUT) < 0)
+            return -1;
+        rv = qemuMonitorBlockJob(priv->mon, mirror->device, NULL, 0, &info,
+                                 BLOCK_JOB_INFO, true);
+        qemuDomainObjExitMonitorWithDriver(driver, vm);
+
+        if (rv < 0)
+            return -1;
+        if (!virDomainObjIsActive(vm)) {
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("guest unexpectedly quit"));
+            return -1;
+        }
+        if (rv == 0) {
+            virReportError(VIR_ERR_OPERATION_FAILED,
+                           _("migration of disk %s failed"), mirror->disk);
+            return -1;
+        }
+
+        mirror->processed = info.cur;
+        mirror->total = info.end;
+        /* Once in sync, the copy keeps following guest writes */
+        if (info.end && info.cur == info.end)
+            mirror->ready = true;
+
+        if (!mirror->ready)
+            ready = false;
+        total += mirror->total;
+        processed += mirror->processed;
+    }
+
+    job->info.fileTotal = total;
+    job->info.fileProcessed = processed;
+    job->info.fileRemaining = total - processed;
+
+    return ready ? 1 : 0;
+}
+
+
+/* Stop the drive-mirror jobs copying disks to the destination.  When
+ * @wait is true, memory was migrated and the guest is paused; cancelling
+ * a job which caught up with the guest then leaves a consistent copy on
+ * the destination once the job is gone, so wait for that to happen.
+ * Otherwise the migration failed and errors are ignored.  */
+static int
+qemuMigrationCancelDriveMirror(struct qemud_driver *driver,
+                               virDomainObjPtr vm,
+                               bool wait)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    struct qemuDomainJobObj *job = &priv->job;
+    virErrorPtr orig_err = NULL;
+    size_t i;
+    int ret = -1;
+
+    if (!wait)
+        orig_err = virSaveLastError();
+
+    for (i = 0 ; i < job->nmirrors ; i++) {
+        qemuDomainMirrorProgressPtr mirror = &job->mirrors[i];
+        int rv;
+
+        if (qemuDomainObjEnterMonitorAsync(driver, vm,
+                                           QEMU_ASYNC_JOB_MIGRATION_OUT) < 0)
+            goto cleanup;
+        rv = qemuMonitorBlockJob(priv->mon, mirror->device, NULL, 0, NULL,
+                                 BLOCK_JOB_ABORT, true);
+        qemuDomainObjExitMonitorWithDriver(driver, vm);
+
+        if (rv < 0 && wait)
+            goto cleanup;
+    }
+
+    while (wait) {
+        bool done = true;
+
+        for (i = 0 ; i < job->nmirrors ; i++) {
+            qemuDomainMirrorProgressPtr mirror = &job->mirrors[i];
+            virDomainBlockJobInfo info;
+            int rv;
+
+            if (qemuDomainObjEnterMonitorAsync(driver, vm,
+                                               QEMU_ASYNC_JOB_MIGRATION_OUT) < 0)
+                goto cleanup;
+            rv = qemuMonitorBlockJob(priv->mon, mirror->device, NULL, 0,
+                                     &info, BLOCK_JOB_INFO, true);
+            qemuDomainObjExitMonitorWithDriver(driver, vm);
+
+            if (rv < 0)
+                goto cleanup;
+            if (rv > 0)
+                done = false;
+        }
+
+        if (done)
+            break;
+
+        if (!virDomainObjIsActive(vm)) {
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("guest unexpectedly quit"));
+            goto cleanup;
+        }
+
+        qemuMigrationWaitForProgress(driver, vm);
+    }
+
+    ret = 0;
+
+cleanup:
+    if (orig_err) {
+        virSetError(orig_err);
+        virFreeError(orig_err);
+    }
+    return ret;
+}
+
+
+/* Copy non-shared disks of a domain to the NBD server started by the
+ * destination with one drive-mirror job per disk.  All disks are copied
+ * in parallel while the guest keeps running, and this returns once all
+ * of them caught up with the guest.  The jobs then mirror guest writes
+ * until qemuMigrationCancelDriveMirror is called.  */
+static int
+qemuMigrationDriveMirror(struct qemud_driver *driver,
+                         virDomainObjPtr vm,
+                         qemuMigrationCookiePtr mig,
+                         const char *host,
+                         unsigned long speed,
+                         unsigned long flags,
+                         virConnectPtr dconn)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    struct qemuDomainJobObj *job = &priv->job;
+    unsigned int mirror_flags = VIR_DOMAIN_BLOCK_REBASE_REUSE_EXT;
+    unsigned long disk_speed = 0;
+    char *nbd_dest = NULL;
+    size_t ncopied = 0;
+    unsigned long long elapsed;
+    int i;
+    int rv;
+    int ret = -1;
+
+    VIR_DEBUG("driver=%p, vm=%p, host=%s, port=%d, speed=%lu, flags=%lx",
+              driver, vm, host, mig->nbd->port, speed, flags);
+
+    /* Only copy what is not in the backing chain already present on
+     * the destination */
+    if (flags & VIR_MIGRATE_NON_SHARED_INC)
+        mirror_flags |= VIR_DOMAIN_BLOCK_REBASE_SHALLOW;
+
+    for (i = 0 ; i < vm->def->ndisks ; i++) {
+        if (qemuMigrationDiskIsCopied(vm->def->disks[i]))
+            ncopied++;
+    }
+    if (!ncopied)
+        return 0;
+
+    if (VIR_ALLOC_N(job->mirrors, ncopied) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+
+    /* Disks share the bandwidth allowed for the migration */
+    if (speed < QEMU_DOMAIN_MIG_BANDWIDTH_MAX) {
+        disk_speed = speed / ncopied;
+        if (!disk_speed)
+            disk_speed = 1;
+    }
+
+    ignore_value(virTimeMillisNow(&job->mirrorStart));
+
+    for (i = 0 ; i < vm->def->ndisks ; i++) {
+        virDomainDiskDefPtr disk = vm->def->disks[i];
+        qemuDomainMirrorProgressPtr mirror = &job->mirrors[job->nmirrors];
+
+        if (!qemuMigrationDiskIsCopied(disk))
+            continue;
+
+        if (!(mirror->disk = strdup(disk->dst)) ||
+            virAsprintf(&mirror->device, "drive-%s", disk->info.alias) < 0 ||
+            virAsprintf(&nbd_dest, "nbd:%s:%d:exportname=%s",
+                        host, mig->nbd->port, mirror->device) < 0) {
+            virReportOOMError();
+            goto error;
+        }
+
+        if (qemuDomainObjEnterMonitorAsync(driver, vm,
+                                           QEMU_ASYNC_JOB_MIGRATION_OUT) < 0)
+            goto error;
+        rv = qemuMonitorDriveMirror(priv->mon, mirror->device, nbd_dest,
+                                    NULL, disk_speed, mirror_flags);
+        qemuDomainObjExitMonitorWithDriver(driver, vm);
+        VIR_FREE(nbd_dest);
+
+        if (rv < 0)
+            goto error;
+        job->nmirrors++;
+    }
+
+    job->info.type = VIR_DOMAIN_JOB_UNBOUNDED;
+
+    while ((rv = qemuMigrationUpdateDriveMirror(driver, vm)) == 0) {
+        if (job->asyncAbort) {
+            virReportError(VIR_ERR_OPERATION_ABORTED, _("%s: %s"),
+                           qemuDomainAsyncJobTypeToString(job->asyncJob),
+                           _("canceled by client"));
+            goto error;
+        }
+
+        if (dconn && virConnectIsAlive(dconn) <= 0) {
+            virReportError(VIR_ERR_OPERATION_FAILED, "%s",
+                           _("Lost connection to destination host"));
+            goto error;
+        }
+
+        qemuMigrationWaitForProgress(driver, vm);
+    }
+    if (rv < 0)
+        goto error;
+
+    if (virTimeMillisNow(&job->mirrorEnd) == 0) {
+        elapsed = job->mirrorEnd - job->mirrorStart;
+        VIR_DEBUG("Copied %zu disks of %s (%llu bytes) in %llu ms",
+                  job->nmirrors, vm->def->name, job->info.fileTotal, elapsed);
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(nbd_dest);
+    return ret;
+
+error:
+    /* The disk which failed to start is not counted in nmirrors */
+    if (job->nmirrors < ncopied) {
+        VIR_FREE(job->mirrors[job->nmirrors].disk);
+        VIR_FREE(job->mirrors[job->nmirrors].device);
+    }
+    qemuMigrationCancelDriveMirror(driver, vm, false);
+    goto cleanup;
+}
+
+
 static int
 qemuMigrationRun(struct qemud_driver *driver,
                  virDomainObjPtr vm,
@@ -2019,11 +2927,16 @@ qemuMigrationRun(struct qemud_driver *driver,
     unsigned long migrate_speed = resource ? resource : priv->migMaxBandwidth;
     virErrorPtr orig_err = NULL;
     bool abort_on_error = !!(flags & VIR_MIGRATE_ABORT_ON_ERROR);
+    bool mirrored = false;
+    unsigned long long start = 0;
+    unsigned long long now;
+
+    ignore_value(virTimeMillisNow(&start));
 
-    VIR_DEBUG("driver=%p, vm=%p, cookiein=%s, cookieinlen=%d, "
+    VIR_DEBUG("driver=%p, vm=%p, cookiein=%p, cookieinlen=%d, "
               "cookieout=%p, cookieoutlen=%p, flags=%lx, resource=%lu, "
               "spec=%p (dest=%d, fwd=%d)",
-              driver, vm, NULLSTR(cookiein), cookieinlen,
+              driver, vm, cookiein, cookieinlen,
               cookieout, cookieoutlen, flags, resource,
               spec, spec->destType, spec->fwdType);
 
@@ -2037,12 +2950,18 @@ qemuMigrationRun(struct qemud_driver *driver,
     }
 
     if (!(mig = qemuMigrationEatCookie(driver, vm, cookiein, cookieinlen,
-                                       QEMU_MIGRATION_COOKIE_GRAPHICS)))
+                                       QEMU_MIGRATION_COOKIE_GRAPHICS |
+                                       QEMU_MIGRATION_COOKIE_NBD)))
         goto cleanup;
+    qemuMigrationCookieGetTimes(mig, vm);
 
     if (qemuDomainMigrateGraphicsRelocate(driver, vm, mig) < 0)
         VIR_WARN("unable to provide data for graphics client relocation");
 
+    /* Wait for our turn and share of bandwidth among outgoing migrations */
+    if (qemuMigrationQueueEnter(driver, vm, &migrate_speed) < 0)
+        goto cleanup;
+
     /* Before EnterMonitor, since qemuMigrationSetOffline already does that */
     if (!(flags & VIR_MIGRATE_LIVE) &&
         virDomainObjGetState(vm, NULL) == VIR_DOMAIN_RUNNING) {
@@ -2050,6 +2969,19 @@ qemuMigrationRun(struct qemud_driver *driver,
             goto cleanup;
     }
 
+    /* Copy disks before memory instead of inside the migration stream
+     * if the destination exports them over NBD */
+    if (flags & (VIR_MIGRATE_NON_SHARED_DISK | VIR_MIGRATE_NON_SHARED_INC) &&
+        mig->nbd && mig->nbd->port &&
+        (spec->destType == MIGRATION_DEST_HOST ||
+         spec->destType == MIGRATION_DEST_CONNECT_HOST) &&
+        qemuCapsGet(priv->caps, QEMU_CAPS_DRIVE_MIRROR)) {
+        if (qemuMigrationDriveMirror(driver, vm, mig, spec->dest.host.name,
+                                     migrate_speed, flags, dconn) < 0)
+            goto cleanup;
+        mirrored = true;
+    }
+
     if (qemuDomainObjEnterMonitorAsync(driver, vm,
                                        QEMU_ASYNC_JOB_MIGRATION_OUT) < 0)
         goto cleanup;
@@ -2070,10 +3002,10 @@ qemuMigrationRun(struct qemud_driver *driver,
         goto cleanup;
     }
 
-    if (flags & VIR_MIGRATE_NON_SHARED_DISK)
+    if (!mirrored && (flags & VIR_MIGRATE_NON_SHARED_DISK))
         migrate_flags |= QEMU_MONITOR_MIGRATE_NON_SHARED_DISK;
 
-    if (flags & VIR_MIGRATE_NON_SHARED_INC)
+    if (!mirrored && (flags & VIR_MIGRATE_NON_SHARED_INC))
         migrate_flags |= QEMU_MONITOR_MIGRATE_NON_SHARED_INC;
 
     /* connect to the destination qemu if needed */
@@ -2182,6 +3114,15 @@ cleanup:
         VIR_FORCE_CLOSE(fd);
     }
 
+    if (mirrored &&
+        qemuMigrationCancelDriveMirror(driver, vm, ret == 0) < 0)
+        ret = -1;
+
+    qemuMigrationQueueLeave(driver, vm);
+
+    if (ret == 0 && start && virTimeMillisNow(&now) == 0)
+        priv->job.phases.perform = now - start;
+
     if (ret == 0 &&
         qemuMigrationBakeCookie(mig, driver, vm, cookieout, cookieoutlen,
                                 QEMU_MIGRATION_COOKIE_PERSISTENT ) < 0)
@@ -2228,9 +3169,9 @@ static int doNativeMigrate(struct qemud_driver *driver,
     int ret = -1;
     qemuMigrationSpec spec;
 
-    VIR_DEBUG("driver=%p, vm=%p, uri=%s, cookiein=%s, cookieinlen=%d, "
+    VIR_DEBUG("driver=%p, vm=%p, uri=%s, cookiein=%p, cookieinlen=%d, "
               "cookieout=%p, cookieoutlen=%p, flags=%lx, resource=%lu",
-              driver, vm, uri, NULLSTR(cookiein), cookieinlen,
+              driver, vm, uri, cookiein, cookieinlen,
               cookieout, cookieoutlen, flags, resource);
 
     if (STRPREFIX(uri, "tcp:") && !STRPREFIX(uri, "tcp://")) {
@@ -2284,9 +3225,9 @@ static int doTunnelMigrate(struct qemud_driver *driver,
     int ret = -1;
     qemuMigrationSpec spec;
 
-    VIR_DEBUG("driver=%p, vm=%p, st=%p, cookiein=%s, cookieinlen=%d, "
+    VIR_DEBUG("driver=%p, vm=%p, st=%p, cookiein=%p, cookieinlen=%d, "
               "cookieout=%p, cookieoutlen=%p, flags=%lx, resource=%lu",
-              driver, vm, st, NULLSTR(cookiein), cookieinlen,
+              driver, vm, st, cookiein, cookieinlen,
               cookieout, cookieoutlen, flags, resource);
 
     if (!qemuCapsGet(priv->caps, QEMU_CAPS_MIGRATE_QEMU_FD) &&
@@ -2847,6 +3788,7 @@ qemuMigrationPerformJob(struct qemud_driver *driver,
      * confirm step.
      */
     if (!v3proto) {
+        qemuDomainObjJobCompleted(vm);
         qemuProcessStop(driver, vm, VIR_DOMAIN_SHUTOFF_MIGRATED,
                         VIR_QEMU_PROCESS_STOP_MIGRATED);
         virDomainAuditStop(vm, "migrated");
@@ -3003,10 +3945,10 @@ qemuMigrationPerform(struct qemud_driver *driver,
                      bool v3proto)
 {
     VIR_DEBUG("driver=%p, conn=%p, vm=%p, xmlin=%s, dconnuri=%s, "
-              "uri=%s, cookiein=%s, cookieinlen=%d, cookieout=%p, "
+              "uri=%s, cookiein=%p, cookieinlen=%d, cookieout=%p, "
               "cookieoutlen=%p, flags=%lx, dname=%s, resource=%lu, v3proto=%d",
               driver, conn, vm, NULLSTR(xmlin), NULLSTR(dconnuri),
-              NULLSTR(uri), NULLSTR(cookiein), cookieinlen,
+              NULLSTR(uri), cookiein, cookieinlen,
               cookieout, cookieoutlen, flags, NULLSTR(dname),
               resource, v3proto);
 
@@ -3112,10 +4054,14 @@ qemuMigrationFinish(struct qemud_driver *driver,
     virErrorPtr orig_err = NULL;
     int cookie_flags = 0;
     qemuDomainObjPrivatePtr priv = vm->privateData;
+    unsigned long long start = 0;
+    unsigned long long now;
+
+    ignore_value(virTimeMillisNow(&start));
 
-    VIR_DEBUG("driver=%p, dconn=%p, vm=%p, cookiein=%s, cookieinlen=%d, "
+    VIR_DEBUG("driver=%p, dconn=%p, vm=%p, cookiein=%p, cookieinlen=%d, "
               "cookieout=%p, cookieoutlen=%p, flags=%lx, retcode=%d",
-              driver, dconn, vm, NULLSTR(cookiein), cookieinlen,
+              driver, dconn, vm, cookiein, cookieinlen,
               cookieout, cookieoutlen, flags, retcode);
 
     if (!qemuMigrationJobIsActive(vm, QEMU_ASYNC_JOB_MIGRATION_IN))
@@ -3133,6 +4079,7 @@ qemuMigrationFinish(struct qemud_driver *driver,
     if (!(mig = qemuMigrationEatCookie(driver, vm, cookiein,
                                        cookieinlen, cookie_flags)))
         goto endjob;
+    qemuMigrationCookieGetTimes(mig, vm);
 
     /* Did the migration go as planned?  If yes, return the domain
      * object, but if no, clean up the empty qemu process.
@@ -3154,6 +4101,9 @@ qemuMigrationFinish(struct qemud_driver *driver,
             goto endjob;
         }
 
+        /* The source finished copying disks before the memory */
+        qemuMigrationStopNBDServer(driver, vm);
+
         if (flags & VIR_MIGRATE_PERSIST_DEST) {
             virDomainDefPtr vmdef;
             if (vm->persistent)
@@ -3266,6 +4216,11 @@ qemuMigrationFinish(struct qemud_driver *driver,
                                          VIR_DOMAIN_EVENT_STOPPED_FAILED);
     }
 
+    if (start && virTimeMillisNow(&now) == 0)
+        priv->job.phases.finish = now - start;
+    if (dom)
+        qemuDomainObjJobCompleted(vm);
+
     if (qemuMigrationBakeCookie(mig, driver, vm, cookieout, cookieoutlen, 0) < 0)
         VIR_WARN("Unable to encode migration cookie");
 
@@ -3303,10 +4258,11 @@ int qemuMigrationConfirm(struct qemud_driver *driver,
 {
     qemuMigrationCookiePtr mig;
     virDomainEventPtr event = NULL;
+    qemuDomainObjPrivatePtr priv = vm->privateData;
     int rv = -1;
-    VIR_DEBUG("driver=%p, conn=%p, vm=%p, cookiein=%s, cookieinlen=%d, "
+    VIR_DEBUG("driver=%p, conn=%p, vm=%p, cookiein=%p, cookieinlen=%d, "
               "flags=%x, retcode=%d",
-              driver, conn, vm, NULLSTR(cookiein), cookieinlen,
+              driver, conn, vm, cookiein, cookieinlen,
               flags, retcode);
 
     virCheckFlags(QEMU_MIGRATION_FLAGS, -1);
@@ -3318,6 +4274,12 @@ int qemuMigrationConfirm(struct qemud_driver *driver,
 
     if (!(mig = qemuMigrationEatCookie(driver, vm, cookiein, cookieinlen, 0)))
         return -1;
+    qemuMigrationCookieGetTimes(mig, vm);
+
+    VIR_DEBUG("Migration phases of %s took begin=%llu prepare=%llu"
+              " perform=%llu finish=%llu ms", vm->def->name,
+              priv->job.phases.begin, priv->job.phases.prepare,
+              priv->job.phases.perform, priv->job.phases.finish);
 
     /* Did the migration go as planned?  If yes, kill off the
      * domain object, but if no, resume CPUs
@@ -3327,6 +4289,7 @@ int qemuMigrationConfirm(struct qemud_driver *driver,
          * up domain shutdown until SPICE server transfers its data */
         qemuMigrationWaitForSpice(driver, vm);
 
+        qemuDomainObjJobCompleted(vm);
         qemuProcessStop(driver, vm, VIR_DOMAIN_SHUTOFF_MIGRATED,
                         VIR_QEMU_PROCESS_STOP_MIGRATED);
         virDomainAuditStop(vm, "migrated");
@@ -3372,7 +4335,8 @@ cleanup:
 int
 qemuMigrationToFile(struct qemud_driver *driver, virDomainObjPtr vm,
                     int fd, off_t offset, const char *path,
-                    const char *compressor,
+                    const char *const *compressor,
+                    unsigned long bandwidth,
                     bool bypassSecurityDriver,
                     enum qemuDomainAsyncJob asyncJob)
 {
@@ -3385,12 +4349,14 @@ qemuMigrationToFile(struct qemud_driver *driver, virDomainObjPtr vm,
     int pipeFD[2] = { -1, -1 };
     unsigned long saveMigBandwidth = priv->migMaxBandwidth;
 
-    /* Increase migration bandwidth to unlimited since target is a file.
+    /* Increase migration bandwidth to unlimited since target is a file,
+     * unless the caller asked for a limit (MiB/s).
      * Failure to change migration speed is not fatal. */
+    if (!bandwidth)
+        bandwidth = QEMU_DOMAIN_MIG_BANDWIDTH_MAX;
     if (qemuDomainObjEnterMonitorAsync(driver, vm, asyncJob) == 0) {
-        qemuMonitorSetMigrationSpeed(priv->mon,
-                                     QEMU_DOMAIN_MIG_BANDWIDTH_MAX);
-        priv->migMaxBandwidth = QEMU_DOMAIN_MIG_BANDWIDTH_MAX;
+        qemuMonitorSetMigrationSpeed(priv->mon, bandwidth);
+        priv->migMaxBandwidth = bandwidth;
         qemuDomainObjExitMonitorWithDriver(driver, vm);
     }
 
@@ -3456,14 +4422,8 @@ qemuMigrationToFile(struct qemud_driver *driver, virDomainObjPtr vm,
                                           args, path, offset);
         }
     } else {
-        const char *prog = compressor;
-        const char *args[] = {
-            prog,
-            "-c",
-            NULL
-        };
         if (pipeFD[0] != -1) {
-            cmd = virCommandNewArgs(args);
+            cmd = virCommandNewArgs(compressor);
             virCommandSetInputFD(cmd, pipeFD[0]);
             virCommandSetOutputFD(cmd, &fd);
             if (virSetCloseExec(pipeFD[1]) < 0) {
@@ -3485,7 +4445,7 @@ qemuMigrationToFile(struct qemud_driver *driver, virDomainObjPtr vm,
         } else {
             rc = qemuMonitorMigrateToFile(priv->mon,
                                           QEMU_MONITOR_MIGRATE_BACKGROUND,
-                                          args, path, offset);
+                                          compressor, path, offset);
         }
     }
     qemuDomainObjExitMonitorWithDriver(driver, vm);
@@ -3501,6 +4461,7 @@ qemuMigrationToFile(struct qemud_driver *driver, virDomainObjPtr vm,
     if (cmd && virCommandWait(cmd, NULL) < 0)
         goto cleanup;
 
+    qemuDomainObjJobCompleted(vm);
     ret = 0;
 
 cleanup:
@@ -151,7 +151,8 @@ bool qemuMigrationIsAllowed(struct qemud_driver *driver, virDomainObjPtr vm,
 
 int qemuMigrationToFile(struct qemud_driver *driver, virDomainObjPtr vm,
                         int fd, off_t offset, const char *path,
-                        const char *compressor,
+                        const char *const *compressor,
+                        unsigned long bandwidth,
                         bool bypassSecurityDriver,
                         enum qemuDomainAsyncJob asyncJob)
     ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(5)
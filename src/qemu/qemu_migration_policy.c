@@ -0,0 +1,605 @@
+/*
+ * qemu_migration_policy.c: QEMU migration convergence and bandwidth policies
+ *
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "qemu_migration_policy.h"
+#include "qemu_monitor.h"
+#include "qemu_cgroup.h"
+
+#include "logging.h"
+#include "memory.h"
+#include "virtime.h"
+#include "virterror_internal.h"
+
+#define VIR_FROM_THIS VIR_FROM_QEMU
+
+/* A migration is not converging if the guest dirties memory at least
+ * this fast, in percent of the transfer rate */
+#define QEMU_MIGRATION_POLICY_DIRTY_RATIO 50
+
+/* How much vCPU time is withheld at each throttling step (percent) */
+#define QEMU_MIGRATION_POLICY_THROTTLE_STEP 20
+
+/* Smallest CFS quota accepted by the kernel (us) */
+#define QEMU_MIGRATION_POLICY_MIN_QUOTA 1000
+
+/* How often a migration waiting for its turn checks for being aborted */
+#define QEMU_MIGRATION_QUEUE_POLL 500
+
+
+static int
+qemuMigrationPolicySetDowntime(struct qemud_driver *driver,
+                               virDomainObjPtr vm,
+                               enum qemuDomainAsyncJob asyncJob,
+                               unsigned long long downtime)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    int ret;
+
+    if (qemuDomainObjEnterMonitorAsync(driver, vm, asyncJob) < 0)
+        return -1;
+    ret = qemuMonitorSetMigrationDowntime(priv->mon, downtime);
+    qemuDomainObjExitMonitorWithDriver(driver, vm);
+
+    return ret;
+}
+
+
+/* Throttling needs a separate cgroup for each vCPU thread, see
+ * qemuSetupCgroupForVcpu.  */
+static bool
+qemuMigrationPolicyCanThrottle(struct qemud_driver *driver,
+                               virDomainObjPtr vm)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+
+    return driver->cgroup &&
+        qemuCgroupControllerActive(driver, VIR_CGROUP_CONTROLLER_CPU) &&
+        priv->nvcpupids > 0 &&
+        priv->vcpupids[0] != vm->pid;
+}
+
+
+/* Withhold @throttle percent of the CPU time each vCPU is allowed to use
+ * according to the domain configuration, or go back to that
+ * configuration if @throttle is 0.  The throttle is kept in the status
+ * XML so that it can be removed if libvirtd restarts meanwhile.  */
+static int
+qemuMigrationPolicySetThrottle(struct qemud_driver *driver,
+                               virDomainObjPtr vm,
+                               unsigned int throttle)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    virCgroupPtr cgroup = NULL;
+    virCgroupPtr cgroup_vcpu = NULL;
+    long long quota = vm->def->cputune.quota;
+    int ret = -1;
+    int rc;
+    int i;
+
+    rc = virCgroupForDomain(driver->cgroup, vm->def->name, &cgroup, 0);
+    if (rc != 0) {
+        virReportSystemError(-rc,
+                             _("Unable to find cgroup for %s"),
+                             vm->def->name);
+        goto cleanup;
+    }
+
+    for (i = 0; i < priv->nvcpupids; i++) {
+        long long newQuota;
+
+        rc = virCgroupForVcpu(cgroup, i, &cgroup_vcpu, 0);
+        if (rc < 0) {
+            virReportSystemError(-rc,
+                                 _("Unable to find vcpu cgroup for %s(vcpu:"
+                                   " %d)"),
+                                 vm->def->name, i);
+            goto cleanup;
+        }
+
+        if (throttle) {
+            unsigned long long period;
+
+            if (quota > 0) {
+                newQuota = quota;
+            } else {
+                rc = virCgroupGetCpuCfsPeriod(cgroup_vcpu, &period);
+                if (rc < 0) {
+                    virReportSystemError(-rc, "%s",
+                                         _("Unable to get cpu bandwidth period"));
+                    goto cleanup;
+                }
+                newQuota = period;
+            }
+
+            newQuota = newQuota * (100 - throttle) / 100;
+            if (newQuota < QEMU_MIGRATION_POLICY_MIN_QUOTA)
+                newQuota = QEMU_MIGRATION_POLICY_MIN_QUOTA;
+        } else {
+            newQuota = quota > 0 ? quota : -1;
+        }
+
+        if (qemuSetupCgroupVcpuBW(cgroup_vcpu, 0, newQuota) < 0)
+            goto cleanup;
+
+        virCgroupFree(&cgroup_vcpu);
+    }
+
+    priv->migThrottle = throttle;
+    if (virDomainSaveStatus(driver->caps, driver->stateDir, vm) < 0)
+        VIR_WARN("Failed to save status on vm %s", vm->def->name);
+
+    ret = 0;
+
+cleanup:
+    virCgroupFree(&cgroup_vcpu);
+    virCgroupFree(&cgroup);
+    return ret;
+}
+
+
+/**
+ * qemuMigrationPolicyApply:
+ *
+ * Called with the driver and @vm locked each time the status of an
+ * outgoing migration has been updated.  Once the migration did not
+ * finish after the configured number of passes over guest memory and
+ * the guest dirtied memory too fast during the last complete pass for
+ * it to finish any time soon, takes at most one action per pass, that
+ * is each time a new dirtying rate was measured, according to the
+ * configured policy:
+ *
+ *  - raise the maximum downtime if stopping the guest long enough to
+ *    transfer what the next pass is expected to start with does not
+ *    exceed the limit,
+ *  - otherwise withhold enough vCPU time from the guest to bring its
+ *    dirtying rate below the threshold, assuming the rate follows the
+ *    CPU time the guest gets, and at least one more step,
+ *  - and when vCPUs cannot be throttled any further, raise the maximum
+ *    downtime to the limit.
+ *
+ * Returns 0 on success, -1 if the domain could not be talked to.
+ */
+int
+qemuMigrationPolicyApply(struct qemud_driver *driver,
+                         virDomainObjPtr vm,
+                         enum qemuDomainAsyncJob asyncJob)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    qemuDomainJobProgressPtr progress = &priv->job.progress;
+    qemuDomainJobConvergePtr converge = &priv->job.converge;
+    int policy = driver->migrationConvergePolicy;
+    unsigned long long maxDowntime = driver->migrationConvergeMaxDowntime;
+    unsigned int maxThrottle = driver->migrationConvergeMaxThrottle;
+    unsigned long long downtime;
+    unsigned long long expected;
+
+    if (policy == QEMU_MIGRATION_CONVERGE_NONE ||
+        asyncJob != QEMU_ASYNC_JOB_MIGRATION_OUT)
+        return 0;
+
+    /* The dirtying rate is known once the first pass is complete */
+    if (!progress->bps ||
+        progress->iteration < 2 ||
+        progress->iteration <= converge->iteration ||
+        progress->iteration <= driver->migrationConvergeIterations)
+        return 0;
+    converge->iteration = progress->iteration;
+
+    if (progress->dirtyRate * 100 <
+        progress->bps * QEMU_MIGRATION_POLICY_DIRTY_RATIO)
+        return 0;
+
+    if (converge->downtime)
+        downtime = converge->downtime;
+    else if (priv->migMaxDowntime)
+        downtime = priv->migMaxDowntime;
+    else
+        downtime = QEMU_MIGRATION_DEFAULT_DOWNTIME;
+
+    /* QEMU finishes the migration by itself once it can */
+    if (progress->downtime <= downtime)
+        return 0;
+
+    if (policy != QEMU_MIGRATION_CONVERGE_DOWNTIME &&
+        !converge->noThrottle &&
+        !qemuMigrationPolicyCanThrottle(driver, vm)) {
+        VIR_WARN("Unable to throttle vCPUs of domain %s without cgroup cpu "
+                 "controller and vCPU threads", vm->def->name);
+        converge->noThrottle = true;
+    }
+
+    /* A pass has just started, so the memory dirtied while the remaining
+     * memory is sent is what the next pass starts with.  Leave some room
+     * as the dirtying rate varies from pass to pass.  */
+    if (progress->dirtyRate < progress->bps)
+        expected = progress->downtime * progress->dirtyRate / progress->bps;
+    else
+        expected = progress->downtime;
+    expected += expected / 4;
+
+    /* QEMU will be able to finish after the next pass */
+    if (expected <= downtime)
+        return 0;
+
+    if (policy != QEMU_MIGRATION_CONVERGE_THROTTLE &&
+        expected <= maxDowntime) {
+        VIR_DEBUG("Raising maximum downtime of %s from %llums to %llums",
+                  vm->def->name, downtime, expected);
+        if (qemuMigrationPolicySetDowntime(driver, vm, asyncJob, expected) < 0)
+            return -1;
+        converge->downtime = expected;
+    } else if (policy != QEMU_MIGRATION_CONVERGE_DOWNTIME &&
+               !converge->noThrottle &&
+               converge->throttle < maxThrottle) {
+        unsigned long long share;
+        unsigned int throttle;
+
+        /* Share of its configured CPU time (percent) the guest may get
+         * for its dirtying rate to fall below the threshold */
+        share = (100 - converge->throttle) * progress->bps *
+                QEMU_MIGRATION_POLICY_DIRTY_RATIO /
+                (100 * progress->dirtyRate);
+        throttle = 100 - share;
+        if (throttle < converge->throttle + QEMU_MIGRATION_POLICY_THROTTLE_STEP)
+            throttle = converge->throttle + QEMU_MIGRATION_POLICY_THROTTLE_STEP;
+        if (throttle > maxThrottle)
+            throttle = maxThrottle;
+
+        VIR_DEBUG("Throttling vCPUs of %s by %u%%", vm->def->name, throttle);
+        if (qemuMigrationPolicySetThrottle(driver, vm, throttle) < 0) {
+            VIR_WARN("Unable to throttle vCPUs of domain %s", vm->def->name);
+            virResetLastError();
+            converge->noThrottle = true;
+            return 0;
+        }
+        converge->throttle = throttle;
+    } else if (policy != QEMU_MIGRATION_CONVERGE_THROTTLE &&
+               downtime < maxDowntime) {
+        VIR_DEBUG("Raising maximum downtime of %s from %llums to the "
+                  "%llums limit", vm->def->name, downtime, maxDowntime);
+        if (qemuMigrationPolicySetDowntime(driver, vm, asyncJob,
+                                           maxDowntime) < 0)
+            return -1;
+        converge->downtime = maxDowntime;
+    } else {
+        return 0;
+    }
+
+    converge->actions++;
+    return 0;
+}
+
+
+/**
+ * qemuMigrationPolicyReset:
+ *
+ * Undoes changes made by qemuMigrationPolicyApply once the migration
+ * finished, so that the domain runs unthrottled if it is resumed on
+ * this host and a later migration starts with the downtime set by the
+ * user.
+ */
+void
+qemuMigrationPolicyReset(struct qemud_driver *driver,
+                         virDomainObjPtr vm,
+                         enum qemuDomainAsyncJob asyncJob)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    qemuDomainJobConvergePtr converge = &priv->job.converge;
+    virErrorPtr orig_err;
+
+    if (asyncJob != QEMU_ASYNC_JOB_MIGRATION_OUT ||
+        !virDomainObjIsActive(vm) ||
+        (!priv->migThrottle && !converge->downtime))
+        return;
+
+    /* Don't overwrite the error which made the migration fail */
+    orig_err = virSaveLastError();
+
+    if (priv->migThrottle &&
+        qemuMigrationPolicySetThrottle(driver, vm, 0) < 0)
+        VIR_WARN("Unable to restore vCPU bandwidth of domain %s",
+                 vm->def->name);
+
+    if (converge->downtime) {
+        unsigned long long downtime = priv->migMaxDowntime;
+
+        if (!downtime)
+            downtime = QEMU_MIGRATION_DEFAULT_DOWNTIME;
+        if (qemuMigrationPolicySetDowntime(driver, vm, asyncJob,
+                                           downtime) < 0)
+            VIR_WARN("Unable to restore maximum downtime of domain %s",
+                     vm->def->name);
+        converge->downtime = 0;
+    }
+
+    if (orig_err) {
+        virSetError(orig_err);
+        virFreeError(orig_err);
+    } else {
+        virResetLastError();
+    }
+}
+
+
+/**
+ * qemuMigrationPolicyRecover:
+ *
+ * Gives back the vCPU time withheld from @vm by a migration which was
+ * running when libvirtd stopped, as found in the domain status XML.
+ * Called with the driver and @vm locked while reconnecting to @vm.
+ */
+void
+qemuMigrationPolicyRecover(struct qemud_driver *driver,
+                           virDomainObjPtr vm)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+
+    if (!priv->migThrottle)
+        return;
+
+    VIR_DEBUG("Removing %u%% vCPU throttle of %s left by a migration",
+              priv->migThrottle, vm->def->name);
+
+    if (!qemuMigrationPolicyCanThrottle(driver, vm) ||
+        qemuMigrationPolicySetThrottle(driver, vm, 0) < 0) {
+        VIR_WARN("Unable to restore vCPU bandwidth of domain %s",
+                 vm->def->name);
+        virResetLastError();
+        priv->migThrottle = 0;
+    }
+}
+
+
+/* Split migration_bandwidth between outgoing migrations: those asking
+ * for less than an equal share get what they asked for and the others
+ * split what remains.  Called with the driver locked.  */
+static void
+qemuMigrationQueueBalance(struct qemud_driver *driver)
+{
+    unsigned long remaining = driver->migrationBandwidth;
+    size_t left = driver->nmigrations;
+    bool capped = true;
+    size_t i;
+
+    for (i = 0; i < driver->nmigrations; i++) {
+        qemuDomainObjPrivatePtr priv = driver->migrations[i]->privateData;
+        qemuDomainMigrationSlotPtr slot = &priv->job.slot;
+
+        slot->capped = !remaining;
+        slot->speed = remaining ? 0 : slot->requested;
+    }
+
+    if (!remaining)
+        return;
+
+    while (left && capped) {
+        unsigned long share = remaining / left;
+
+        capped = false;
+        for (i = 0; i < driver->nmigrations; i++) {
+            qemuDomainObjPrivatePtr priv = driver->migrations[i]->privateData;
+            qemuDomainMigrationSlotPtr slot = &priv->job.slot;
+
+            if (slot->capped || slot->requested > share)
+                continue;
+
+            slot->capped = true;
+            slot->speed = slot->requested;
+            remaining -= slot->requested;
+            left--;
+            capped = true;
+        }
+    }
+
+    for (i = 0; i < driver->nmigrations; i++) {
+        qemuDomainObjPrivatePtr priv = driver->migrations[i]->privateData;
+        qemuDomainMigrationSlotPtr slot = &priv->job.slot;
+
+        if (!slot->capped)
+            slot->speed = left && remaining / left ? remaining / left : 1;
+
+        VIR_DEBUG("Migration of %s may use %lu of %lu MiB/s",
+                  driver->migrations[i]->def->name, slot->speed,
+                  driver->migrationBandwidth);
+    }
+}
+
+
+static void
+qemuMigrationQueueRemove(virDomainObjPtr **list,
+                         size_t *nlist,
+                         virDomainObjPtr vm)
+{
+    size_t i;
+
+    for (i = 0; i < *nlist; i++) {
+        if ((*list)[i] == vm) {
+            ignore_value(VIR_DELETE_ELEMENT(*list, i, *nlist));
+            return;
+        }
+    }
+}
+
+
+/**
+ * qemuMigrationQueueEnter:
+ *
+ * Waits until the outgoing migration of @vm may start transferring data
+ * without exceeding migration_max_concurrent and gives it a share of
+ * migration_bandwidth.  Migrations are let in in the order they asked.
+ * @speed is the bandwidth asked for on input and the one to set in QEMU
+ * on output.  Called with both driver and vm locked; both are released
+ * while waiting.
+ *
+ * Returns 0 on success, -1 if the migration must not go on.
+ */
+int
+qemuMigrationQueueEnter(struct qemud_driver *driver,
+                        virDomainObjPtr vm,
+                        unsigned long *speed)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    qemuDomainMigrationSlotPtr slot = &priv->job.slot;
+    unsigned long long start = 0;
+    unsigned long long now;
+    int ret = -1;
+
+    if (slot->active ||
+        (!driver->migrationMaxConcurrent && !driver->migrationBandwidth))
+        return 0;
+
+    if (VIR_APPEND_ELEMENT_COPY(driver->migrationsQueued,
+                                driver->nmigrationsQueued, vm) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+    ignore_value(virTimeMillisNow(&start));
+
+    while (driver->migrationsQueued[0] != vm ||
+           (driver->migrationMaxConcurrent &&
+            driver->nmigrations >= driver->migrationMaxConcurrent)) {
+        if (priv->job.asyncAbort) {
+            virReportError(VIR_ERR_OPERATION_ABORTED, _("%s: %s"),
+                           qemuDomainAsyncJobTypeToString(priv->job.asyncJob),
+                           _("canceled by client"));
+            goto cleanup;
+        }
+
+        VIR_DEBUG("Migration of %s waits for one of %zu migrations "
+                  "to finish", vm->def->name, driver->nmigrations);
+
+        virDomainObjUnlock(vm);
+        if (virTimeMillisNow(&now) < 0 ||
+            (virCondWaitUntil(&driver->migrationCond, &driver->lock,
+                              now + QEMU_MIGRATION_QUEUE_POLL) < 0 &&
+             errno != ETIMEDOUT)) {
+            virReportSystemError(errno, "%s",
+                                 _("Unable to wait for other migrations"));
+            virDomainObjLock(vm);
+            goto cleanup;
+        }
+        virDomainObjLock(vm);
+
+        if (!virDomainObjIsActive(vm)) {
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("guest unexpectedly quit"));
+            goto cleanup;
+        }
+    }
+
+    if (VIR_APPEND_ELEMENT_COPY(driver->migrations,
+                                driver->nmigrations, vm) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    if (start && virTimeMillisNow(&now) == 0)
+        slot->queued = now - start;
+    slot->active = true;
+    slot->maxBandwidth = priv->migMaxBandwidth;
+    slot->requested = *speed ? *speed : 1;
+    qemuMigrationQueueBalance(driver);
+    *speed = slot->applied = slot->speed;
+    ret = 0;
+
+cleanup:
+    qemuMigrationQueueRemove(&driver->migrationsQueued,
+                             &driver->nmigrationsQueued, vm);
+    /* The next migration may be able to start as well */
+    virCondBroadcast(&driver->migrationCond);
+    return ret;
+}
+
+
+/**
+ * qemuMigrationQueueUpdate:
+ *
+ * Sets the bandwidth of the outgoing migration of @vm to the share it
+ * was last given, which changes as other migrations start and finish.
+ * Failures are not fatal to the migration, it just keeps its previous
+ * bandwidth.
+ */
+void
+qemuMigrationQueueUpdate(struct qemud_driver *driver,
+                         virDomainObjPtr vm,
+                         enum qemuDomainAsyncJob asyncJob)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    qemuDomainMigrationSlotPtr slot = &priv->job.slot;
+    int rc;
+
+    if (asyncJob != QEMU_ASYNC_JOB_MIGRATION_OUT || !slot->active)
+        return;
+
+    /* virDomainMigrateSetMaxSpeed sets the new limit in QEMU directly */
+    if (priv->migMaxBandwidth != slot->maxBandwidth) {
+        slot->maxBandwidth = priv->migMaxBandwidth;
+        slot->applied = priv->migMaxBandwidth;
+        slot->requested = priv->migMaxBandwidth ? priv->migMaxBandwidth : 1;
+        qemuMigrationQueueBalance(driver);
+    }
+
+    if (slot->speed == slot->applied)
+        return;
+
+    VIR_DEBUG("Changing migration bandwidth of %s from %lu to %lu MiB/s",
+              vm->def->name, slot->applied, slot->speed);
+
+    if (qemuDomainObjEnterMonitorAsync(driver, vm, asyncJob) < 0) {
+        virResetLastError();
+        return;
+    }
+    rc = qemuMonitorSetMigrationSpeed(priv->mon, slot->speed);
+    qemuDomainObjExitMonitorWithDriver(driver, vm);
+
+    if (rc < 0) {
+        VIR_WARN("Unable to change migration bandwidth of domain %s",
+                 vm->def->name);
+        virResetLastError();
+    }
+    slot->applied = slot->speed;
+}
+
+
+/**
+ * qemuMigrationQueueLeave:
+ *
+ * Gives the share of migration_bandwidth used by the outgoing migration
+ * of @vm to the remaining migrations and lets the next one start.
+ * Called with the driver locked.
+ */
+void
+qemuMigrationQueueLeave(struct qemud_driver *driver,
+                        virDomainObjPtr vm)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    qemuDomainMigrationSlotPtr slot = &priv->job.slot;
+
+    if (!slot->active)
+        return;
+
+    qemuMigrationQueueRemove(&driver->migrations, &driver->nmigrations, vm);
+    slot->active = false;
+    qemuMigrationQueueBalance(driver);
+    virCondBroadcast(&driver->migrationCond);
+}
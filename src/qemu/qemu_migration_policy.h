@@ -0,0 +1,59 @@
+/*
+ * qemu_migration_policy.h: QEMU migration convergence and bandwidth policies
+ *
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __QEMU_MIGRATION_POLICY_H__
+# define __QEMU_MIGRATION_POLICY_H__
+
+# include "qemu_conf.h"
+# include "qemu_domain.h"
+
+/* QEMU's default maximum downtime of a migration, in milliseconds */
+# define QEMU_MIGRATION_DEFAULT_DOWNTIME 30
+
+int qemuMigrationPolicyApply(struct qemud_driver *driver,
+                             virDomainObjPtr vm,
+                             enum qemuDomainAsyncJob asyncJob)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
+
+void qemuMigrationPolicyReset(struct qemud_driver *driver,
+                              virDomainObjPtr vm,
+                              enum qemuDomainAsyncJob asyncJob)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
+
+void qemuMigrationPolicyRecover(struct qemud_driver *driver,
+                                virDomainObjPtr vm)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
+
+int qemuMigrationQueueEnter(struct qemud_driver *driver,
+                            virDomainObjPtr vm,
+                            unsigned long *speed)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(3);
+
+void qemuMigrationQueueUpdate(struct qemud_driver *driver,
+                              virDomainObjPtr vm,
+                              enum qemuDomainAsyncJob asyncJob)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
+
+void qemuMigrationQueueLeave(struct qemud_driver *driver,
+                             virDomainObjPtr vm)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
+
+#endif /* __QEMU_MIGRATION_POLICY_H__ */
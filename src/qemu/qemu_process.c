@@ -39,6 +39,7 @@
 #include "qemu_hotplug.h"
 #include "qemu_bridge_filter.h"
 #include "qemu_migration.h"
+#include "qemu_migration_policy.h"
 
 #if HAVE_NUMACTL
 # define NUMA_VERSION1_COMPATIBILITY 1
@@ -324,6 +325,7 @@ qemuProcessHandleMonitorEOF(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
     event = virDomainEventNewFromObj(vm,
                                      VIR_DOMAIN_EVENT_STOPPED,
                                      eventReason);
+    qemuDomainObjSignalJobProgress(vm);
     qemuProcessStop(driver, vm, stopReason, 0);
     virDomainAuditStop(vm, auditReason);
 
@@ -736,6 +738,9 @@ qemuProcessHandleStop(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
             VIR_WARN("Unable to save status on vm %s after state change",
                      vm->def->name);
         }
+
+        /* QEMU stops the guest right before the final stage of migration */
+        qemuDomainObjSignalJobProgress(vm);
     }
 
 unlock:
@@ -950,6 +955,8 @@ qemuProcessHandleIOError(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
 
         if (virDomainSaveStatus(driver->caps, driver->stateDir, vm) < 0)
             VIR_WARN("Unable to save status on vm %s after IO error", vm->def->name);
+
+        qemuDomainObjSignalJobProgress(vm);
     }
     virDomainObjUnlock(vm);
 
@@ -999,6 +1006,8 @@ qemuProcessHandleBlockJob(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
         if (disk->mirror && type == VIR_DOMAIN_BLOCK_JOB_TYPE_COPY &&
             status == VIR_DOMAIN_BLOCK_JOB_READY)
             disk->mirroring = true;
+        /* Disks may be copied as part of a migration */
+        qemuDomainObjSignalJobProgress(vm);
     }
 
     virDomainObjUnlock(vm);
@@ -2639,20 +2648,24 @@ qemuProcessInitPCIAddresses(struct qemud_driver *driver,
 }
 
 
-static int qemuProcessNextFreePort(struct qemud_driver *driver,
-                                   int startPort)
+/* Find a port between @startPort and @portMax (exclusive) which is
+ * neither reserved in @ports, whose first bit stands for @portMin, nor
+ * bound by anyone else, and reserve it.  */
+static int qemuProcessReservePort(virBitmapPtr ports,
+                                  int portMin,
+                                  int portMax,
+                                  int startPort)
 {
     int i;
 
-    for (i = startPort ; i < driver->remotePortMax; i++) {
+    for (i = startPort ; i < portMax; i++) {
         int fd;
         int reuse = 1;
         struct sockaddr_in addr;
         bool used = false;
 
-        if (virBitmapGetBit(driver->reservedRemotePorts,
-                            i - driver->remotePortMin, &used) < 0)
-            VIR_DEBUG("virBitmapGetBit failed on bit %d", i - driver->remotePortMin);
+        if (virBitmapGetBit(ports, i - portMin, &used) < 0)
+            VIR_DEBUG("virBitmapGetBit failed on bit %d", i - portMin);
 
         if (used)
             continue;
@@ -2673,10 +2686,9 @@ static int qemuProcessNextFreePort(struct qemud_driver *driver,
             /* Not in use, lets grab it */
             VIR_FORCE_CLOSE(fd);
             /* Add port to bitmap of reserved ports */
-            if (virBitmapSetBit(driver->reservedRemotePorts,
-                                i - driver->remotePortMin) < 0) {
+            if (virBitmapSetBit(ports, i - portMin) < 0) {
                 VIR_DEBUG("virBitmapSetBit failed on bit %d",
-                          i - driver->remotePortMin);
+                          i - portMin);
             }
             return i;
         }
@@ -2694,18 +2706,60 @@ static int qemuProcessNextFreePort(struct qemud_driver *driver,
 
 
 static void
-qemuProcessReturnPort(struct qemud_driver *driver,
-                      int port)
+qemuProcessReleasePort(virBitmapPtr ports,
+                       int portMin,
+                       int port)
 {
-    if (port < driver->remotePortMin)
+    if (port < portMin)
         return;
 
-    if (virBitmapClearBit(driver->reservedRemotePorts,
-                          port - driver->remotePortMin) < 0)
+    if (virBitmapClearBit(ports, port - portMin) < 0)
         VIR_DEBUG("Could not mark port %d as unused", port);
 }
 
 
+static int qemuProcessNextFreePort(struct qemud_driver *driver,
+                                   int startPort)
+{
+    return qemuProcessReservePort(driver->reservedRemotePorts,
+                                  driver->remotePortMin,
+                                  driver->remotePortMax,
+                                  startPort);
+}
+
+
+static void
+qemuProcessReturnPort(struct qemud_driver *driver,
+                      int port)
+{
+    qemuProcessReleasePort(driver->reservedRemotePorts,
+                           driver->remotePortMin, port);
+}
+
+
+/* Reserve a port for the NBD server of an incoming migration. The caller
+ * must hold the driver lock and give the port back with
+ * qemuProcessReturnNBDPort.  */
+int
+qemuProcessNextFreeNBDPort(struct qemud_driver *driver)
+{
+    return qemuProcessReservePort(driver->reservedNBDPorts,
+                                  QEMUD_MIGRATION_NBD_FIRST_PORT,
+                                  QEMUD_MIGRATION_NBD_FIRST_PORT +
+                                  QEMUD_MIGRATION_NBD_NUM_PORTS,
+                                  QEMUD_MIGRATION_NBD_FIRST_PORT);
+}
+
+
+void
+qemuProcessReturnNBDPort(struct qemud_driver *driver,
+                         int port)
+{
+    qemuProcessReleasePort(driver->reservedNBDPorts,
+                           QEMUD_MIGRATION_NBD_FIRST_PORT, port);
+}
+
+
 static int
 qemuProcessPrepareChardevDevice(virDomainDefPtr def ATTRIBUTE_UNUSED,
                                 virDomainChrDefPtr dev,
@@ -3248,6 +3302,7 @@ qemuProcessReconnect(void *opaque)
     struct qemuDomainJobObj oldjob;
     int state;
     int reason;
+    int err;
     size_t i;
 
     memcpy(&oldjob, &data->oldjob, sizeof(oldjob));
@@ -3338,12 +3393,33 @@ qemuProcessReconnect(void *opaque)
     if (qemuProcessNotifyNets(obj->def) < 0)
         goto error;
 
-    if (qemuProcessFiltersInstantiate(conn, obj->def))
+    /* Instantiate the filters without holding the driver lock, so that
+     * the reconnect threads of other domains can instantiate theirs
+     * meanwhile. Without the driver lock the filter update lock has to
+     * be taken before the domain lock, since a filter update locks the
+     * domains while holding it. The job keeps the domain running. */
+    virDomainObjUnlock(obj);
+    qemuDriverUnlock(driver);
+
+    virNWFilterReadLockFilterUpdates();
+    virDomainObjLock(obj);
+    err = virDomainObjIsActive(obj) &&
+          qemuProcessFiltersInstantiate(conn, obj->def);
+    virDomainObjUnlock(obj);
+    virNWFilterUnlockFilterUpdates();
+
+    qemuDriverLock(driver);
+    virDomainObjLock(obj);
+
+    if (err || !virDomainObjIsActive(obj))
         goto error;
 
     if (qemuDomainCheckEjectableMedia(driver, obj, QEMU_ASYNC_JOB_NONE) < 0)
         goto error;
 
+    /* The migration which throttled vCPUs did not survive the restart */
+    qemuMigrationPolicyRecover(driver, obj);
+
     if (qemuProcessRecoverJob(driver, obj, conn, &oldjob) < 0)
         goto error;
 
@@ -4426,6 +4502,12 @@ retry:
     virDomainObjSetState(vm, VIR_DOMAIN_SHUTOFF, reason);
     VIR_FREE(priv->vcpupids);
     priv->nvcpupids = 0;
+    if (priv->nbdPort) {
+        qemuProcessReturnNBDPort(driver, priv->nbdPort);
+        priv->nbdPort = 0;
+    }
+    priv->migMaxDowntime = 0;
+    priv->migThrottle = 0;
     virObjectUnref(priv->caps);
     priv->caps = NULL;
     VIR_FREE(priv->pidfile);
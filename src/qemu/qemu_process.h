@@ -103,4 +103,8 @@ virBitmapPtr qemuPrepareCpumap(struct qemud_driver *driver,
                                virBitmapPtr nodemask);
 int qemuSetUnprivSGIO(virDomainDiskDefPtr disk);
 
+int qemuProcessNextFreeNBDPort(struct qemud_driver *driver);
+void qemuProcessReturnNBDPort(struct qemud_driver *driver,
+                              int port);
+
 #endif /* __QEMU_PROCESS_H__ */
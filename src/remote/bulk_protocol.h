@@ -0,0 +1,74 @@
+/*
+ * Please do not edit this file.
+ * It was generated using rpcgen.
+ */
+
+#ifndef _BULK_PROTOCOL_H_RPCGEN
+#define _BULK_PROTOCOL_H_RPCGEN
+
+#include <rpc/rpc.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "internal.h"
+#include "remote_protocol.h"
+#include <arpa/inet.h>
+#define BULK_DOMAIN_LIST_MAX 1024
+#define BULK_DOMAIN_PARAMETERS_MAX 16
+
+struct bulk_domain_list_managed_save_args {
+        struct {
+                u_int doms_len;
+                remote_nonnull_domain *doms_val;
+        } doms;
+        struct {
+                u_int params_len;
+                remote_typed_param *params_val;
+        } params;
+        u_int flags;
+};
+typedef struct bulk_domain_list_managed_save_args bulk_domain_list_managed_save_args;
+
+struct bulk_domain_list_managed_restore_args {
+        struct {
+                u_int doms_len;
+                remote_nonnull_domain *doms_val;
+        } doms;
+        struct {
+                u_int params_len;
+                remote_typed_param *params_val;
+        } params;
+        u_int flags;
+};
+typedef struct bulk_domain_list_managed_restore_args bulk_domain_list_managed_restore_args;
+#define BULK_PROGRAM 0x20008088
+#define BULK_PROTOCOL_VERSION 1
+
+enum bulk_procedure {
+        BULK_PROC_DOMAIN_LIST_MANAGED_SAVE = 1,
+        BULK_PROC_DOMAIN_LIST_MANAGED_RESTORE = 2,
+};
+typedef enum bulk_procedure bulk_procedure;
+
+/* the xdr functions */
+
+#if defined(__STDC__) || defined(__cplusplus)
+extern  bool_t xdr_bulk_domain_list_managed_save_args (XDR *, bulk_domain_list_managed_save_args*);
+extern  bool_t xdr_bulk_domain_list_managed_restore_args (XDR *, bulk_domain_list_managed_restore_args*);
+extern  bool_t xdr_bulk_procedure (XDR *, bulk_procedure*);
+
+#else /* K&R C */
+extern bool_t xdr_bulk_domain_list_managed_save_args ();
+extern bool_t xdr_bulk_domain_list_managed_restore_args ();
+extern bool_t xdr_bulk_procedure ();
+
+#endif /* K&R C */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !_BULK_PROTOCOL_H_RPCGEN */
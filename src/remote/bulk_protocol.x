@@ -0,0 +1,67 @@
+/* -*- c -*-
+ * bulk_protocol.x: protocol for operations acting on many domains at
+ *   once, between remote_internal driver and libvirtd.  These calls
+ *   are not part of the upstream remote protocol, so they live in a
+ *   program of their own: a daemon which does not know them rejects
+ *   the program instead of decoding them as some other call.
+ *
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+%#include "internal.h"
+%#include "remote_protocol.h"
+%#include <arpa/inet.h>
+
+/*
+ * Upper limit on number of domains saved or restored in one call
+ */
+const BULK_DOMAIN_LIST_MAX = 1024;
+
+/*
+ * Upper limit on number of bulk save or restore parameters
+ */
+const BULK_DOMAIN_PARAMETERS_MAX = 16;
+
+/*----- Protocol. -----*/
+struct bulk_domain_list_managed_save_args {
+    remote_nonnull_domain doms<BULK_DOMAIN_LIST_MAX>;
+    remote_typed_param params<BULK_DOMAIN_PARAMETERS_MAX>;
+    unsigned int flags;
+};
+
+struct bulk_domain_list_managed_restore_args {
+    remote_nonnull_domain doms<BULK_DOMAIN_LIST_MAX>;
+    remote_typed_param params<BULK_DOMAIN_PARAMETERS_MAX>;
+    unsigned int flags;
+};
+
+/* Define the program number, protocol version and procedure numbers here. */
+const BULK_PROGRAM = 0x20008088;
+const BULK_PROTOCOL_VERSION = 1;
+
+enum bulk_procedure {
+    /* Each function must have a three-word comment.  The first word is
+     * whether gendispatch.pl handles daemon, the second whether
+     * it handles src/remote.
+     * The last argument describes priority of API. There are two accepted
+     * values: low, high; Each API that might eventually access hypervisor's
+     * monitor (and thus block) MUST fall into low priority. However, there
+     * are some exceptions to this rule, e.g. domainDestroy. Other APIs MAY
+     * be marked as high priority. If in doubt, it's safe to choose low. */
+    BULK_PROC_DOMAIN_LIST_MANAGED_SAVE = 1, /* skipgen skipgen priority:low */
+    BULK_PROC_DOMAIN_LIST_MANAGED_RESTORE = 2 /* skipgen skipgen priority:low */
+};
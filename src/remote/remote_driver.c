@@ -38,6 +38,7 @@
 #include "remote_driver.h"
 #include "remote_protocol.h"
 #include "qemu_protocol.h"
+#include "bulk_protocol.h"
 #include "memory.h"
 #include "util.h"
 #include "virfile.h"
@@ -77,6 +78,7 @@ struct private_data {
     virNetClientPtr client;
     virNetClientProgramPtr remoteProgram;
     virNetClientProgramPtr qemuProgram;
+    virNetClientProgramPtr bulkProgram;
 
     int counter; /* Serial number for RPC */
 
@@ -93,6 +95,7 @@ struct private_data {
 
 enum {
     REMOTE_CALL_QEMU              = (1 << 0),
+    REMOTE_CALL_BULK              = (1 << 1),
 };
 
 
@@ -781,9 +784,16 @@ doRemoteOpen(virConnectPtr conn,
                                                      0,
                                                      NULL)))
         goto failed;
+    if (!(priv->bulkProgram = virNetClientProgramNew(BULK_PROGRAM,
+                                                     BULK_PROTOCOL_VERSION,
+                                                     NULL,
+                                                     0,
+                                                     NULL)))
+        goto failed;
 
     if (virNetClientAddProgram(priv->client, priv->remoteProgram) < 0 ||
-        virNetClientAddProgram(priv->client, priv->qemuProgram) < 0)
+        virNetClientAddProgram(priv->client, priv->qemuProgram) < 0 ||
+        virNetClientAddProgram(priv->client, priv->bulkProgram) < 0)
         goto failed;
 
     /* Try and authenticate with server */
@@ -868,6 +878,7 @@ no_memory:
  failed:
     virObjectUnref(priv->remoteProgram);
     virObjectUnref(priv->qemuProgram);
+    virObjectUnref(priv->bulkProgram);
     virNetClientClose(priv->client);
     virObjectUnref(priv->client);
     priv->client = NULL;
@@ -1030,7 +1041,8 @@ doRemoteClose(virConnectPtr conn, struct private_data *priv)
     priv->client = NULL;
     virObjectUnref(priv->remoteProgram);
     virObjectUnref(priv->qemuProgram);
-    priv->remoteProgram = priv->qemuProgram = NULL;
+    virObjectUnref(priv->bulkProgram);
+    priv->remoteProgram = priv->qemuProgram = priv->bulkProgram = NULL;
 
     /* Free hostname copy */
     VIR_FREE(priv->hostname);
@@ -5541,11 +5553,17 @@ callWithFD(virConnectPtr conn ATTRIBUTE_UNUSED,
            xdrproc_t ret_filter, char *ret)
 {
     int rv;
-    virNetClientProgramPtr prog = flags & REMOTE_CALL_QEMU ? priv->qemuProgram : priv->remoteProgram;
+    virNetClientProgramPtr prog = priv->remoteProgram;
     int counter = priv->counter++;
     virNetClientPtr client = priv->client;
     int fds[] = { fd };
     size_t nfds = fd == -1 ? 0 : 1;
+
+    if (flags & REMOTE_CALL_QEMU)
+        prog = priv->qemuProgram;
+    else if (flags & REMOTE_CALL_BULK)
+        prog = priv->bulkProgram;
+
     priv->localUses++;
 
     /* Unlock, so that if we get any async events/stream data
@@ -5804,6 +5822,149 @@ done:
     return rv;
 }
 
+static int
+remoteDomainGetJobStats(virDomainPtr domain,
+                        int *type,
+                        virTypedParameterPtr *params,
+                        int *nparams,
+                        unsigned int flags)
+{
+    int rv = -1;
+    remote_domain_get_job_stats_args args;
+    remote_domain_get_job_stats_ret ret;
+    virTypedParameterPtr stats = NULL;
+    int nstats;
+    struct private_data *priv = domain->conn->privateData;
+
+    remoteDriverLock(priv);
+
+    make_nonnull_domain(&args.dom, domain);
+    args.flags = flags;
+
+    memset (&ret, 0, sizeof(ret));
+    if (call (domain->conn, priv, 0, REMOTE_PROC_DOMAIN_GET_JOB_STATS,
+              (xdrproc_t) xdr_remote_domain_get_job_stats_args, (char *) &args,
+              (xdrproc_t) xdr_remote_domain_get_job_stats_ret, (char *) &ret) == -1)
+        goto done;
+
+    nstats = ret.params.params_len;
+    if (nstats > REMOTE_DOMAIN_JOB_STATS_MAX) {
+        virReportError(VIR_ERR_RPC, "%s",
+                       _("returned number of parameters exceeds limit"));
+        goto cleanup;
+    }
+    if (nstats && VIR_ALLOC_N(stats, nstats) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    if (remoteDeserializeTypedParameters(ret.params.params_val,
+                                         ret.params.params_len,
+                                         REMOTE_DOMAIN_JOB_STATS_MAX,
+                                         stats,
+                                         &nstats) < 0)
+        goto cleanup;
+
+    *type = ret.type;
+    *params = stats;
+    *nparams = nstats;
+    stats = NULL;
+    rv = 0;
+
+cleanup:
+    VIR_FREE(stats);
+    xdr_free ((xdrproc_t) xdr_remote_domain_get_job_stats_ret,
+              (char *) &ret);
+done:
+    remoteDriverUnlock(priv);
+    return rv;
+}
+
+static int
+remoteDomainListManagedSaveRestore(virConnectPtr conn,
+                                   int proc,
+                                   virDomainPtr *doms,
+                                   unsigned int ndoms,
+                                   virTypedParameterPtr params,
+                                   int nparams,
+                                   unsigned int flags)
+{
+    int rv = -1;
+    /* Both procedures take the same arguments */
+    bulk_domain_list_managed_save_args args;
+    struct private_data *priv = conn->privateData;
+    unsigned int i;
+
+    remoteDriverLock(priv);
+
+    memset(&args, 0, sizeof(args));
+
+    if (ndoms > BULK_DOMAIN_LIST_MAX) {
+        virReportError(VIR_ERR_RPC,
+                       _("too many domains '%d' for limit '%d'"),
+                       ndoms, BULK_DOMAIN_LIST_MAX);
+        goto done;
+    }
+
+    if (VIR_ALLOC_N(args.doms.doms_val, ndoms) < 0) {
+        virReportOOMError();
+        goto done;
+    }
+    args.doms.doms_len = ndoms;
+    for (i = 0 ; i < ndoms ; i++)
+        make_nonnull_domain(&args.doms.doms_val[i], doms[i]);
+    args.flags = flags;
+
+    if (remoteSerializeTypedParameters(params, nparams,
+                                       &args.params.params_val,
+                                       &args.params.params_len) < 0)
+        goto cleanup;
+
+    if (call(conn, priv, REMOTE_CALL_BULK, proc,
+             (xdrproc_t) xdr_bulk_domain_list_managed_save_args,
+             (char *) &args,
+             (xdrproc_t) xdr_void, (char *) NULL) == -1)
+        goto cleanup;
+
+    rv = 0;
+
+cleanup:
+    remoteFreeTypedParameters(args.params.params_val,
+                              args.params.params_len);
+    VIR_FREE(args.doms.doms_val);
+done:
+    remoteDriverUnlock(priv);
+    return rv;
+}
+
+static int
+remoteDomainListManagedSave(virConnectPtr conn,
+                            virDomainPtr *doms,
+                            unsigned int ndoms,
+                            virTypedParameterPtr params,
+                            int nparams,
+                            unsigned int flags)
+{
+    return remoteDomainListManagedSaveRestore(conn,
+                                              BULK_PROC_DOMAIN_LIST_MANAGED_SAVE,
+                                              doms, ndoms, params, nparams,
+                                              flags);
+}
+
+static int
+remoteDomainListManagedRestore(virConnectPtr conn,
+                               virDomainPtr *doms,
+                               unsigned int ndoms,
+                               virTypedParameterPtr params,
+                               int nparams,
+                               unsigned int flags)
+{
+    return remoteDomainListManagedSaveRestore(conn,
+                                              BULK_PROC_DOMAIN_LIST_MANAGED_RESTORE,
+                                              doms, ndoms, params, nparams,
+                                              flags);
+}
+
 static void
 remoteDomainEventQueue(struct private_data *priv, virDomainEventPtr event)
 {
@@ -6060,6 +6221,9 @@ static virDriver remote_driver = {
     .cpuCompare = remoteCPUCompare, /* 0.7.5 */
     .cpuBaseline = remoteCPUBaseline, /* 0.7.7 */
     .domainGetJobInfo = remoteDomainGetJobInfo, /* 0.7.7 */
+    .domainGetJobStats = remoteDomainGetJobStats, /* 1.0.3 */
+    .domainListManagedSave = remoteDomainListManagedSave, /* 1.0.0 */
+    .domainListManagedRestore = remoteDomainListManagedRestore, /* 1.0.0 */
     .domainAbortJob = remoteDomainAbortJob, /* 0.7.7 */
     .domainMigrateSetMaxDowntime = remoteDomainMigrateSetMaxDowntime, /* 0.8.0 */
     .domainMigrateSetMaxSpeed = remoteDomainMigrateSetMaxSpeed, /* 0.9.0 */
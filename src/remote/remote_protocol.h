@@ -78,6 +78,7 @@ typedef remote_nonnull_string *remote_string;
 #define REMOTE_DOMAIN_GET_CPU_STATS_MAX 2048
 #define REMOTE_DOMAIN_DISK_ERRORS_MAX 256
 #define REMOTE_NODE_MEMORY_PARAMETERS_MAX 64
+#define REMOTE_DOMAIN_JOB_STATS_MAX 64
 
 typedef char remote_uuid[VIR_UUID_BUFLEN];
 
@@ -3141,6 +3142,21 @@ struct remote_node_get_memory_parameters_ret {
         int nparams;
 };
 typedef struct remote_node_get_memory_parameters_ret remote_node_get_memory_parameters_ret;
+
+struct remote_domain_get_job_stats_args {
+        remote_nonnull_domain dom;
+        u_int flags;
+};
+typedef struct remote_domain_get_job_stats_args remote_domain_get_job_stats_args;
+
+struct remote_domain_get_job_stats_ret {
+        int type;
+        struct {
+                u_int params_len;
+                remote_typed_param *params_val;
+        } params;
+};
+typedef struct remote_domain_get_job_stats_ret remote_domain_get_job_stats_ret;
 #define REMOTE_PROGRAM 0x20008086
 #define REMOTE_PROTOCOL_VERSION 1
 
@@ -3437,6 +3453,7 @@ enum remote_procedure {
         REMOTE_PROC_DOMAIN_BLOCK_COMMIT = 290,
         REMOTE_PROC_NETWORK_UPDATE = 291,
         REMOTE_PROC_DOMAIN_EVENT_PMSUSPEND_DISK = 292,
+        REMOTE_PROC_DOMAIN_GET_JOB_STATS = 298,
 };
 typedef enum remote_procedure remote_procedure;
 
@@ -3917,6 +3934,8 @@ extern  bool_t xdr_remote_connect_list_all_secrets_ret (XDR *, remote_connect_li
 extern  bool_t xdr_remote_node_set_memory_parameters_args (XDR *, remote_node_set_memory_parameters_args*);
 extern  bool_t xdr_remote_node_get_memory_parameters_args (XDR *, remote_node_get_memory_parameters_args*);
 extern  bool_t xdr_remote_node_get_memory_parameters_ret (XDR *, remote_node_get_memory_parameters_ret*);
+extern  bool_t xdr_remote_domain_get_job_stats_args (XDR *, remote_domain_get_job_stats_args*);
+extern  bool_t xdr_remote_domain_get_job_stats_ret (XDR *, remote_domain_get_job_stats_ret*);
 extern  bool_t xdr_remote_procedure (XDR *, remote_procedure*);
 
 #else /* K&R C */
@@ -4394,6 +4413,8 @@ extern bool_t xdr_remote_connect_list_all_secrets_ret ();
 extern bool_t xdr_remote_node_set_memory_parameters_args ();
 extern bool_t xdr_remote_node_get_memory_parameters_args ();
 extern bool_t xdr_remote_node_get_memory_parameters_ret ();
+extern bool_t xdr_remote_domain_get_job_stats_args ();
+extern bool_t xdr_remote_domain_get_job_stats_ret ();
 extern bool_t xdr_remote_procedure ();
 
 #endif /* K&R C */
@@ -234,6 +234,11 @@ const REMOTE_DOMAIN_DISK_ERRORS_MAX = 256;
  */
 const REMOTE_NODE_MEMORY_PARAMETERS_MAX = 64;
 
+/*
+ * Upper limit on number of job stats
+ */
+const REMOTE_DOMAIN_JOB_STATS_MAX = 64;
+
 /* UUID.  VIR_UUID_BUFLEN definition comes from libvirt.h */
 typedef opaque remote_uuid[VIR_UUID_BUFLEN];
 
@@ -2670,6 +2675,16 @@ struct remote_node_get_memory_parameters_ret {
     int nparams;
 };
 
+struct remote_domain_get_job_stats_args {
+    remote_nonnull_domain dom;
+    unsigned int flags;
+};
+
+struct remote_domain_get_job_stats_ret {
+    int type;
+    remote_typed_param params<REMOTE_DOMAIN_JOB_STATS_MAX>;
+};
+
 /*----- Protocol. -----*/
 
 /* Define the program number, protocol version and procedure numbers here. */
@@ -3013,7 +3028,8 @@ enum remote_procedure {
     REMOTE_PROC_DOMAIN_BLOCK_COMMIT = 290, /* autogen autogen */
 
     REMOTE_PROC_NETWORK_UPDATE = 291, /* autogen autogen priority:high */
-    REMOTE_PROC_DOMAIN_EVENT_PMSUSPEND_DISK = 292 /* autogen autogen */
+    REMOTE_PROC_DOMAIN_EVENT_PMSUSPEND_DISK = 292, /* autogen autogen */
+    REMOTE_PROC_DOMAIN_GET_JOB_STATS = 298 /* skipgen skipgen */
 
     /*
      * Notice how the entries are grouped in sets of 10 ?
@@ -38,11 +38,287 @@
 #include "memory.h"
 #include "logging.h"
 #include "virfile.h"
+#include "virhash.h"
+#include "threads.h"
+#include "stat-time.h"
 
 #define VIR_FROM_THIS VIR_FROM_STORAGE
 
 #define PV_BLANK_SECTOR_SIZE 512
 
+/*
+ * LVM writes a fresh metadata backup of a volume group every time
+ * the group's metadata is committed. As long as that file has not
+ * been replaced, the lvs/vgs report we last parsed for the group is
+ * still accurate, so a pool refresh can replay it instead of forking
+ * the LVM tools again (each of which also takes the global LVM lock).
+ * If the backup file cannot be found we always run the tools.
+ *
+ * The backup is only written by the host that changes the metadata,
+ * so this cannot notice changes made from other hosts sharing the
+ * group. Reports of clustered volume groups are therefore never
+ * cached. Groups shared between hosts without clvmd cannot be told
+ * apart, and the pool must be refreshed after changing them elsewhere
+ * anyway; a cached report may hide such changes until the group is
+ * changed on this host too.
+ */
+#define LVM_BACKUP_DIR "/etc/lvm/backup"
+
+typedef struct _virStorageBackendLogicalReport virStorageBackendLogicalReport;
+typedef virStorageBackendLogicalReport *virStorageBackendLogicalReportPtr;
+struct _virStorageBackendLogicalReport {
+    size_t ncolumns;
+    size_t nrows;
+    char **cells;               /* nrows * ncolumns matched groups */
+};
+
+typedef struct _virStorageBackendLogicalCacheEntry virStorageBackendLogicalCacheEntry;
+typedef virStorageBackendLogicalCacheEntry *virStorageBackendLogicalCacheEntryPtr;
+struct _virStorageBackendLogicalCacheEntry {
+    /* Identity of the metadata backup when the report was taken */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+
+    virStorageBackendLogicalReport lvs;
+    virStorageBackendLogicalReport vgs;
+};
+
+static virMutex virStorageBackendLogicalCacheLock;
+static virHashTablePtr virStorageBackendLogicalCache;
+static unsigned long long virStorageBackendLogicalCacheHits;
+static unsigned long long virStorageBackendLogicalCacheMisses;
+
+
+static void
+virStorageBackendLogicalReportClear(virStorageBackendLogicalReportPtr report)
+{
+    size_t i;
+
+    for (i = 0 ; i < report->nrows * report->ncolumns ; i++)
+        VIR_FREE(report->cells[i]);
+    VIR_FREE(report->cells);
+    report->nrows = 0;
+}
+
+
+static void
+virStorageBackendLogicalCacheEntryFree(virStorageBackendLogicalCacheEntryPtr entry)
+{
+    if (!entry)
+        return;
+
+    virStorageBackendLogicalReportClear(&entry->lvs);
+    virStorageBackendLogicalReportClear(&entry->vgs);
+    VIR_FREE(entry);
+}
+
+
+static void
+virStorageBackendLogicalCacheDataFree(void *payload,
+                                      const void *name ATTRIBUTE_UNUSED)
+{
+    virStorageBackendLogicalCacheEntryFree(payload);
+}
+
+
+static int
+virStorageBackendLogicalCacheOnceInit(void)
+{
+    if (virMutexInit(&virStorageBackendLogicalCacheLock) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("Unable to initialize mutex"));
+        return -1;
+    }
+
+    if (!(virStorageBackendLogicalCache =
+          virHashCreate(10, virStorageBackendLogicalCacheDataFree)))
+        return -1;
+
+    return 0;
+}
+
+VIR_ONCE_GLOBAL_INIT(virStorageBackendLogicalCache)
+
+
+/*
+ * Fetch the identity of the metadata backup of the pool's volume
+ * group. Returns 0 on success, -1 if the report for this group
+ * cannot be cached (no error is reported in that case).
+ */
+static int
+virStorageBackendLogicalCacheStat(virStoragePoolObjPtr pool,
+                                  struct stat *sb)
+{
+    char *path = NULL;
+    int ret = -1;
+
+    if (virAsprintf(&path, "%s/%s",
+                    LVM_BACKUP_DIR, pool->def->source.name) < 0)
+        goto cleanup;
+
+    if (stat(path, sb) < 0 || !S_ISREG(sb->st_mode))
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(path);
+    return ret;
+}
+
+
+static bool
+virStorageBackendLogicalCacheEntryValid(virStorageBackendLogicalCacheEntryPtr entry,
+                                        struct stat *sb)
+{
+    struct timespec mtime = get_stat_mtime(sb);
+
+    return entry->dev == sb->st_dev &&
+        entry->ino == sb->st_ino &&
+        entry->size == sb->st_size &&
+        entry->mtime.tv_sec == mtime.tv_sec &&
+        entry->mtime.tv_nsec == mtime.tv_nsec;
+}
+
+
+static void
+virStorageBackendLogicalCacheInvalidate(virStoragePoolObjPtr pool)
+{
+    if (virStorageBackendLogicalCacheInitialize() < 0) {
+        virResetLastError();
+        return;
+    }
+
+    virMutexLock(&virStorageBackendLogicalCacheLock);
+    virHashRemoveEntry(virStorageBackendLogicalCache, pool->def->source.name);
+    virMutexUnlock(&virStorageBackendLogicalCacheLock);
+}
+
+
+static void
+virStorageBackendLogicalCacheStore(virStoragePoolObjPtr pool,
+                                   virStorageBackendLogicalCacheEntryPtr entry)
+{
+    virMutexLock(&virStorageBackendLogicalCacheLock);
+    if (virHashUpdateEntry(virStorageBackendLogicalCache,
+                           pool->def->source.name, entry) < 0) {
+        virResetLastError();
+        virStorageBackendLogicalCacheEntryFree(entry);
+    }
+    virMutexUnlock(&virStorageBackendLogicalCacheLock);
+}
+
+
+static int
+virStorageBackendLogicalReportAppend(virStorageBackendLogicalReportPtr report,
+                                     char **const groups)
+{
+    size_t ncells = report->nrows * report->ncolumns;
+    size_t i;
+
+    if (VIR_EXPAND_N(report->cells, ncells, report->ncolumns) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+
+    for (i = 0 ; i < report->ncolumns ; i++) {
+        if (!(report->cells[report->nrows * report->ncolumns + i] =
+              strdup(groups[i]))) {
+            virReportOOMError();
+            goto error;
+        }
+    }
+
+    report->nrows++;
+    return 0;
+
+error:
+    for (i = 0 ; i < report->ncolumns ; i++)
+        VIR_FREE(report->cells[report->nrows * report->ncolumns + i]);
+    return -1;
+}
+
+
+static int
+virStorageBackendLogicalReportReplay(virStoragePoolObjPtr pool,
+                                     virStorageBackendLogicalReportPtr report,
+                                     virStorageBackendListVolRegexFunc func,
+                                     void *data)
+{
+    char **groups = NULL;
+    size_t i, j;
+    int ret = -1;
+
+    if (VIR_ALLOC_N(groups, report->ncolumns) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+
+    for (i = 0 ; i < report->nrows ; i++) {
+        /* The callbacks are allowed to scribble over the groups */
+        for (j = 0 ; j < report->ncolumns ; j++) {
+            if (!(groups[j] =
+                  strdup(report->cells[i * report->ncolumns + j]))) {
+                virReportOOMError();
+                goto cleanup;
+            }
+        }
+
+        if (func(pool, groups, data) < 0)
+            goto cleanup;
+
+        for (j = 0 ; j < report->ncolumns ; j++)
+            VIR_FREE(groups[j]);
+    }
+
+    ret = 0;
+
+cleanup:
+    for (j = 0 ; j < report->ncolumns ; j++)
+        VIR_FREE(groups[j]);
+    VIR_FREE(groups);
+    return ret;
+}
+
+
+/* The sixth vg_attr character of a clustered volume group is 'c'; an
+ * unexpected report is treated like one of a clustered group */
+static bool
+virStorageBackendLogicalReportIsClustered(virStorageBackendLogicalReportPtr vgs)
+{
+    const char *attr;
+
+    if (vgs->nrows != 1 || vgs->ncolumns < 3)
+        return true;
+
+    attr = vgs->cells[2];
+    return strlen(attr) < 6 || attr[5] == 'c';
+}
+
+
+struct virStorageBackendLogicalCaptureData {
+    virStorageBackendListVolRegexFunc func;
+    void *data;
+    virStorageBackendLogicalReportPtr report;
+};
+
+static int
+virStorageBackendLogicalCaptureFunc(virStoragePoolObjPtr pool,
+                                    char **const groups,
+                                    void *opaque)
+{
+    struct virStorageBackendLogicalCaptureData *capture = opaque;
+
+    /* Record the row before the callback gets to modify it */
+    if (capture->report &&
+        virStorageBackendLogicalReportAppend(capture->report, groups) < 0)
+        return -1;
+
+    return capture->func(pool, groups, capture->data);
+}
+
 
 static int
 virStorageBackendLogicalSetActive(virStoragePoolObjPtr pool,
@@ -55,6 +331,8 @@ virStorageBackendLogicalSetActive(virStoragePoolObjPtr pool,
                              pool->def->source.name,
                              NULL);
 
+    virStorageBackendLogicalCacheInvalidate(pool);
+
     ret = virCommandRun(cmd, NULL);
     virCommandFree(cmd);
     return ret;
@@ -276,7 +554,8 @@ cleanup:
 
 static int
 virStorageBackendLogicalFindLVs(virStoragePoolObjPtr pool,
-                                virStorageVolDefPtr vol)
+                                virStorageVolDefPtr vol,
+                                virStorageBackendLogicalReportPtr report)
 {
     /*
      *  # lvs --separator , --noheadings --units b --unbuffered --nosuffix --options "lv_name,origin,uuid,devices,seg_size,vg_extent_size,size" VGNAME
@@ -303,9 +582,17 @@ virStorageBackendLogicalFindLVs(virStoragePoolObjPtr pool,
     int vars[] = {
         9
     };
+    struct virStorageBackendLogicalCaptureData capture = {
+        .func = virStorageBackendLogicalMakeVol,
+        .data = vol,
+        .report = report,
+    };
     int ret = -1;
     virCommandPtr cmd;
 
+    if (report)
+        report->ncolumns = vars[0];
+
     cmd = virCommandNewArgList(LVS,
                                "--separator", "#",
                                "--noheadings",
@@ -320,8 +607,8 @@ virStorageBackendLogicalFindLVs(virStoragePoolObjPtr pool,
                                       1,
                                       regexes,
                                       vars,
-                                      virStorageBackendLogicalMakeVol,
-                                      vol, "lvs") < 0)
+                                      virStorageBackendLogicalCaptureFunc,
+                                      &capture, "lvs") < 0)
         goto cleanup;
 
     ret = 0;
@@ -512,6 +799,8 @@ virStorageBackendLogicalBuildPool(virConnectPtr conn ATTRIBUTE_UNUSED,
 
     virCheckFlags(0, -1);
 
+    virStorageBackendLogicalCacheInvalidate(pool);
+
     memset(zeros, 0, sizeof(zeros));
 
     vgcmd = virCommandNewArgList(VGCREATE, pool->def->source.name, NULL);
@@ -578,31 +867,115 @@ cleanup:
 }
 
 
+/*
+ * Refresh the pool from the cached lvs/vgs report if the volume group
+ * metadata has not changed since it was taken. Returns 1 if the pool
+ * was refreshed, 0 if the LVM tools need to be run, -1 on error.
+ */
+static int
+virStorageBackendLogicalCacheReplay(virStoragePoolObjPtr pool,
+                                    struct stat *sb)
+{
+    virStorageBackendLogicalCacheEntryPtr entry;
+    int ret = 0;
+
+    virMutexLock(&virStorageBackendLogicalCacheLock);
+
+    entry = virHashLookup(virStorageBackendLogicalCache,
+                          pool->def->source.name);
+    if (!entry || !virStorageBackendLogicalCacheEntryValid(entry, sb)) {
+        virStorageBackendLogicalCacheMisses++;
+        VIR_DEBUG("No valid LVM report cached for '%s' (hits=%llu misses=%llu)",
+                  pool->def->source.name,
+                  virStorageBackendLogicalCacheHits,
+                  virStorageBackendLogicalCacheMisses);
+        goto cleanup;
+    }
+
+    virStorageBackendLogicalCacheHits++;
+    VIR_DEBUG("Replaying cached LVM report for '%s' (hits=%llu misses=%llu)",
+              pool->def->source.name,
+              virStorageBackendLogicalCacheHits,
+              virStorageBackendLogicalCacheMisses);
+
+    if (virStorageBackendLogicalReportReplay(pool, &entry->lvs,
+                                             virStorageBackendLogicalMakeVol,
+                                             NULL) < 0 ||
+        virStorageBackendLogicalReportReplay(pool, &entry->vgs,
+                                             virStorageBackendLogicalRefreshPoolFunc,
+                                             NULL) < 0) {
+        virHashRemoveEntry(virStorageBackendLogicalCache,
+                           pool->def->source.name);
+        ret = -1;
+        goto cleanup;
+    }
+
+    ret = 1;
+
+cleanup:
+    virMutexUnlock(&virStorageBackendLogicalCacheLock);
+    return ret;
+}
+
+
 static int
 virStorageBackendLogicalRefreshPool(virConnectPtr conn ATTRIBUTE_UNUSED,
                                     virStoragePoolObjPtr pool)
 {
     /*
-     *  # vgs --separator : --noheadings --units b --unbuffered --nosuffix --options "vg_size,vg_free" VGNAME
-     *    10603200512:4328521728
+     *  # vgs --separator : --noheadings --units b --unbuffered --nosuffix --options "vg_size,vg_free,vg_attr" VGNAME
+     *    10603200512:4328521728:wz--n-
      *
-     * Pull out size & free
+     * Pull out size & free, and the attributes telling whether the
+     * group is clustered
      *
      * NB vgs from some distros (e.g. SLES10 SP2) outputs trailing ":" on each line
      */
     const char *regexes[] = {
-        "^\\s*(\\S+):([0-9]+):?\\s*$"
+        "^\\s*([0-9]+):([0-9]+):([a-z-]+):?\\s*$"
     };
     int vars[] = {
-        2
+        3
     };
     virCommandPtr cmd = NULL;
+    virStorageBackendLogicalCacheEntryPtr entry = NULL;
+    struct virStorageBackendLogicalCaptureData capture = {
+        .func = virStorageBackendLogicalRefreshPoolFunc,
+        .data = NULL,
+        .report = NULL,
+    };
+    struct stat sb;
+    int rc;
     int ret = -1;
 
     virFileWaitForDevices();
 
+    if (virStorageBackendLogicalCacheInitialize() < 0)
+        goto cleanup;
+
+    if (virStorageBackendLogicalCacheStat(pool, &sb) == 0) {
+        if ((rc = virStorageBackendLogicalCacheReplay(pool, &sb)) < 0)
+            goto cleanup;
+        if (rc > 0) {
+            ret = 0;
+            goto cleanup;
+        }
+
+        if (VIR_ALLOC(entry) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+        entry->dev = sb.st_dev;
+        entry->ino = sb.st_ino;
+        entry->size = sb.st_size;
+        entry->mtime = get_stat_mtime(&sb);
+        entry->vgs.ncolumns = vars[0];
+        capture.report = &entry->vgs;
+    }
+
     /* Get list of all logical volumes */
-    if (virStorageBackendLogicalFindLVs(pool, NULL) < 0)
+    if (virStorageBackendLogicalFindLVs(pool, NULL,
+                                        entry ? &entry->lvs : NULL) < 0)
         goto cleanup;
 
     cmd = virCommandNewArgList(VGS,
@@ -611,7 +984,7 @@ virStorageBackendLogicalRefreshPool(virConnectPtr conn ATTRIBUTE_UNUSED,
                                "--units", "b",
                                "--unbuffered",
                                "--nosuffix",
-                               "--options", "vg_size,vg_free",
+                               "--options", "vg_size,vg_free,vg_attr",
                                pool->def->source.name,
                                NULL);
 
@@ -621,14 +994,26 @@ virStorageBackendLogicalRefreshPool(virConnectPtr conn ATTRIBUTE_UNUSED,
                                       1,
                                       regexes,
                                       vars,
-                                      virStorageBackendLogicalRefreshPoolFunc,
-                                      NULL, "vgs") < 0)
+                                      virStorageBackendLogicalCaptureFunc,
+                                      &capture, "vgs") < 0)
         goto cleanup;
 
+    if (entry) {
+        if (virStorageBackendLogicalReportIsClustered(&entry->vgs)) {
+            VIR_DEBUG("Not caching LVM report of clustered group '%s'",
+                      pool->def->source.name);
+            virStorageBackendLogicalCacheInvalidate(pool);
+        } else {
+            virStorageBackendLogicalCacheStore(pool, entry);
+            entry = NULL;
+        }
+    }
+
     ret = 0;
 
 cleanup:
     virCommandFree(cmd);
+    virStorageBackendLogicalCacheEntryFree(entry);
     if (ret < 0)
         virStoragePoolObjClearVols(pool);
     return ret;
@@ -660,6 +1045,8 @@ virStorageBackendLogicalDeletePool(virConnectPtr conn ATTRIBUTE_UNUSED,
 
     virCheckFlags(0, -1);
 
+    virStorageBackendLogicalCacheInvalidate(pool);
+
     /* first remove the volume group */
     cmd = virCommandNewArgList(VGREMOVE,
                                "-f", pool->def->source.name,
@@ -714,6 +1101,8 @@ virStorageBackendLogicalCreateVol(virConnectPtr conn,
 
     vol->type = VIR_STORAGE_VOL_BLOCK;
 
+    virStorageBackendLogicalCacheInvalidate(pool);
+
     if (vol->target.path != NULL) {
         /* A target path passed to CreateVol has no meaning */
         VIR_FREE(vol->target.path);
@@ -774,7 +1163,7 @@ virStorageBackendLogicalCreateVol(virConnectPtr conn,
     }
 
     /* Fill in data about this new vol */
-    if (virStorageBackendLogicalFindLVs(pool, vol) < 0) {
+    if (virStorageBackendLogicalFindLVs(pool, vol, NULL) < 0) {
         virReportSystemError(errno,
                              _("cannot find newly created volume '%s'"),
                              vol->target.path);
@@ -811,7 +1200,7 @@ virStorageBackendLogicalBuildVolFrom(virConnectPtr conn,
 
 static int
 virStorageBackendLogicalDeleteVol(virConnectPtr conn ATTRIBUTE_UNUSED,
-                                  virStoragePoolObjPtr pool ATTRIBUTE_UNUSED,
+                                  virStoragePoolObjPtr pool,
                                   virStorageVolDefPtr vol,
                                   unsigned int flags)
 {
@@ -823,6 +1212,8 @@ virStorageBackendLogicalDeleteVol(virConnectPtr conn ATTRIBUTE_UNUSED,
 
     virCheckFlags(0, -1);
 
+    virStorageBackendLogicalCacheInvalidate(pool);
+
     if (virAsprintf(&volpath, "%s/%s",
                     pool->def->source.name, vol->name) < 0) {
         virReportOOMError();
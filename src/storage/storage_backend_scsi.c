@@ -27,6 +27,8 @@
 #include <stdio.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
 #include "virterror_internal.h"
 #include "storage_backend_scsi.h"
@@ -34,6 +36,10 @@
 #include "logging.h"
 #include "virfile.h"
 #include "command.h"
+#include "threadpool.h"
+#include "virhash.h"
+#include "virtime.h"
+#include "c-ctype.h"
 
 #define VIR_FROM_THIS VIR_FROM_STORAGE
 
@@ -162,12 +168,282 @@ cleanup:
 }
 
 
+/* Upper bound on the number of threads probing LUNs of one host */
+#define SCSI_SCAN_MAX_WORKERS 8
+
+typedef struct _virStorageBackendSCSIScan virStorageBackendSCSIScan;
+typedef virStorageBackendSCSIScan *virStorageBackendSCSIScanPtr;
+struct _virStorageBackendSCSIScan {
+    /* workers only read pool->def; volumes are added by the scanner */
+    virStoragePoolObjPtr pool;
+    uint32_t host;
+
+    /* "major:minor" -> path in the pool target directory, may be NULL */
+    virHashTablePtr stablePaths;
+
+#ifdef HAVE_UDEV
+    unsigned long long generation;
+#endif
+
+    virMutex lock;
+    virCond cond;
+    size_t pending;
+};
+
+typedef struct _virStorageBackendSCSILU virStorageBackendSCSILU;
+typedef virStorageBackendSCSILU *virStorageBackendSCSILUPtr;
+struct _virStorageBackendSCSILU {
+    uint32_t host;
+    uint32_t bus;
+    uint32_t target;
+    uint32_t lun;
+
+    virStorageVolDefPtr vol;    /* result of probing the LUN */
+};
+
+
+#ifdef HAVE_UDEV
+/*
+ * Keys reported by scsi_id, cached by device identity so that refreshing
+ * a pool does not fork the helper again for every LUN.  An entry is only
+ * reused for the same H:B:T:L, the same sysfs device instance and the
+ * same block device number.
+ */
+typedef struct _virStorageBackendSCSIKey virStorageBackendSCSIKey;
+typedef virStorageBackendSCSIKey *virStorageBackendSCSIKeyPtr;
+struct _virStorageBackendSCSIKey {
+    uint32_t host;
+    unsigned long long generation;
+    char *serial;
+};
+
+static virMutex scsiKeyLock;
+static virHashTablePtr scsiKeys;
+static unsigned long long scsiKeyGeneration;
+
+static void
+virStorageBackendSCSIKeyFree(void *payload,
+                             const void *name ATTRIBUTE_UNUSED)
+{
+    virStorageBackendSCSIKeyPtr key = payload;
+
+    if (!key)
+        return;
+    VIR_FREE(key->serial);
+    VIR_FREE(key);
+}
+
+static int
+virStorageBackendSCSIKeysOnceInit(void)
+{
+    if (virMutexInit(&scsiKeyLock) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("Unable to initialize mutex"));
+        return -1;
+    }
+    if (!(scsiKeys = virHashCreate(256, virStorageBackendSCSIKeyFree)))
+        return -1;
+    return 0;
+}
+
+VIR_ONCE_GLOBAL_INIT(virStorageBackendSCSIKeys)
+
+static unsigned long long
+virStorageBackendSCSIKeysNewGeneration(void)
+{
+    unsigned long long generation;
+
+    if (virStorageBackendSCSIKeysInitialize() < 0)
+        return 0;
+
+    virMutexLock(&scsiKeyLock);
+    generation = ++scsiKeyGeneration;
+    virMutexUnlock(&scsiKeyLock);
+
+    return generation;
+}
+
+static char *
+virStorageBackendSCSIKeysLookup(const char *identity,
+                                unsigned long long generation)
+{
+    virStorageBackendSCSIKeyPtr key;
+    char *serial = NULL;
+
+    if (!identity || virStorageBackendSCSIKeysInitialize() < 0)
+        return NULL;
+
+    virMutexLock(&scsiKeyLock);
+    if ((key = virHashLookup(scsiKeys, identity))) {
+        key->generation = generation;
+        serial = strdup(key->serial);
+    }
+    virMutexUnlock(&scsiKeyLock);
+
+    return serial;
+}
+
+static void
+virStorageBackendSCSIKeysStore(const char *identity,
+                               uint32_t host,
+                               unsigned long long generation,
+                               const char *serial)
+{
+    virStorageBackendSCSIKeyPtr key = NULL;
+
+    if (!identity || virStorageBackendSCSIKeysInitialize() < 0)
+        return;
+
+    if (VIR_ALLOC(key) < 0 ||
+        !(key->serial = strdup(serial))) {
+        virStorageBackendSCSIKeyFree(key, NULL);
+        return;
+    }
+    key->host = host;
+    key->generation = generation;
+
+    virMutexLock(&scsiKeyLock);
+    if (virHashUpdateEntry(scsiKeys, identity, key) < 0)
+        virStorageBackendSCSIKeyFree(key, NULL);
+    virMutexUnlock(&scsiKeyLock);
+}
+
+struct virStorageBackendSCSIKeysPruneData {
+    uint32_t host;
+    unsigned long long generation;
+};
+
+static int
+virStorageBackendSCSIKeysPruneOne(const void *payload,
+                                  const void *name ATTRIBUTE_UNUSED,
+                                  const void *opaque)
+{
+    const virStorageBackendSCSIKey *key = payload;
+    const struct virStorageBackendSCSIKeysPruneData *data = opaque;
+
+    return key->host == data->host && key->generation != data->generation;
+}
+
+/* Forget the keys of LUNs on @host that were not seen by the last scan */
+static void
+virStorageBackendSCSIKeysPrune(uint32_t host,
+                               unsigned long long generation)
+{
+    struct virStorageBackendSCSIKeysPruneData data = { host, generation };
+
+    if (!generation)
+        return;
+
+    virMutexLock(&scsiKeyLock);
+    virHashRemoveSet(scsiKeys, virStorageBackendSCSIKeysPruneOne, &data);
+    virMutexUnlock(&scsiKeyLock);
+}
+
+
+/*
+ * Read the LUN's NAA designator from sysfs, in the form scsi_id
+ * prints it, so the helper does not have to be run.  Returns NULL
+ * without reporting an error if the kernel does not expose the
+ * identifier or it is of some other type.
+ */
 static char *
-virStorageBackendSCSISerial(const char *dev)
+virStorageBackendSCSISysfsSerial(const char *block_device)
+{
+    char *path = NULL;
+    char *wwid = NULL;
+    char *serial = NULL;
+    char *p;
+    int fd = -1;
+    size_t len;
+
+    if (virAsprintf(&path, "/sys/block/%s/device/wwid", block_device) < 0)
+        goto cleanup;
+
+    if ((fd = open(path, O_RDONLY)) < 0 ||
+        virFileReadLimFD(fd, 256, &wwid) < 0)
+        goto cleanup;
+
+    len = strlen(wwid);
+    while (len > 0 && c_isspace(wwid[len - 1]))
+        wwid[--len] = '\0';
+
+    if (!STRPREFIX(wwid, "naa.") || len == strlen("naa."))
+        goto cleanup;
+
+    for (p = wwid + strlen("naa."); *p; p++) {
+        if (!c_isxdigit(*p))
+            goto cleanup;
+        *p = c_tolower(*p);
+    }
+
+    /* scsi_id prefixes the designator with its type, 3 for NAA */
+    ignore_value(virAsprintf(&serial, "3%s", wwid + strlen("naa.")));
+
+cleanup:
+    VIR_FORCE_CLOSE(fd);
+    VIR_FREE(wwid);
+    VIR_FREE(path);
+    return serial;
+}
+
+
+/*
+ * Identify the device behind a LUN: the sysfs device directory is
+ * recreated, with a new inode, whenever the kernel drops and rediscovers
+ * the LUN, and the block device number changes along with the disk.
+ */
+static char *
+virStorageBackendSCSIKeyIdentity(virStorageBackendSCSILUPtr lu,
+                                 const char *block_device)
+{
+    char *lun_path = NULL;
+    char *dev_path = NULL;
+    char *identity = NULL;
+    struct stat lun_sb, dev_sb;
+
+    if (virAsprintf(&lun_path, "/sys/bus/scsi/devices/%u:%u:%u:%u",
+                    lu->host, lu->bus, lu->target, lu->lun) < 0 ||
+        virAsprintf(&dev_path, "/dev/%s", block_device) < 0)
+        goto cleanup;
+
+    if (stat(lun_path, &lun_sb) < 0 ||
+        stat(dev_path, &dev_sb) < 0 ||
+        !S_ISBLK(dev_sb.st_mode))
+        goto cleanup;
+
+    ignore_value(virAsprintf(&identity, "%u:%u:%u:%u/%llu/%u:%u",
+                             lu->host, lu->bus, lu->target, lu->lun,
+                             (unsigned long long)lun_sb.st_ino,
+                             major(dev_sb.st_rdev), minor(dev_sb.st_rdev)));
+
+cleanup:
+    VIR_FREE(lun_path);
+    VIR_FREE(dev_path);
+    return identity;
+}
+#endif /* HAVE_UDEV */
+
+
+static char *
+virStorageBackendSCSISerial(virStorageBackendSCSIScanPtr scan ATTRIBUTE_UNUSED,
+                            virStorageBackendSCSILUPtr lu ATTRIBUTE_UNUSED,
+                            const char *block_device ATTRIBUTE_UNUSED,
+                            const char *dev)
 {
     char *serial = NULL;
 #ifdef HAVE_UDEV
-    virCommandPtr cmd = virCommandNewArgList(
+    virCommandPtr cmd = NULL;
+    char *identity = NULL;
+
+    if ((serial = virStorageBackendSCSISysfsSerial(block_device)))
+        return serial;
+
+    identity = virStorageBackendSCSIKeyIdentity(lu, block_device);
+    if ((serial = virStorageBackendSCSIKeysLookup(identity,
+                                                  scan->generation)))
+        goto cleanup;
+
+    cmd = virCommandNewArgList(
         "/lib/udev/scsi_id",
         "--replace-whitespace",
         "--whitelisted",
@@ -185,6 +461,10 @@ virStorageBackendSCSISerial(const char *dev)
         char *nl = strchr(serial, '\n');
         if (nl)
             *nl = '\0';
+#ifdef HAVE_UDEV
+        virStorageBackendSCSIKeysStore(identity, lu->host,
+                                       scan->generation, serial);
+#endif
     } else {
         VIR_FREE(serial);
         if (!(serial = strdup(dev)))
@@ -194,20 +474,116 @@ virStorageBackendSCSISerial(const char *dev)
 #ifdef HAVE_UDEV
 cleanup:
     virCommandFree(cmd);
+    VIR_FREE(identity);
 #endif
 
     return serial;
 }
 
 
+static void
+virStorageBackendSCSIStablePathFree(void *payload,
+                                    const void *name ATTRIBUTE_UNUSED)
+{
+    VIR_FREE(payload);
+}
+
+/*
+ * Map the device numbers of the block devices in the pool target
+ * directory to their path there, so that finding the stable path of
+ * each LUN does not scan the whole directory again.  Returns NULL if
+ * the pool has no such directory or it cannot be read yet, in which
+ * case virStorageBackendStablePath is used for each LUN.
+ */
+static virHashTablePtr
+virStorageBackendSCSIStablePathsLoad(virStoragePoolObjPtr pool)
+{
+    const char *dir = pool->def->target.path;
+    virHashTablePtr paths = NULL;
+    DIR *dh = NULL;
+    struct dirent *dent;
+    char *path = NULL;
+    char key[32];
+    struct stat sb;
+
+    if (dir == NULL ||
+        STREQ(dir, "/dev") ||
+        STREQ(dir, "/dev/") ||
+        !STRPREFIX(dir, "/dev"))
+        return NULL;
+
+    if ((dh = opendir(dir)) == NULL)
+        return NULL;
+
+    if (!(paths = virHashCreate(256, virStorageBackendSCSIStablePathFree)))
+        goto error;
+
+    while ((dent = readdir(dh)) != NULL) {
+        if (dent->d_name[0] == '.')
+            continue;
+
+        if (virAsprintf(&path, "%s/%s", dir, dent->d_name) < 0) {
+            virReportOOMError();
+            goto error;
+        }
+
+        if (stat(path, &sb) == 0 && S_ISBLK(sb.st_mode)) {
+            snprintf(key, sizeof(key), "%u:%u",
+                     major(sb.st_rdev), minor(sb.st_rdev));
+            /* Like virStorageBackendStablePath, the first link wins */
+            if (!virHashLookup(paths, key) &&
+                virHashAddEntry(paths, key, path) == 0)
+                path = NULL;
+        }
+
+        VIR_FREE(path);
+    }
+
+    closedir(dh);
+    return paths;
+
+error:
+    closedir(dh);
+    virHashFree(paths);
+    virResetLastError();
+    return NULL;
+}
+
+
+static char *
+virStorageBackendSCSIStablePath(virStorageBackendSCSIScanPtr scan,
+                                const char *devpath)
+{
+    struct stat sb;
+    char key[32];
+    const char *path;
+    char *stablepath;
+
+    if (!scan->stablePaths ||
+        stat(devpath, &sb) < 0 ||
+        !S_ISBLK(sb.st_mode))
+        return virStorageBackendStablePath(scan->pool, devpath);
+
+    snprintf(key, sizeof(key), "%u:%u",
+             major(sb.st_rdev), minor(sb.st_rdev));
+
+    /* udev may have created the link after the directory was read */
+    if (!(path = virHashLookup(scan->stablePaths, key)))
+        return virStorageBackendStablePath(scan->pool, devpath);
+
+    if (!(stablepath = strdup(path)))
+        virReportOOMError();
+
+    return stablepath;
+}
+
+
 static int
-virStorageBackendSCSINewLun(virStoragePoolObjPtr pool,
-                            uint32_t host ATTRIBUTE_UNUSED,
-                            uint32_t bus,
-                            uint32_t target,
-                            uint32_t lun,
+virStorageBackendSCSINewLun(virStorageBackendSCSIScanPtr scan,
+                            virStorageBackendSCSILUPtr lu,
                             const char *dev)
 {
+    virStoragePoolObjPtr pool = scan->pool;
     virStorageVolDefPtr vol;
     char *devpath = NULL;
     int retval = 0;
@@ -225,7 +601,8 @@ virStorageBackendSCSINewLun(virStoragePoolObjPtr pool,
      * in the volume name. We only need uniqueness per-pool, so
      * just leave 'host' out
      */
-    if (virAsprintf(&(vol->name), "unit:%u:%u:%u", bus, target, lun) < 0) {
+    if (virAsprintf(&(vol->name), "unit:%u:%u:%u",
+                    lu->bus, lu->target, lu->lun) < 0) {
         virReportOOMError();
         retval = -1;
         goto free_vol;
@@ -239,14 +616,9 @@ virStorageBackendSCSINewLun(virStoragePoolObjPtr pool,
 
     VIR_DEBUG("Trying to create volume for '%s'", devpath);
 
-    /* Now figure out the stable path
-     *
-     * XXX this method is O(N) because it scans the pool target
-     * dir every time its run. Should figure out a more efficient
-     * way of doing this...
-     */
-    if ((vol->target.path = virStorageBackendStablePath(pool,
-                                                        devpath)) == NULL) {
+    /* Now figure out the stable path */
+    if ((vol->target.path = virStorageBackendSCSIStablePath(scan,
+                                                            devpath)) == NULL) {
         retval = -1;
         goto free_vol;
     }
@@ -273,21 +645,13 @@ virStorageBackendSCSINewLun(virStoragePoolObjPtr pool,
         goto free_vol;
     }
 
-    if (!(vol->key = virStorageBackendSCSISerial(vol->target.path))) {
+    if (!(vol->key = virStorageBackendSCSISerial(scan, lu, dev,
+                                                 vol->target.path))) {
         retval = -1;
         goto free_vol;
     }
 
-    pool->def->capacity += vol->capacity;
-    pool->def->allocation += vol->allocation;
-
-    if (VIR_REALLOC_N(pool->volumes.objs,
-                      pool->volumes.count + 1) < 0) {
-        virReportOOMError();
-        retval = -1;
-        goto free_vol;
-    }
-    pool->volumes.objs[pool->volumes.count++] = vol;
+    lu->vol = vol;
 
     goto out;
 
@@ -438,13 +802,13 @@ out:
 
 
 static int
-processLU(virStoragePoolObjPtr pool,
-          uint32_t host,
-          uint32_t bus,
-          uint32_t target,
-          uint32_t lun)
+processLU(virStorageBackendSCSIScanPtr scan,
+          virStorageBackendSCSILUPtr lu)
 {
-    char *type_path = NULL;
+    uint32_t host = lu->host;
+    uint32_t bus = lu->bus;
+    uint32_t target = lu->target;
+    uint32_t lun = lu->lun;
     int retval = 0;
     int device_type;
     char *block_device = NULL;
@@ -477,9 +841,7 @@ processLU(virStoragePoolObjPtr pool,
         goto out;
     }
 
-    if (virStorageBackendSCSINewLun(pool,
-                                    host, bus, target, lun,
-                                    block_device) < 0) {
+    if (virStorageBackendSCSINewLun(scan, lu, block_device) < 0) {
         VIR_DEBUG("Failed to create new storage volume for %u:%u:%u:%u",
                   host, bus, target, lun);
         retval = -1;
@@ -489,14 +851,86 @@ processLU(virStoragePoolObjPtr pool,
     VIR_DEBUG("Created new storage volume for %u:%u:%u:%u successfully",
               host, bus, target, lun);
 
-    VIR_FREE(type_path);
-
 out:
     VIR_FREE(block_device);
     return retval;
 }
 
 
+static void
+virStorageBackendSCSIScanWorker(void *jobdata, void *opaque)
+{
+    virStorageBackendSCSILUPtr lu = jobdata;
+    virStorageBackendSCSIScanPtr scan = opaque;
+
+    ignore_value(processLU(scan, lu));
+    virResetLastError();
+
+    virMutexLock(&scan->lock);
+    if (--scan->pending == 0)
+        virCondBroadcast(&scan->cond);
+    virMutexUnlock(&scan->lock);
+}
+
+
+/*
+ * Probe all @nlus LUNs, using up to SCSI_SCAN_MAX_WORKERS threads:
+ * each LUN costs several sysfs reads, an open of the device node and
+ * possibly a run of scsi_id, most of which is spent waiting.
+ */
+static void
+virStorageBackendSCSIScanLUs(virStorageBackendSCSIScanPtr scan,
+                             virStorageBackendSCSILUPtr lus,
+                             size_t nlus)
+{
+    virThreadPoolPtr workers = NULL;
+    size_t i;
+
+    if (nlus > 1 &&
+        virMutexInit(&scan->lock) == 0) {
+        if (virCondInit(&scan->cond) == 0) {
+            workers = virThreadPoolNew(0, MIN(nlus, SCSI_SCAN_MAX_WORKERS), 0,
+                                       virStorageBackendSCSIScanWorker, scan);
+            if (!workers)
+                ignore_value(virCondDestroy(&scan->cond));
+        }
+        if (!workers)
+            virMutexDestroy(&scan->lock);
+    }
+
+    if (!workers) {
+        /* Probe the LUNs one after another */
+        virResetLastError();
+        for (i = 0 ; i < nlus ; i++)
+            ignore_value(processLU(scan, &lus[i]));
+        return;
+    }
+
+    for (i = 0 ; i < nlus ; i++) {
+        virMutexLock(&scan->lock);
+        scan->pending++;
+        virMutexUnlock(&scan->lock);
+
+        if (virThreadPoolSendJob(workers, 0, &lus[i]) < 0) {
+            virMutexLock(&scan->lock);
+            scan->pending--;
+            virMutexUnlock(&scan->lock);
+            virResetLastError();
+            ignore_value(processLU(scan, &lus[i]));
+        }
+    }
+
+    virMutexLock(&scan->lock);
+    while (scan->pending > 0)
+        ignore_value(virCondWait(&scan->cond, &scan->lock));
+    virMutexUnlock(&scan->lock);
+
+    virThreadPoolFree(workers);
+    ignore_value(virCondDestroy(&scan->cond));
+    virMutexDestroy(&scan->lock);
+}
+
+
 int
 virStorageBackendSCSIFindLUs(virStoragePoolObjPtr pool,
                              uint32_t scanhost)
@@ -507,11 +941,21 @@ virStorageBackendSCSIFindLUs(virStoragePoolObjPtr pool,
     DIR *devicedir = NULL;
     struct dirent *lun_dirent = NULL;
     char devicepattern[64];
+    virStorageBackendSCSIScan scan;
+    virStorageBackendSCSILUPtr lus = NULL;
+    size_t nlus = 0, i;
+    unsigned long long then = 0, now = 0;
 
     VIR_DEBUG("Discovering LUs on host %u", scanhost);
 
+    memset(&scan, 0, sizeof(scan));
+    scan.pool = pool;
+    scan.host = scanhost;
+
     virFileWaitForDevices();
 
+    ignore_value(virTimeMillisNow(&then));
+
     if (virAsprintf(&device_path, "/sys/bus/scsi/devices") < 0) {
         virReportOOMError();
         goto out;
@@ -536,12 +980,60 @@ virStorageBackendSCSIFindLUs(virStoragePoolObjPtr pool,
 
         VIR_DEBUG("Found LU '%s'", lun_dirent->d_name);
 
-        processLU(pool, scanhost, bus, target, lun);
+        if (VIR_EXPAND_N(lus, nlus, 1) < 0) {
+            virReportOOMError();
+            closedir(devicedir);
+            retval = -1;
+            goto out;
+        }
+        lus[nlus - 1].host = scanhost;
+        lus[nlus - 1].bus = bus;
+        lus[nlus - 1].target = target;
+        lus[nlus - 1].lun = lun;
     }
 
     closedir(devicedir);
 
+    scan.stablePaths = virStorageBackendSCSIStablePathsLoad(pool);
+#ifdef HAVE_UDEV
+    scan.generation = virStorageBackendSCSIKeysNewGeneration();
+#endif
+
+    virStorageBackendSCSIScanLUs(&scan, lus, nlus);
+
+    /* Add the volumes in the order the LUNs were found */
+    for (i = 0 ; i < nlus ; i++) {
+        virStorageVolDefPtr vol = lus[i].vol;
+
+        if (!vol)
+            continue;
+
+        if (VIR_REALLOC_N(pool->volumes.objs,
+                          pool->volumes.count + 1) < 0) {
+            virReportOOMError();
+            retval = -1;
+            goto out;
+        }
+
+        pool->def->capacity += vol->capacity;
+        pool->def->allocation += vol->allocation;
+        pool->volumes.objs[pool->volumes.count++] = vol;
+        lus[i].vol = NULL;
+    }
+
+#ifdef HAVE_UDEV
+    virStorageBackendSCSIKeysPrune(scanhost, scan.generation);
+#endif
+
+    ignore_value(virTimeMillisNow(&now));
+    VIR_DEBUG("Probed %zu LUs on host %u in %llu ms",
+              nlus, scanhost, now - then);
+
 out:
+    for (i = 0 ; i < nlus ; i++)
+        virStorageVolDefFree(lus[i].vol);
+    VIR_FREE(lus);
+    virHashFree(scan.stablePaths);
     VIR_FREE(device_path);
     return retval;
 }
@@ -28,6 +28,9 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#ifndef WIN32
+# include <spawn.h>
+#endif
 
 #if HAVE_CAPNG
 # include <cap-ng.h>
@@ -52,6 +55,7 @@ enum {
     VIR_EXEC_DAEMON = (1 << 1),
     VIR_EXEC_CLEAR_CAPS = (1 << 2),
     VIR_EXEC_RUN_SYNC = (1 << 3),
+    VIR_EXEC_SPAWN = (1 << 4),
 };
 
 struct _virCommand {
@@ -373,6 +377,103 @@ prepareStdFd(int fd, int std)
     return 0;
 }
 
+# if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#  if __GLIBC_PREREQ(2, 34)
+#   define VIR_SPAWN_CLOSEFROM 1
+#  endif
+# endif
+
+/*
+ * Start @binary with posix_spawn rather than virFork. On Linux this
+ * creates the child with clone(CLONE_VM|CLONE_VFORK), so the cost no
+ * longer grows with the size of the daemon's address space and page
+ * tables. It is only suitable for commands which need nothing done in
+ * the child besides wiring up stdio and closing inherited FDs.
+ *
+ * Returns 0 on success, -1 if the caller should fall back to virFork,
+ * in which case no error is reported.
+ */
+static int
+virExecSpawn(const char *binary,
+             const char *const*argv,
+             const char *const*envp,
+             int infd, int childout, int childerr,
+             pid_t *retpid)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    int ret = -1;
+    int rc;
+# ifndef VIR_SPAWN_CLOSEFROM
+    int fd, openmax;
+# endif
+
+    /* Not every libc clears close-on-exec for a dup2 onto itself */
+    if (infd == STDIN_FILENO ||
+        childout == STDOUT_FILENO ||
+        childerr == STDERR_FILENO)
+        return -1;
+
+    if (posix_spawn_file_actions_init(&actions) != 0)
+        return -1;
+    if (posix_spawnattr_init(&attr) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+
+    if (posix_spawn_file_actions_adddup2(&actions, infd, STDIN_FILENO) != 0 ||
+        posix_spawn_file_actions_adddup2(&actions, childout, STDOUT_FILENO) != 0 ||
+        posix_spawn_file_actions_adddup2(&actions, childerr, STDERR_FILENO) != 0)
+        goto cleanup;
+
+# ifdef VIR_SPAWN_CLOSEFROM
+    if (posix_spawn_file_actions_addclosefrom_np(&actions,
+                                                 STDERR_FILENO + 1) != 0)
+        goto cleanup;
+# else
+    /* FDs marked close-on-exec go away by themselves */
+    openmax = sysconf(_SC_OPEN_MAX);
+    for (fd = STDERR_FILENO + 1; fd < openmax; fd++) {
+        int fdflags = fcntl(fd, F_GETFD);
+        if (fdflags < 0 || (fdflags & FD_CLOEXEC))
+            continue;
+        if (posix_spawn_file_actions_addclose(&actions, fd) != 0)
+            goto cleanup;
+    }
+# endif
+
+    /* Same signal state as virFork leaves the child in */
+    sigfillset(&sigs);
+    sigdelset(&sigs, SIGKILL);
+    sigdelset(&sigs, SIGSTOP);
+    if (posix_spawnattr_setsigdefault(&attr, &sigs) != 0)
+        goto cleanup;
+    sigemptyset(&sigs);
+    if (posix_spawnattr_setsigmask(&attr, &sigs) != 0)
+        goto cleanup;
+    if (posix_spawnattr_setflags(&attr,
+                                 POSIX_SPAWN_SETSIGDEF |
+                                 POSIX_SPAWN_SETSIGMASK) != 0)
+        goto cleanup;
+
+    rc = posix_spawn(retpid, binary, &actions, &attr,
+                     (char *const *) argv,
+                     envp ? (char *const *) envp : environ);
+    if (rc != 0) {
+        VIR_DEBUG("Cannot spawn %s: %s, falling back to fork",
+                  binary, strerror(rc));
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return ret;
+}
+
 /*
  * @argv argv to exec
  * @envp optional environment to use for exec
@@ -388,6 +489,8 @@ prepareStdFd(int fd, int std)
  *        VIR_EXEC_NONE     : Default function behavior
  *        VIR_EXEC_NONBLOCK : Set child process output fd's as non-blocking
  *        VIR_EXEC_DAEMON   : Daemonize the child process
+ *        VIR_EXEC_SPAWN    : Try posix_spawn first; @hook, @capabilities
+ *                            and the resource limits are then ignored
  * @hook optional virExecHook function to call prior to exec
  * @data data to pass to the hook function
  * @pidfile path to use as pidfile for daemonized process (needs DAEMON flag)
@@ -488,10 +591,15 @@ virExecWithHook(const char *const*argv,
         childerr = null;
     }
 
-    forkRet = virFork(&pid);
+    if ((flags & VIR_EXEC_SPAWN) &&
+        virExecSpawn(binary, argv, envp, infd, childout, childerr, &pid) == 0) {
+        forkRet = 0;
+    } else {
+        forkRet = virFork(&pid);
 
-    if (pid < 0) {
-        goto cleanup;
+        if (pid < 0) {
+            goto cleanup;
+        }
     }
 
     if (pid) { /* parent */
@@ -2178,6 +2286,7 @@ virCommandRunAsync(virCommandPtr cmd, pid_t *pid)
     char *str;
     int i;
     bool synchronous = false;
+    unsigned int flags;
 
     if (!cmd || cmd->has_error == ENOMEM) {
         virReportOOMError();
@@ -2229,6 +2338,16 @@ virCommandRunAsync(virCommandPtr cmd, pid_t *pid)
     VIR_DEBUG("About to run %s", str ? str : cmd->args[0]);
     VIR_FREE(str);
 
+    /* Most commands (iptables, ip, tc, qemu-img, ...) need nothing
+     * run in the child before exec, so they can avoid forking
+     * the whole daemon */
+    flags = cmd->flags;
+    if (!cmd->hook && !cmd->pwd && !cmd->handshake &&
+        cmd->preserve_size == 0 && !cmd->capabilities &&
+        !(flags & (VIR_EXEC_DAEMON | VIR_EXEC_CLEAR_CAPS)) &&
+        !cmd->maxMemLock && !cmd->maxProcesses && !cmd->maxFiles)
+        flags |= VIR_EXEC_SPAWN;
+
     ret = virExecWithHook((const char *const *)cmd->args,
                           (const char *const *)cmd->env,
                           cmd->preserve,
@@ -2237,7 +2356,7 @@ virCommandRunAsync(virCommandPtr cmd, pid_t *pid)
                           cmd->infd,
                           cmd->outfdptr,
                           cmd->errfdptr,
-                          cmd->flags,
+                          flags,
                           virCommandHook,
                           cmd,
                           cmd->pidfile,
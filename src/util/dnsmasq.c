@@ -47,6 +47,8 @@
 #include "virterror_internal.h"
 #include "logging.h"
 #include "virfile.h"
+#include "buf.h"
+#include "virhash.h"
 
 #define VIR_FROM_THIS VIR_FROM_NETWORK
 #define DNSMASQ_HOSTSFILE_SUFFIX "hostsfile"
@@ -83,6 +85,7 @@ addnhostsFree(dnsmasqAddnHostsfile *addnhostsfile)
         addnhostsfile->nhosts = 0;
     }
 
+    virHashFree(addnhostsfile->ips);
     VIR_FREE(addnhostsfile->path);
 
     VIR_FREE(addnhostsfile);
@@ -94,21 +97,19 @@ addnhostsAdd(dnsmasqAddnHostsfile *addnhostsfile,
              const char *name)
 {
     char *ipstr = NULL;
-    int idx = -1;
-    int i;
+    void *entry;
+    size_t idx;
 
     if (!(ipstr = virSocketAddrFormat(ip)))
         return -1;
 
-    for (i = 0; i < addnhostsfile->nhosts; i++) {
-        if (STREQ((const char *)addnhostsfile->hosts[i].ip, (const char *)ipstr)) {
-            idx = i;
-            break;
-        }
-    }
+    /* the index holds idx + 1 of the entry of each address */
+    entry = virHashLookup(addnhostsfile->ips, ipstr);
+    idx = (size_t)entry;
 
-    if (idx < 0) {
-        if (VIR_REALLOC_N(addnhostsfile->hosts, addnhostsfile->nhosts + 1) < 0)
+    if (idx-- == 0) {
+        if (VIR_RESIZE_N(addnhostsfile->hosts, addnhostsfile->nhosts_max,
+                         addnhostsfile->nhosts, 1) < 0)
             goto alloc_error;
 
         idx = addnhostsfile->nhosts;
@@ -118,6 +119,14 @@ addnhostsAdd(dnsmasqAddnHostsfile *addnhostsfile,
         if (virAsprintf(&addnhostsfile->hosts[idx].ip, "%s", ipstr) < 0)
             goto alloc_error;
 
+        if (virHashAddEntry(addnhostsfile->ips, ipstr,
+                            (void *)(idx + 1)) < 0) {
+            VIR_FREE(addnhostsfile->hosts[idx].ip);
+            VIR_FREE(addnhostsfile->hosts[idx].hostnames);
+            VIR_FREE(ipstr);
+            return -1;
+        }
+
         addnhostsfile->hosts[idx].nhostnames = 0;
         addnhostsfile->nhosts++;
     }
@@ -154,6 +163,9 @@ addnhostsNew(const char *name,
     addnhostsfile->hosts = NULL;
     addnhostsfile->nhosts = 0;
 
+    if (!(addnhostsfile->ips = virHashCreate(0, NULL)))
+        goto error;
+
     if (virAsprintf(&addnhostsfile->path, "%s/%s.%s", config_dir, name,
                     DNSMASQ_ADDNHOSTSFILE_SUFFIX) < 0) {
         virReportOOMError();
@@ -167,79 +179,95 @@ addnhostsNew(const char *name,
     return NULL;
 }
 
+/*
+ * Atomically replace the content of the file at @path with the content
+ * of @buf, unless the file already has that content, so that dnsmasq
+ * never sees a partially written file and is only told to reload files
+ * that actually changed.
+ *
+ * Returns 1 if the file was written, 0 if it was left untouched or
+ * -errno on failure.
+ */
 static int
-addnhostsWrite(const char *path,
-               dnsmasqAddnHost *hosts,
-               unsigned int nhosts)
+dnsmasqFileReplace(const char *path, virBufferPtr buf)
 {
-    char *tmp;
-    FILE *f;
-    bool istmp = true;
-    unsigned int i, ii;
-    int rc = 0;
-
-    /* even if there are 0 hosts, create a 0 length file, to allow
-     * for runtime addition.
-     */
+    const char *content;
+    size_t len;
+    char *old = NULL;
+    char *tmp = NULL;
+    int fd;
+    int oldlen = -1;
+    int rc = 1;
 
-    if (virAsprintf(&tmp, "%s.new", path) < 0)
+    if (virBufferError(buf))
         return -ENOMEM;
 
-    if (!(f = fopen(tmp, "w"))) {
-        istmp = false;
-        if (!(f = fopen(path, "w"))) {
-            rc = -errno;
-            goto cleanup;
-        }
-    }
-
-    for (i = 0; i < nhosts; i++) {
-        if (fputs(hosts[i].ip, f) == EOF || fputc('\t', f) == EOF) {
-            rc = -errno;
-            VIR_FORCE_FCLOSE(f);
+    content = virBufferCurrentContent(buf);
+    len = virBufferUse(buf);
 
-            if (istmp)
-                unlink(tmp);
-
-            goto cleanup;
-        }
-
-        for (ii = 0; ii < hosts[i].nhostnames; ii++) {
-            if (fputs(hosts[i].hostnames[ii], f) == EOF || fputc('\t', f) == EOF) {
-                rc = -errno;
-                VIR_FORCE_FCLOSE(f);
-
-                if (istmp)
-                    unlink(tmp);
-
-                goto cleanup;
-            }
-        }
+    if ((fd = open(path, O_RDONLY)) >= 0) {
+        oldlen = virFileReadLimFD(fd, len + 1, &old);
+        VIR_FORCE_CLOSE(fd);
+    }
 
-        if (fputc('\n', f) == EOF) {
-            rc = -errno;
-            VIR_FORCE_FCLOSE(f);
+    if (oldlen >= 0 && oldlen == len &&
+        (len == 0 || memcmp(old, content, len) == 0)) {
+        rc = 0;
+        goto cleanup;
+    }
 
-            if (istmp)
-                unlink(tmp);
+    /* even if there are 0 hosts, create a 0 length file, to allow
+     * for runtime addition.
+     */
 
-            goto cleanup;
-        }
+    if (virAsprintf(&tmp, "%s.new", path) < 0) {
+        rc = -ENOMEM;
+        goto cleanup;
     }
 
-    if (VIR_FCLOSE(f) == EOF) {
-        rc = -errno;
+    if (virFileWriteStr(tmp, content ? content : "", 0644) < 0) {
+        unlink(tmp);
+        /* fall back to writing the file in place */
+        if (virFileWriteStr(path, content ? content : "", 0644) < 0)
+            rc = -errno;
         goto cleanup;
     }
 
-    if (istmp && rename(tmp, path) < 0) {
+    if (rename(tmp, path) < 0) {
         rc = -errno;
         unlink(tmp);
-        goto cleanup;
     }
 
  cleanup:
     VIR_FREE(tmp);
+    VIR_FREE(old);
+
+    return rc;
+}
+
+static int
+addnhostsWrite(const char *path,
+               dnsmasqAddnHost *hosts,
+               unsigned int nhosts)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    unsigned int i, ii;
+    int rc;
+
+    for (i = 0; i < nhosts; i++) {
+        virBufferAdd(&buf, hosts[i].ip, -1);
+        virBufferAddChar(&buf, '\t');
+
+        for (ii = 0; ii < hosts[i].nhostnames; ii++) {
+            virBufferAdd(&buf, hosts[i].hostnames[ii], -1);
+            virBufferAddChar(&buf, '\t');
+        }
+
+        virBufferAddChar(&buf, '\n');
+    }
+
+    rc = dnsmasqFileReplace(path, &buf);
+    virBufferFreeAndReset(&buf);
 
     return rc;
 }
@@ -256,7 +284,7 @@ addnhostsSave(dnsmasqAddnHostsfile *addnhostsfile)
         return -1;
     }
 
-    return 0;
+    return err;
 }
 
 static int
@@ -300,7 +328,8 @@ hostsfileAdd(dnsmasqHostsfile *hostsfile,
              const char *name)
 {
     char *ipstr = NULL;
-    if (VIR_REALLOC_N(hostsfile->hosts, hostsfile->nhosts + 1) < 0)
+    if (VIR_RESIZE_N(hostsfile->hosts, hostsfile->nhosts_max,
+                     hostsfile->nhosts, 1) < 0)
         goto alloc_error;
 
     if (!(ipstr = virSocketAddrFormat(ip)))
@@ -361,52 +390,17 @@ hostsfileWrite(const char *path,
                dnsmasqDhcpHost *hosts,
                unsigned int nhosts)
 {
-    char *tmp;
-    FILE *f;
-    bool istmp = true;
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
     unsigned int i;
-    int rc = 0;
-
-    /* even if there are 0 hosts, create a 0 length file, to allow
-     * for runtime addition.
-     */
-
-    if (virAsprintf(&tmp, "%s.new", path) < 0)
-        return -ENOMEM;
-
-    if (!(f = fopen(tmp, "w"))) {
-        istmp = false;
-        if (!(f = fopen(path, "w"))) {
-            rc = -errno;
-            goto cleanup;
-        }
-    }
+    int rc;
 
     for (i = 0; i < nhosts; i++) {
-        if (fputs(hosts[i].host, f) == EOF || fputc('\n', f) == EOF) {
-            rc = -errno;
-            VIR_FORCE_FCLOSE(f);
-
-            if (istmp)
-                unlink(tmp);
-
-            goto cleanup;
-        }
+        virBufferAdd(&buf, hosts[i].host, -1);
+        virBufferAddChar(&buf, '\n');
     }
 
-    if (VIR_FCLOSE(f) == EOF) {
-        rc = -errno;
-        goto cleanup;
-    }
-
-    if (istmp && rename(tmp, path) < 0) {
-        rc = -errno;
-        unlink(tmp);
-        goto cleanup;
-    }
-
- cleanup:
-    VIR_FREE(tmp);
+    rc = dnsmasqFileReplace(path, &buf);
+    virBufferFreeAndReset(&buf);
 
     return rc;
 }
@@ -423,7 +417,7 @@ hostsfileSave(dnsmasqHostsfile *hostsfile)
         return -1;
     }
 
-    return 0;
+    return err;
 }
 
 /**
@@ -523,11 +517,16 @@ dnsmasqAddHost(dnsmasqContext *ctx,
  * @ctx: pointer to the dnsmasq context for each network
  *
  * Saves all the configurations associated with a context to disk.
+ * Files whose content did not change are not rewritten.
+ *
+ * Returns 1 if any of the files was written, 0 if none of them had to
+ * be, or -1 on error.
  */
 int
 dnsmasqSave(const dnsmasqContext *ctx)
 {
     int ret = 0;
+    int changed = 0;
 
     if (virFileMakePath(ctx->config_dir) < 0) {
         virReportSystemError(errno, _("cannot create config directory '%s'"),
@@ -535,14 +534,18 @@ dnsmasqSave(const dnsmasqContext *ctx)
         return -1;
     }
 
-    if (ctx->hostsfile)
-        ret = hostsfileSave(ctx->hostsfile);
-    if (ret == 0) {
-        if (ctx->addnhostsfile)
-            ret = addnhostsSave(ctx->addnhostsfile);
+    if (ctx->hostsfile) {
+        if ((ret = hostsfileSave(ctx->hostsfile)) < 0)
+            return -1;
+        changed |= ret;
+    }
+    if (ctx->addnhostsfile) {
+        if ((ret = addnhostsSave(ctx->addnhostsfile)) < 0)
+            return -1;
+        changed |= ret;
     }
 
-    return ret;
+    return changed;
 }
 
 
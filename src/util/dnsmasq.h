@@ -24,6 +24,7 @@
 
 # include "virobject.h"
 # include "virsocketaddr.h"
+# include "virhash.h"
 
 typedef struct
 {
@@ -38,6 +39,7 @@ typedef struct
 typedef struct
 {
     unsigned int     nhosts;
+    size_t           nhosts_max;
     dnsmasqDhcpHost *hosts;
 
     char            *path;  /* Absolute path of dnsmasq's hostsfile. */
@@ -54,7 +56,9 @@ typedef struct
 typedef struct
 {
     unsigned int     nhosts;
+    size_t           nhosts_max;
     dnsmasqAddnHost *hosts;
+    virHashTablePtr  ips;   /* address -> index + 1 in hosts */
 
     char            *path;  /* Absolute path of dnsmasq's hostsfile. */
 } dnsmasqAddnHostsfile;
@@ -23,6 +23,7 @@
  *   - Read existing file
  *   - Write existing file
  *   - Create & write new file
+ *   - Compress & decompress chunked streams
  */
 
 #include <config.h>
@@ -40,6 +41,7 @@
 #include "virterror_internal.h"
 #include "configmake.h"
 #include "virrandom.h"
+#include "virchunkstream.h"
 
 #define VIR_FROM_THIS VIR_FROM_STORAGE
 
@@ -72,35 +74,147 @@ cleanup:
     return fd;
 }
 
+/* Size and alignment of the buffers used to copy data */
+#define IOHELPER_BUFLEN (1024 * 1024)
+#define IOHELPER_ALIGN_MASK (64 * 1024 - 1)
+
+/* Number of buffers the input is read into, ahead of the output */
+#define IOHELPER_NBUFFERS 4
+
+typedef struct _ioBuffer ioBuffer;
+struct _ioBuffer {
+    void *base; /* Location to be freed */
+    char *buf; /* Aligned location within base */
+    size_t len; /* Amount of data requested from the input */
+    ssize_t got; /* Amount of data actually read */
+    bool shortRead; /* true if we hit a short read, here or before */
+    bool full;
+};
+
+/* The input is read by a separate thread, so that reading from the
+ * file does not have to wait for the output to be written, and the
+ * other way round.  This matters most with O_DIRECT, where the kernel
+ * does not read ahead for us.  */
+typedef struct _ioReader ioReader;
+struct _ioReader {
+    virMutex lock;
+    virCond cond;
+
+    int fd;
+    unsigned long long length;
+    bool direct;
+    ioBuffer bufs[IOHELPER_NBUFFERS];
+
+    bool done; /* no more buffers will be filled */
+    bool quit; /* the output failed */
+    int err; /* errno of the failed read, if any */
+    bool tooManyShortReads;
+};
+
+static void
+ioReaderThread(void *opaque)
+{
+    ioReader *rd = opaque;
+    unsigned long long total = 0;
+    size_t buflen = IOHELPER_BUFLEN;
+    bool shortRead = false;
+    bool tooManyShortReads = false;
+    int err = 0;
+    size_t i = 0;
+
+    while (1) {
+        ioBuffer *b = &rd->bufs[i];
+        ssize_t got;
+        bool quit;
+
+        virMutexLock(&rd->lock);
+        while (b->full && !rd->quit)
+            ignore_value(virCondWait(&rd->cond, &rd->lock));
+        quit = rd->quit;
+        virMutexUnlock(&rd->lock);
+        if (quit)
+            break;
+
+        if (rd->length &&
+            (rd->length - total) < buflen)
+            buflen = rd->length - total;
+
+        if (buflen == 0)
+            break; /* End of requested data from client */
+
+        if ((got = saferead(rd->fd, b->buf, buflen)) < 0) {
+            err = errno;
+            break;
+        }
+        if (got == 0)
+            break; /* End of file before end of requested data */
+        if (got < buflen || (buflen & IOHELPER_ALIGN_MASK)) {
+            /* O_DIRECT can handle at most one short read, at end of file */
+            if (rd->direct && shortRead) {
+                tooManyShortReads = true;
+                break;
+            }
+            shortRead = true;
+        }
+        total += got;
+
+        virMutexLock(&rd->lock);
+        b->len = buflen;
+        b->got = got;
+        b->shortRead = shortRead;
+        b->full = true;
+        virCondSignal(&rd->cond);
+        virMutexUnlock(&rd->lock);
+
+        i = (i + 1) % IOHELPER_NBUFFERS;
+    }
+
+    virMutexLock(&rd->lock);
+    rd->err = err;
+    rd->tooManyShortReads = tooManyShortReads;
+    rd->done = true;
+    virCondSignal(&rd->cond);
+    virMutexUnlock(&rd->lock);
+}
+
 static int
 runIO(const char *path, int fd, int oflags, unsigned long long length)
 {
-    void *base = NULL; /* Location to be freed */
-    char *buf = NULL; /* Aligned location within base */
-    size_t buflen = 1024*1024;
-    intptr_t alignMask = 64*1024 - 1;
+    ioReader rd;
+    virThread reader;
+    bool haveLock = false;
+    bool haveCond = false;
+    bool haveReader = false;
     int ret = -1;
     int fdin, fdout;
     const char *fdinname, *fdoutname;
     unsigned long long total = 0;
     bool direct = O_DIRECT && ((oflags & O_DIRECT) != 0);
-    bool shortRead = false; /* true if we hit a short read */
     off_t end = 0;
+    size_t i;
+
+    memset(&rd, 0, sizeof(rd));
+
+    for (i = 0 ; i < IOHELPER_NBUFFERS ; i++) {
+        ioBuffer *b = &rd.bufs[i];
 
 #if HAVE_POSIX_MEMALIGN
-    if (posix_memalign(&base, alignMask + 1, buflen)) {
-        virReportOOMError();
-        goto cleanup;
-    }
-    buf = base;
+        if (posix_memalign(&b->base, IOHELPER_ALIGN_MASK + 1,
+                           IOHELPER_BUFLEN)) {
+            virReportOOMError();
+            goto cleanup;
+        }
+        b->buf = b->base;
 #else
-    if (VIR_ALLOC_N(buf, buflen + alignMask) < 0) {
-        virReportOOMError();
-        goto cleanup;
-    }
-    base = buf;
-    buf = (char *) (((intptr_t) base + alignMask) & ~alignMask);
+        if (VIR_ALLOC_N(b->buf, IOHELPER_BUFLEN + IOHELPER_ALIGN_MASK) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+        b->base = b->buf;
+        b->buf = (char *) (((intptr_t) b->base + IOHELPER_ALIGN_MASK) &
+                           ~IOHELPER_ALIGN_MASK);
 #endif
+    }
 
     switch (oflags & O_ACCMODE) {
     case O_RDONLY:
@@ -138,38 +252,49 @@ runIO(const char *path, int fd, int oflags, unsigned long long length)
         goto cleanup;
     }
 
-    while (1) {
-        ssize_t got;
+    if (virMutexInit(&rd.lock) < 0) {
+        virReportSystemError(errno, "%s", _("Unable to initialize mutex"));
+        goto cleanup;
+    }
+    haveLock = true;
+    if (virCondInit(&rd.cond) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to initialize condition variable"));
+        goto cleanup;
+    }
+    haveCond = true;
 
-        if (length &&
-            (length - total) < buflen)
-            buflen = length - total;
+    rd.fd = fdin;
+    rd.length = length;
+    rd.direct = direct;
+    if (virThreadCreate(&reader, true, ioReaderThread, &rd) < 0) {
+        virReportSystemError(errno, "%s", _("Unable to create thread"));
+        goto cleanup;
+    }
+    haveReader = true;
 
-        if (buflen == 0)
-            break; /* End of requested data from client */
+    for (i = 0 ; ; i = (i + 1) % IOHELPER_NBUFFERS) {
+        ioBuffer *b = &rd.bufs[i];
+        ssize_t got;
+        bool full;
 
-        if ((got = saferead(fdin, buf, buflen)) < 0) {
-            virReportSystemError(errno, _("Unable to read %s"), fdinname);
-            goto cleanup;
-        }
-        if (got == 0)
-            break; /* End of file before end of requested data */
-        if (got < buflen || (buflen & alignMask)) {
-            /* O_DIRECT can handle at most one short read, at end of file */
-            if (direct && shortRead) {
-                virReportSystemError(EINVAL, "%s",
-                                     _("Too many short reads for O_DIRECT"));
-            }
-            shortRead = true;
-        }
+        virMutexLock(&rd.lock);
+        while (!b->full && !rd.done)
+            ignore_value(virCondWait(&rd.cond, &rd.lock));
+        full = b->full;
+        virMutexUnlock(&rd.lock);
+
+        if (!full)
+            break; /* All data read, or a read failed */
 
+        got = b->got;
         total += got;
-        if (fdout == fd && direct && shortRead) {
+        if (fdout == fd && direct && b->shortRead) {
             end = total;
-            memset(buf + got, 0, buflen - got);
-            got = (got + alignMask) & ~alignMask;
+            memset(b->buf + got, 0, b->len - got);
+            got = (got + IOHELPER_ALIGN_MASK) & ~IOHELPER_ALIGN_MASK;
         }
-        if (safewrite(fdout, buf, got) < 0) {
+        if (safewrite(fdout, b->buf, got) < 0) {
             virReportSystemError(errno, _("Unable to write %s"), fdoutname);
             goto cleanup;
         }
@@ -177,6 +302,21 @@ runIO(const char *path, int fd, int oflags, unsigned long long length)
             virReportSystemError(errno, _("Unable to truncate %s"), fdoutname);
             goto cleanup;
         }
+
+        virMutexLock(&rd.lock);
+        b->full = false;
+        virCondSignal(&rd.cond);
+        virMutexUnlock(&rd.lock);
+    }
+
+    if (rd.tooManyShortReads) {
+        virReportSystemError(EINVAL, "%s",
+                             _("Too many short reads for O_DIRECT"));
+        goto cleanup;
+    }
+    if (rd.err) {
+        virReportSystemError(rd.err, _("Unable to read %s"), fdinname);
+        goto cleanup;
     }
 
     /* Ensure all data is written */
@@ -191,13 +331,26 @@ runIO(const char *path, int fd, int oflags, unsigned long long length)
     ret = 0;
 
 cleanup:
+    if (haveReader) {
+        virMutexLock(&rd.lock);
+        rd.quit = true;
+        virCondSignal(&rd.cond);
+        virMutexUnlock(&rd.lock);
+        virThreadJoin(&reader);
+    }
+    if (haveCond)
+        ignore_value(virCondDestroy(&rd.cond));
+    if (haveLock)
+        virMutexDestroy(&rd.lock);
+
     if (VIR_CLOSE(fd) < 0 &&
         ret == 0) {
         virReportSystemError(errno, _("Unable to close %s"), path);
         ret = -1;
     }
 
-    VIR_FREE(base);
+    for (i = 0 ; i < IOHELPER_NBUFFERS ; i++)
+        VIR_FREE(rd.bufs[i].base);
     return ret;
 }
 
@@ -210,8 +363,10 @@ usage(int status)
         fprintf(stderr, _("%s: try --help for more details"), program_name);
     } else {
         printf(_("Usage: %s FILENAME OFLAGS MODE OFFSET LENGTH DELETE\n"
-                 "   or: %s FILENAME LENGTH FD\n"),
-               program_name, program_name);
+                 "   or: %s FILENAME LENGTH FD\n"
+                 "   or: %s --chunk-compress THREADS\n"
+                 "   or: %s --chunk-decompress THREADS\n"),
+               program_name, program_name, program_name, program_name);
     }
     exit(status);
 }
@@ -228,6 +383,7 @@ main(int argc, char **argv)
     unsigned int delete = 0;
     int fd = -1;
     int lengthIndex = 0;
+    unsigned int nthreads;
 
     program_name = argv[0];
 
@@ -248,7 +404,26 @@ main(int argc, char **argv)
 
     if (argc > 1 && STREQ(argv[1], "--help"))
         usage(EXIT_SUCCESS);
-    if (argc == 7) { /* FILENAME OFLAGS MODE OFFSET LENGTH DELETE */
+    if (argc == 3 && (STREQ(argv[1], "--chunk-compress") ||
+                      STREQ(argv[1], "--chunk-decompress"))) {
+        /* --chunk-compress|--chunk-decompress THREADS, stdin to stdout */
+        if (virStrToLong_ui(argv[2], NULL, 10, &nthreads) < 0) {
+            fprintf(stderr, _("%s: malformed thread count %s"),
+                    program_name, argv[2]);
+            exit(EXIT_FAILURE);
+        }
+        path = "stdin";
+        if (STREQ(argv[1], "--chunk-compress")) {
+            if (virChunkStreamCompress(STDIN_FILENO, STDOUT_FILENO,
+                                       nthreads) < 0)
+                goto error;
+        } else {
+            if (virChunkStreamDecompress(STDIN_FILENO, STDOUT_FILENO,
+                                         nthreads) < 0)
+                goto error;
+        }
+        return 0;
+    } else if (argc == 7) { /* FILENAME OFLAGS MODE OFFSET LENGTH DELETE */
         lengthIndex = 5;
         if (virStrToLong_i(argv[2], NULL, 10, &oflags) < 0) {
             fprintf(stderr, _("%s: malformed file flags %s"),
@@ -44,13 +44,19 @@
 #include "virterror_internal.h"
 #include "logging.h"
 #include "threads.h"
+#include "buf.h"
+#include "virtime.h"
 
+static char *iptables_restore_cmd_path = NULL;
+static char *ip6tables_restore_cmd_path = NULL;
 #if HAVE_FIREWALLD
 static char *firewall_cmd_path = NULL;
+#endif
 
 static int
 virIpTablesOnceInit(void)
 {
+#if HAVE_FIREWALLD
     firewall_cmd_path = virFindFileInPath("firewall-cmd");
     if (!firewall_cmd_path) {
         VIR_INFO("firewall-cmd not found on system. "
@@ -69,13 +75,22 @@ virIpTablesOnceInit(void)
         }
         virCommandFree(cmd);
     }
+
+    /* rules have to be passed to firewalld one by one */
+    if (firewall_cmd_path)
+        return 0;
+#endif
+
+    iptables_restore_cmd_path = virFindFileInPath("iptables-restore");
+    ip6tables_restore_cmd_path = virFindFileInPath("ip6tables-restore");
+    if (!iptables_restore_cmd_path || !ip6tables_restore_cmd_path)
+        VIR_INFO("iptables-restore not found on system. "
+                 "iptables transactions will run one command per rule.");
     return 0;
 }
 
 VIR_ONCE_GLOBAL_INIT(virIpTables)
 
-#endif
-
 #define VIR_FROM_THIS VIR_FROM_NONE
 
 enum {
@@ -89,12 +104,29 @@ typedef struct
     char  *chain;
 } iptRules;
 
+typedef struct _iptablesRule iptablesRule;
+struct _iptablesRule
+{
+    iptRules *rules;
+    int       family;
+    int       action;
+    size_t    nargs;
+    char    **args;
+    bool      oom;
+};
+
 struct _iptablesContext
 {
     iptRules *input_filter;
     iptRules *forward_filter;
     iptRules *nat_postrouting;
     iptRules *mangle_postrouting;
+
+    /* rules queued by an open transaction */
+    bool           batching;
+    size_t         npending;
+    size_t         npending_max;
+    iptablesRule **pending;
 };
 
 static void
@@ -127,27 +159,97 @@ iptRulesNew(const char *table,
     return NULL;
 }
 
+static void
+iptablesRuleFree(iptablesRule *rule)
+{
+    size_t i;
+
+    if (!rule)
+        return;
+
+    for (i = 0 ; i < rule->nargs ; i++)
+        VIR_FREE(rule->args[i]);
+    VIR_FREE(rule->args);
+    VIR_FREE(rule);
+}
+
+/*
+ * Create a rule to be added to or removed from the chain of @rules.
+ * Like virCommand, errors are remembered and reported when the rule
+ * is run, so the arguments may be added without checking for them.
+ */
+static iptablesRule *
+iptablesRuleNew(iptRules *rules, int family, int action)
+{
+    iptablesRule *rule;
+
+    if (VIR_ALLOC(rule) < 0)
+        return NULL;
+
+    rule->rules = rules;
+    rule->family = family;
+    rule->action = action;
+
+    return rule;
+}
+
+static void
+iptablesRuleAddArg(iptablesRule *rule, const char *arg)
+{
+    char *copy;
+
+    if (!rule || rule->oom)
+        return;
+
+    if (!(copy = strdup(arg)) ||
+        VIR_EXPAND_N(rule->args, rule->nargs, 1) < 0) {
+        VIR_FREE(copy);
+        rule->oom = true;
+        return;
+    }
+
+    rule->args[rule->nargs - 1] = copy;
+}
+
+static void ATTRIBUTE_SENTINEL
+iptablesRuleAddArgList(iptablesRule *rule, ...)
+{
+    va_list args;
+    const char *s;
+
+    va_start(args, rule);
+    while ((s = va_arg(args, const char *)))
+        iptablesRuleAddArg(rule, s);
+    va_end(args);
+}
+
 static virCommandPtr
-iptablesCommandNew(iptRules *rules, int family, int action)
+iptablesCommandNew(iptablesRule *rule)
 {
     virCommandPtr cmd = NULL;
+    size_t i;
+
 #if HAVE_FIREWALLD
-    virIpTablesInitialize();
     if (firewall_cmd_path) {
         cmd = virCommandNew(firewall_cmd_path);
         virCommandAddArgList(cmd, "--direct", "--passthrough",
-                             (family == AF_INET6) ? "ipv6" : "ipv4", NULL);
+                             (rule->family == AF_INET6) ? "ipv6" : "ipv4",
+                             NULL);
     }
 #endif
 
     if (cmd == NULL) {
-        cmd = virCommandNew((family == AF_INET6)
+        cmd = virCommandNew((rule->family == AF_INET6)
                         ? IP6TABLES_PATH : IPTABLES_PATH);
     }
 
-    virCommandAddArgList(cmd, "--table", rules->table,
-                         action == ADD ? "--insert" : "--delete",
-                         rules->chain, NULL);
+    virCommandAddArgList(cmd, "--table", rule->rules->table,
+                         rule->action == ADD ? "--insert" : "--delete",
+                         rule->rules->chain, NULL);
+
+    for (i = 0 ; i < rule->nargs ; i++)
+        virCommandAddArg(cmd, rule->args[i]);
+
     return cmd;
 }
 
@@ -160,23 +262,258 @@ iptablesCommandRunAndFree(virCommandPtr cmd)
     return ret;
 }
 
+/*
+ * Check whether @rule can be passed to iptables-restore, which splits
+ * its input lines at whitespace and treats quotes specially.
+ */
+static bool
+iptablesRuleCanRestore(iptablesRule *rule)
+{
+    size_t i;
+
+    if (!((rule->family == AF_INET6) ? ip6tables_restore_cmd_path
+                                      : iptables_restore_cmd_path))
+        return false;
+
+    for (i = 0 ; i < rule->nargs ; i++) {
+        if (!rule->args[i][0] ||
+            strpbrk(rule->args[i], " \t\n\"'"))
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Run @rule, or queue it if a transaction is open on @ctx. A NULL @ctx
+ * runs the rule right away. @rule is freed in any case.
+ */
+static int
+iptablesRuleRun(iptablesContext *ctx, iptablesRule *rule)
+{
+    int ret;
+
+    if (!rule || rule->oom) {
+        virReportOOMError();
+        iptablesRuleFree(rule);
+        return -1;
+    }
+
+    if (virIpTablesInitialize() < 0) {
+        iptablesRuleFree(rule);
+        return -1;
+    }
+
+    /* even rules that iptables-restore cannot take are queued, so that
+     * they are run in order with the others at commit time */
+    if (ctx && ctx->batching) {
+        if (VIR_RESIZE_N(ctx->pending, ctx->npending_max,
+                         ctx->npending, 1) < 0) {
+            virReportOOMError();
+            iptablesRuleFree(rule);
+            return -1;
+        }
+        ctx->pending[ctx->npending++] = rule;
+        return 0;
+    }
+
+    ret = iptablesCommandRunAndFree(iptablesCommandNew(rule));
+    iptablesRuleFree(rule);
+    return ret;
+}
+
 static int ATTRIBUTE_SENTINEL
-iptablesAddRemoveRule(iptRules *rules, int family, int action,
+iptablesAddRemoveRule(iptablesContext *ctx, iptRules *rules,
+                      int family, int action,
                       const char *arg, ...)
 {
     va_list args;
-    virCommandPtr cmd = NULL;
+    iptablesRule *rule;
     const char *s;
 
-    cmd = iptablesCommandNew(rules, family, action);
-    virCommandAddArg(cmd, arg);
+    rule = iptablesRuleNew(rules, family, action);
+    iptablesRuleAddArg(rule, arg);
 
     va_start(args, arg);
     while ((s = va_arg(args, const char *)))
-        virCommandAddArg(cmd, s);
+        iptablesRuleAddArg(rule, s);
     va_end(args);
 
-    return iptablesCommandRunAndFree(cmd);
+    return iptablesRuleRun(ctx, rule);
+}
+
+/*
+ * Apply all queued rules of @family in @table with a single
+ * iptables-restore call. The rules are left untouched if it fails, or
+ * if any of them cannot be passed to iptables-restore.
+ */
+static int
+iptablesRestoreTable(iptablesContext *ctx, int family, const char *table)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    virCommandPtr cmd = NULL;
+    char *errbuf = NULL;
+    size_t i, j;
+    int status;
+    int ret = -1;
+
+    virBufferAsprintf(&buf, "*%s\n", table);
+    for (i = 0 ; i < ctx->npending ; i++) {
+        iptablesRule *rule = ctx->pending[i];
+
+        if (!rule || rule->family != family ||
+            STRNEQ(rule->rules->table, table))
+            continue;
+
+        if (!iptablesRuleCanRestore(rule)) {
+            VIR_DEBUG("Cannot restore all rules of table %s", table);
+            goto cleanup;
+        }
+
+        virBufferAsprintf(&buf, "%s %s",
+                          rule->action == ADD ? "--insert" : "--delete",
+                          rule->rules->chain);
+        for (j = 0 ; j < rule->nargs ; j++)
+            virBufferAsprintf(&buf, " %s", rule->args[j]);
+        virBufferAddChar(&buf, '\n');
+    }
+    virBufferAddLit(&buf, "COMMIT\n");
+
+    if (virBufferError(&buf)) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    cmd = virCommandNew((family == AF_INET6) ? ip6tables_restore_cmd_path
+                                             : iptables_restore_cmd_path);
+    virCommandAddArg(cmd, "--noflush");
+    virCommandSetInputBuffer(cmd, virBufferCurrentContent(&buf));
+    virCommandSetErrorBuffer(cmd, &errbuf);
+
+    if (virCommandRun(cmd, &status) < 0)
+        goto cleanup;
+
+    if (status != 0) {
+        VIR_DEBUG("iptables-restore of table %s failed with status %d: %s",
+                  table, status, NULLSTR(errbuf));
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virCommandFree(cmd);
+    virBufferFreeAndReset(&buf);
+    VIR_FREE(errbuf);
+    return ret;
+}
+
+/**
+ * iptablesTransactionBegin:
+ * @ctx: pointer to the IP table context
+ *
+ * Start queueing the rules added to or removed from @ctx instead of
+ * running one iptables command per rule. The queued rules are applied
+ * by iptablesTransactionCommit. The caller must serialize the use of
+ * @ctx until then.
+ */
+void
+iptablesTransactionBegin(iptablesContext *ctx)
+{
+    ctx->batching = true;
+}
+
+/**
+ * iptablesTransactionAbort:
+ * @ctx: pointer to the IP table context
+ *
+ * Drop the rules queued since iptablesTransactionBegin without applying
+ * them.
+ */
+void
+iptablesTransactionAbort(iptablesContext *ctx)
+{
+    size_t i;
+
+    for (i = 0 ; i < ctx->npending ; i++)
+        iptablesRuleFree(ctx->pending[i]);
+    VIR_FREE(ctx->pending);
+    ctx->npending = ctx->npending_max = 0;
+    ctx->batching = false;
+}
+
+/**
+ * iptablesTransactionCommit:
+ * @ctx: pointer to the IP table context
+ *
+ * Apply the rules queued since iptablesTransactionBegin, with one
+ * iptables-restore call per address family and table. If such a call
+ * fails, or a rule of that table cannot be passed to iptables-restore,
+ * the rules of that table are applied one by one instead, in the order
+ * they were queued.
+ *
+ * Returns 0 in case of success or an error code if any of the rules
+ * could not be applied.
+ */
+int
+iptablesTransactionCommit(iptablesContext *ctx)
+{
+    unsigned long long then = 0, now = 0;
+    int nrestore = 0, nexec = 0;
+    size_t nrules = ctx->npending;
+    size_t i, j;
+    int ret = 0;
+
+    ctx->batching = false;
+
+    ignore_value(virTimeMillisNow(&then));
+
+    for (i = 0 ; i < ctx->npending ; i++) {
+        iptablesRule *rule = ctx->pending[i];
+        int family;
+        const char *table;
+        bool restored;
+
+        if (!rule)
+            continue;
+
+        family = rule->family;
+        table = rule->rules->table;
+
+        restored = iptablesRestoreTable(ctx, family, table) == 0;
+        if (restored) {
+            nrestore++;
+        } else {
+            /* fall back to the exact behaviour of running the rules */
+            virResetLastError();
+        }
+
+        for (j = i ; j < ctx->npending ; j++) {
+            iptablesRule *other = ctx->pending[j];
+
+            if (!other || other->family != family ||
+                STRNEQ(other->rules->table, table))
+                continue;
+
+            if (!restored) {
+                nexec++;
+                if (iptablesCommandRunAndFree(iptablesCommandNew(other)) < 0)
+                    ret = -1;
+            }
+
+            iptablesRuleFree(other);
+            ctx->pending[j] = NULL;
+        }
+    }
+
+    iptablesTransactionAbort(ctx);
+
+    ignore_value(virTimeMillisNow(&now));
+    VIR_DEBUG("Committed %zu iptables rules with %d restore and %d "
+              "iptables commands in %llums",
+              nrules, nrestore, nexec, now - then);
+
+    return ret;
 }
 
 /**
@@ -230,6 +567,7 @@ iptablesContextFree(iptablesContext *ctx)
         iptRulesFree(ctx->nat_postrouting);
     if (ctx->mangle_postrouting)
         iptRulesFree(ctx->mangle_postrouting);
+    iptablesTransactionAbort(ctx);
     VIR_FREE(ctx);
 }
 
@@ -246,7 +584,7 @@ iptablesInput(iptablesContext *ctx,
     snprintf(portstr, sizeof(portstr), "%d", port);
     portstr[sizeof(portstr) - 1] = '\0';
 
-    return iptablesAddRemoveRule(ctx->input_filter,
+    return iptablesAddRemoveRule(ctx, ctx->input_filter,
                                  family,
                                  action,
                                  "--in-interface", iface,
@@ -385,24 +723,24 @@ iptablesForwardAllowOut(iptablesContext *ctx,
 {
     int ret;
     char *networkstr;
-    virCommandPtr cmd = NULL;
+    iptablesRule *rule;
 
     if (!(networkstr = iptablesFormatNetwork(netaddr, prefix)))
         return -1;
 
-    cmd = iptablesCommandNew(ctx->forward_filter,
-                             VIR_SOCKET_ADDR_FAMILY(netaddr),
-                             action);
-    virCommandAddArgList(cmd,
-                         "--source", networkstr,
-                         "--in-interface", iface, NULL);
+    rule = iptablesRuleNew(ctx->forward_filter,
+                           VIR_SOCKET_ADDR_FAMILY(netaddr),
+                           action);
+    iptablesRuleAddArgList(rule,
+                           "--source", networkstr,
+                           "--in-interface", iface, NULL);
 
     if (physdev && physdev[0])
-        virCommandAddArgList(cmd, "--out-interface", physdev, NULL);
+        iptablesRuleAddArgList(rule, "--out-interface", physdev, NULL);
 
-    virCommandAddArgList(cmd, "--jump", "ACCEPT", NULL);
+    iptablesRuleAddArgList(rule, "--jump", "ACCEPT", NULL);
 
-    ret = iptablesCommandRunAndFree(cmd);
+    ret = iptablesRuleRun(ctx, rule);
     VIR_FREE(networkstr);
     return ret;
 }
@@ -472,7 +810,7 @@ iptablesForwardAllowRelatedIn(iptablesContext *ctx,
         return -1;
 
     if (physdev && physdev[0]) {
-        ret = iptablesAddRemoveRule(ctx->forward_filter,
+        ret = iptablesAddRemoveRule(ctx, ctx->forward_filter,
                                     VIR_SOCKET_ADDR_FAMILY(netaddr),
                                     action,
                                     "--destination", networkstr,
@@ -483,7 +821,7 @@ iptablesForwardAllowRelatedIn(iptablesContext *ctx,
                                     "--jump", "ACCEPT",
                                     NULL);
     } else {
-        ret = iptablesAddRemoveRule(ctx->forward_filter,
+        ret = iptablesAddRemoveRule(ctx, ctx->forward_filter,
                                     VIR_SOCKET_ADDR_FAMILY(netaddr),
                                     action,
                                     "--destination", networkstr,
@@ -560,7 +898,7 @@ iptablesForwardAllowIn(iptablesContext *ctx,
         return -1;
 
     if (physdev && physdev[0]) {
-        ret = iptablesAddRemoveRule(ctx->forward_filter,
+        ret = iptablesAddRemoveRule(ctx, ctx->forward_filter,
                                     VIR_SOCKET_ADDR_FAMILY(netaddr),
                                     action,
                                     "--destination", networkstr,
@@ -569,7 +907,7 @@ iptablesForwardAllowIn(iptablesContext *ctx,
                                     "--jump", "ACCEPT",
                                     NULL);
     } else {
-        ret = iptablesAddRemoveRule(ctx->forward_filter,
+        ret = iptablesAddRemoveRule(ctx, ctx->forward_filter,
                                     VIR_SOCKET_ADDR_FAMILY(netaddr),
                                     action,
                                     "--destination", networkstr,
@@ -637,7 +975,7 @@ iptablesForwardAllowCross(iptablesContext *ctx,
                           const char *iface,
                           int action)
 {
-    return iptablesAddRemoveRule(ctx->forward_filter,
+    return iptablesAddRemoveRule(ctx, ctx->forward_filter,
                                  family,
                                  action,
                                  "--in-interface", iface,
@@ -694,7 +1032,7 @@ iptablesForwardRejectOut(iptablesContext *ctx,
                          const char *iface,
                          int action)
 {
-    return iptablesAddRemoveRule(ctx->forward_filter,
+    return iptablesAddRemoveRule(ctx, ctx->forward_filter,
                                  family,
                                  action,
                                  "--in-interface", iface,
@@ -750,7 +1088,7 @@ iptablesForwardRejectIn(iptablesContext *ctx,
                         const char *iface,
                         int action)
 {
-    return iptablesAddRemoveRule(ctx->forward_filter,
+    return iptablesAddRemoveRule(ctx, ctx->forward_filter,
                                  family,
                                  action,
                                  "--out-interface", iface,
@@ -816,7 +1154,7 @@ iptablesForwardMasquerade(iptablesContext *ctx,
     char *addrEndStr = NULL;
     char *portRangeStr = NULL;
     char *natRangeStr = NULL;
-    virCommandPtr cmd = NULL;
+    iptablesRule *rule = NULL;
 
     if (!(networkstr = iptablesFormatNetwork(netaddr, prefix)))
         return -1;
@@ -838,16 +1176,16 @@ iptablesForwardMasquerade(iptablesContext *ctx,
         }
     }
 
-    cmd = iptablesCommandNew(ctx->nat_postrouting, AF_INET, action);
-    virCommandAddArgList(cmd, "--source", networkstr, NULL);
+    rule = iptablesRuleNew(ctx->nat_postrouting, AF_INET, action);
+    iptablesRuleAddArgList(rule, "--source", networkstr, NULL);
 
     if (protocol && protocol[0])
-        virCommandAddArgList(cmd, "-p", protocol, NULL);
+        iptablesRuleAddArgList(rule, "-p", protocol, NULL);
 
-    virCommandAddArgList(cmd, "!", "--destination", networkstr, NULL);
+    iptablesRuleAddArgList(rule, "!", "--destination", networkstr, NULL);
 
     if (physdev && physdev[0])
-        virCommandAddArgList(cmd, "--out-interface", physdev, NULL);
+        iptablesRuleAddArgList(rule, "--out-interface", physdev, NULL);
 
     if (protocol && protocol[0]) {
         if (portStart == 0 && portEnd == 0) {
@@ -884,18 +1222,19 @@ iptablesForwardMasquerade(iptablesContext *ctx,
             goto cleanup;
         }
 
-        virCommandAddArgList(cmd, "--jump", "SNAT",
-                                  "--to-source", natRangeStr, NULL);
+        iptablesRuleAddArgList(rule, "--jump", "SNAT",
+                                     "--to-source", natRangeStr, NULL);
      } else {
-         virCommandAddArgList(cmd, "--jump", "MASQUERADE", NULL);
+         iptablesRuleAddArgList(rule, "--jump", "MASQUERADE", NULL);
 
          if (portRangeStr && portRangeStr[0])
-             virCommandAddArgList(cmd, "--to-ports", &portRangeStr[1], NULL);
+             iptablesRuleAddArgList(rule, "--to-ports", &portRangeStr[1], NULL);
      }
 
-    ret = virCommandRun(cmd, NULL);
+    ret = iptablesRuleRun(ctx, rule);
+    rule = NULL;
 cleanup:
-    virCommandFree(cmd);
+    iptablesRuleFree(rule);
     VIR_FREE(networkstr);
     VIR_FREE(addrStartStr);
     VIR_FREE(addrEndStr);
@@ -976,7 +1315,9 @@ iptablesOutputFixUdpChecksum(iptablesContext *ctx,
     snprintf(portstr, sizeof(portstr), "%d", port);
     portstr[sizeof(portstr) - 1] = '\0';
 
-    return iptablesAddRemoveRule(ctx->mangle_postrouting,
+    /* not all iptables implementations support this rule, so it is
+     * never queued with others that must not fail along with it */
+    return iptablesAddRemoveRule(NULL, ctx->mangle_postrouting,
                                  AF_INET,
                                  action,
                                  "--out-interface", iface,
@@ -29,6 +29,10 @@ typedef struct _iptablesContext iptablesContext;
 iptablesContext *iptablesContextNew              (void);
 void             iptablesContextFree             (iptablesContext *ctx);
 
+void             iptablesTransactionBegin        (iptablesContext *ctx);
+void             iptablesTransactionAbort        (iptablesContext *ctx);
+int              iptablesTransactionCommit       (iptablesContext *ctx);
+
 int              iptablesAddTcpInput             (iptablesContext *ctx,
                                                   int family,
                                                   const char *iface,
@@ -43,6 +43,8 @@
 #include "c-ctype.h"
 #include "virhash.h"
 #include "virendian.h"
+#include "threads.h"
+#include "stat-time.h"
 
 #define VIR_FROM_THIS VIR_FROM_STORAGE
 
@@ -655,38 +657,246 @@ cleanup:
 }
 
 
-/* Given a file descriptor FD open on PATH, and optionally opened from
- * a given DIRECTORY, return metadata about that file, assuming it has
- * the given FORMAT. */
-static virStorageFileMetadataPtr
-virStorageFileGetMetadataInternal(const char *path,
-                                  int fd,
-                                  const char *directory,
-                                  int format)
+/* Facts read from the header of a single image, before its backing
+ * file name (if any) has been resolved against the file system. */
+typedef struct _virStorageFileHeader virStorageFileHeader;
+typedef virStorageFileHeader *virStorageFileHeaderPtr;
+struct _virStorageFileHeader {
+    unsigned long long capacity;
+    bool encrypted;
+    char *backing; /* Backing store name as recorded in the image */
+    int backingFormat;
+};
+
+static void
+virStorageFileHeaderClear(virStorageFileHeaderPtr hdr)
 {
-    virStorageFileMetadata *meta = NULL;
-    unsigned char *buf = NULL;
-    ssize_t len = STORAGE_MAX_HEAD;
-    virStorageFileMetadata *ret = NULL;
-    struct stat sb;
+    VIR_FREE(hdr->backing);
+    memset(hdr, 0, sizeof(*hdr));
+}
 
-    VIR_DEBUG("path=%s, fd=%d, format=%d", path, fd, format);
+static int
+virStorageFileHeaderCopy(virStorageFileHeaderPtr dst,
+                         const virStorageFileHeader *src)
+{
+    *dst = *src;
+    dst->backing = NULL;
+    if (src->backing && !(dst->backing = strdup(src->backing))) {
+        virReportOOMError();
+        return -1;
+    }
+    return 0;
+}
 
-    if (VIR_ALLOC(meta) < 0) {
+
+/*
+ * Image headers are probed over and over again for the same backing
+ * chains (domain startup, security labelling, cgroup setup, block
+ * info queries, pool refreshes...). Remember what was found in each
+ * header, keyed by path, requested format and the uid/gid it was
+ * opened as, and reuse it for as long as the file still has the same
+ * identity and timestamps. Backing file names are always resolved
+ * afresh since that depends on files other than the image itself.
+ */
+#define VIR_STORAGE_FILE_HEADER_CACHE_MAX 4096
+
+typedef struct _virStorageFileHeaderCacheEntry virStorageFileHeaderCacheEntry;
+typedef virStorageFileHeaderCacheEntry *virStorageFileHeaderCacheEntryPtr;
+struct _virStorageFileHeaderCacheEntry {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    virStorageFileHeader hdr;
+};
+
+static virMutex virStorageFileHeaderCacheLock;
+static virHashTablePtr virStorageFileHeaderCache;
+static unsigned long long virStorageFileHeaderCacheHits;
+static unsigned long long virStorageFileHeaderCacheMisses;
+
+static void
+virStorageFileHeaderCacheDataFree(void *payload,
+                                  const void *name ATTRIBUTE_UNUSED)
+{
+    virStorageFileHeaderCacheEntryPtr entry = payload;
+
+    virStorageFileHeaderClear(&entry->hdr);
+    VIR_FREE(entry);
+}
+
+static int
+virStorageFileHeaderCacheOnceInit(void)
+{
+    if (virMutexInit(&virStorageFileHeaderCacheLock) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("Unable to initialize mutex"));
+        return -1;
+    }
+
+    if (!(virStorageFileHeaderCache =
+          virHashCreate(50, virStorageFileHeaderCacheDataFree)))
+        return -1;
+
+    return 0;
+}
+
+VIR_ONCE_GLOBAL_INIT(virStorageFileHeaderCache)
+
+static char *
+virStorageFileHeaderCacheKey(const char *path, int format,
+                             uid_t uid, gid_t gid)
+{
+    char *key;
+
+    if (virAsprintf(&key, "%d:%d:%d:%s",
+                    format, (int)uid, (int)gid, path) < 0) {
         virReportOOMError();
         return NULL;
     }
+    return key;
+}
 
-    if (fstat(fd, &sb) < 0) {
-        virReportSystemError(errno,
-                             _("cannot stat file '%s'"),
-                             path);
-        goto cleanup;
+static bool
+virStorageFileHeaderCacheEntryMatches(virStorageFileHeaderCacheEntryPtr entry,
+                                      struct stat *sb)
+{
+    struct timespec mtime = get_stat_mtime(sb);
+    struct timespec ctime = get_stat_ctime(sb);
+
+    return entry->dev == sb->st_dev &&
+        entry->ino == sb->st_ino &&
+        entry->size == sb->st_size &&
+        entry->mtime.tv_sec == mtime.tv_sec &&
+        entry->mtime.tv_nsec == mtime.tv_nsec &&
+        entry->ctime.tv_sec == ctime.tv_sec &&
+        entry->ctime.tv_nsec == ctime.tv_nsec;
+}
+
+/* Only regular files are cached: writes to a block device do not
+ * update its timestamps, so a stale header could not be detected */
+static bool
+virStorageFileHeaderCacheable(struct stat *sb)
+{
+    return S_ISREG(sb->st_mode);
+}
+
+/* Returns 1 and fills @hdr on a cache hit, 0 on a miss, -1 on error.
+ * A miss is only counted if @countMiss is true, so that a caller that
+ * goes on to read the header through another lookup counts it once */
+static int
+virStorageFileHeaderCacheLookup(const char *path, struct stat *sb,
+                                int format, uid_t uid, gid_t gid,
+                                virStorageFileHeaderPtr hdr,
+                                bool countMiss)
+{
+    virStorageFileHeaderCacheEntryPtr entry;
+    char *key;
+    int ret = 0;
+
+    if (!virStorageFileHeaderCacheable(sb))
+        return 0;
+
+    if (virStorageFileHeaderCacheInitialize() < 0)
+        return -1;
+
+    if (!(key = virStorageFileHeaderCacheKey(path, format, uid, gid)))
+        return -1;
+
+    virMutexLock(&virStorageFileHeaderCacheLock);
+    entry = virHashLookup(virStorageFileHeaderCache, key);
+    if (entry && virStorageFileHeaderCacheEntryMatches(entry, sb)) {
+        if (virStorageFileHeaderCopy(hdr, &entry->hdr) < 0) {
+            ret = -1;
+        } else {
+            virStorageFileHeaderCacheHits++;
+            ret = 1;
+        }
+    } else if (countMiss) {
+        virStorageFileHeaderCacheMisses++;
     }
+    virMutexUnlock(&virStorageFileHeaderCacheLock);
+
+    VIR_DEBUG("path=%s format=%d %s", path, format,
+              ret > 0 ? "cache hit" : "cache miss");
+
+    VIR_FREE(key);
+    return ret;
+}
+
+/* Failing to cache a header is not fatal, so no error is left behind */
+static void
+virStorageFileHeaderCacheStore(const char *path, struct stat *sb,
+                               int format, uid_t uid, gid_t gid,
+                               const virStorageFileHeader *hdr)
+{
+    virStorageFileHeaderCacheEntryPtr entry = NULL;
+    char *key = NULL;
+
+    if (!virStorageFileHeaderCacheable(sb))
+        return;
+
+    if (virStorageFileHeaderCacheInitialize() < 0)
+        goto error;
+
+    if (!(key = virStorageFileHeaderCacheKey(path, format, uid, gid)))
+        goto error;
+
+    if (VIR_ALLOC(entry) < 0) {
+        virReportOOMError();
+        goto error;
+    }
+
+    entry->dev = sb->st_dev;
+    entry->ino = sb->st_ino;
+    entry->size = sb->st_size;
+    entry->mtime = get_stat_mtime(sb);
+    entry->ctime = get_stat_ctime(sb);
+    if (virStorageFileHeaderCopy(&entry->hdr, hdr) < 0)
+        goto error;
+
+    virMutexLock(&virStorageFileHeaderCacheLock);
+    if (virHashSize(virStorageFileHeaderCache) >=
+        VIR_STORAGE_FILE_HEADER_CACHE_MAX)
+        virHashRemoveAll(virStorageFileHeaderCache);
+    if (virHashUpdateEntry(virStorageFileHeaderCache, key, entry) < 0) {
+        virMutexUnlock(&virStorageFileHeaderCacheLock);
+        goto error;
+    }
+    virMutexUnlock(&virStorageFileHeaderCacheLock);
+
+    VIR_FREE(key);
+    return;
+
+error:
+    virResetLastError();
+    if (entry) {
+        virStorageFileHeaderClear(&entry->hdr);
+        VIR_FREE(entry);
+    }
+    VIR_FREE(key);
+}
+
+
+/* Given a file descriptor FD open on PATH, whose stat is SB, read the
+ * header of the file, assuming it has the given FORMAT. */
+static int
+virStorageFileReadHeader(const char *path,
+                         int fd,
+                         struct stat *sb,
+                         int format,
+                         virStorageFileHeaderPtr hdr)
+{
+    unsigned char *buf = NULL;
+    ssize_t len = STORAGE_MAX_HEAD;
+    int ret = -1;
+
+    memset(hdr, 0, sizeof(*hdr));
 
     /* No header to probe for directories, but also no backing file */
-    if (S_ISDIR(sb.st_mode))
-        return meta;
+    if (S_ISDIR(sb->st_mode))
+        return 0;
 
     if (lseek(fd, 0, SEEK_SET) == (off_t)-1) {
         virReportSystemError(errno, _("cannot seek to start of '%s'"), path);
@@ -725,16 +935,16 @@ virStorageFileGetMetadataInternal(const char *path,
             goto done;
 
         if (fileTypeInfo[format].endian == LV_LITTLE_ENDIAN)
-            meta->capacity = virReadBufInt64LE(buf +
-                                               fileTypeInfo[format].sizeOffset);
+            hdr->capacity = virReadBufInt64LE(buf +
+                                              fileTypeInfo[format].sizeOffset);
         else
-            meta->capacity = virReadBufInt64BE(buf +
-                                               fileTypeInfo[format].sizeOffset);
+            hdr->capacity = virReadBufInt64BE(buf +
+                                              fileTypeInfo[format].sizeOffset);
         /* Avoid unlikely, but theoretically possible overflow */
-        if (meta->capacity > (ULLONG_MAX /
-                              fileTypeInfo[format].sizeMultiplier))
+        if (hdr->capacity > (ULLONG_MAX /
+                             fileTypeInfo[format].sizeMultiplier))
             goto done;
-        meta->capacity *= fileTypeInfo[format].sizeMultiplier;
+        hdr->capacity *= fileTypeInfo[format].sizeMultiplier;
     }
 
     if (fileTypeInfo[format].qcowCryptOffset != -1) {
@@ -742,66 +952,136 @@ virStorageFileGetMetadataInternal(const char *path,
 
         crypt_format = virReadBufInt32BE(buf +
                                          fileTypeInfo[format].qcowCryptOffset);
-        meta->encrypted = crypt_format != 0;
+        hdr->encrypted = crypt_format != 0;
     }
 
     if (fileTypeInfo[format].getBackingStore != NULL) {
-        char *backing;
-        int backingFormat;
-        int store = fileTypeInfo[format].getBackingStore(&backing,
-                                                         &backingFormat,
+        int store = fileTypeInfo[format].getBackingStore(&hdr->backing,
+                                                         &hdr->backingFormat,
                                                          buf, len);
-        if (store == BACKING_STORE_INVALID)
+        if (store == BACKING_STORE_INVALID) {
+            VIR_FREE(hdr->backing);
+            hdr->backingFormat = VIR_STORAGE_FILE_NONE;
             goto done;
+        }
 
         if (store == BACKING_STORE_ERROR)
             goto cleanup;
 
-        meta->backingStoreIsFile = false;
-        if (backing != NULL) {
-            meta->backingStore = strdup(backing);
-            if (meta->backingStore == NULL) {
-                virReportOOMError();
-                VIR_FREE(backing);
-                goto cleanup;
-            }
-            if (virBackingStoreIsFile(backing)) {
-                meta->backingStoreIsFile = true;
-                meta->backingStoreRaw = meta->backingStore;
-                meta->backingStore = NULL;
-                if (virFindBackingFile(directory ? directory : path,
-                                       !!directory, backing,
-                                       &meta->directory,
-                                       &meta->backingStore) < 0) {
-                    /* the backing file is (currently) unavailable, treat this
-                     * file as standalone:
-                     * backingStoreRaw is kept to mark broken image chains */
-                    meta->backingStoreIsFile = false;
-                    backingFormat = VIR_STORAGE_FILE_NONE;
-                    VIR_WARN("Backing file '%s' of image '%s' is missing.",
-                             meta->backingStoreRaw, path);
-
-                }
-            }
-            VIR_FREE(backing);
-            meta->backingStoreFormat = backingFormat;
-        } else {
-            meta->backingStore = NULL;
-            meta->backingStoreFormat = VIR_STORAGE_FILE_NONE;
-        }
+        if (hdr->backing == NULL)
+            hdr->backingFormat = VIR_STORAGE_FILE_NONE;
     }
 
 done:
-    ret = meta;
-    meta = NULL;
+    ret = 0;
 
 cleanup:
-    virStorageFileFreeMetadata(meta);
+    if (ret < 0)
+        virStorageFileHeaderClear(hdr);
     VIR_FREE(buf);
     return ret;
 }
 
 
+/* Turn the header HDR of the image at PATH, optionally opened from a
+ * given DIRECTORY, into metadata about that file. */
+static virStorageFileMetadataPtr
+virStorageFileMetadataFromHeader(const char *path,
+                                 const char *directory,
+                                 virStorageFileHeaderPtr hdr)
+{
+    virStorageFileMetadata *meta = NULL;
+    int backingFormat = hdr->backingFormat;
+
+    if (VIR_ALLOC(meta) < 0) {
+        virReportOOMError();
+        return NULL;
+    }
+
+    meta->capacity = hdr->capacity;
+    meta->encrypted = hdr->encrypted;
+
+    if (hdr->backing == NULL) {
+        meta->backingStoreFormat = VIR_STORAGE_FILE_NONE;
+        return meta;
+    }
+
+    meta->backingStoreIsFile = false;
+    if (virBackingStoreIsFile(hdr->backing)) {
+        meta->backingStoreIsFile = true;
+        if (!(meta->backingStoreRaw = strdup(hdr->backing))) {
+            virReportOOMError();
+            goto error;
+        }
+        if (virFindBackingFile(directory ? directory : path,
+                               !!directory, hdr->backing,
+                               &meta->directory,
+                               &meta->backingStore) < 0) {
+            /* the backing file is (currently) unavailable, treat this
+             * file as standalone:
+             * backingStoreRaw is kept to mark broken image chains */
+            meta->backingStoreIsFile = false;
+            backingFormat = VIR_STORAGE_FILE_NONE;
+            VIR_WARN("Backing file '%s' of image '%s' is missing.",
+                     meta->backingStoreRaw, path);
+
+        }
+    } else if (!(meta->backingStore = strdup(hdr->backing))) {
+        virReportOOMError();
+        goto error;
+    }
+    meta->backingStoreFormat = backingFormat;
+
+    return meta;
+
+error:
+    virStorageFileFreeMetadata(meta);
+    return NULL;
+}
+
+
+/* Given a file descriptor FD open on PATH as UID/GID, and optionally
+ * opened from a given DIRECTORY, return metadata about that file,
+ * assuming it has the given FORMAT. */
+static virStorageFileMetadataPtr
+virStorageFileGetMetadataInternal(const char *path,
+                                  int fd,
+                                  const char *directory,
+                                  int format,
+                                  uid_t uid, gid_t gid)
+{
+    virStorageFileHeader hdr;
+    virStorageFileMetadataPtr ret = NULL;
+    struct stat sb;
+    int rc;
+
+    VIR_DEBUG("path=%s, fd=%d, format=%d", path, fd, format);
+
+    memset(&hdr, 0, sizeof(hdr));
+
+    if (fstat(fd, &sb) < 0) {
+        virReportSystemError(errno,
+                             _("cannot stat file '%s'"),
+                             path);
+        return NULL;
+    }
+
+    if ((rc = virStorageFileHeaderCacheLookup(path, &sb, format,
+                                              uid, gid, &hdr, true)) < 0)
+        return NULL;
+
+    if (rc == 0) {
+        if (virStorageFileReadHeader(path, fd, &sb, format, &hdr) < 0)
+            return NULL;
+        virStorageFileHeaderCacheStore(path, &sb, format, uid, gid, &hdr);
+    }
+
+    ret = virStorageFileMetadataFromHeader(path, directory, &hdr);
+    virStorageFileHeaderClear(&hdr);
+    return ret;
+}
+
+
 /**
  * virStorageFileProbeFormatFromFD:
  *
@@ -911,7 +1191,8 @@ virStorageFileGetMetadataFromFD(const char *path,
                                 int fd,
                                 int format)
 {
-    return virStorageFileGetMetadataInternal(path, fd, NULL, format);
+    return virStorageFileGetMetadataInternal(path, fd, NULL, format,
+                                             -1, -1);
 }
 
 /* Recursive workhorse for virStorageFileGetMetadata.  */
@@ -921,6 +1202,7 @@ virStorageFileGetMetadataRecurse(const char *path, const char *directory,
                                  bool allow_probe, virHashTablePtr cycle)
 {
     int fd;
+    struct stat sb;
     VIR_DEBUG("path=%s format=%d uid=%d gid=%d probe=%d",
               path, format, (int)uid, (int)gid, allow_probe);
 
@@ -935,16 +1217,37 @@ virStorageFileGetMetadataRecurse(const char *path, const char *directory,
     if (virHashAddEntry(cycle, path, (void *)1) < 0)
         return NULL;
 
+    /* A header cached from an earlier open as the same user spares us
+     * opening the file again, which may need a fork for NFS */
+    if (stat(path, &sb) == 0) {
+        virStorageFileHeader hdr;
+        int rc;
+
+        memset(&hdr, 0, sizeof(hdr));
+        /* on a miss the lookup after opening the file counts it */
+        if ((rc = virStorageFileHeaderCacheLookup(path, &sb, format,
+                                                  uid, gid, &hdr,
+                                                  false)) < 0)
+            return NULL;
+        if (rc > 0) {
+            ret = virStorageFileMetadataFromHeader(path, directory, &hdr);
+            virStorageFileHeaderClear(&hdr);
+            goto recurse;
+        }
+    }
+
     if ((fd = virFileOpenAs(path, O_RDONLY, 0, uid, gid, 0)) < 0) {
         virReportSystemError(-fd, _("cannot open file '%s'"), path);
         return NULL;
     }
 
-    ret = virStorageFileGetMetadataInternal(path, fd, directory, format);
+    ret = virStorageFileGetMetadataInternal(path, fd, directory, format,
+                                            uid, gid);
 
     if (VIR_CLOSE(fd) < 0)
         VIR_WARN("could not close file %s", path);
 
+recurse:
     if (ret && ret->backingStoreIsFile) {
         if (ret->backingStoreFormat == VIR_STORAGE_FILE_AUTO && !allow_probe)
             ret->backingStoreFormat = VIR_STORAGE_FILE_RAW;
@@ -1006,6 +1309,31 @@ virStorageFileGetMetadata(const char *path, int format,
     return ret;
 }
 
+/**
+ * virStorageFileMetadataCacheStats:
+ * @hits: filled with the number of image headers served from the cache
+ * @misses: filled with the number of headers of regular files that had
+ *          to be read from the file
+ *
+ * Report how effective the cache of probed image headers has been.
+ */
+void
+virStorageFileMetadataCacheStats(unsigned long long *hits,
+                                 unsigned long long *misses)
+{
+    *hits = *misses = 0;
+
+    if (virStorageFileHeaderCacheInitialize() < 0) {
+        virResetLastError();
+        return;
+    }
+
+    virMutexLock(&virStorageFileHeaderCacheLock);
+    *hits = virStorageFileHeaderCacheHits;
+    *misses = virStorageFileHeaderCacheMisses;
+    virMutexUnlock(&virStorageFileHeaderCacheLock);
+}
+
 /**
  * virStorageFileFreeMetadata:
  *
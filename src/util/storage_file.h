@@ -88,6 +88,10 @@ const char *virStorageFileChainLookup(virStorageFileMetadataPtr chain,
 
 void virStorageFileFreeMetadata(virStorageFileMetadataPtr meta);
 
+void virStorageFileMetadataCacheStats(unsigned long long *hits,
+                                      unsigned long long *misses)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
+
 int virStorageFileResize(const char *path, unsigned long long capacity);
 
 enum {
@@ -0,0 +1,1148 @@
+/*
+ * virchunkstream.c: chunked streams compressed in parallel
+ *
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * A chunked stream is a sequence of records, each made of a header
+ *
+ *   uint32_t magic;     VIR_CHUNK_STREAM_MAGIC
+ *   uint32_t type;      enum virChunkStreamType
+ *   uint32_t rawLen;    length of the chunk once decompressed
+ *   uint32_t dataLen;   length of the data following the header
+ *
+ * stored in big-endian byte order, followed by the data.  The input is
+ * cut in chunks of VIR_CHUNK_STREAM_CHUNK_SIZE bytes, only the last one
+ * being shorter, which are compressed independently of each other so
+ * that several threads can work on consecutive chunks at the same time.
+ * Chunks made of zero bytes only are stored without any data, other
+ * chunks are stored in the LZ4 block format, or as is if they do not
+ * compress.  The stream ends with a VIR_CHUNK_STREAM_END record so that
+ * a truncated stream is never mistaken for a complete one.
+ *
+ * The same machinery can instead run an external compression program on
+ * each chunk, of VIR_CHUNK_STREAM_FILTER_CHUNK_SIZE bytes then, and write
+ * the outputs back to back without any record header.  gzip, bzip2 and
+ * xz all decompress such a sequence as a single stream.
+ */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "virchunkstream.h"
+#include "command.h"
+#include "threads.h"
+#include "memory.h"
+#include "util.h"
+#include "virendian.h"
+#include "virfile.h"
+#include "virterror_internal.h"
+#include "logging.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+#define VIR_CHUNK_STREAM_MAGIC 0x4c564353 /* "LVCS" */
+#define VIR_CHUNK_STREAM_CHUNK_SIZE (1024 * 1024)
+#define VIR_CHUNK_STREAM_HEADER_SIZE 16
+
+/* Chunks given to compression programs are larger, so that a program is
+ * not run too often and still compresses well */
+#define VIR_CHUNK_STREAM_FILTER_CHUNK_SIZE (8 * 1024 * 1024)
+
+enum virChunkStreamType {
+    VIR_CHUNK_STREAM_RAW = 0,
+    VIR_CHUNK_STREAM_LZ4 = 1,
+    VIR_CHUNK_STREAM_ZERO = 2,
+    VIR_CHUNK_STREAM_END = 3,
+};
+
+/* Parameters of the LZ4 block format */
+#define VIR_LZ4_MIN_MATCH 4
+#define VIR_LZ4_MAX_OFFSET 65535
+#define VIR_LZ4_LAST_LITERALS 5
+#define VIR_LZ4_MF_LIMIT 12
+
+#define VIR_LZ4_HASH_BITS 13
+#define VIR_LZ4_HASH_SIZE (1 << VIR_LZ4_HASH_BITS)
+
+/* Look for matches less and less often in data that does not compress */
+#define VIR_LZ4_SKIP_TRIGGER 6
+
+
+static inline uint32_t
+virLZ4Read32(const unsigned char *p)
+{
+    uint32_t val;
+
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+
+static inline unsigned int
+virLZ4Hash(uint32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - VIR_LZ4_HASH_BITS);
+}
+
+
+static unsigned char *
+virLZ4PutLength(unsigned char *op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+
+/* Append @nliterals bytes at @literals followed, unless @len is 0, by a
+ * match of @len bytes @offset bytes back.  Returns the new end of the
+ * output, or NULL if the sequence does not fit before @oend.  */
+static unsigned char *
+virLZ4PutSequence(unsigned char *op, unsigned char *oend,
+                  const unsigned char *literals, size_t nliterals,
+                  size_t offset, size_t len)
+{
+    unsigned char *token;
+    size_t need = 1 + nliterals + nliterals / 255 + 1;
+
+    if (len)
+        need += 2 + (len - VIR_LZ4_MIN_MATCH) / 255 + 1;
+    if (need > (size_t)(oend - op))
+        return NULL;
+
+    token = op++;
+    if (nliterals >= 15) {
+        *token = 15 << 4;
+        op = virLZ4PutLength(op, nliterals - 15);
+    } else {
+        *token = nliterals << 4;
+    }
+    memcpy(op, literals, nliterals);
+    op += nliterals;
+
+    if (len) {
+        len -= VIR_LZ4_MIN_MATCH;
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        if (len >= 15) {
+            *token |= 15;
+            op = virLZ4PutLength(op, len - 15);
+        } else {
+            *token |= len;
+        }
+    }
+
+    return op;
+}
+
+
+/* Compress @srclen bytes at @src into at most @dstlen bytes at @dst,
+ * using @table of VIR_LZ4_HASH_SIZE entries as scratch space.
+ * Returns the length of the compressed data, or 0 if it does not fit.  */
+static size_t
+virLZ4Compress(const unsigned char *src, size_t srclen,
+               unsigned char *dst, size_t dstlen, uint32_t *table)
+{
+    const unsigned char *ip = src;
+    const unsigned char *anchor = src;
+    const unsigned char *end = src + srclen;
+    unsigned char *op = dst;
+    unsigned char *oend = dst + dstlen;
+
+    if (srclen > VIR_LZ4_MF_LIMIT) {
+        const unsigned char *mflimit = end - VIR_LZ4_MF_LIMIT;
+        const unsigned char *matchlimit = end - VIR_LZ4_LAST_LITERALS;
+        unsigned int misses = 0;
+
+        memset(table, 0, VIR_LZ4_HASH_SIZE * sizeof(*table));
+
+        while (ip < mflimit) {
+            uint32_t seq = virLZ4Read32(ip);
+            unsigned int h = virLZ4Hash(seq);
+            const unsigned char *ref = src + table[h];
+            const unsigned char *mp;
+            const unsigned char *rp;
+
+            table[h] = ip - src;
+            if (ref >= ip || ip - ref > VIR_LZ4_MAX_OFFSET ||
+                virLZ4Read32(ref) != seq) {
+                ip += 1 + (misses++ >> VIR_LZ4_SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            mp = ip + VIR_LZ4_MIN_MATCH;
+            rp = ref + VIR_LZ4_MIN_MATCH;
+            while (mp < matchlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            if (!(op = virLZ4PutSequence(op, oend, anchor, ip - anchor,
+                                         ip - ref, mp - ip)))
+                return 0;
+            ip = anchor = mp;
+        }
+    }
+
+    if (!(op = virLZ4PutSequence(op, oend, anchor, end - anchor, 0, 0)))
+        return 0;
+
+    return op - dst;
+}
+
+
+static int
+virLZ4GetLength(const unsigned char **ip, const unsigned char *iend,
+                size_t *len)
+{
+    unsigned int b;
+
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+
+    return 0;
+}
+
+
+/* Decompress @srclen bytes at @src, which must expand to exactly @dstlen
+ * bytes at @dst.  Returns 0 on success, -1 if the data is corrupted.  */
+static int
+virLZ4Decompress(const unsigned char *src, size_t srclen,
+                 unsigned char *dst, size_t dstlen)
+{
+    const unsigned char *ip = src;
+    const unsigned char *iend = src + srclen;
+    unsigned char *op = dst;
+    unsigned char *oend = dst + dstlen;
+
+    while (ip < iend) {
+        unsigned int token = *ip++;
+        size_t len = token >> 4;
+        size_t offset;
+        const unsigned char *ref;
+
+        if (len == 15 && virLZ4GetLength(&ip, iend, &len) < 0)
+            return -1;
+        if (len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+
+        /* The last sequence has no match */
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst))
+            return -1;
+
+        len = token & 15;
+        if (len == 15 && virLZ4GetLength(&ip, iend, &len) < 0)
+            return -1;
+        len += VIR_LZ4_MIN_MATCH;
+        if (len > (size_t)(oend - op))
+            return -1;
+
+        ref = op - offset;
+        if (offset >= len) {
+            memcpy(op, ref, len);
+            op += len;
+        } else {
+            /* The match repeats the last @offset bytes */
+            while (len--)
+                *op++ = *ref++;
+        }
+    }
+
+    return op == oend ? 0 : -1;
+}
+
+
+typedef struct _virChunkStreamSlot virChunkStreamSlot;
+typedef virChunkStreamSlot *virChunkStreamSlotPtr;
+struct _virChunkStreamSlot {
+    unsigned char header[VIR_CHUNK_STREAM_HEADER_SIZE];
+    unsigned int type;
+    size_t rawLen;
+    size_t dataLen;
+
+    unsigned char *in;          /* as read from the input */
+    unsigned char *buf;         /* (de)compressed data */
+    size_t bufAlloc;
+    uint32_t *table;            /* LZ4 hash table */
+    const unsigned char *out;   /* what to write after the header */
+    size_t outLen;
+
+    bool done;
+};
+
+/* Chunks are read in order by the calling thread into a ring of slots,
+ * handed to worker threads, and written in order by a writer thread
+ * once processed.  */
+typedef struct _virChunkStream virChunkStream;
+typedef virChunkStream *virChunkStreamPtr;
+struct _virChunkStream {
+    virMutex lock;
+    virCond cond;
+
+    bool compress;
+    const char *const *filter;  /* compression program, if any */
+    size_t chunkSize;
+    int fdin;
+    int fdout;
+
+    virChunkStreamProgress progress;
+    void *opaque;
+    unsigned long long nbytes;  /* Bytes read from the input */
+
+    virChunkStreamSlotPtr slots;
+    size_t nslots;
+
+    /* Number of chunks read, handed to workers, and written */
+    unsigned long long nread;
+    unsigned long long nworked;
+    unsigned long long nwritten;
+
+    bool eof;
+    bool quit;
+    virErrorPtr err;
+};
+
+
+/* Called with @st locked when a thread failed, to stop all of them */
+static void
+virChunkStreamAbort(virChunkStreamPtr st)
+{
+    if (!st->err)
+        st->err = virSaveLastError();
+    st->quit = true;
+    virCondBroadcast(&st->cond);
+}
+
+
+static void
+virChunkStreamPutHeader(unsigned char *header, unsigned int type,
+                        size_t rawLen, size_t dataLen)
+{
+    uint32_t fields[] = { VIR_CHUNK_STREAM_MAGIC, type, rawLen, dataLen };
+    size_t i;
+
+    for (i = 0 ; i < ARRAY_CARDINALITY(fields) ; i++) {
+        header[i * 4] = fields[i] >> 24;
+        header[i * 4 + 1] = fields[i] >> 16;
+        header[i * 4 + 2] = fields[i] >> 8;
+        header[i * 4 + 3] = fields[i];
+    }
+}
+
+
+static bool
+virChunkStreamIsZero(const unsigned char *buf, size_t len)
+{
+    return buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+
+/* Decode and check a record header */
+static int
+virChunkStreamGetHeader(const unsigned char *header, unsigned int *type,
+                        size_t *rawLen, size_t *dataLen)
+{
+    *type = virReadBufInt32BE(header + 4);
+    *rawLen = virReadBufInt32BE(header + 8);
+    *dataLen = virReadBufInt32BE(header + 12);
+
+    if (virReadBufInt32BE(header) != VIR_CHUNK_STREAM_MAGIC ||
+        *type > VIR_CHUNK_STREAM_END ||
+        *rawLen > VIR_CHUNK_STREAM_CHUNK_SIZE ||
+        (*type == VIR_CHUNK_STREAM_RAW && *dataLen != *rawLen) ||
+        (*type == VIR_CHUNK_STREAM_LZ4 && *dataLen >= *rawLen) ||
+        (*type == VIR_CHUNK_STREAM_ZERO && *dataLen != 0)) {
+        virReportError(VIR_ERR_OPERATION_FAILED, "%s",
+                       _("invalid chunk header in chunked stream"));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Returns 1 if a chunk was read, 0 at the end of the stream, -1 on error */
+static int
+virChunkStreamRead(virChunkStreamPtr st, virChunkStreamSlotPtr slot)
+{
+    unsigned char header[VIR_CHUNK_STREAM_HEADER_SIZE];
+    ssize_t got;
+
+    if (st->compress) {
+        if ((got = saferead(st->fdin, slot->in, st->chunkSize)) < 0) {
+            virReportSystemError(errno, "%s", _("Unable to read stream"));
+            return -1;
+        }
+        slot->rawLen = got;
+        /* Compression programs give a valid output for an empty input,
+         * but nothing at all is not a valid stream */
+        if (got == 0 && st->filter && st->nread == 0)
+            return 1;
+        return got > 0;
+    }
+
+    if ((got = saferead(st->fdin, header, sizeof(header))) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to read chunked stream"));
+        return -1;
+    }
+    if (got != sizeof(header)) {
+        virReportError(VIR_ERR_OPERATION_FAILED, "%s",
+                       _("chunked stream is truncated"));
+        return -1;
+    }
+
+    if (virChunkStreamGetHeader(header, &slot->type,
+                                &slot->rawLen, &slot->dataLen) < 0)
+        return -1;
+
+    if (slot->type == VIR_CHUNK_STREAM_END)
+        return 0;
+
+    if ((got = saferead(st->fdin, slot->in, slot->dataLen)) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to read chunked stream"));
+        return -1;
+    }
+    if (got != slot->dataLen) {
+        virReportError(VIR_ERR_OPERATION_FAILED, "%s",
+                       _("chunked stream is truncated"));
+        return -1;
+    }
+
+    return 1;
+}
+
+
+static int
+virChunkStreamPack(virChunkStreamSlotPtr slot)
+{
+    size_t len;
+
+    if (virChunkStreamIsZero(slot->in, slot->rawLen)) {
+        slot->type = VIR_CHUNK_STREAM_ZERO;
+        slot->out = NULL;
+        slot->outLen = 0;
+    } else if ((len = virLZ4Compress(slot->in, slot->rawLen,
+                                     slot->buf, slot->rawLen - 1,
+                                     slot->table)) > 0) {
+        slot->type = VIR_CHUNK_STREAM_LZ4;
+        slot->out = slot->buf;
+        slot->outLen = len;
+    } else {
+        slot->type = VIR_CHUNK_STREAM_RAW;
+        slot->out = slot->in;
+        slot->outLen = slot->rawLen;
+    }
+
+    virChunkStreamPutHeader(slot->header, slot->type,
+                            slot->rawLen, slot->outLen);
+    return 0;
+}
+
+
+/* Runs the compression program on the chunk, feeding it the chunk and
+ * collecting its output at the same time so that neither side of the
+ * pipes can fill up */
+static int
+virChunkStreamFilterChunk(virChunkStreamPtr st, virChunkStreamSlotPtr slot)
+{
+    virCommandPtr cmd = NULL;
+    int infd[2] = { -1, -1 };
+    int outfd = -1;
+    size_t inOff = 0;
+    int ret = -1;
+
+    slot->outLen = 0;
+
+    if (pipe2(infd, O_CLOEXEC) < 0) {
+        virReportSystemError(errno, "%s", _("Unable to create pipe"));
+        goto cleanup;
+    }
+
+    cmd = virCommandNewArgs(st->filter);
+    virCommandSetInputFD(cmd, infd[0]);
+    virCommandSetOutputFD(cmd, &outfd);
+    if (virCommandRunAsync(cmd, NULL) < 0)
+        goto cleanup;
+    VIR_FORCE_CLOSE(infd[0]);
+
+    if (virSetNonBlock(infd[1]) < 0 || virSetNonBlock(outfd) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to set non-blocking mode"));
+        goto cleanup;
+    }
+
+    if (slot->rawLen == 0)
+        VIR_FORCE_CLOSE(infd[1]);
+
+    while (outfd != -1) {
+        struct pollfd fds[2];
+        size_t nfds = 0;
+        size_t i;
+
+        if (infd[1] != -1) {
+            fds[nfds].fd = infd[1];
+            fds[nfds].events = POLLOUT;
+            fds[nfds].revents = 0;
+            nfds++;
+        }
+        fds[nfds].fd = outfd;
+        fds[nfds].events = POLLIN;
+        fds[nfds].revents = 0;
+        nfds++;
+
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            virReportSystemError(errno, "%s", _("Unable to poll on pipes"));
+            goto cleanup;
+        }
+
+        for (i = 0 ; i < nfds ; i++) {
+            ssize_t done;
+
+            if (!fds[i].revents)
+                continue;
+
+            if (fds[i].fd == infd[1]) {
+                done = write(infd[1], slot->in + inOff, slot->rawLen - inOff);
+                if (done < 0) {
+                    if (errno == EAGAIN || errno == EINTR)
+                        continue;
+                    virReportSystemError(errno, "%s",
+                                         _("Unable to write to compressor"));
+                    goto cleanup;
+                }
+                inOff += done;
+                if (inOff == slot->rawLen)
+                    VIR_FORCE_CLOSE(infd[1]);
+            } else {
+                if (slot->bufAlloc - slot->outLen < 64 * 1024 &&
+                    VIR_RESIZE_N(slot->buf, slot->bufAlloc,
+                                 slot->outLen, 64 * 1024) < 0) {
+                    virReportOOMError();
+                    goto cleanup;
+                }
+                done = read(outfd, slot->buf + slot->outLen,
+                            slot->bufAlloc - slot->outLen);
+                if (done < 0) {
+                    if (errno == EAGAIN || errno == EINTR)
+                        continue;
+                    virReportSystemError(errno, "%s",
+                                         _("Unable to read from compressor"));
+                    goto cleanup;
+                }
+                if (done == 0)
+                    VIR_FORCE_CLOSE(outfd);
+                slot->outLen += done;
+            }
+        }
+    }
+
+    if (infd[1] != -1) {
+        virReportError(VIR_ERR_OPERATION_FAILED,
+                       _("%s exited before reading all its input"),
+                       st->filter[0]);
+        goto cleanup;
+    }
+
+    if (virCommandWait(cmd, NULL) < 0)
+        goto cleanup;
+
+    slot->out = slot->buf;
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_CLOSE(infd[0]);
+    VIR_FORCE_CLOSE(infd[1]);
+    VIR_FORCE_CLOSE(outfd);
+    if (ret < 0)
+        virCommandAbort(cmd);
+    virCommandFree(cmd);
+    return ret;
+}
+
+
+static int
+virChunkStreamUnpack(virChunkStreamSlotPtr slot)
+{
+    switch ((enum virChunkStreamType) slot->type) {
+    case VIR_CHUNK_STREAM_ZERO:
+        memset(slot->buf, 0, slot->rawLen);
+        slot->out = slot->buf;
+        break;
+
+    case VIR_CHUNK_STREAM_LZ4:
+        if (virLZ4Decompress(slot->in, slot->dataLen,
+                             slot->buf, slot->rawLen) < 0) {
+            virReportError(VIR_ERR_OPERATION_FAILED, "%s",
+                           _("corrupted chunk in chunked stream"));
+            return -1;
+        }
+        slot->out = slot->buf;
+        break;
+
+    case VIR_CHUNK_STREAM_RAW:
+    case VIR_CHUNK_STREAM_END:
+        slot->out = slot->in;
+        break;
+    }
+
+    slot->outLen = slot->rawLen;
+    return 0;
+}
+
+
+static int
+virChunkStreamWrite(virChunkStreamPtr st, virChunkStreamSlotPtr slot)
+{
+    if ((st->compress && !st->filter &&
+         safewrite(st->fdout, slot->header, sizeof(slot->header)) < 0) ||
+        (slot->outLen &&
+         safewrite(st->fdout, slot->out, slot->outLen) < 0)) {
+        virReportSystemError(errno, "%s", _("Unable to write stream"));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void
+virChunkStreamWorker(void *opaque)
+{
+    virChunkStreamPtr st = opaque;
+
+    virMutexLock(&st->lock);
+    while (!st->quit) {
+        virChunkStreamSlotPtr slot;
+        int rc;
+
+        if (st->nworked == st->nread) {
+            if (st->eof)
+                break;
+            ignore_value(virCondWait(&st->cond, &st->lock));
+            continue;
+        }
+
+        slot = &st->slots[st->nworked++ % st->nslots];
+        virMutexUnlock(&st->lock);
+
+        if (st->filter)
+            rc = virChunkStreamFilterChunk(st, slot);
+        else if (st->compress)
+            rc = virChunkStreamPack(slot);
+        else
+            rc = virChunkStreamUnpack(slot);
+
+        virMutexLock(&st->lock);
+        if (rc < 0) {
+            virChunkStreamAbort(st);
+            break;
+        }
+        slot->done = true;
+        virCondBroadcast(&st->cond);
+    }
+    virMutexUnlock(&st->lock);
+}
+
+
+static void
+virChunkStreamWriter(void *opaque)
+{
+    virChunkStreamPtr st = opaque;
+
+    virMutexLock(&st->lock);
+    while (!st->quit) {
+        virChunkStreamSlotPtr slot = &st->slots[st->nwritten % st->nslots];
+        int rc;
+
+        if (st->nwritten == st->nread && st->eof)
+            break;
+
+        if (st->nwritten == st->nread || !slot->done) {
+            ignore_value(virCondWait(&st->cond, &st->lock));
+            continue;
+        }
+
+        virMutexUnlock(&st->lock);
+        rc = virChunkStreamWrite(st, slot);
+        virMutexLock(&st->lock);
+
+        if (rc < 0) {
+            virChunkStreamAbort(st);
+            break;
+        }
+        slot->done = false;
+        st->nwritten++;
+        virCondBroadcast(&st->cond);
+    }
+    virMutexUnlock(&st->lock);
+}
+
+
+static unsigned int
+virChunkStreamDefaultThreads(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (ncpus > 0)
+        return ncpus;
+#endif
+    return 1;
+}
+
+
+static int
+virChunkStreamRun(int fdin, int fdout, unsigned int nthreads, bool compress,
+                  const char *const *filter,
+                  virChunkStreamProgress progress, void *opaque)
+{
+    virChunkStream st;
+    virThreadPtr workers = NULL;
+    virThread writer;
+    size_t nworkers = 0;
+    bool haveWriter = false;
+    bool haveLock = false;
+    bool haveCond = false;
+    int ret = -1;
+    size_t i;
+
+    memset(&st, 0, sizeof(st));
+    st.compress = compress;
+    st.filter = filter;
+    st.chunkSize = filter ? VIR_CHUNK_STREAM_FILTER_CHUNK_SIZE
+                          : VIR_CHUNK_STREAM_CHUNK_SIZE;
+    st.fdin = fdin;
+    st.fdout = fdout;
+    st.progress = progress;
+    st.opaque = opaque;
+
+    if (nthreads == 0)
+        nthreads = virChunkStreamDefaultThreads();
+    if (nthreads > VIR_CHUNK_STREAM_MAX_THREADS)
+        nthreads = VIR_CHUNK_STREAM_MAX_THREADS;
+
+    if (virMutexInit(&st.lock) < 0) {
+        virReportSystemError(errno, "%s", _("Unable to initialize mutex"));
+        goto cleanup;
+    }
+    haveLock = true;
+    if (virCondInit(&st.cond) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to initialize condition variable"));
+        goto cleanup;
+    }
+    haveCond = true;
+
+    /* Let the input be read while all workers are busy and the output of
+     * the oldest chunk is being written */
+    st.nslots = nthreads * 2;
+    if (VIR_ALLOC_N(st.slots, st.nslots) < 0 ||
+        VIR_ALLOC_N(workers, nthreads) < 0)
+        goto no_memory;
+    for (i = 0 ; i < st.nslots ; i++) {
+        /* The output of compression programs is collected as it comes */
+        if (VIR_ALLOC_N(st.slots[i].in, st.chunkSize) < 0 ||
+            (!filter &&
+             VIR_ALLOC_N(st.slots[i].buf, VIR_CHUNK_STREAM_CHUNK_SIZE) < 0))
+            goto no_memory;
+        if (compress && !filter &&
+            VIR_ALLOC_N(st.slots[i].table, VIR_LZ4_HASH_SIZE) < 0)
+            goto no_memory;
+    }
+
+    if (virThreadCreate(&writer, true, virChunkStreamWriter, &st) < 0) {
+        virReportSystemError(errno, "%s", _("Unable to create thread"));
+        goto cleanup;
+    }
+    haveWriter = true;
+
+    for (i = 0 ; i < nthreads ; i++) {
+        if (virThreadCreate(&workers[i], true,
+                            virChunkStreamWorker, &st) < 0) {
+            virReportSystemError(errno, "%s", _("Unable to create thread"));
+            goto cleanup;
+        }
+        nworkers++;
+    }
+
+    virMutexLock(&st.lock);
+    while (!st.quit) {
+        virChunkStreamSlotPtr slot;
+        int rc;
+
+        if (st.nread - st.nwritten == st.nslots) {
+            ignore_value(virCondWait(&st.cond, &st.lock));
+            continue;
+        }
+
+        slot = &st.slots[st.nread % st.nslots];
+        virMutexUnlock(&st.lock);
+        rc = virChunkStreamRead(&st, slot);
+        virMutexLock(&st.lock);
+
+        if (rc < 0) {
+            virChunkStreamAbort(&st);
+            break;
+        }
+        if (rc == 0) {
+            st.eof = true;
+        } else {
+            st.nread++;
+            st.nbytes += slot->rawLen;
+        }
+        virCondBroadcast(&st.cond);
+
+        if (progress && rc > 0) {
+            unsigned long long nbytes = st.nbytes;
+
+            virMutexUnlock(&st.lock);
+            progress(nbytes, opaque);
+            virMutexLock(&st.lock);
+        }
+
+        if (st.eof)
+            break;
+    }
+    virMutexUnlock(&st.lock);
+
+    ret = 0;
+
+cleanup:
+    if (haveLock) {
+        virMutexLock(&st.lock);
+        if (ret < 0)
+            virChunkStreamAbort(&st);
+        virMutexUnlock(&st.lock);
+    }
+    if (haveWriter)
+        virThreadJoin(&writer);
+    for (i = 0 ; i < nworkers ; i++)
+        virThreadJoin(&workers[i]);
+
+    if (st.err) {
+        virSetError(st.err);
+        virFreeError(st.err);
+        ret = -1;
+    } else if (ret == 0 && compress && !filter) {
+        unsigned char end[VIR_CHUNK_STREAM_HEADER_SIZE];
+
+        virChunkStreamPutHeader(end, VIR_CHUNK_STREAM_END, 0, 0);
+        if (safewrite(fdout, end, sizeof(end)) < 0) {
+            virReportSystemError(errno, "%s", _("Unable to write stream"));
+            ret = -1;
+        }
+    }
+
+    VIR_DEBUG("%s %llu chunks with %zu threads: %d",
+              compress ? "compressed" : "decompressed",
+              st.nwritten, nworkers, ret);
+
+    if (st.slots) {
+        for (i = 0 ; i < st.nslots ; i++) {
+            VIR_FREE(st.slots[i].in);
+            VIR_FREE(st.slots[i].buf);
+            VIR_FREE(st.slots[i].table);
+        }
+        VIR_FREE(st.slots);
+    }
+    VIR_FREE(workers);
+    if (haveCond)
+        ignore_value(virCondDestroy(&st.cond));
+    if (haveLock)
+        virMutexDestroy(&st.lock);
+    return ret;
+
+no_memory:
+    virReportOOMError();
+    goto cleanup;
+}
+
+
+/**
+ * virChunkStreamCompress:
+ * @fdin: file descriptor to read data from
+ * @fdout: file descriptor to write the chunked stream to
+ * @nthreads: number of threads compressing chunks, 0 for one per CPU
+ *
+ * Compresses everything read from @fdin until its end into a chunked
+ * stream.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int
+virChunkStreamCompress(int fdin, int fdout, unsigned int nthreads)
+{
+    return virChunkStreamRun(fdin, fdout, nthreads, true, NULL, NULL, NULL);
+}
+
+
+/**
+ * virChunkStreamDecompress:
+ * @fdin: file descriptor to read a chunked stream from
+ * @fdout: file descriptor to write the data to
+ * @nthreads: number of threads decompressing chunks, 0 for one per CPU
+ *
+ * Decompresses the chunked stream read from @fdin.  Nothing is read from
+ * @fdin past the end of the stream.
+ *
+ * Returns 0 on success, -1 on error, in particular if the chunked stream
+ * is corrupted or truncated.
+ */
+int
+virChunkStreamDecompress(int fdin, int fdout, unsigned int nthreads)
+{
+    return virChunkStreamRun(fdin, fdout, nthreads, false, NULL, NULL, NULL);
+}
+
+
+/**
+ * virChunkStreamCompressWith:
+ * @fdin: file descriptor to read data from
+ * @fdout: file descriptor to write the compressed data to
+ * @nthreads: number of programs run at the same time, 0 for one per CPU
+ * @argv: command line of a program compressing its stdin to its stdout
+ * @progress: callback told of the number of bytes read so far, or NULL
+ * @opaque: data passed to @progress
+ *
+ * Compresses everything read from @fdin until its end by running @argv
+ * on consecutive chunks of it in parallel and writing their outputs to
+ * @fdout in order.  This only gives a valid stream with programs which
+ * accept concatenated streams when decompressing, such as gzip, bzip2
+ * or xz.  @progress is called by the calling thread.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int
+virChunkStreamCompressWith(int fdin, int fdout, unsigned int nthreads,
+                           const char *const *argv,
+                           virChunkStreamProgress progress, void *opaque)
+{
+    return virChunkStreamRun(fdin, fdout, nthreads, true,
+                             argv, progress, opaque);
+}
+
+
+/**
+ * virChunkStreamIsChunked:
+ * @buf: data to look at
+ * @len: length of @buf
+ *
+ * Returns true if @buf starts like a chunked stream.
+ */
+bool
+virChunkStreamIsChunked(const char *buf, size_t len)
+{
+    return len >= VIR_CHUNK_STREAM_HEADER_SIZE &&
+        virReadBufInt32BE(buf) == VIR_CHUNK_STREAM_MAGIC;
+}
+
+
+/**
+ * virChunkStreamCompressBuffer:
+ * @in: data to compress
+ * @inlen: length of @in
+ * @out: filled with the chunked stream, to be freed by the caller
+ * @outlen: filled with the length of @out
+ *
+ * Compresses @inlen bytes at @in into a chunked stream held in memory,
+ * which virChunkStreamDecompressBuffer or virChunkStreamDecompress
+ * decompress.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int
+virChunkStreamCompressBuffer(const char *in, size_t inlen,
+                             char **out, size_t *outlen)
+{
+    size_t nchunks = (inlen + VIR_CHUNK_STREAM_CHUNK_SIZE - 1) /
+        VIR_CHUNK_STREAM_CHUNK_SIZE;
+    const unsigned char *ip = (const unsigned char *) in;
+    unsigned char *op;
+    unsigned char *buf;
+    uint32_t *table;
+
+    if (VIR_ALLOC_N(table, VIR_LZ4_HASH_SIZE) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+
+    /* Chunks never grow by more than their header */
+    if (VIR_ALLOC_N(buf, inlen + (nchunks + 1) *
+                    VIR_CHUNK_STREAM_HEADER_SIZE) < 0) {
+        virReportOOMError();
+        VIR_FREE(table);
+        return -1;
+    }
+    op = buf;
+
+    while (inlen > 0) {
+        size_t rawLen = MIN(inlen, VIR_CHUNK_STREAM_CHUNK_SIZE);
+        unsigned int type;
+        size_t len = 0;
+
+        if (virChunkStreamIsZero(ip, rawLen)) {
+            type = VIR_CHUNK_STREAM_ZERO;
+        } else if ((len = virLZ4Compress(ip, rawLen,
+                                         op + VIR_CHUNK_STREAM_HEADER_SIZE,
+                                         rawLen - 1, table)) > 0) {
+            type = VIR_CHUNK_STREAM_LZ4;
+        } else {
+            type = VIR_CHUNK_STREAM_RAW;
+            len = rawLen;
+            memcpy(op + VIR_CHUNK_STREAM_HEADER_SIZE, ip, rawLen);
+        }
+
+        virChunkStreamPutHeader(op, type, rawLen, len);
+        op += VIR_CHUNK_STREAM_HEADER_SIZE + len;
+        ip += rawLen;
+        inlen -= rawLen;
+    }
+
+    virChunkStreamPutHeader(op, VIR_CHUNK_STREAM_END, 0, 0);
+    op += VIR_CHUNK_STREAM_HEADER_SIZE;
+
+    VIR_FREE(table);
+    *outlen = op - buf;
+    *out = (char *) buf;
+    return 0;
+}
+
+
+/**
+ * virChunkStreamDecompressBuffer:
+ * @in: chunked stream to decompress
+ * @inlen: length of @in
+ * @maxlen: largest length of the decompressed data to accept
+ * @out: filled with the decompressed data, to be freed by the caller
+ * @outlen: filled with the length of @out
+ *
+ * Decompresses the chunked stream held in memory at @in, which must not
+ * be followed by anything else.
+ *
+ * Returns 0 on success, -1 on error, in particular if the chunked stream
+ * is corrupted, truncated, or decompresses to more than @maxlen bytes.
+ */
+int
+virChunkStreamDecompressBuffer(const char *in, size_t inlen, size_t maxlen,
+                               char **out, size_t *outlen)
+{
+    const unsigned char *ip = (const unsigned char *) in;
+    const unsigned char *iend = ip + inlen;
+    unsigned char *buf = NULL;
+    size_t len = 0;
+    size_t alloc = 0;
+
+    for (;;) {
+        unsigned int type;
+        size_t rawLen;
+        size_t dataLen;
+
+        if (iend - ip < VIR_CHUNK_STREAM_HEADER_SIZE) {
+            virReportError(VIR_ERR_OPERATION_FAILED, "%s",
+                           _("chunked stream is truncated"));
+            goto error;
+        }
+        if (virChunkStreamGetHeader(ip, &type, &rawLen, &dataLen) < 0)
+            goto error;
+        ip += VIR_CHUNK_STREAM_HEADER_SIZE;
+
+        if (type == VIR_CHUNK_STREAM_END)
+            break;
+
+        if (iend - ip < dataLen) {
+            virReportError(VIR_ERR_OPERATION_FAILED, "%s",
+                           _("chunked stream is truncated"));
+            goto error;
+        }
+        if (rawLen > maxlen - len) {
+            virReportError(VIR_ERR_OPERATION_FAILED,
+                           _("chunked stream is larger than %zu bytes"),
+                           maxlen);
+            goto error;
+        }
+        if (VIR_RESIZE_N(buf, alloc, len, rawLen) < 0) {
+            virReportOOMError();
+            goto error;
+        }
+
+        switch ((enum virChunkStreamType) type) {
+        case VIR_CHUNK_STREAM_ZERO:
+            memset(buf + len, 0, rawLen);
+            break;
+
+        case VIR_CHUNK_STREAM_LZ4:
+            if (virLZ4Decompress(ip, dataLen, buf + len, rawLen) < 0) {
+                virReportError(VIR_ERR_OPERATION_FAILED, "%s",
+                               _("corrupted chunk in chunked stream"));
+                goto error;
+            }
+            break;
+
+        case VIR_CHUNK_STREAM_RAW:
+        case VIR_CHUNK_STREAM_END:
+            memcpy(buf + len, ip, rawLen);
+            break;
+        }
+
+        ip += dataLen;
+        len += rawLen;
+    }
+
+    if (ip != iend) {
+        virReportError(VIR_ERR_OPERATION_FAILED, "%s",
+                       _("unexpected data after chunked stream"));
+        goto error;
+    }
+
+    *out = (char *) buf;
+    *outlen = len;
+    return 0;
+
+error:
+    VIR_FREE(buf);
+    return -1;
+}
@@ -0,0 +1,49 @@
+/*
+ * virchunkstream.h: chunked streams compressed in parallel
+ *
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __VIR_CHUNK_STREAM_H__
+# define __VIR_CHUNK_STREAM_H__
+
+# include "internal.h"
+
+/* Largest number of threads compressing or decompressing a stream */
+# define VIR_CHUNK_STREAM_MAX_THREADS 16
+
+typedef void (*virChunkStreamProgress)(unsigned long long nbytes,
+                                       void *opaque);
+
+int virChunkStreamCompress(int fdin, int fdout, unsigned int nthreads);
+int virChunkStreamDecompress(int fdin, int fdout, unsigned int nthreads);
+bool virChunkStreamIsChunked(const char *buf, size_t len);
+int virChunkStreamCompressBuffer(const char *in, size_t inlen,
+                                 char **out, size_t *outlen)
+    ATTRIBUTE_NONNULL(3) ATTRIBUTE_NONNULL(4);
+int virChunkStreamDecompressBuffer(const char *in, size_t inlen,
+                                   size_t maxlen,
+                                   char **out, size_t *outlen)
+    ATTRIBUTE_NONNULL(4) ATTRIBUTE_NONNULL(5);
+int virChunkStreamCompressWith(int fdin, int fdout, unsigned int nthreads,
+                               const char *const *argv,
+                               virChunkStreamProgress progress,
+                               void *opaque)
+    ATTRIBUTE_NONNULL(4);
+
+#endif /* __VIR_CHUNK_STREAM_H__ */
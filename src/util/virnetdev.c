@@ -30,6 +30,8 @@
 #include "memory.h"
 #include "pci.h"
 #include "logging.h"
+#include "virtime.h"
+#include "threads.h"
 
 #include <sys/ioctl.h>
 #include <net/if.h>
@@ -45,35 +47,61 @@
 #define VIR_FROM_THIS VIR_FROM_NONE
 
 #if defined(HAVE_STRUCT_IFREQ)
-static int virNetDevSetupControlFull(const char *ifname,
-                                     struct ifreq *ifr,
-                                     int domain,
-                                     int type)
+/* All the ioctl based helpers below share one control socket rather
+ * than opening a new one for every request. The socket is tied to the
+ * network namespace of the process that opened it, so a child process
+ * (which may have been cloned into a namespace of its own) never
+ * reuses the one inherited from its parent. */
+static virMutex virNetDevControlLock;
+static int virNetDevControlFD = -1;
+static pid_t virNetDevControlPid;
+
+static int virNetDevControlOnceInit(void)
 {
-    int fd;
-
-    memset(ifr, 0, sizeof(*ifr));
-
-    if (virStrcpyStatic(ifr->ifr_name, ifname) == NULL) {
-        virReportSystemError(ERANGE,
-                             _("Network interface name '%s' is too long"),
-                             ifname);
-        return -1;
-    }
-
-    if ((fd = socket(domain, type, 0)) < 0) {
+    if (virMutexInit(&virNetDevControlLock) < 0) {
         virReportSystemError(errno, "%s",
-                             _("Cannot open network interface control socket"));
+                             _("Unable to initialize mutex"));
         return -1;
     }
+    return 0;
+}
 
-    if (virSetInherit(fd, false) < 0) {
-        virReportSystemError(errno, "%s",
-                             _("Cannot set close-on-exec flag for socket"));
-        VIR_FORCE_CLOSE(fd);
+VIR_ONCE_GLOBAL_INIT(virNetDevControl)
+
+static int virNetDevGetControlFD(void)
+{
+    int fd = -1;
+
+    if (virNetDevControlInitialize() < 0)
         return -1;
+
+    virMutexLock(&virNetDevControlLock);
+
+    if (virNetDevControlFD >= 0 && virNetDevControlPid != getpid())
+        VIR_FORCE_CLOSE(virNetDevControlFD);
+
+    if (virNetDevControlFD < 0) {
+        if ((fd = socket(AF_PACKET, SOCK_DGRAM, 0)) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("Cannot open network interface control socket"));
+            goto cleanup;
+        }
+
+        if (virSetInherit(fd, false) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("Cannot set close-on-exec flag for socket"));
+            VIR_FORCE_CLOSE(fd);
+            goto cleanup;
+        }
+
+        virNetDevControlFD = fd;
+        virNetDevControlPid = getpid();
     }
 
+    fd = virNetDevControlFD;
+
+cleanup:
+    virMutexUnlock(&virNetDevControlLock);
     return fd;
 }
 
@@ -81,7 +109,16 @@ static int virNetDevSetupControlFull(const char *ifname,
 static int virNetDevSetupControl(const char *ifname,
                                  struct ifreq *ifr)
 {
-    return virNetDevSetupControlFull(ifname, ifr, AF_PACKET, SOCK_DGRAM);
+    memset(ifr, 0, sizeof(*ifr));
+
+    if (virStrcpyStatic(ifr->ifr_name, ifname) == NULL) {
+        virReportSystemError(ERANGE,
+                             _("Network interface name '%s' is too long"),
+                             ifname);
+        return -1;
+    }
+
+    return virNetDevGetControlFD();
 }
 #endif
 
@@ -116,7 +153,6 @@ int virNetDevExists(const char *ifname)
     ret = 1;
 
 cleanup:
-    VIR_FORCE_CLOSE(fd);
     return ret;
 }
 #else
@@ -170,7 +206,6 @@ int virNetDevSetMAC(const char *ifname,
     ret = 0;
 
 cleanup:
-    VIR_FORCE_CLOSE(fd);
     return ret;
 }
 #else
@@ -217,7 +252,6 @@ int virNetDevGetMAC(const char *ifname,
     ret = 0;
 
 cleanup:
-    VIR_FORCE_CLOSE(fd);
     return ret;
 }
 #else
@@ -347,7 +381,6 @@ int virNetDevGetMTU(const char *ifname)
     ret = ifr.ifr_mtu;
 
 cleanup:
-    VIR_FORCE_CLOSE(fd);
     return ret;
 }
 #else
@@ -393,7 +426,6 @@ int virNetDevSetMTU(const char *ifname, int mtu)
     ret = 0;
 
 cleanup:
-    VIR_FORCE_CLOSE(fd);
     return ret;
 }
 #else
@@ -428,6 +460,160 @@ int virNetDevSetMTUFromDevice(const char *ifname,
 }
 
 
+#if defined(__linux__) && defined(HAVE_LIBNL)
+static struct nl_msg *
+virNetDevLinkChangeMessage(virNetDevLinkChangePtr change)
+{
+    struct nl_msg *nl_msg;
+    struct ifinfomsg ifinfo = {
+        .ifi_family = AF_UNSPEC,
+    };
+
+    if (change->online >= 0) {
+        ifinfo.ifi_change = IFF_UP;
+        ifinfo.ifi_flags = change->online ? IFF_UP : 0;
+    }
+
+    nl_msg = nlmsg_alloc_simple(RTM_SETLINK, NLM_F_REQUEST | NLM_F_ACK);
+    if (!nl_msg) {
+        virReportOOMError();
+        return NULL;
+    }
+
+    if (nlmsg_append(nl_msg, &ifinfo, sizeof(ifinfo), NLMSG_ALIGNTO) < 0)
+        goto buffer_too_small;
+
+    if (nla_put(nl_msg, IFLA_IFNAME, strlen(change->ifname)+1,
+                change->ifname) < 0)
+        goto buffer_too_small;
+
+    if (change->macaddr) {
+        unsigned char mac[VIR_MAC_BUFLEN];
+
+        virMacAddrGetRaw(change->macaddr, mac);
+        if (nla_put(nl_msg, IFLA_ADDRESS, sizeof(mac), mac) < 0)
+            goto buffer_too_small;
+    }
+
+    if (change->mtu > 0 &&
+        nla_put_u32(nl_msg, IFLA_MTU, change->mtu) < 0)
+        goto buffer_too_small;
+
+    return nl_msg;
+
+buffer_too_small:
+    virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                   _("allocated netlink buffer is too small"));
+    nlmsg_free(nl_msg);
+    return NULL;
+}
+
+/**
+ * virNetDevSetLinkBatch:
+ * @changes: array of link changes
+ * @nchanges: number of entries in @changes
+ *
+ * Apply the MAC address, MTU and up/down changes described by @changes
+ * to their interfaces. Each entry becomes a single RTM_SETLINK request,
+ * and the requests are pipelined to the kernel over one netlink socket
+ * rather than issued as one ioctl round trip per setting. Within an
+ * entry the kernel applies the MAC address first, then the MTU, then
+ * the link state.
+ *
+ * Returns 0 in case of success or -1 on failure
+ */
+int virNetDevSetLinkBatch(virNetDevLinkChangePtr changes,
+                          size_t nchanges)
+{
+    int ret = -1;
+    struct nl_msg **nl_msgs = NULL;
+    unsigned char **recvbufs = NULL;
+    unsigned int *recvbuflens = NULL;
+    unsigned long long then = 0;
+    unsigned long long now = 0;
+    size_t i;
+
+    if (nchanges == 0)
+        return 0;
+
+    if (VIR_ALLOC_N(nl_msgs, nchanges) < 0 ||
+        VIR_ALLOC_N(recvbufs, nchanges) < 0 ||
+        VIR_ALLOC_N(recvbuflens, nchanges) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    for (i = 0 ; i < nchanges ; i++) {
+        if (!(nl_msgs[i] = virNetDevLinkChangeMessage(&changes[i])))
+            goto cleanup;
+    }
+
+    ignore_value(virTimeMillisNow(&then));
+
+    if (virNetlinkCommandBatch(nl_msgs, nchanges, recvbufs, recvbuflens,
+                               NETLINK_ROUTE) < 0)
+        goto cleanup;
+
+    ignore_value(virTimeMillisNow(&now));
+    VIR_DEBUG("Applied %zu link changes in %llu ms", nchanges, now - then);
+
+    for (i = 0 ; i < nchanges ; i++) {
+        struct nlmsghdr *resp = (struct nlmsghdr *)recvbufs[i];
+        struct nlmsgerr *err;
+
+        if (recvbuflens[i] < NLMSG_LENGTH(sizeof(*err)) ||
+            resp->nlmsg_type != NLMSG_ERROR) {
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("malformed netlink response message"));
+            goto cleanup;
+        }
+
+        err = (struct nlmsgerr *)NLMSG_DATA(resp);
+        if (err->error) {
+            virReportSystemError(-err->error,
+                                 _("Cannot change link settings of '%s'"),
+                                 changes[i].ifname);
+            goto cleanup;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    for (i = 0 ; i < nchanges ; i++) {
+        if (nl_msgs && nl_msgs[i])
+            nlmsg_free(nl_msgs[i]);
+        if (recvbufs)
+            VIR_FREE(recvbufs[i]);
+    }
+    VIR_FREE(nl_msgs);
+    VIR_FREE(recvbufs);
+    VIR_FREE(recvbuflens);
+    return ret;
+}
+#else /* ! (defined(__linux__) && defined(HAVE_LIBNL)) */
+int virNetDevSetLinkBatch(virNetDevLinkChangePtr changes,
+                          size_t nchanges)
+{
+    size_t i;
+
+    for (i = 0 ; i < nchanges ; i++) {
+        if (changes[i].macaddr &&
+            virNetDevSetMAC(changes[i].ifname, changes[i].macaddr) < 0)
+            return -1;
+        if (changes[i].mtu > 0 &&
+            virNetDevSetMTU(changes[i].ifname, changes[i].mtu) < 0)
+            return -1;
+        if (changes[i].online >= 0 &&
+            virNetDevSetOnline(changes[i].ifname, !!changes[i].online) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+#endif /* ! (defined(__linux__) && defined(HAVE_LIBNL)) */
+
+
 /**
  * virNetDevSetNamespace:
  * @ifname: name of device
@@ -495,7 +681,6 @@ int virNetDevSetName(const char* ifname, const char *newifname)
     ret = 0;
 
 cleanup:
-    VIR_FORCE_CLOSE(fd);
     return ret;
 }
 #else
@@ -555,7 +740,6 @@ int virNetDevSetOnline(const char *ifname,
     ret = 0;
 
 cleanup:
-    VIR_FORCE_CLOSE(fd);
     return ret;
 }
 #else
@@ -601,7 +785,6 @@ int virNetDevIsOnline(const char *ifname,
     ret = 0;
 
 cleanup:
-    VIR_FORCE_CLOSE(fd);
     return ret;
 }
 #else
@@ -630,13 +813,10 @@ int virNetDevGetIndex(const char *ifname, int *ifindex)
 {
     int ret = -1;
     struct ifreq ifreq;
-    int fd = socket(PF_PACKET, SOCK_DGRAM, 0);
+    int fd = virNetDevGetControlFD();
 
-    if (fd < 0) {
-        virReportSystemError(errno, "%s",
-                             _("Unable to open control socket"));
+    if (fd < 0)
         return -1;
-    }
 
     memset(&ifreq, 0, sizeof(ifreq));
 
@@ -658,7 +838,6 @@ int virNetDevGetIndex(const char *ifname, int *ifindex)
     ret = 0;
 
 cleanup:
-    VIR_FORCE_CLOSE(fd);
     return ret;
 }
 #else /* ! SIOCGIFINDEX */
@@ -679,13 +858,10 @@ int virNetDevGetVLanID(const char *ifname, int *vlanid)
       .cmd = GET_VLAN_VID_CMD,
     };
     int ret = -1;
-    int fd = socket(PF_PACKET, SOCK_DGRAM, 0);
+    int fd = virNetDevGetControlFD();
 
-    if (fd < 0) {
-        virReportSystemError(errno, "%s",
-                             _("Unable to open control socket"));
+    if (fd < 0)
         return -1;
-    }
 
     if (virStrcpyStatic(vlanargs.device1, ifname) == NULL) {
         virReportSystemError(ERANGE,
@@ -704,8 +880,6 @@ int virNetDevGetVLanID(const char *ifname, int *vlanid)
     ret = 0;
 
  cleanup:
-    VIR_FORCE_CLOSE(fd);
-
     return ret;
 }
 #else /* ! SIOCGIFVLAN */
@@ -841,7 +1015,6 @@ int virNetDevGetIPv4Address(const char *ifname,
     ret = 0;
 
 cleanup:
-    VIR_FORCE_CLOSE(fd);
     return ret;
 }
 
@@ -921,7 +1094,6 @@ int virNetDevValidateConfig(const char *ifname,
     ret = 1;
 
  cleanup:
-    VIR_FORCE_CLOSE(fd);
     return ret;
 }
 #else /* ! HAVE_STRUCT_IFREQ */
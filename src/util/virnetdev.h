@@ -74,6 +74,19 @@ int virNetDevSetMTU(const char *ifname,
 int virNetDevSetMTUFromDevice(const char *ifname,
                               const char *otherifname)
     ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_RETURN_CHECK;
+
+typedef struct _virNetDevLinkChange virNetDevLinkChange;
+typedef virNetDevLinkChange *virNetDevLinkChangePtr;
+struct _virNetDevLinkChange {
+    const char *ifname;
+    virMacAddrPtr macaddr;  /* new MAC address, or NULL to keep it */
+    int mtu;                /* new MTU, or 0 to keep it */
+    int online;             /* 1 to bring the link up, 0 down, -1 to keep */
+};
+
+int virNetDevSetLinkBatch(virNetDevLinkChangePtr changes,
+                          size_t nchanges)
+    ATTRIBUTE_RETURN_CHECK;
 int virNetDevGetMTU(const char *ifname)
     ATTRIBUTE_NONNULL(1) ATTRIBUTE_RETURN_CHECK;
 int virNetDevSetNamespace(const char *ifname, pid_t pidInNs)
@@ -26,6 +26,17 @@
 #include "command.h"
 #include "memory.h"
 #include "virterror_internal.h"
+#include "virnetdev.h"
+#include "logging.h"
+#include "util.h"
+
+#if defined(__linux__) && defined(HAVE_LIBNL)
+# include <arpa/inet.h>
+# include <linux/if_ether.h>
+# include <linux/pkt_sched.h>
+# include <linux/pkt_cls.h>
+# include "virnetlink.h"
+#endif
 
 #define VIR_FROM_THIS VIR_FROM_NONE
 
@@ -41,25 +52,525 @@ virNetDevBandwidthFree(virNetDevBandwidthPtr def)
 }
 
 
+#if defined(__linux__) && defined(HAVE_LIBNL)
+/* Scheduler clock parameters, needed to express rates and bursts in
+ * the units the kernel expects. These are computed exactly like
+ * tc(8) does, so that the result is identical to running tc. */
+typedef struct _virNetDevBandwidthClock virNetDevBandwidthClock;
+struct _virNetDevBandwidthClock {
+    double tickInUsec;
+    unsigned int hz;
+};
+
+/* Size of the rate tables passed along with HTB classes and policers */
+# define VIR_NETDEV_BANDWIDTH_RTAB_CELLS 256
+
+/* Default MTU assumed by tc for HTB classes and by our policer */
+# define VIR_NETDEV_BANDWIDTH_HTB_MTU 1600
+# define VIR_NETDEV_BANDWIDTH_POLICE_MTU (64 * 1024)
+
+/* At most: two deletions, root qdisc, two classes, sfq, fw filter,
+ * ingress qdisc and the policing filter */
+# define VIR_NETDEV_BANDWIDTH_MAX_MSGS 9
+
+typedef struct _virNetDevBandwidthReq virNetDevBandwidthReq;
+typedef virNetDevBandwidthReq *virNetDevBandwidthReqPtr;
+struct _virNetDevBandwidthReq {
+    int ifindex;
+    virNetDevBandwidthClock clock;
+    size_t nmsgs;
+    struct nl_msg *msgs[VIR_NETDEV_BANDWIDTH_MAX_MSGS];
+    const char *what[VIR_NETDEV_BANDWIDTH_MAX_MSGS];
+    bool mayFail[VIR_NETDEV_BANDWIDTH_MAX_MSGS];
+};
+
+static int
+virNetDevBandwidthClockInit(virNetDevBandwidthClock *clock)
+{
+    char *buf = NULL;
+    unsigned int t2us, us2t, clockRes, hz;
+    int ret = -1;
+
+    if (virFileReadAll("/proc/net/psched", 1024, &buf) < 0)
+        goto cleanup;
+
+    if (sscanf(buf, "%08x %08x %08x %08x", &t2us, &us2t, &clockRes, &hz) != 4 ||
+        us2t == 0) {
+        VIR_DEBUG("Unexpected content of /proc/net/psched: %s", buf);
+        goto cleanup;
+    }
+
+    if (clockRes == 1000000000)
+        t2us = us2t;
+
+    clock->tickInUsec = (double)t2us / us2t * ((double)clockRes / 1000000);
+    clock->hz = clockRes == 1000000 && hz ? hz : 100;
+    ret = 0;
+
+cleanup:
+    VIR_FREE(buf);
+    return ret;
+}
+
+/* Time, in scheduler ticks, needed to send @size bytes at @rate bytes/s */
+static unsigned int
+virNetDevBandwidthXmitTime(virNetDevBandwidthClock *clock,
+                           unsigned long long rate,
+                           unsigned long long size)
+{
+    unsigned int usec = 1000000.0 * size / rate;
+
+    return usec * clock->tickInUsec;
+}
+
+static void
+virNetDevBandwidthRateTable(virNetDevBandwidthClock *clock,
+                            struct tc_ratespec *spec,
+                            uint32_t *rtab,
+                            unsigned long long rate,
+                            unsigned int mtu)
+{
+    int cellLog = 0;
+    size_t i;
+
+    while ((mtu >> cellLog) > 255)
+        cellLog++;
+
+    for (i = 0 ; i < VIR_NETDEV_BANDWIDTH_RTAB_CELLS ; i++)
+        rtab[i] = virNetDevBandwidthXmitTime(clock, rate, (i + 1) << cellLog);
+
+    spec->rate = rate;
+    spec->cell_log = cellLog;
+    spec->cell_align = -1;
+# ifdef TC_LINKLAYER_MASK
+    spec->linklayer = TC_LINKLAYER_ETHERNET;
+# endif
+}
+
 /**
- * virNetDevBandwidthSet:
- * @ifname: on which interface
- * @bandwidth: rates to set (may be NULL)
- * @hierarchical_class: whether to create hierarchical class
+ * virNetDevBandwidthReqAdd:
+ * @req: request batch
+ * @type: RTM_NEWQDISC, RTM_DELQDISC, RTM_NEWTCLASS or RTM_NEWTFILTER
+ * @parent: parent handle
+ * @handle: handle of the new object, 0 to let the kernel pick one
+ * @info: filter priority and protocol, 0 for anything else
+ * @kind: queueing discipline, class or classifier type, may be NULL
+ * @what: description of the object, for error messages
  *
- * This function enables QoS on specified interface
- * and set given traffic limits for both, incoming
- * and outgoing traffic. Any previous setting get
- * overwritten. If @hierarchical_class is TRUE, create
- * hierarchical class. It is used to guarantee minimal
- * throughput ('floor' attribute in NIC).
+ * Queue a new traffic control message in @req. Options, if any, are
+ * to be appended to the returned message by the caller.
  *
- * Return 0 on success, -1 otherwise.
+ * Returns the message, or NULL on error.
  */
-int
-virNetDevBandwidthSet(const char *ifname,
-                      virNetDevBandwidthPtr bandwidth,
-                      bool hierarchical_class)
+static struct nl_msg *
+virNetDevBandwidthReqAdd(virNetDevBandwidthReqPtr req,
+                         int type,
+                         uint32_t parent,
+                         uint32_t handle,
+                         uint32_t info,
+                         const char *kind,
+                         const char *what)
+{
+    struct nl_msg *nl_msg;
+    int flags = NLM_F_REQUEST | NLM_F_ACK;
+    struct tcmsg tcm = {
+        .tcm_family = AF_UNSPEC,
+        .tcm_ifindex = req->ifindex,
+        .tcm_handle = handle,
+        .tcm_parent = parent,
+        .tcm_info = info,
+    };
+
+    sa_assert(req->nmsgs < VIR_NETDEV_BANDWIDTH_MAX_MSGS);
+
+    if (type != RTM_DELQDISC)
+        flags |= NLM_F_CREATE | NLM_F_EXCL;
+
+    if (!(nl_msg = nlmsg_alloc_simple(type, flags))) {
+        virReportOOMError();
+        return NULL;
+    }
+
+    if (nlmsg_append(nl_msg, &tcm, sizeof(tcm), NLMSG_ALIGNTO) < 0 ||
+        (kind && nla_put_string(nl_msg, TCA_KIND, kind) < 0)) {
+        nlmsg_free(nl_msg);
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("allocated netlink buffer is too small"));
+        return NULL;
+    }
+
+    req->msgs[req->nmsgs] = nl_msg;
+    req->what[req->nmsgs] = what;
+    req->mayFail[req->nmsgs] = type == RTM_DELQDISC;
+    req->nmsgs++;
+
+    return nl_msg;
+}
+
+static int
+virNetDevBandwidthReqAddHTBClass(virNetDevBandwidthReqPtr req,
+                                 uint32_t parent,
+                                 uint32_t classid,
+                                 unsigned long long rate,
+                                 unsigned long long ceil,
+                                 unsigned long long burst,
+                                 const char *what)
+{
+    struct nl_msg *nl_msg;
+    struct nlattr *opts;
+    struct tc_htb_opt opt;
+    uint32_t rtab[VIR_NETDEV_BANDWIDTH_RTAB_CELLS];
+    uint32_t ctab[VIR_NETDEV_BANDWIDTH_RTAB_CELLS];
+    unsigned int mtu = VIR_NETDEV_BANDWIDTH_HTB_MTU;
+
+    memset(&opt, 0, sizeof(opt));
+
+    if (!ceil)
+        ceil = rate;
+    if (!burst)
+        burst = rate / req->clock.hz + mtu;
+
+    virNetDevBandwidthRateTable(&req->clock, &opt.rate, rtab, rate, mtu);
+    virNetDevBandwidthRateTable(&req->clock, &opt.ceil, ctab, ceil, mtu);
+    opt.buffer = virNetDevBandwidthXmitTime(&req->clock, rate, burst);
+    opt.cbuffer = virNetDevBandwidthXmitTime(&req->clock, ceil,
+                                             ceil / req->clock.hz + mtu);
+
+    if (!(nl_msg = virNetDevBandwidthReqAdd(req, RTM_NEWTCLASS, parent,
+                                            classid, 0, "htb", what)))
+        return -1;
+
+    if (!(opts = nla_nest_start(nl_msg, TCA_OPTIONS)) ||
+        nla_put(nl_msg, TCA_HTB_PARMS, sizeof(opt), &opt) < 0 ||
+        nla_put(nl_msg, TCA_HTB_RTAB, sizeof(rtab), rtab) < 0 ||
+        nla_put(nl_msg, TCA_HTB_CTAB, sizeof(ctab), ctab) < 0)
+        goto buffer_too_small;
+    nla_nest_end(nl_msg, opts);
+
+    return 0;
+
+buffer_too_small:
+    virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                   _("allocated netlink buffer is too small"));
+    return -1;
+}
+
+static int
+virNetDevBandwidthReqAddClear(virNetDevBandwidthReqPtr req)
+{
+    if (!virNetDevBandwidthReqAdd(req, RTM_DELQDISC, TC_H_ROOT, 0, 0,
+                                  NULL, "root qdisc") ||
+        !virNetDevBandwidthReqAdd(req, RTM_DELQDISC, TC_H_INGRESS,
+                                  TC_H_MAKE(TC_H_INGRESS, 0), 0,
+                                  "ingress", "ingress qdisc"))
+        return -1;
+    return 0;
+}
+
+/* Same tree as virNetDevBandwidthSetTC builds, see the explanation
+ * there */
+static int
+virNetDevBandwidthReqAddInbound(virNetDevBandwidthReqPtr req,
+                                virNetDevBandwidthRatePtr in,
+                                bool hierarchical_class)
+{
+    struct nl_msg *nl_msg;
+    struct nlattr *opts;
+    unsigned long long average = in->average * 1000;
+    unsigned long long peak = in->peak * 1000;
+    unsigned long long burst = in->burst * 1024;
+    struct tc_htb_glob glob = {
+        .version = 3,
+        .rate2quantum = 10,
+        .defcls = hierarchical_class ? 2 : 1,
+    };
+    struct tc_sfq_qopt sfq = {
+        .perturb_period = 10,
+    };
+    uint32_t classid = TC_H_MAKE(1 << 16, hierarchical_class ? 2 : 1);
+
+    if (!(nl_msg = virNetDevBandwidthReqAdd(req, RTM_NEWQDISC, TC_H_ROOT,
+                                            TC_H_MAKE(1 << 16, 0), 0,
+                                            "htb", "htb qdisc 1:")))
+        return -1;
+    if (!(opts = nla_nest_start(nl_msg, TCA_OPTIONS)) ||
+        nla_put(nl_msg, TCA_HTB_INIT, sizeof(glob), &glob) < 0)
+        goto buffer_too_small;
+    nla_nest_end(nl_msg, opts);
+
+    if (hierarchical_class &&
+        virNetDevBandwidthReqAddHTBClass(req, TC_H_MAKE(1 << 16, 0),
+                                         TC_H_MAKE(1 << 16, 1),
+                                         average, peak, 0,
+                                         "htb class 1:1") < 0)
+        return -1;
+
+    if (virNetDevBandwidthReqAddHTBClass(req,
+                                         hierarchical_class ?
+                                         TC_H_MAKE(1 << 16, 1) :
+                                         TC_H_MAKE(1 << 16, 0),
+                                         classid, average, peak, burst,
+                                         hierarchical_class ?
+                                         "htb class 1:2" :
+                                         "htb class 1:1") < 0)
+        return -1;
+
+    if (!(nl_msg = virNetDevBandwidthReqAdd(req, RTM_NEWQDISC, classid,
+                                            TC_H_MAKE(2 << 16, 0), 0,
+                                            "sfq", "sfq qdisc 2:")))
+        return -1;
+    if (nla_put(nl_msg, TCA_OPTIONS, sizeof(sfq), &sfq) < 0)
+        goto buffer_too_small;
+
+    if (!(nl_msg = virNetDevBandwidthReqAdd(req, RTM_NEWTFILTER,
+                                            TC_H_MAKE(1 << 16, 0), 1,
+                                            TC_H_MAKE(0, htons(ETH_P_IP)),
+                                            "fw", "fw filter")))
+        return -1;
+    if (!(opts = nla_nest_start(nl_msg, TCA_OPTIONS)) ||
+        nla_put_u32(nl_msg, TCA_FW_CLASSID, 1) < 0)
+        goto buffer_too_small;
+    nla_nest_end(nl_msg, opts);
+
+    return 0;
+
+buffer_too_small:
+    virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                   _("allocated netlink buffer is too small"));
+    return -1;
+}
+
+static int
+virNetDevBandwidthReqAddOutbound(virNetDevBandwidthReqPtr req,
+                                 virNetDevBandwidthRatePtr out)
+{
+    struct nl_msg *nl_msg;
+    struct nlattr *opts;
+    struct nlattr *police;
+    unsigned long long average = out->average * 1000;
+    unsigned long long burst = (out->burst ? out->burst : out->average) * 1024;
+    uint32_t rtab[VIR_NETDEV_BANDWIDTH_RTAB_CELLS];
+    struct tc_police p;
+    /* match ip src 0.0.0.0/0 */
+    struct {
+        struct tc_u32_sel sel;
+        struct tc_u32_key keys[1];
+    } sel;
+
+    memset(&p, 0, sizeof(p));
+    p.action = TC_POLICE_SHOT;
+    p.mtu = VIR_NETDEV_BANDWIDTH_POLICE_MTU;
+    virNetDevBandwidthRateTable(&req->clock, &p.rate, rtab, average, p.mtu);
+    p.burst = virNetDevBandwidthXmitTime(&req->clock, average, burst);
+
+    memset(&sel, 0, sizeof(sel));
+    sel.sel.flags = TC_U32_TERMINAL;
+    sel.sel.nkeys = 1;
+    sel.keys[0].off = 12;
+
+    if (!virNetDevBandwidthReqAdd(req, RTM_NEWQDISC, TC_H_INGRESS,
+                                  TC_H_MAKE(TC_H_INGRESS, 0), 0,
+                                  "ingress", "ingress qdisc"))
+        return -1;
+
+    if (!(nl_msg = virNetDevBandwidthReqAdd(req, RTM_NEWTFILTER,
+                                            TC_H_MAKE(TC_H_INGRESS, 0), 0,
+                                            TC_H_MAKE(0, htons(ETH_P_IP)),
+                                            "u32", "u32 police filter")))
+        return -1;
+
+    if (!(opts = nla_nest_start(nl_msg, TCA_OPTIONS)) ||
+        nla_put_u32(nl_msg, TCA_U32_CLASSID, 1) < 0 ||
+        !(police = nla_nest_start(nl_msg, TCA_U32_POLICE)) ||
+        nla_put(nl_msg, TCA_POLICE_TBF, sizeof(p), &p) < 0 ||
+        nla_put(nl_msg, TCA_POLICE_RATE, sizeof(rtab), rtab) < 0)
+        goto buffer_too_small;
+    nla_nest_end(nl_msg, police);
+    if (nla_put(nl_msg, TCA_U32_SEL, sizeof(sel), &sel) < 0)
+        goto buffer_too_small;
+    nla_nest_end(nl_msg, opts);
+
+    return 0;
+
+buffer_too_small:
+    virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                   _("allocated netlink buffer is too small"));
+    return -1;
+}
+
+/**
+ * virNetDevBandwidthReqRun:
+ * @req: request batch
+ * @ifname: interface the batch applies to
+ *
+ * Send all messages in @req to the kernel in one pipelined exchange.
+ * Failures of messages flagged @mayFail are ignored, just like the
+ * exit status of tc is when clearing bandwidth.
+ *
+ * Returns 0 on success, -1 on error, 1 if netlink could not be used
+ * at all and tc should be run instead. No error is reported in the
+ * latter case.
+ */
+static int
+virNetDevBandwidthReqRun(virNetDevBandwidthReqPtr req,
+                         const char *ifname)
+{
+    unsigned char *recvbufs[VIR_NETDEV_BANDWIDTH_MAX_MSGS] = { NULL };
+    unsigned int recvbuflens[VIR_NETDEV_BANDWIDTH_MAX_MSGS] = { 0 };
+    int ret = -1;
+    size_t i;
+
+    if (virNetlinkCommandBatch(req->msgs, req->nmsgs, recvbufs, recvbuflens,
+                               NETLINK_ROUTE) < 0) {
+        VIR_DEBUG("Netlink is unusable for traffic control on %s, "
+                  "falling back to tc", ifname);
+        virResetLastError();
+        return 1;
+    }
+
+    for (i = 0 ; i < req->nmsgs ; i++) {
+        struct nlmsghdr *resp = (struct nlmsghdr *)recvbufs[i];
+        struct nlmsgerr *err;
+
+        if (recvbuflens[i] < NLMSG_LENGTH(sizeof(*err)) ||
+            resp->nlmsg_type != NLMSG_ERROR) {
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("malformed netlink response message"));
+            goto cleanup;
+        }
+
+        err = (struct nlmsgerr *)NLMSG_DATA(resp);
+        if (err->error && !req->mayFail[i]) {
+            virReportSystemError(-err->error,
+                                 _("Cannot set up %s on interface '%s'"),
+                                 req->what[i], ifname);
+            goto cleanup;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    for (i = 0 ; i < req->nmsgs ; i++)
+        VIR_FREE(recvbufs[i]);
+    return ret;
+}
+
+static void
+virNetDevBandwidthReqFree(virNetDevBandwidthReqPtr req)
+{
+    size_t i;
+
+    for (i = 0 ; i < req->nmsgs ; i++)
+        nlmsg_free(req->msgs[i]);
+    req->nmsgs = 0;
+}
+
+/*
+ * Returns 0 on success, -1 on error, 1 if tc must be used instead.
+ */
+static int
+virNetDevBandwidthSetNetlink(const char *ifname,
+                             virNetDevBandwidthPtr bandwidth,
+                             bool hierarchical_class)
+{
+    virNetDevBandwidthReq req;
+    int ret = -1;
+
+    memset(&req, 0, sizeof(req));
+
+    /* Rates beyond 32 bits need the 64 bit attributes which older
+     * kernels don't know; leave those to tc */
+    if ((bandwidth->in &&
+         (bandwidth->in->average > UINT32_MAX / 1000 ||
+          bandwidth->in->peak > UINT32_MAX / 1000)) ||
+        (bandwidth->out && bandwidth->out->average > UINT32_MAX / 1000))
+        return 1;
+
+    if (virNetDevBandwidthClockInit(&req.clock) < 0) {
+        virResetLastError();
+        return 1;
+    }
+
+    if (virNetDevGetIndex(ifname, &req.ifindex) < 0)
+        return -1;
+
+    if (virNetDevBandwidthReqAddClear(&req) < 0)
+        goto cleanup;
+
+    if (bandwidth->in && bandwidth->in->average &&
+        virNetDevBandwidthReqAddInbound(&req, bandwidth->in,
+                                        hierarchical_class) < 0)
+        goto cleanup;
+
+    if (bandwidth->out &&
+        virNetDevBandwidthReqAddOutbound(&req, bandwidth->out) < 0)
+        goto cleanup;
+
+    ret = virNetDevBandwidthReqRun(&req, ifname);
+
+cleanup:
+    virNetDevBandwidthReqFree(&req);
+    return ret;
+}
+
+static int
+virNetDevBandwidthClearNetlink(const char *ifname)
+{
+    virNetDevBandwidthReq req;
+    int ret = -1;
+
+    memset(&req, 0, sizeof(req));
+
+    /* Removing QoS from an interface which is gone already is not an
+     * error; leave reporting of any other problem to tc */
+    if (virNetDevGetIndex(ifname, &req.ifindex) < 0) {
+        virResetLastError();
+        return 1;
+    }
+
+    if (virNetDevBandwidthReqAddClear(&req) < 0)
+        goto cleanup;
+
+    ret = virNetDevBandwidthReqRun(&req, ifname);
+
+cleanup:
+    virNetDevBandwidthReqFree(&req);
+    return ret;
+}
+#endif /* defined(__linux__) && defined(HAVE_LIBNL) */
+
+
+static int
+virNetDevBandwidthClearTC(const char *ifname)
+{
+    int ret = 0;
+    int dummy; /* for ignoring the exit status */
+    virCommandPtr cmd = NULL;
+
+    cmd = virCommandNew(TC);
+    virCommandAddArgList(cmd, "qdisc", "del", "dev", ifname, "root", NULL);
+
+    if (virCommandRun(cmd, &dummy) < 0)
+        ret = -1;
+
+    virCommandFree(cmd);
+
+    cmd = virCommandNew(TC);
+    virCommandAddArgList(cmd, "qdisc",  "del", "dev", ifname, "ingress", NULL);
+
+    if (virCommandRun(cmd, &dummy) < 0)
+        ret = -1;
+
+    virCommandFree(cmd);
+
+    return ret;
+}
+
+static int
+virNetDevBandwidthSetTC(const char *ifname,
+                        virNetDevBandwidthPtr bandwidth,
+                        bool hierarchical_class)
 {
     int ret = -1;
     virCommandPtr cmd = NULL;
@@ -73,7 +584,7 @@ virNetDevBandwidthSet(const char *ifname,
         goto cleanup;
     }
 
-    virNetDevBandwidthClear(ifname);
+    virNetDevBandwidthClearTC(ifname);
 
     if (bandwidth->in && bandwidth->in->average) {
         if (virAsprintf(&average, "%llukbps", bandwidth->in->average) < 0)
@@ -240,6 +751,47 @@ cleanup:
     return ret;
 }
 
+/**
+ * virNetDevBandwidthSet:
+ * @ifname: on which interface
+ * @bandwidth: rates to set (may be NULL)
+ * @hierarchical_class: whether to create hierarchical class
+ *
+ * This function enables QoS on specified interface
+ * and set given traffic limits for both, incoming
+ * and outgoing traffic. Any previous setting get
+ * overwritten. If @hierarchical_class is TRUE, create
+ * hierarchical class. It is used to guarantee minimal
+ * throughput ('floor' attribute in NIC).
+ *
+ * The traffic control objects are created over netlink in a
+ * single exchange with the kernel; tc is only run where that is
+ * not possible.
+ *
+ * Return 0 on success, -1 otherwise.
+ */
+int
+virNetDevBandwidthSet(const char *ifname,
+                      virNetDevBandwidthPtr bandwidth,
+                      bool hierarchical_class)
+{
+    if (!bandwidth) {
+        /* nothing to be enabled */
+        return 0;
+    }
+
+#if defined(__linux__) && defined(HAVE_LIBNL)
+    {
+        int rc = virNetDevBandwidthSetNetlink(ifname, bandwidth,
+                                              hierarchical_class);
+        if (rc <= 0)
+            return rc;
+    }
+#endif
+
+    return virNetDevBandwidthSetTC(ifname, bandwidth, hierarchical_class);
+}
+
 /**
  * virNetDevBandwidthClear:
  * @ifname: on which interface
@@ -253,27 +805,13 @@ cleanup:
 int
 virNetDevBandwidthClear(const char *ifname)
 {
-    int ret = 0;
-    int dummy; /* for ignoring the exit status */
-    virCommandPtr cmd = NULL;
-
-    cmd = virCommandNew(TC);
-    virCommandAddArgList(cmd, "qdisc", "del", "dev", ifname, "root", NULL);
-
-    if (virCommandRun(cmd, &dummy) < 0)
-        ret = -1;
-
-    virCommandFree(cmd);
-
-    cmd = virCommandNew(TC);
-    virCommandAddArgList(cmd, "qdisc",  "del", "dev", ifname, "ingress", NULL);
+#if defined(__linux__) && defined(HAVE_LIBNL)
+    int rc = virNetDevBandwidthClearNetlink(ifname);
+    if (rc <= 0)
+        return rc;
+#endif
 
-    if (virCommandRun(cmd, &dummy) < 0)
-        ret = -1;
-
-    virCommandFree(cmd);
-
-    return ret;
+    return virNetDevBandwidthClearTC(ifname);
 }
 
 /*
@@ -282,6 +282,7 @@ int virNetDevTapCreateInBridgePort(const char *brname,
                                    unsigned int flags)
 {
     virMacAddr tapmac;
+    virNetDevLinkChange change;
 
     if (virNetDevTapCreate(ifname, tapfd, flags) < 0)
         return -1;
@@ -311,14 +312,18 @@ int virNetDevTapCreateInBridgePort(const char *brname,
         tapmac.addr[0] = 0xFE; /* Discourage bridge from using TAP dev MAC */
     }
 
-    if (virNetDevSetMAC(*ifname, &tapmac) < 0)
-        goto error;
-
     /* We need to set the interface MTU before adding it
      * to the bridge, because the bridge will have its
      * MTU adjusted automatically when we add the new interface.
+     * Both settings go to the kernel in a single request.
      */
-    if (virNetDevSetMTUFromDevice(*ifname, brname) < 0)
+    change.ifname = *ifname;
+    change.macaddr = &tapmac;
+    change.online = -1;
+    if ((change.mtu = virNetDevGetMTU(brname)) < 0)
+        goto error;
+
+    if (virNetDevSetLinkBatch(&change, 1) < 0)
         goto error;
 
     if (virtPortProfile) {
@@ -103,6 +103,44 @@ static int nextWatch = 1;
 static virNetlinkEventSrvPrivatePtr server[MAX_LINKS] = {NULL};
 static virNetlinkHandle *placeholder_nlhandle = NULL;
 
+/* Connected sockets kept for reuse by requests to the kernel, so that
+ * setting up a guest NIC doesn't cost a socket per netlink request */
+# define NETLINK_POOL_MAX 4
+
+/* Maximum number of requests virNetlinkCommandBatch keeps in flight */
+# define NETLINK_BATCH_WINDOW 16
+
+static virMutex poolLock;
+static pid_t poolPid;
+static virNetlinkHandle *pool[MAX_LINKS][NETLINK_POOL_MAX];
+static size_t poolCount[MAX_LINKS];
+
+static int
+virNetlinkPoolOnceInit(void)
+{
+    if (virMutexInit(&poolLock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize netlink pool mutex"));
+        return -1;
+    }
+    return 0;
+}
+
+VIR_ONCE_GLOBAL_INIT(virNetlinkPool)
+
+/* Must be called with poolLock held */
+static void
+virNetlinkPoolDrain(void)
+{
+    size_t i, j;
+
+    for (i = 0 ; i < MAX_LINKS ; i++) {
+        for (j = 0 ; j < poolCount[i] ; j++)
+            virNetlinkFree(pool[i][j]);
+        poolCount[i] = 0;
+    }
+}
+
 /* Function definitions */
 
 /**
@@ -147,17 +185,163 @@ virNetlinkStartup(void)
  * virNetlinkShutdown:
  *
  * Undo any initialization done by virNetlinkStartup. This currently
- * destroys the placeholder nl_handle.
+ * destroys the placeholder nl_handle and any socket kept for reuse.
  */
 void
 virNetlinkShutdown(void)
 {
+    if (virNetlinkPoolInitialize() == 0) {
+        virMutexLock(&poolLock);
+        virNetlinkPoolDrain();
+        virMutexUnlock(&poolLock);
+    }
+
     if (placeholder_nlhandle) {
         virNetlinkFree(placeholder_nlhandle);
         placeholder_nlhandle = NULL;
     }
 }
 
+static virNetlinkHandle *
+virNetlinkConnect(unsigned int protocol, unsigned int groups)
+{
+    virNetlinkHandle *nlhandle = NULL;
+
+    nlhandle = virNetlinkAlloc();
+    if (!nlhandle) {
+        virReportSystemError(errno,
+                             "%s", _("cannot allocate nlhandle for netlink"));
+        return NULL;
+    }
+
+    if (nl_connect(nlhandle, protocol) < 0) {
+        virReportSystemError(errno,
+                        _("cannot connect to netlink socket with protocol %d"),
+                             protocol);
+        goto error;
+    }
+
+    if (nl_socket_get_fd(nlhandle) < 0) {
+        virReportSystemError(errno,
+                             "%s", _("cannot get netlink socket fd"));
+        goto error;
+    }
+
+    if (groups && nl_socket_add_membership(nlhandle, groups) < 0) {
+        virReportSystemError(errno,
+                             "%s", _("cannot add netlink membership"));
+        goto error;
+    }
+
+    return nlhandle;
+
+error:
+    virNetlinkFree(nlhandle);
+    return NULL;
+}
+
+/**
+ * virNetlinkPoolGet:
+ * @protocol: netlink protocol
+ *
+ * Get a connected handle for talking to the kernel, reusing one
+ * left over by an earlier request if possible.
+ *
+ * Returns the handle, or NULL on error.
+ */
+static virNetlinkHandle *
+virNetlinkPoolGet(unsigned int protocol)
+{
+    virNetlinkHandle *nlhandle = NULL;
+
+    if (virNetlinkPoolInitialize() < 0)
+        return NULL;
+
+    virMutexLock(&poolLock);
+    /* Handles inherited by a child may live in a different network
+     * namespace than the one the child runs in, so never reuse them */
+    if (poolPid != getpid()) {
+        virNetlinkPoolDrain();
+        poolPid = getpid();
+    }
+    if (poolCount[protocol] > 0)
+        nlhandle = pool[protocol][--poolCount[protocol]];
+    virMutexUnlock(&poolLock);
+
+    if (!nlhandle)
+        nlhandle = virNetlinkConnect(protocol, 0);
+
+    return nlhandle;
+}
+
+/**
+ * virNetlinkPoolPut:
+ * @protocol: netlink protocol
+ * @nlhandle: handle obtained from virNetlinkPoolGet
+ *
+ * Give back a handle whose pending responses have all been consumed.
+ * Handles in an unknown state must be released with virNetlinkFree
+ * instead.
+ */
+static void
+virNetlinkPoolPut(unsigned int protocol, virNetlinkHandle *nlhandle)
+{
+    virMutexLock(&poolLock);
+    if (poolPid == getpid() && poolCount[protocol] < NETLINK_POOL_MAX) {
+        pool[protocol][poolCount[protocol]++] = nlhandle;
+        nlhandle = NULL;
+    }
+    virMutexUnlock(&poolLock);
+
+    if (nlhandle)
+        virNetlinkFree(nlhandle);
+}
+
+static int
+virNetlinkRecv(virNetlinkHandle *nlhandle, struct sockaddr_nl *nladdr,
+               unsigned char **respbuf, unsigned int *respbuflen)
+{
+    struct timeval tv = {
+        .tv_sec = NETLINK_ACK_TIMEOUT_S,
+    };
+    fd_set readfds;
+    int fd = nl_socket_get_fd(nlhandle);
+    int n;
+
+    FD_ZERO(&readfds);
+    FD_SET(fd, &readfds);
+
+    n = select(fd + 1, &readfds, NULL, NULL, &tv);
+    if (n <= 0) {
+        if (n < 0)
+            virReportSystemError(errno, "%s",
+                                 _("error in select call"));
+        if (n == 0)
+            virReportSystemError(ETIMEDOUT, "%s",
+                                 _("no valid netlink response was received"));
+        return -1;
+    }
+
+    n = nl_recv(nlhandle, nladdr, respbuf, NULL);
+    if (n <= 0) {
+        virReportSystemError(errno,
+                             "%s", _("nl_recv failed"));
+        VIR_FREE(*respbuf);
+        return -1;
+    }
+
+    *respbuflen = n;
+    return 0;
+}
+
+static uint32_t
+virNetlinkRespSeq(unsigned char *respbuf, unsigned int respbuflen)
+{
+    if (respbuflen < NLMSG_HDRLEN)
+        return 0;
+    return ((struct nlmsghdr *)respbuf)->nlmsg_seq;
+}
+
 /**
  * virNetlinkCommand:
  * @nlmsg: pointer to netlink message
@@ -170,6 +354,8 @@ virNetlinkShutdown(void)
  * @groups: the group identifier
  *
  * Send the given message to the netlink layer and receive response.
+ * Requests to the kernel that don't join any group go through a socket
+ * reused from earlier requests.
  * Returns 0 on success, -1 on error. In case of error, no response
  * buffer will be returned.
  */
@@ -178,21 +364,18 @@ int virNetlinkCommand(struct nl_msg *nl_msg,
                       uint32_t src_pid, uint32_t dst_pid,
                       unsigned int protocol, unsigned int groups)
 {
-    int rc = 0;
+    int rc = -1;
     struct sockaddr_nl nladdr = {
             .nl_family = AF_NETLINK,
             .nl_pid    = dst_pid,
             .nl_groups = 0,
     };
-    ssize_t nbytes;
-    struct timeval tv = {
-        .tv_sec = NETLINK_ACK_TIMEOUT_S,
-    };
-    fd_set readfds;
-    int fd;
-    int n;
     struct nlmsghdr *nlmsg = nlmsg_hdr(nl_msg);
     virNetlinkHandle *nlhandle = NULL;
+    bool pooled = dst_pid == 0 && groups == 0;
+
+    *respbuf = NULL;
+    *respbuflen = 0;
 
     if (protocol >= MAX_LINKS) {
         virReportSystemError(EINVAL,
@@ -200,77 +383,161 @@ int virNetlinkCommand(struct nl_msg *nl_msg,
         return -EINVAL;
     }
 
-    nlhandle = virNetlinkAlloc();
-    if (!nlhandle) {
-        virReportSystemError(errno,
-                             "%s", _("cannot allocate nlhandle for netlink"));
+    if (pooled)
+        nlhandle = virNetlinkPoolGet(protocol);
+    else
+        nlhandle = virNetlinkConnect(protocol, groups);
+    if (!nlhandle)
         return -1;
-    }
 
-    if (nl_connect(nlhandle, protocol) < 0) {
+    nlmsg_set_dst(nl_msg, &nladdr);
+
+    nlmsg->nlmsg_pid = src_pid ? src_pid : getpid();
+
+    if (nl_send_auto_complete(nlhandle, nl_msg) < 0) {
         virReportSystemError(errno,
-                        _("cannot connect to netlink socket with protocol %d"),
-                             protocol);
-        rc = -1;
-        goto error;
+                             "%s", _("cannot send to netlink socket"));
+        goto cleanup;
     }
 
-    fd = nl_socket_get_fd(nlhandle);
-    if (fd < 0) {
-        virReportSystemError(errno,
-                             "%s", _("cannot get netlink socket fd"));
-        rc = -1;
-        goto error;
+    for (;;) {
+        if (virNetlinkRecv(nlhandle, &nladdr, respbuf, respbuflen) < 0)
+            goto cleanup;
+
+        /* A reused socket may still hold a late answer to a request
+         * that some earlier caller gave up on */
+        if (!pooled ||
+            virNetlinkRespSeq(*respbuf, *respbuflen) == nlmsg->nlmsg_seq)
+            break;
+
+        VIR_DEBUG("Discarding stale netlink response seq=%u",
+                  virNetlinkRespSeq(*respbuf, *respbuflen));
+        VIR_FREE(*respbuf);
     }
 
-    if (groups && nl_socket_add_membership(nlhandle, groups) < 0) {
-        virReportSystemError(errno,
-                             "%s", _("cannot add netlink membership"));
-        rc = -1;
-        goto error;
+    rc = 0;
+
+cleanup:
+    if (rc < 0) {
+        VIR_FREE(*respbuf);
+        *respbuflen = 0;
     }
 
-    nlmsg_set_dst(nl_msg, &nladdr);
+    if (pooled && rc == 0)
+        virNetlinkPoolPut(protocol, nlhandle);
+    else
+        virNetlinkFree(nlhandle);
+    return rc;
+}
 
-    nlmsg->nlmsg_pid = src_pid ? src_pid : getpid();
+/**
+ * virNetlinkCommandBatch:
+ * @nl_msgs: array of netlink messages to send to the kernel
+ * @nmsgs: number of messages in @nl_msgs
+ * @respbufs: array of @nmsgs pointers where response buffers will be
+ *      allocated
+ * @respbuflens: array of @nmsgs integers holding the size of the
+ *      response buffers on return of the function
+ * @protocol: netlink protocol
+ *
+ * Send all of @nl_msgs to the kernel over a single socket, keeping up
+ * to NETLINK_BATCH_WINDOW requests in flight instead of waiting for
+ * the answer to each of them in turn. Every message must produce
+ * exactly one response, so requests that only change state need to
+ * carry NLM_F_ACK. Responses are matched to requests by sequence
+ * number: respbufs[i] holds the answer to nl_msgs[i].
+ *
+ * Returns 0 on success, -1 on error. In case of error, no response
+ * buffers will be returned.
+ */
+int virNetlinkCommandBatch(struct nl_msg **nl_msgs, size_t nmsgs,
+                           unsigned char **respbufs,
+                           unsigned int *respbuflens,
+                           unsigned int protocol)
+{
+    int rc = -1;
+    struct sockaddr_nl nladdr = {
+            .nl_family = AF_NETLINK,
+            .nl_pid    = 0,
+            .nl_groups = 0,
+    };
+    virNetlinkHandle *nlhandle = NULL;
+    unsigned char *buf = NULL;
+    unsigned int buflen;
+    uint32_t seq;
+    size_t sent = 0;
+    size_t done = 0;
+    size_t i;
+
+    for (i = 0 ; i < nmsgs ; i++) {
+        respbufs[i] = NULL;
+        respbuflens[i] = 0;
+    }
 
-    nbytes = nl_send_auto_complete(nlhandle, nl_msg);
-    if (nbytes < 0) {
-        virReportSystemError(errno,
-                             "%s", _("cannot send to netlink socket"));
-        rc = -1;
-        goto error;
+    if (protocol >= MAX_LINKS) {
+        virReportSystemError(EINVAL,
+                             _("invalid protocol argument: %d"), protocol);
+        return -1;
     }
 
-    FD_ZERO(&readfds);
-    FD_SET(fd, &readfds);
+    if (nmsgs == 0)
+        return 0;
 
-    n = select(fd + 1, &readfds, NULL, NULL, &tv);
-    if (n <= 0) {
-        if (n < 0)
-            virReportSystemError(errno, "%s",
-                                 _("error in select call"));
-        if (n == 0)
-            virReportSystemError(ETIMEDOUT, "%s",
-                                 _("no valid netlink response was received"));
-        rc = -1;
-        goto error;
-    }
+    if (!(nlhandle = virNetlinkPoolGet(protocol)))
+        return -1;
 
-    *respbuflen = nl_recv(nlhandle, &nladdr, respbuf, NULL);
-    if (*respbuflen <= 0) {
-        virReportSystemError(errno,
-                             "%s", _("nl_recv failed"));
-        rc = -1;
+    while (done < nmsgs) {
+        while (sent < nmsgs && sent - done < NETLINK_BATCH_WINDOW) {
+            struct nlmsghdr *nlmsg = nlmsg_hdr(nl_msgs[sent]);
+
+            nlmsg_set_dst(nl_msgs[sent], &nladdr);
+            nlmsg->nlmsg_pid = getpid();
+
+            if (nl_send_auto_complete(nlhandle, nl_msgs[sent]) < 0) {
+                virReportSystemError(errno,
+                                     "%s", _("cannot send to netlink socket"));
+                goto cleanup;
+            }
+            sent++;
+        }
+
+        if (virNetlinkRecv(nlhandle, &nladdr, &buf, &buflen) < 0)
+            goto cleanup;
+
+        seq = virNetlinkRespSeq(buf, buflen);
+        for (i = done ; i < sent ; i++) {
+            if (!respbufs[i] && nlmsg_hdr(nl_msgs[i])->nlmsg_seq == seq)
+                break;
+        }
+
+        if (i == sent) {
+            VIR_DEBUG("Discarding stale netlink response seq=%u", seq);
+            VIR_FREE(buf);
+            continue;
+        }
+
+        respbufs[i] = buf;
+        respbuflens[i] = buflen;
+        buf = NULL;
+
+        while (done < sent && respbufs[done])
+            done++;
     }
-error:
-    if (rc == -1) {
-        VIR_FREE(*respbuf);
-        *respbuf = NULL;
-        *respbuflen = 0;
+
+    rc = 0;
+
+cleanup:
+    if (rc < 0) {
+        for (i = 0 ; i < nmsgs ; i++) {
+            VIR_FREE(respbufs[i]);
+            respbuflens[i] = 0;
+        }
     }
 
-    virNetlinkFree(nlhandle);
+    if (rc == 0)
+        virNetlinkPoolPut(protocol, nlhandle);
+    else
+        virNetlinkFree(nlhandle);
     return rc;
 }
 
@@ -761,6 +1028,16 @@ int virNetlinkCommand(struct nl_msg *nl_msg ATTRIBUTE_UNUSED,
     return -1;
 }
 
+int virNetlinkCommandBatch(struct nl_msg **nl_msgs ATTRIBUTE_UNUSED,
+                           size_t nmsgs ATTRIBUTE_UNUSED,
+                           unsigned char **respbufs ATTRIBUTE_UNUSED,
+                           unsigned int *respbuflens ATTRIBUTE_UNUSED,
+                           unsigned int protocol ATTRIBUTE_UNUSED)
+{
+    virReportError(VIR_ERR_INTERNAL_ERROR, "%s", _(unsupported));
+    return -1;
+}
+
 /**
  * stopNetlinkEventServer: stop the monitor to receive netlink
  * messages for libvirtd
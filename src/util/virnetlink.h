@@ -51,6 +51,10 @@ int virNetlinkCommand(struct nl_msg *nl_msg,
                       unsigned char **respbuf, unsigned int *respbuflen,
                       uint32_t src_pid, uint32_t dst_pid,
                       unsigned int protocol, unsigned int groups);
+int virNetlinkCommandBatch(struct nl_msg **nl_msgs, size_t nmsgs,
+                           unsigned char **respbufs,
+                           unsigned int *respbuflens,
+                           unsigned int protocol);
 
 typedef void (*virNetlinkEventHandleCallback)(unsigned char *msg, int length, struct sockaddr_nl *peer, bool *handled, void *opaque);
 
@@ -22,6 +22,7 @@
 #include "testutils.h"
 #include "testutilsqemu.h"
 #include "qemumonitortestutils.h"
+#include "qemu/qemu_domain.h"
 #include "threads.h"
 #include "virterror_internal.h"
 
@@ -423,6 +424,243 @@ cleanup:
 }
 
 
+static int
+testQemuMonitorJSONNBDServer(const void *data)
+{
+    virCapsPtr caps = (virCapsPtr)data;
+    qemuMonitorTestPtr test = qemuMonitorTestNew(true, caps);
+    int ret = -1;
+
+    if (!test)
+        return -1;
+
+    if (qemuMonitorTestAddItem(test, "nbd-server-start",
+                               "{\"return\": {}}") < 0 ||
+        qemuMonitorTestAddItem(test, "nbd-server-add",
+                               "{\"return\": {}}") < 0 ||
+        qemuMonitorTestAddItem(test, "nbd-server-stop",
+                               "{\"return\": {}}") < 0)
+        goto cleanup;
+
+    if (qemuMonitorNBDServerStart(qemuMonitorTestGetMonitor(test),
+                                  "localhost", 49153) < 0)
+        goto cleanup;
+
+    if (qemuMonitorNBDServerAdd(qemuMonitorTestGetMonitor(test),
+                                "drive-virtio-disk0", true) < 0)
+        goto cleanup;
+
+    if (qemuMonitorNBDServerStop(qemuMonitorTestGetMonitor(test)) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    qemuMonitorTestFree(test);
+    return ret;
+}
+
+
+/* Replies the migration relies on when a disk copy over NBD fails or is
+ * cancelled */
+static int
+testQemuMonitorJSONDriveMirrorErrors(const void *data)
+{
+    virCapsPtr caps = (virCapsPtr)data;
+    qemuMonitorTestPtr test = qemuMonitorTestNew(true, caps);
+    int ret = -1;
+    virDomainBlockJobInfo info;
+    virErrorPtr err;
+
+    if (!test)
+        return -1;
+
+    if (qemuMonitorTestAddItem(test, "drive-mirror",
+                               "{\"error\": {\"class\": \"GenericError\","
+                               " \"desc\": \"Failed to connect socket\"}}") < 0 ||
+        qemuMonitorTestAddItem(test, "block-job-cancel",
+                               "{\"error\": {\"class\": \"DeviceNotActive\","
+                               " \"desc\": \"No active block job on device"
+                               " 'drive-virtio-disk0'\"}}") < 0 ||
+        qemuMonitorTestAddItem(test, "query-block-jobs",
+                               "{\"return\": [{\"device\": \"drive-virtio-disk0\","
+                               " \"type\": \"mirror\", \"busy\": true,"
+                               " \"speed\": 0, \"offset\": 1024,"
+                               " \"len\": 4096}]}") < 0 ||
+        qemuMonitorTestAddItem(test, "query-block-jobs",
+                               "{\"return\": []}") < 0)
+        goto cleanup;
+
+    /* The destination NBD server is unreachable */
+    if (qemuMonitorDriveMirror(qemuMonitorTestGetMonitor(test),
+                               "drive-virtio-disk0",
+                               "nbd:localhost:49217:exportname=drive-virtio-disk0",
+                               NULL, 0, 0) != -1) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       "drive-mirror error was not reported");
+        goto cleanup;
+    }
+
+    /* The copy already went away when it was to be cancelled */
+    virResetLastError();
+    if (qemuMonitorBlockJob(qemuMonitorTestGetMonitor(test),
+                            "drive-virtio-disk0", NULL, 0, NULL,
+                            BLOCK_JOB_ABORT, true) != -1) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       "block-job-cancel error was not reported");
+        goto cleanup;
+    }
+    if (!(err = virGetLastError()) || err->code != VIR_ERR_OPERATION_INVALID) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       "inactive block job was not reported as such");
+        goto cleanup;
+    }
+    virResetLastError();
+
+    /* A copy still in progress ... */
+    if (qemuMonitorBlockJob(qemuMonitorTestGetMonitor(test),
+                            "drive-virtio-disk0", NULL, 0, &info,
+                            BLOCK_JOB_INFO, true) != 1) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       "running block job was not found");
+        goto cleanup;
+    }
+    if (info.type != VIR_DOMAIN_BLOCK_JOB_TYPE_COPY ||
+        info.cur != 1024 || info.end != 4096) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       "unexpected block job progress type=%d cur=%llu end=%llu",
+                       info.type, info.cur, info.end);
+        goto cleanup;
+    }
+
+    /* ... and one which finished being cancelled */
+    if (qemuMonitorBlockJob(qemuMonitorTestGetMonitor(test),
+                            "drive-virtio-disk0", NULL, 0, &info,
+                            BLOCK_JOB_INFO, true) != 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       "cancelled block job is still reported");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    qemuMonitorTestFree(test);
+    return ret;
+}
+
+
+/* Samples of a migration as reported by query-migrate: job time (ms),
+ * memory transferred and remaining, and the rates expected afterwards */
+struct testMigrationSample {
+    unsigned long long time;
+    unsigned long long transferred;
+    unsigned long long remaining;
+    unsigned long long iteration;
+    unsigned long long bps;
+    unsigned long long dirtyRate;
+};
+
+static int
+testQemuMonitorJSONMigrationProgress(const void *data)
+{
+    virCapsPtr caps = (virCapsPtr)data;
+    qemuMonitorTestPtr test = qemuMonitorTestNew(true, caps);
+    qemuDomainJobProgress progress;
+    /* The first pass sends 1GB in 2.5s while the guest dirties 300MB,
+     * the second one sends those 300MB in 1s while 150MB get dirtied */
+    const struct testMigrationSample samples[] = {
+        {    0,          0, 1000000000, 1,         0,         0 },
+        { 1000,  400000000,  600000000, 1, 400000000,         0 },
+        { 2000,  800000000,  200000000, 1, 400000000,         0 },
+        { 2500, 1000000000,  300000000, 2, 400000000, 120000000 },
+        { 3000, 1200000000,  100000000, 2, 400000000, 120000000 },
+        { 3500, 1300000000,  150000000, 3, 300000000, 150000000 },
+    };
+    int ret = -1;
+    size_t i;
+
+    if (!test)
+        return -1;
+
+    memset(&progress, 0, sizeof(progress));
+
+    for (i = 0; i < ARRAY_CARDINALITY(samples); i++) {
+        char *reply;
+
+        if (virAsprintf(&reply,
+                        "{ "
+                        "    \"return\": { "
+                        "        \"status\": \"active\", "
+                        "        \"ram\": { "
+                        "            \"transferred\": %llu, "
+                        "            \"remaining\": %llu, "
+                        "            \"total\": 1073741824 "
+                        "        } "
+                        "    } "
+                        "}",
+                        samples[i].transferred, samples[i].remaining) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+
+        if (qemuMonitorTestAddItem(test, "query-migrate", reply) < 0) {
+            VIR_FREE(reply);
+            goto cleanup;
+        }
+        VIR_FREE(reply);
+    }
+
+    for (i = 0; i < ARRAY_CARDINALITY(samples); i++) {
+        int status;
+        unsigned long long transferred;
+        unsigned long long remaining;
+        unsigned long long total;
+
+        if (qemuMonitorGetMigrationStatus(qemuMonitorTestGetMonitor(test),
+                                          &status, &transferred,
+                                          &remaining, &total) < 0)
+            goto cleanup;
+
+        if (status != QEMU_MONITOR_MIGRATION_STATUS_ACTIVE) {
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           "Migration status was unexpectedly %d", status);
+            goto cleanup;
+        }
+
+        qemuDomainJobProgressUpdate(&progress, samples[i].time,
+                                    transferred, remaining);
+
+        if (progress.iteration != samples[i].iteration ||
+            progress.bps != samples[i].bps ||
+            progress.dirtyRate != samples[i].dirtyRate) {
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           "Sample %zu: expected iteration %llu, rate %llu "
+                           "and dirty rate %llu, got %llu, %llu and %llu",
+                           i, samples[i].iteration, samples[i].bps,
+                           samples[i].dirtyRate, progress.iteration,
+                           progress.bps, progress.dirtyRate);
+            goto cleanup;
+        }
+    }
+
+    /* 150MB left at 300MB/s, of which 150MB/s get dirtied again */
+    if (progress.downtime != 500 || progress.timeRemaining != 1000) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       "Expected downtime 500ms and time remaining 1000ms, "
+                       "got %llums and %llums",
+                       progress.downtime, progress.timeRemaining);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    qemuMonitorTestFree(test);
+    return ret;
+}
+
+
 static int
 mymain(void)
 {
@@ -446,6 +684,9 @@ mymain(void)
     DO_TEST(GetMachines);
     DO_TEST(GetCPUDefinitions);
     DO_TEST(GetCommands);
+    DO_TEST(NBDServer);
+    DO_TEST(DriveMirrorErrors);
+    DO_TEST(MigrationProgress);
 
     virCapabilitiesFree(caps);
 
@@ -0,0 +1,407 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "command.h"
+#include "memory.h"
+#include "testutils.h"
+#include "util.h"
+#include "virchunkstream.h"
+#include "virfile.h"
+
+
+static void
+testQuietError(void *userData ATTRIBUTE_UNUSED,
+               virErrorPtr error ATTRIBUTE_UNUSED)
+{
+    /* nothing */
+}
+
+
+enum {
+    TEST_DATA_ZERO,
+    TEST_DATA_TEXT,
+    TEST_DATA_RANDOM,
+    TEST_DATA_MIXED,
+};
+
+struct testInfo {
+    int type;
+    size_t len;
+    unsigned int nthreads;
+};
+
+
+static void
+testFillData(unsigned char *buf, size_t len, int type)
+{
+    static const char text[] = "The quick brown fox jumps over the lazy dog. ";
+    uint32_t seed = 42;
+    size_t i;
+
+    for (i = 0 ; i < len ; i++) {
+        seed = seed * 1103515245 + 12345;
+
+        switch (type) {
+        case TEST_DATA_ZERO:
+            buf[i] = 0;
+            break;
+        case TEST_DATA_TEXT:
+            buf[i] = text[i % (sizeof(text) - 1)];
+            break;
+        case TEST_DATA_RANDOM:
+            buf[i] = seed >> 16;
+            break;
+        case TEST_DATA_MIXED:
+            /* Pages which are empty, hold a short run, or random data */
+            switch ((i / 4096) % 3) {
+            case 0:
+                buf[i] = 0;
+                break;
+            case 1:
+                buf[i] = i % 4096 < 100 ? (i / 4096) & 0xff : 0;
+                break;
+            default:
+                buf[i] = seed >> 16;
+                break;
+            }
+            break;
+        }
+    }
+}
+
+
+static FILE *
+testWriteTemp(const unsigned char *buf, size_t len)
+{
+    FILE *fp;
+
+    if (!(fp = tmpfile()))
+        return NULL;
+    if (len && fwrite(buf, 1, len, fp) != len) {
+        VIR_FORCE_FCLOSE(fp);
+        return NULL;
+    }
+    if (fflush(fp) != 0 || lseek(fileno(fp), 0, SEEK_SET) < 0) {
+        VIR_FORCE_FCLOSE(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+
+static int
+testRewind(FILE *fp, off_t *len)
+{
+    if ((*len = lseek(fileno(fp), 0, SEEK_END)) < 0 ||
+        lseek(fileno(fp), 0, SEEK_SET) < 0)
+        return -1;
+    return 0;
+}
+
+
+static int
+testRoundTrip(const void *opaque)
+{
+    const struct testInfo *info = opaque;
+    unsigned char *data = NULL;
+    unsigned char *result = NULL;
+    FILE *in = NULL;
+    FILE *packed = NULL;
+    FILE *out = NULL;
+    off_t packedLen;
+    off_t outLen;
+    int ret = -1;
+
+    if (VIR_ALLOC_N(data, info->len + 1) < 0 ||
+        VIR_ALLOC_N(result, info->len + 1) < 0)
+        goto cleanup;
+    testFillData(data, info->len, info->type);
+
+    if (!(in = testWriteTemp(data, info->len)) ||
+        !(packed = tmpfile()) ||
+        !(out = tmpfile()))
+        goto cleanup;
+
+    if (virChunkStreamCompress(fileno(in), fileno(packed),
+                               info->nthreads) < 0)
+        goto cleanup;
+    if (testRewind(packed, &packedLen) < 0)
+        goto cleanup;
+
+    /* Zeroed and repeated data must shrink */
+    if (info->type != TEST_DATA_RANDOM && info->len >= 4096 &&
+        packedLen >= info->len) {
+        if (virTestGetDebug())
+            fprintf(stderr, "\n%zu bytes compressed to %lld bytes\n",
+                    info->len, (long long) packedLen);
+        goto cleanup;
+    }
+
+    if (virChunkStreamDecompress(fileno(packed), fileno(out),
+                                 info->nthreads) < 0)
+        goto cleanup;
+    if (testRewind(out, &outLen) < 0)
+        goto cleanup;
+
+    if (outLen != info->len ||
+        saferead(fileno(out), result, info->len) != info->len ||
+        memcmp(data, result, info->len) != 0) {
+        if (virTestGetDebug())
+            fprintf(stderr, "\ndecompressed data differs\n");
+        goto cleanup;
+    }
+
+    /* Truncated streams are refused */
+    if (packedLen > 1) {
+        if (ftruncate(fileno(packed), packedLen - 1) < 0 ||
+            lseek(fileno(packed), 0, SEEK_SET) < 0 ||
+            lseek(fileno(out), 0, SEEK_SET) < 0)
+            goto cleanup;
+        if (virChunkStreamDecompress(fileno(packed), fileno(out),
+                                     info->nthreads) == 0) {
+            if (virTestGetDebug())
+                fprintf(stderr, "\ntruncated stream accepted\n");
+            goto cleanup;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_FCLOSE(in);
+    VIR_FORCE_FCLOSE(packed);
+    VIR_FORCE_FCLOSE(out);
+    VIR_FREE(data);
+    VIR_FREE(result);
+    return ret;
+}
+
+
+static int
+testBuffer(const void *opaque)
+{
+    const struct testInfo *info = opaque;
+    char *data = NULL;
+    char *packed = NULL;
+    char *result = NULL;
+    size_t packedLen;
+    size_t resultLen;
+    FILE *in = NULL;
+    FILE *out = NULL;
+    off_t outLen;
+    int ret = -1;
+
+    if (VIR_ALLOC_N(data, info->len + 1) < 0)
+        goto cleanup;
+    testFillData((unsigned char *) data, info->len, info->type);
+
+    if (virChunkStreamCompressBuffer(data, info->len,
+                                     &packed, &packedLen) < 0 ||
+        !virChunkStreamIsChunked(packed, packedLen))
+        goto cleanup;
+
+    if (virChunkStreamDecompressBuffer(packed, packedLen, info->len,
+                                       &result, &resultLen) < 0 ||
+        resultLen != info->len ||
+        memcmp(data, result, info->len) != 0) {
+        if (virTestGetDebug())
+            fprintf(stderr, "\ndecompressed buffer differs\n");
+        goto cleanup;
+    }
+    VIR_FREE(result);
+
+    /* Streams held in memory are the same as those in files */
+    if (!(in = testWriteTemp((unsigned char *) packed, packedLen)) ||
+        !(out = tmpfile()))
+        goto cleanup;
+    if (virChunkStreamDecompress(fileno(in), fileno(out),
+                                 info->nthreads) < 0 ||
+        testRewind(out, &outLen) < 0 ||
+        outLen != info->len)
+        goto cleanup;
+
+    /* Limits on the decompressed length are enforced */
+    if (info->len > 0 &&
+        virChunkStreamDecompressBuffer(packed, packedLen, info->len - 1,
+                                       &result, &resultLen) == 0)
+        goto cleanup;
+
+    /* Truncated streams are refused */
+    if (virChunkStreamDecompressBuffer(packed, packedLen - 1, info->len,
+                                       &result, &resultLen) == 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_FCLOSE(in);
+    VIR_FORCE_FCLOSE(out);
+    VIR_FREE(data);
+    VIR_FREE(packed);
+    VIR_FREE(result);
+    return ret;
+}
+
+
+static void
+testProgress(unsigned long long nbytes, void *opaque)
+{
+    unsigned long long *progress = opaque;
+
+    *progress = nbytes;
+}
+
+
+static int
+testCompressWith(const void *opaque)
+{
+    const struct testInfo *info = opaque;
+    const char *const compress[] = { "gzip", "-c", NULL };
+    unsigned char *data = NULL;
+    unsigned char *result = NULL;
+    FILE *in = NULL;
+    FILE *packed = NULL;
+    FILE *out = NULL;
+    virCommandPtr cmd = NULL;
+    unsigned long long progress = 0;
+    int outfd;
+    off_t outLen;
+    int ret = -1;
+
+    if (VIR_ALLOC_N(data, info->len + 1) < 0 ||
+        VIR_ALLOC_N(result, info->len + 1) < 0)
+        goto cleanup;
+    testFillData(data, info->len, info->type);
+
+    if (!(in = testWriteTemp(data, info->len)) ||
+        !(packed = tmpfile()) ||
+        !(out = tmpfile()))
+        goto cleanup;
+
+    if (virChunkStreamCompressWith(fileno(in), fileno(packed),
+                                   info->nthreads, compress,
+                                   testProgress, &progress) < 0)
+        goto cleanup;
+    if (progress != info->len ||
+        lseek(fileno(packed), 0, SEEK_SET) < 0)
+        goto cleanup;
+
+    /* The chunks compressed separately form a single gzip stream */
+    outfd = fileno(out);
+    cmd = virCommandNewArgList("gzip", "-dc", NULL);
+    virCommandSetInputFD(cmd, fileno(packed));
+    virCommandSetOutputFD(cmd, &outfd);
+    if (virCommandRun(cmd, NULL) < 0)
+        goto cleanup;
+    if (testRewind(out, &outLen) < 0)
+        goto cleanup;
+
+    if (outLen != info->len ||
+        saferead(fileno(out), result, info->len) != info->len ||
+        memcmp(data, result, info->len) != 0) {
+        if (virTestGetDebug())
+            fprintf(stderr, "\ndecompressed data differs\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virCommandFree(cmd);
+    VIR_FORCE_FCLOSE(in);
+    VIR_FORCE_FCLOSE(packed);
+    VIR_FORCE_FCLOSE(out);
+    VIR_FREE(data);
+    VIR_FREE(result);
+    return ret;
+}
+
+
+static int
+testCorrupt(const void *opaque ATTRIBUTE_UNUSED)
+{
+    static const unsigned char garbage[] = "LibvirtQemudSave is not chunked";
+    FILE *in = NULL;
+    FILE *out = NULL;
+    int ret = -1;
+
+    if (!(in = testWriteTemp(garbage, sizeof(garbage))) ||
+        !(out = tmpfile()))
+        goto cleanup;
+
+    if (virChunkStreamDecompress(fileno(in), fileno(out), 1) == 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_FCLOSE(in);
+    VIR_FORCE_FCLOSE(out);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+    char *gzip;
+
+    virSetErrorFunc(NULL, testQuietError);
+
+#define DO_TEST(name, type, len, nthreads)                              \
+    do {                                                                \
+        struct testInfo info = { type, len, nthreads };                 \
+        if (virtTestRun("Chunk stream " name, 1,                        \
+                        testRoundTrip, &info) < 0)                      \
+            ret = -1;                                                   \
+    } while (0)
+
+    DO_TEST("empty", TEST_DATA_TEXT, 0, 1);
+    DO_TEST("short", TEST_DATA_TEXT, 10, 1);
+    DO_TEST("text", TEST_DATA_TEXT, 100000, 1);
+    DO_TEST("zero", TEST_DATA_ZERO, 3 * 1024 * 1024, 2);
+    DO_TEST("random", TEST_DATA_RANDOM, 1024 * 1024 + 1, 2);
+    DO_TEST("mixed", TEST_DATA_MIXED, 5 * 1024 * 1024 + 4321, 1);
+    DO_TEST("mixed threaded", TEST_DATA_MIXED, 9 * 1024 * 1024 + 17, 4);
+
+    if (virtTestRun("Chunk stream corrupt", 1, testCorrupt, NULL) < 0)
+        ret = -1;
+
+#define DO_TEST_BUFFER(name, type, len)                                 \
+    do {                                                                \
+        struct testInfo info = { type, len, 1 };                        \
+        if (virtTestRun("Chunk stream buffer " name, 1,                 \
+                        testBuffer, &info) < 0)                         \
+            ret = -1;                                                   \
+    } while (0)
+
+    DO_TEST_BUFFER("empty", TEST_DATA_TEXT, 0);
+    DO_TEST_BUFFER("text", TEST_DATA_TEXT, 100000);
+    DO_TEST_BUFFER("mixed", TEST_DATA_MIXED, 3 * 1024 * 1024 + 5);
+
+#define DO_TEST_WITH(name, type, len, nthreads)                         \
+    do {                                                                \
+        struct testInfo info = { type, len, nthreads };                 \
+        if (virtTestRun("Chunk stream with gzip " name, 1,              \
+                        testCompressWith, &info) < 0)                   \
+            ret = -1;                                                   \
+    } while (0)
+
+    if ((gzip = virFindFileInPath("gzip"))) {
+        DO_TEST_WITH("empty", TEST_DATA_TEXT, 0, 1);
+        DO_TEST_WITH("mixed", TEST_DATA_MIXED, 5 * 1024 * 1024 + 4321, 1);
+        DO_TEST_WITH("mixed threaded", TEST_DATA_MIXED,
+                     19 * 1024 * 1024 + 17, 4);
+        VIR_FREE(gzip);
+    }
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
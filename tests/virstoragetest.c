@@ -21,6 +21,7 @@
 #include <config.h>
 
 #include <stdlib.h>
+#include <sys/time.h>
 
 #include "testutils.h"
 #include "command.h"
@@ -292,6 +293,63 @@ cleanup:
     return ret;
 }
 
+static int
+testStorageMetadataCache(const void *args ATTRIBUTE_UNUSED)
+{
+    virStorageFileMetadataPtr meta = NULL;
+    unsigned long long hits, misses;
+    unsigned long long newhits, newmisses;
+    struct timeval times[2] = { { 1, 0 }, { 1, 0 } };
+    int ret = -1;
+
+    /* Probing the same chain twice in a row must not read any header */
+    if (!(meta = virStorageFileGetMetadata(abswrap, VIR_STORAGE_FILE_QCOW2,
+                                           -1, -1, true)))
+        goto cleanup;
+    virStorageFileFreeMetadata(meta);
+
+    virStorageFileMetadataCacheStats(&hits, &misses);
+
+    if (!(meta = virStorageFileGetMetadata(abswrap, VIR_STORAGE_FILE_QCOW2,
+                                           -1, -1, true)))
+        goto cleanup;
+
+    virStorageFileMetadataCacheStats(&newhits, &newmisses);
+    if (newmisses != misses || newhits != hits + 3) {
+        fprintf(stderr, "expected 3 more hits, 0 more misses; "
+                "got %llu more hits, %llu more misses\n",
+                newhits - hits, newmisses - misses);
+        goto cleanup;
+    }
+    virStorageFileFreeMetadata(meta);
+    meta = NULL;
+
+    /* A modified image is read again, and counted as a single miss */
+    if (utimes(abswrap, times) < 0) {
+        fprintf(stderr, "cannot set times of %s\n", abswrap);
+        goto cleanup;
+    }
+
+    hits = newhits;
+    misses = newmisses;
+    if (!(meta = virStorageFileGetMetadata(abswrap, VIR_STORAGE_FILE_QCOW2,
+                                           -1, -1, true)))
+        goto cleanup;
+
+    virStorageFileMetadataCacheStats(&newhits, &newmisses);
+    if (newmisses != misses + 1 || newhits != hits + 2) {
+        fprintf(stderr, "expected 2 more hits, 1 more miss; "
+                "got %llu more hits, %llu more misses\n",
+                newhits - hits, newmisses - misses);
+        goto cleanup;
+    }
+
+    ret = 0;
+cleanup:
+    virStorageFileFreeMetadata(meta);
+    return ret;
+}
+
 static int
 mymain(void)
 {
@@ -464,6 +522,11 @@ mymain(void)
                chain8a, EXP_PASS,
                chain8b, ALLOW_PROBE | EXP_PASS);
 
+    /* Unchanged images of the chain above come from the header cache */
+    if (virtTestRun("Storage metadata cache", 1,
+                    testStorageMetadataCache, NULL) < 0)
+        ret = -1;
+
     /* Rewrite qcow2 to a missing backing file, with backing type */
     virCommandFree(cmd);
     cmd = virCommandNewArgList(qemuimg, "rebase", "-u", "-f", "qcow2",
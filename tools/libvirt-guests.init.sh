@@ -43,6 +43,8 @@ ON_BOOT=start
 ON_SHUTDOWN=suspend
 SHUTDOWN_TIMEOUT=300
 PARALLEL_SHUTDOWN=0
+PARALLEL_SAVE=0
+SAVE_BANDWIDTH=0
 START_DELAY=0
 BYPASS_CACHE=0
 
@@ -190,6 +192,9 @@ start() {
         test_connect "$uri" || continue
 
         eval_gettext "Resuming guests on \$uri URI..."; echo
+        if [ "$PARALLEL_SAVE" -gt 1 ] && [ "$START_DELAY" -eq 0 ]; then
+            resume_guests_parallel "$uri" "$list"
+        fi
         for guest in $list; do
             name=$(guest_name "$uri" "$guest")
             eval_gettext "Resuming guest \$name: "
@@ -214,6 +219,50 @@ start() {
     started
 }
 
+# resume_guests_parallel URI GUESTS
+# Start all GUESTS on URI which are not running yet, letting libvirt
+# restore up to $PARALLEL_SAVE of them at the same time. Guests which
+# could not be started are left for the caller to start one by one.
+resume_guests_parallel()
+{
+    uri=$1
+    guests=$2
+
+    off=
+    for guest in $guests; do
+        guest_is_on "$uri" "$guest" || continue
+        "$guest_running" || off="$off $guest"
+    done
+    [ -n "$off" ] || return 0
+
+    bypass=
+    test "x$BYPASS_CACHE" = x0 || bypass=--bypass-cache
+    run_virsh "$uri" managedrestore-bulk $bypass \
+        --concurrency "$PARALLEL_SAVE" $off
+}
+
+# suspend_guests_parallel URI GUESTS
+# Do a managed save of all GUESTS on URI, letting libvirt save up to
+# $PARALLEL_SAVE of them at the same time, and then one by one any guest
+# which is still running.
+suspend_guests_parallel()
+{
+    uri=$1
+    guests=$2
+
+    bypass=
+    bandwidth=
+    test "x$BYPASS_CACHE" = x0 || bypass=--bypass-cache
+    test "x$SAVE_BANDWIDTH" = x0 || bandwidth="--bandwidth $SAVE_BANDWIDTH"
+    run_virsh "$uri" managedsave-bulk $bypass $bandwidth \
+        --concurrency "$PARALLEL_SAVE" --verbose $guests
+
+    for guest in $guests; do
+        guest_is_on "$uri" "$guest" || continue
+        "$guest_running" && suspend_guest "$uri" "$guest"
+    done
+}
+
 # suspend_guest URI GUEST
 # Do a managed save on a GUEST on URI. This function returns after the guest
 # was saved.
@@ -507,6 +556,8 @@ stop() {
             if [ "$PARALLEL_SHUTDOWN" -gt 1 ] &&
                ! "$suspending"; then
                 shutdown_guests_parallel "$uri" "$list"
+            elif [ "$PARALLEL_SAVE" -gt 1 ] && "$suspending"; then
+                suspend_guests_parallel "$uri" "$list"
             else
                 for guest in $list; do
                     if "$suspending"; then
@@ -58,34 +58,21 @@
 # define SA_SIGINFO 0
 #endif
 
-virDomainPtr
-vshCommandOptDomainBy(vshControl *ctl, const vshCmd *cmd,
-                      const char **name, unsigned int flags)
+/* Look up the domain @n, given to option @optname of command @cmdname,
+ * by ID, UUID or name, as allowed by @flags */
+static virDomainPtr
+vshLookupDomainBy(vshControl *ctl, const char *cmdname, const char *optname,
+                  const char *n, unsigned int flags)
 {
     virDomainPtr dom = NULL;
-    const char *n = NULL;
     int id;
-    const char *optname = "domain";
-    virCheckFlags(VSH_BYID | VSH_BYUUID | VSH_BYNAME, NULL);
-
-    if (!vshCmdHasOption(ctl, cmd, optname))
-        return NULL;
-
-    if (vshCommandOptString(cmd, optname, &n) <= 0)
-        return NULL;
-
-    vshDebug(ctl, VSH_ERR_INFO, "%s: found option <%s>: %s\n",
-             cmd->def->name, optname, n);
-
-    if (name)
-        *name = n;
 
     /* try it by ID */
     if (flags & VSH_BYID) {
         if (virStrToLong_i(n, NULL, 10, &id) == 0 && id >= 0) {
             vshDebug(ctl, VSH_ERR_DEBUG,
                      "%s: <%s> seems like domain ID\n",
-                     cmd->def->name, optname);
+                     cmdname, optname);
             dom = virDomainLookupByID(ctl->conn, id);
         }
     }
@@ -93,13 +80,13 @@ vshCommandOptDomainBy(vshControl *ctl, const vshCmd *cmd,
     if (!dom && (flags & VSH_BYUUID) &&
         strlen(n) == VIR_UUID_STRING_BUFLEN-1) {
         vshDebug(ctl, VSH_ERR_DEBUG, "%s: <%s> trying as domain UUID\n",
-                 cmd->def->name, optname);
+                 cmdname, optname);
         dom = virDomainLookupByUUIDString(ctl->conn, n);
     }
     /* try it by NAME */
     if (!dom && (flags & VSH_BYNAME)) {
         vshDebug(ctl, VSH_ERR_DEBUG, "%s: <%s> trying as domain NAME\n",
-                 cmd->def->name, optname);
+                 cmdname, optname);
         dom = virDomainLookupByName(ctl->conn, n);
     }
 
@@ -109,6 +96,29 @@ vshCommandOptDomainBy(vshControl *ctl, const vshCmd *cmd,
     return dom;
 }
 
+virDomainPtr
+vshCommandOptDomainBy(vshControl *ctl, const vshCmd *cmd,
+                      const char **name, unsigned int flags)
+{
+    const char *n = NULL;
+    const char *optname = "domain";
+    virCheckFlags(VSH_BYID | VSH_BYUUID | VSH_BYNAME, NULL);
+
+    if (!vshCmdHasOption(ctl, cmd, optname))
+        return NULL;
+
+    if (vshCommandOptString(cmd, optname, &n) <= 0)
+        return NULL;
+
+    vshDebug(ctl, VSH_ERR_INFO, "%s: found option <%s>: %s\n",
+             cmd->def->name, optname, n);
+
+    if (name)
+        *name = n;
+
+    return vshLookupDomainBy(ctl, cmd->def->name, optname, n, flags);
+}
+
 static const char *
 vshDomainVcpuStateToString(int state)
 {
@@ -3371,6 +3381,258 @@ cleanup:
     return ret;
 }
 
+/*
+ * "managedsave-bulk" and "managedrestore-bulk" commands
+ */
+static const vshCmdInfo info_managedsave_bulk[] = {
+    {"help", N_("managed save of several domains")},
+    {"desc", N_("Do a managed save of several running domains, letting the\n"
+                "    hypervisor save some of them at the same time.")},
+    {NULL, NULL}
+};
+
+static const vshCmdOptDef opts_managedsave_bulk[] = {
+    {"bypass-cache", VSH_OT_BOOL, 0, N_("avoid file system cache when saving")},
+    {"running", VSH_OT_BOOL, 0, N_("set domains to be running on next start")},
+    {"paused", VSH_OT_BOOL, 0, N_("set domains to be paused on next start")},
+    {"concurrency", VSH_OT_INT, VSH_OFLAG_REQ_OPT,
+     N_("number of domains saved at the same time")},
+    {"bandwidth", VSH_OT_INT, VSH_OFLAG_REQ_OPT,
+     N_("bandwidth used by all saves together (MiB/s)")},
+    {"verbose", VSH_OT_BOOL, 0, N_("display the progress of each save")},
+    {"domain", VSH_OT_ARGV, VSH_OFLAG_REQ, N_("domain name, id or uuid")},
+    {NULL, 0, 0, NULL}
+};
+
+static const vshCmdInfo info_managedrestore_bulk[] = {
+    {"help", N_("start several domains from their managed save")},
+    {"desc", N_("Start several inactive domains, restoring them from their\n"
+                "    managed save image if they have one, letting the\n"
+                "    hypervisor start some of them at the same time.")},
+    {NULL, NULL}
+};
+
+static const vshCmdOptDef opts_managedrestore_bulk[] = {
+    {"bypass-cache", VSH_OT_BOOL, 0, N_("avoid file system cache when restoring")},
+    {"paused", VSH_OT_BOOL, 0, N_("leave the domains paused after starting")},
+    {"concurrency", VSH_OT_INT, VSH_OFLAG_REQ_OPT,
+     N_("number of domains started at the same time")},
+    {"verbose", VSH_OT_BOOL, 0, N_("display the progress of each domain")},
+    {"domain", VSH_OT_ARGV, VSH_OFLAG_REQ, N_("domain name, id or uuid")},
+    {NULL, 0, 0, NULL}
+};
+
+typedef struct {
+    virDomainPtr *doms;
+    virTypedParameterPtr params;
+    int nparams;
+    unsigned int flags;
+    bool restore;
+    int writefd;
+} vshBulkData;
+
+static void
+doBulk(void *opaque)
+{
+    char ret = '1';
+    vshBulkData *data = opaque;
+    sigset_t sigmask, oldsigmask;
+    int rc;
+
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, SIGINT);
+    if (pthread_sigmask(SIG_BLOCK, &sigmask, &oldsigmask) < 0)
+        goto out_sig;
+
+    if (data->restore)
+        rc = virDomainListManagedRestore(data->doms, data->params,
+                                         data->nparams, data->flags);
+    else
+        rc = virDomainListManagedSave(data->doms, data->params,
+                                      data->nparams, data->flags);
+    if (rc == 0)
+        ret = '0';
+
+    pthread_sigmask(SIG_SETMASK, &oldsigmask, NULL);
+out_sig:
+    ignore_value(safewrite(data->writefd, &ret, sizeof(ret)));
+}
+
+/* Print the progress of the domains whose job progressed since the
+ * last call, as recorded in @progress */
+static void
+vshBulkPrintProgress(vshControl *ctl,
+                     virDomainPtr *doms,
+                     int *progress)
+{
+    virDomainJobInfo info;
+    int i;
+
+    for (i = 0; doms[i]; i++) {
+        int percent;
+
+        if (virDomainGetJobInfo(doms[i], &info) < 0) {
+            vshResetLibvirtError();
+            continue;
+        }
+        if (info.type == VIR_DOMAIN_JOB_NONE || info.dataTotal == 0)
+            continue;
+
+        percent = 100.0 - info.dataRemaining * 100.0 / info.dataTotal;
+        if (percent > 99)
+            percent = 99;
+        if (percent == progress[i])
+            continue;
+        progress[i] = percent;
+
+        vshPrintExtra(ctl, "%s: [%3d %%]\n",
+                      virDomainGetName(doms[i]), percent);
+    }
+}
+
+static bool
+vshBulkRun(vshControl *ctl, const vshCmd *cmd, bool restore)
+{
+    vshBulkData data;
+    const vshCmdOpt *opt = NULL;
+    virThread workerThread;
+    bool verbose = vshCommandOptBool(cmd, "verbose");
+    unsigned int concurrency;
+    unsigned long long bandwidth;
+    int *progress = NULL;
+    int p[2] = { -1, -1 };
+    int ndoms = 0;
+    bool ret = false;
+    int rv;
+    int i;
+
+    memset(&data, 0, sizeof(data));
+    data.restore = restore;
+
+    if (vshCommandOptBool(cmd, "bypass-cache"))
+        data.flags |= restore ? VIR_DOMAIN_START_BYPASS_CACHE :
+                                VIR_DOMAIN_SAVE_BYPASS_CACHE;
+    if (vshCommandOptBool(cmd, "paused"))
+        data.flags |= restore ? VIR_DOMAIN_START_PAUSED :
+                                VIR_DOMAIN_SAVE_PAUSED;
+    if (!restore && vshCommandOptBool(cmd, "running"))
+        data.flags |= VIR_DOMAIN_SAVE_RUNNING;
+
+    data.params = vshCalloc(ctl, 2, sizeof(*data.params));
+
+    if ((rv = vshCommandOptUInt(cmd, "concurrency", &concurrency)) < 0) {
+        vshError(ctl, "%s", _("Unable to parse integer parameter"));
+        goto cleanup;
+    } else if (rv > 0 &&
+               virTypedParameterAssign(&data.params[data.nparams++],
+                                       VIR_DOMAIN_BULK_CONCURRENCY,
+                                       VIR_TYPED_PARAM_UINT,
+                                       concurrency) < 0) {
+        goto cleanup;
+    }
+
+    if (!restore) {
+        if ((rv = vshCommandOptULongLong(cmd, "bandwidth", &bandwidth)) < 0) {
+            vshError(ctl, "%s", _("Unable to parse integer parameter"));
+            goto cleanup;
+        } else if (rv > 0 &&
+                   virTypedParameterAssign(&data.params[data.nparams++],
+                                           VIR_DOMAIN_BULK_BANDWIDTH,
+                                           VIR_TYPED_PARAM_ULLONG,
+                                           bandwidth) < 0) {
+            goto cleanup;
+        }
+    }
+
+    while ((opt = vshCommandOptArgv(cmd, opt)))
+        ndoms++;
+
+    data.doms = vshCalloc(ctl, ndoms + 1, sizeof(*data.doms));
+    for (i = 0; (opt = vshCommandOptArgv(cmd, opt)); i++) {
+        if (!(data.doms[i] = vshLookupDomainBy(ctl, cmd->def->name,
+                                               opt->def->name, opt->data,
+                                               VSH_BYID | VSH_BYUUID |
+                                               VSH_BYNAME)))
+            goto cleanup;
+    }
+
+    progress = vshCalloc(ctl, ndoms, sizeof(*progress));
+    for (i = 0; i < ndoms; i++)
+        progress[i] = -1;
+
+    if (pipe(p) < 0)
+        goto cleanup;
+    data.writefd = p[1];
+
+    if (virThreadCreate(&workerThread, true, doBulk, &data) < 0)
+        goto cleanup;
+
+    while (1) {
+        struct pollfd pollfd = { .fd = p[0], .events = POLLIN };
+        char retchar;
+
+        if ((rv = poll(&pollfd, 1, 1000)) < 0 && errno == EINTR)
+            continue;
+        if (rv != 0) {
+            ret = rv > 0 && saferead(p[0], &retchar, sizeof(retchar)) > 0 &&
+                  retchar == '0';
+            break;
+        }
+
+        if (verbose)
+            vshBulkPrintProgress(ctl, data.doms, progress);
+    }
+
+    virThreadJoin(&workerThread);
+
+    /* Tell which domains made it, as some may fail while others succeed */
+    for (i = 0; i < ndoms; i++) {
+        const char *name = virDomainGetName(data.doms[i]);
+
+        if (restore) {
+            if (virDomainIsActive(data.doms[i]) == 1)
+                vshPrint(ctl, _("Domain %s started\n"), name);
+            else
+                vshPrint(ctl, _("Domain %s not started\n"), name);
+        } else {
+            if (virDomainIsActive(data.doms[i]) == 0 &&
+                virDomainHasManagedSaveImage(data.doms[i], 0) == 1)
+                vshPrint(ctl, _("Domain %s state saved by libvirt\n"), name);
+            else
+                vshPrint(ctl, _("Domain %s state not saved\n"), name);
+        }
+    }
+
+    if (!ret)
+        vshError(ctl, "%s", restore ? _("Failed to start some domains") :
+                                      _("Failed to save some domains"));
+
+cleanup:
+    VIR_FORCE_CLOSE(p[0]);
+    VIR_FORCE_CLOSE(p[1]);
+    for (i = 0; i < ndoms; i++) {
+        if (data.doms[i])
+            virDomainFree(data.doms[i]);
+    }
+    VIR_FREE(data.doms);
+    virTypedParameterArrayClear(data.params, data.nparams);
+    VIR_FREE(data.params);
+    VIR_FREE(progress);
+    return ret;
+}
+
+static bool
+cmdManagedSaveBulk(vshControl *ctl, const vshCmd *cmd)
+{
+    return vshBulkRun(ctl, cmd, false);
+}
+
+static bool
+cmdManagedRestoreBulk(vshControl *ctl, const vshCmd *cmd)
+{
+    return vshBulkRun(ctl, cmd, true);
+}
+
 /*
  * "managedsave-remove" command
  */
@@ -3726,6 +3988,8 @@ static const vshCmdOptDef opts_dump[] = {
     {"file", VSH_OT_DATA, VSH_OFLAG_REQ, N_("where to dump the core")},
     {"verbose", VSH_OT_BOOL, 0, N_("display the progress of dump")},
     {"memory-only", VSH_OT_BOOL, 0, N_("dump domain's memory only")},
+    {"paging", VSH_OT_BOOL, 0,
+     N_("with --memory-only, only dump memory mapped by the guest")},
     {NULL, 0, 0, NULL}
 };
 
@@ -3763,6 +4027,8 @@ doDump(void *opaque)
         flags |= VIR_DUMP_RESET;
     if (vshCommandOptBool(cmd, "memory-only"))
         flags |= VIR_DUMP_MEMORY_ONLY;
+    if (vshCommandOptBool(cmd, "paging"))
+        flags |= VIR_DUMP_PAGING;
 
     if (virDomainCoreDump(dom, to, flags) < 0) {
         vshError(ctl, _("Failed to core dump domain %s to %s"), name, to);
@@ -4153,9 +4419,165 @@ static const vshCmdInfo info_domjobinfo[] = {
 
 static const vshCmdOptDef opts_domjobinfo[] = {
     {"domain", VSH_OT_DATA, VSH_OFLAG_REQ, N_("domain name, id or uuid")},
+    {"completed", VSH_OT_BOOL, 0,
+     N_("return statistics of the most recently completed job")},
     {NULL, 0, 0, NULL}
 };
 
+/* Print a statistic only available through virDomainGetJobStats, if
+ * @param is one this command knows about */
+static void
+vshDomainJobStatPrint(vshControl *ctl ATTRIBUTE_UNUSED,
+                      virTypedParameterPtr param)
+{
+    const char *label = NULL;
+    const char *unit;
+    double val;
+
+    if (param->type != VIR_TYPED_PARAM_ULLONG)
+        return;
+
+    if (STREQ(param->field, VIR_DOMAIN_JOB_MEMORY_BPS)) {
+        val = vshPrettyCapacity(param->value.ul, &unit);
+        vshPrint(ctl, "%-17s %-.3lf %s/s\n", _("Memory rate:"), val, unit);
+    } else if (STREQ(param->field, VIR_DOMAIN_JOB_MEMORY_DIRTY_BPS)) {
+        val = vshPrettyCapacity(param->value.ul, &unit);
+        vshPrint(ctl, "%-17s %-.3lf %s/s\n", _("Dirty rate:"), val, unit);
+    } else if (STREQ(param->field, VIR_DOMAIN_JOB_MEMORY_ITERATION)) {
+        vshPrint(ctl, "%-17s %-12llu\n", _("Iteration:"), param->value.ul);
+    } else if (STREQ(param->field, VIR_DOMAIN_JOB_CONVERGE_THROTTLE)) {
+        vshPrint(ctl, "%-17s %llu%%\n", _("vCPU throttle:"), param->value.ul);
+    } else if (STREQ(param->field, VIR_DOMAIN_JOB_DISK_BPS)) {
+        val = vshPrettyCapacity(param->value.ul, &unit);
+        vshPrint(ctl, "%-17s %-.3lf %s/s\n", _("Disk rate:"), val, unit);
+    } else if (STREQ(param->field, VIR_DOMAIN_JOB_BANDWIDTH)) {
+        vshPrint(ctl, "%-17s %-12llu MiB/s\n", _("Bandwidth limit:"),
+                 param->value.ul);
+    } else if (STRPREFIX(param->field, VIR_DOMAIN_JOB_DISK_PREFIX) &&
+               virFileHasSuffix(param->field, ".processed")) {
+        const char *disk = param->field + strlen(VIR_DOMAIN_JOB_DISK_PREFIX);
+        int len = strlen(disk) - strlen(".processed");
+
+        val = vshPrettyCapacity(param->value.ul, &unit);
+        vshPrint(ctl, "%-17s %.*s: %-.3lf %s\n", _("Disk copied:"),
+                 len, disk, val, unit);
+    } else {
+        /* The remaining ones are durations */
+        if (STREQ(param->field, VIR_DOMAIN_JOB_DOWNTIME))
+            label = _("Expected downtime:");
+        else if (STREQ(param->field, VIR_DOMAIN_JOB_CONVERGE_DOWNTIME))
+            label = _("Raised downtime:");
+        else if (STREQ(param->field, VIR_DOMAIN_JOB_TIME_DISK_COPY))
+            label = _("Disk copy time:");
+        else if (STREQ(param->field, VIR_DOMAIN_JOB_TIME_QUEUED))
+            label = _("Queued:");
+        else if (STREQ(param->field, VIR_DOMAIN_JOB_TIME_BEGIN))
+            label = _("Begin phase:");
+        else if (STREQ(param->field, VIR_DOMAIN_JOB_TIME_PREPARE))
+            label = _("Prepare phase:");
+        else if (STREQ(param->field, VIR_DOMAIN_JOB_TIME_PERFORM))
+            label = _("Perform phase:");
+        else if (STREQ(param->field, VIR_DOMAIN_JOB_TIME_FINISH))
+            label = _("Finish phase:");
+        else if (STREQ(param->field, VIR_DOMAIN_JOB_TIME_LOADED))
+            label = _("Time to load:");
+        else if (STREQ(param->field, VIR_DOMAIN_JOB_TIME_TO_RUN))
+            label = _("Time to run:");
+
+        if (label)
+            vshPrint(ctl, "%-17s %-12llu ms\n", label, param->value.ul);
+    }
+}
+
+/* Print the statistics only available through virDomainGetJobStats.
+ * Older servers do not support the API, so any error is ignored.  */
+static void
+vshDomainJobStatsPrint(vshControl *ctl, virDomainPtr dom)
+{
+    virTypedParameterPtr params = NULL;
+    int nparams = 0;
+    int type;
+    int i;
+
+    if (virDomainGetJobStats(dom, &type, &params, &nparams, 0) < 0)
+        goto cleanup;
+
+    for (i = 0; i < nparams; i++)
+        vshDomainJobStatPrint(ctl, &params[i]);
+
+cleanup:
+    vshResetLibvirtError();
+    virTypedParameterArrayClear(params, nparams);
+    VIR_FREE(params);
+}
+
+/* Print the statistics of the most recently completed job */
+static bool
+vshDomainJobCompletedPrint(vshControl *ctl, virDomainPtr dom)
+{
+    virTypedParameterPtr params = NULL;
+    int nparams = 0;
+    int type;
+    bool ret = false;
+    int i;
+
+    if (virDomainGetJobStats(dom, &type, &params, &nparams,
+                             VIR_DOMAIN_JOB_STATS_COMPLETED) < 0)
+        goto cleanup;
+
+    vshPrint(ctl, "%-17s %-12s\n", _("Job type:"),
+             type == VIR_DOMAIN_JOB_COMPLETED ? _("Completed") : _("None"));
+
+    /* virDomainGetJobInfo cannot report these for a completed job */
+    for (i = 0; i < nparams; i++) {
+        const char *label = NULL;
+        const char *unit;
+        double val;
+
+        if (params[i].type != VIR_TYPED_PARAM_ULLONG)
+            continue;
+
+        if (STREQ(params[i].field, VIR_DOMAIN_JOB_TIME_ELAPSED)) {
+            vshPrint(ctl, "%-17s %-12llu ms\n", _("Time elapsed:"),
+                     params[i].value.ul);
+            continue;
+        }
+
+        if (STREQ(params[i].field, VIR_DOMAIN_JOB_DATA_PROCESSED))
+            label = _("Data processed:");
+        else if (STREQ(params[i].field, VIR_DOMAIN_JOB_DATA_REMAINING))
+            label = _("Data remaining:");
+        else if (STREQ(params[i].field, VIR_DOMAIN_JOB_DATA_TOTAL))
+            label = _("Data total:");
+        else if (STREQ(params[i].field, VIR_DOMAIN_JOB_MEMORY_PROCESSED))
+            label = _("Memory processed:");
+        else if (STREQ(params[i].field, VIR_DOMAIN_JOB_MEMORY_REMAINING))
+            label = _("Memory remaining:");
+        else if (STREQ(params[i].field, VIR_DOMAIN_JOB_MEMORY_TOTAL))
+            label = _("Memory total:");
+        else if (STREQ(params[i].field, VIR_DOMAIN_JOB_DISK_PROCESSED))
+            label = _("File processed:");
+        else if (STREQ(params[i].field, VIR_DOMAIN_JOB_DISK_REMAINING))
+            label = _("File remaining:");
+        else if (STREQ(params[i].field, VIR_DOMAIN_JOB_DISK_TOTAL))
+            label = _("File total:");
+
+        if (label) {
+            val = vshPrettyCapacity(params[i].value.ul, &unit);
+            vshPrint(ctl, "%-17s %-.3lf %s\n", label, val, unit);
+        } else {
+            vshDomainJobStatPrint(ctl, &params[i]);
+        }
+    }
+
+    ret = true;
+
+cleanup:
+    virTypedParameterArrayClear(params, nparams);
+    VIR_FREE(params);
+    return ret;
+}
+
 static bool
 cmdDomjobinfo(vshControl *ctl, const vshCmd *cmd)
 {
@@ -4166,6 +4588,11 @@ cmdDomjobinfo(vshControl *ctl, const vshCmd *cmd)
     if (!(dom = vshCommandOptDomain(ctl, cmd, NULL)))
         return false;
 
+    if (vshCommandOptBool(cmd, "completed")) {
+        ret = vshDomainJobCompletedPrint(ctl, dom);
+        goto cleanup;
+    }
+
     if (virDomainGetJobInfo(dom, &info) == 0) {
         const char *unit;
         double val;
@@ -4213,6 +4640,7 @@ cmdDomjobinfo(vshControl *ctl, const vshCmd *cmd)
             val = vshPrettyCapacity(info.fileTotal, &unit);
             vshPrint(ctl, "%-17s %-.3lf %s\n", _("File total:"), val, unit);
         }
+        vshDomainJobStatsPrint(ctl, dom);
     } else {
         ret = false;
     }
@@ -8376,7 +8804,11 @@ const vshCmdDef domManagementCmds[] = {
     {"edit", cmdEdit, opts_edit, info_edit, 0},
     {"inject-nmi", cmdInjectNMI, opts_inject_nmi, info_inject_nmi, 0},
     {"send-key", cmdSendKey, opts_send_key, info_send_key, 0},
+    {"managedrestore-bulk", cmdManagedRestoreBulk, opts_managedrestore_bulk,
+     info_managedrestore_bulk, 0},
     {"managedsave", cmdManagedSave, opts_managedsave, info_managedsave, 0},
+    {"managedsave-bulk", cmdManagedSaveBulk, opts_managedsave_bulk,
+     info_managedsave_bulk, 0},
     {"managedsave-remove", cmdManagedSaveRemove, opts_managedsaveremove,
      info_managedsaveremove, 0},
     {"maxvcpus", cmdMaxvcpus, opts_maxvcpus, info_maxvcpus, 0},